@@ -31,74 +31,14 @@
 #include "nippotential.h"
 #include "niperrorhandler.h"
 
-/**
- * The current input file 
- * TODO: get rid of these global variables and make them a struct... */
-static FILE* nip_net_file = NULL;
-
-/**
- * Indicates if there is a Hugin net file open? 0 if no, 1 if yes. 
- * NOTE: could "nip_net_file == NULL" be used for representing the same info? 
- */
-static int nip_net_file_open = 0;
- 
-/* Global variables for relaying results:
- * Some of the results are returned via global variables and some 
- * as the semantic values of net language constructs. 
- * TODO: The functional paradigm would be more elegant... */
-static int nip_node_position_x = 100; ///< last parsed horizontal position
-static int nip_node_position_y = 100; ///< last parsed vertical position
-static int nip_node_size_x = 80; ///< last parsed horizontal size
-static int nip_node_size_y = 60; ///< last parsed vertical size
-
-static nip_double_list nip_parsed_doubles = NULL; ///< list of parsed data
-static int nip_data_size = 0; ///< length of parsed data array
-
-static nip_string_list nip_parsed_strings = NULL; ///< list of parsed names
-static char** nip_statenames = NULL; ///< array of variable value names
-static int nip_n_statenames = 0; ///< size of the array
-
-/* All the unrecognized MY_field = "value" pairs, TODO */
-static nip_string_pair_list nip_ignored_net_fields = NULL; ///< model extras
-static nip_string_pair_list nip_ignored_node_fields = NULL; ///< variable extras
-static nip_string_pair_list nip_ignored_potential_fields = NULL; ///< potential extras
-
-static char* nip_label; ///< node label contents
-static char* nip_persistence; ///< NIP_next contents
-
-static nip_variable_list nip_parsed_vars = NULL; ///< all variables / nodes
-static nip_variable_list nip_parent_vars = NULL; ///< recent parents
-
-static nip_graph nip_parsed_graph = NULL; ///< the graph
-
-static nip_potential_list nip_parsed_potentials = NULL; ///< list of potentials
-
-static nip_interface_list nip_interface_relations = NULL; ///< list of time dependencies
-
-static nip_clique* nip_cliques = NULL; ///< join tree as array of cliques
-static int nip_n_cliques = 0; ///< number of cliques
-
-/**
- * Lexical analysis: what kind of terminal token is next
- * @return Type code of a token that was read next from \p nip_net_file,
- * or 0 at the end of file
- * @see nip_next_hugin_token() */
-static int yylex (void);
-
- /**
-  * Called by yyparse on error
-  * @param s Error message */
-static void yyerror (const char *s);
-
-
-int yyparse(void);
-
 /**
  * Creates a graph from a list of variables referencing each other
  * @param vl List of variables
+ * @param pl List of parsed potentials, i.e. the parents of variables
  * @param g An initial graph
  * @return error code, or 0 if successful */
-static int parsed_vars_to_graph(nip_variable_list vl, nip_graph g);
+static int parsed_vars_to_graph(nip_variable_list vl, nip_potential_list pl,
+                                nip_graph g);
 
 /**
  * Initialises a set of cliques with model parameters
@@ -125,48 +65,128 @@ static void print_parsed_stuff(nip_potential_list pl);
 
 /* BISON Declarations */
 
+/* Everything parsed is kept in a parser context instead of global
+ * variables, so that several models can be parsed at the same time */
+%define api.pure full
+%parse-param {nip_net_parser parser}
+%lex-param {nip_net_parser parser}
+
+%code requires {
+#include "niplists.h"
+#include "nipgraph.h"
+#include "nipparsers.h"
+#include "nipjointree.h"
+#include "nipvariable.h"
+
 /**
- * These are the data types for semantic values. 
- * NOTE: there could be more of these to get rid of global variables... */
+ * The state of parsing a Hugin Net file: the input and all the results
+ * relayed between the rules. Some of the results are returned via this
+ * struct and some as the semantic values of net language constructs. */
+typedef struct {
+  nip_net_file file; ///< the input file and its tokeniser
+
+  int node_position_x; ///< last parsed horizontal position
+  int node_position_y; ///< last parsed vertical position
+  int node_size_x; ///< last parsed horizontal size
+  int node_size_y; ///< last parsed vertical size
+
+  double* parsed_doubles; ///< growable array of parsed data
+  int n_doubles; ///< number of parsed data in the array
+  int doubles_size; ///< allocated size of the array
+  int data_size; ///< length of the last complete data array
+
+  nip_string_list parsed_strings; ///< list of parsed names
+  char** statenames; ///< array of variable value names
+  int n_statenames; ///< size of the array
+
+  /* All the unrecognized MY_field = "value" pairs, TODO */
+  nip_string_pair_list ignored_net_fields; ///< model extras
+  nip_string_pair_list ignored_node_fields; ///< variable extras
+  nip_string_pair_list ignored_potential_fields; ///< potential extras
+
+  char* label; ///< node label contents
+  char* persistence; ///< NIP_next contents
+
+  nip_variable_list parsed_vars; ///< all variables / nodes
+  nip_variable_list parent_vars; ///< recent parents
+
+  nip_graph parsed_graph; ///< the graph
+
+  nip_potential_list parsed_potentials; ///< list of potentials
+
+  nip_interface_list interface_relations; ///< list of time dependencies
+
+  nip_clique* cliques; ///< join tree as array of cliques
+  int n_cliques; ///< number of cliques
+} nip_net_parser_struct;
+
+typedef nip_net_parser_struct* nip_net_parser; ///< parser context reference
+}
+
+/**
+ * These are the data types for semantic values. */
 %union {
   double numval;       ///< numeric values
   double *doublearray; ///< arrays of data
   char *name;          ///< names
   char **stringarray;  ///< arrays of names
   nip_variable var;    ///< a random variable / graph node
-  /* list of X to get rid of global variables? */
 }
 
-%{
+%code provides {
 /**
- * Opens an input file. 
+ * Opens an input file for yyparse().
  * @param filename The name of Hugin net file to open
- * @return 0 if file was opened successfully or if some file was already open. 
- * Returns non-zero error code if an error occurred opening the file. */
-FILE *open_net_file(const char *filename);
+ * @return a new parser context, or NULL if the file could not be opened
+ * @see close_net_file() */
+nip_net_parser open_net_file(const char *filename);
 
 /**
- * Closes the current input file (if there is one). */
-void close_net_file();
+ * Closes the input file and frees the parser context, including the
+ * parsed results not taken with get_parsed_variables() or get_cliques().
+ * @param parser The parser context from open_net_file() */
+void close_net_file(nip_net_parser parser);
 
 /**
- * Gives you the list of variables after yylex()
+ * Gives you the list of variables after yyparse(). The caller becomes
+ * responsible for freeing the list and the variables.
+ * @param parser The parser context
  * @return list of all variables */
-nip_variable_list get_parsed_variables (void);
+nip_variable_list get_parsed_variables(nip_net_parser parser);
 
 /**
- * Gives you the array of cliques after yylex()
+ * Gives you the array of cliques after yyparse(). The caller becomes
+ * responsible for freeing the array and the cliques.
+ * @param parser The parser context
  * @param clique_array_pointer Where the array reference is written
  * @return number of cliques in allocated array */
-int get_cliques (nip_clique** clique_array_pointer);
+int get_cliques(nip_net_parser parser, nip_clique** clique_array_pointer);
 
 /**
  * Gives you the global parameters of the whole network 
  * (node size is the only mandatory field in Hugin net, TODO: others)
+ * @param parser The parser context
  * @param x Where horizontal size is written
  * @param y Where vertical size is written */
-void get_parsed_node_size(int* x, int* y);
-%}
+void get_parsed_node_size(nip_net_parser parser, int* x, int* y);
+}
+
+%code {
+/**
+ * Lexical analysis: what kind of terminal token is next
+ * @param lvalp Where the semantic value of the token is written
+ * @param parser The parser context with the input file
+ * @return Type code of a token that was read next from the input file,
+ * or 0 at the end of file
+ * @see nip_next_hugin_token() */
+static int yylex (YYSTYPE* lvalp, nip_net_parser parser);
+
+/**
+ * Called by yyparse on error
+ * @param parser The parser context
+ * @param s Error message */
+static void yyerror (nip_net_parser parser, const char *s);
+}
 
 
 /***********************/
@@ -199,119 +219,137 @@ void get_parsed_node_size(int* x, int* y);
 %type <var> nodeDeclaration child
 %type <name> labelDeclaration persistenceDeclaration
 
+/* Values discarded because of a syntax error are not leaked */
+%destructor { free($$); } <name> <doublearray>
+
 /* Grammar follows */
 
 %%
 input:  nodes potentials {
-  int nip_parser_error = parsed_vars_to_graph(nip_parsed_vars, nip_parsed_graph);
+  int nip_parser_error = parsed_vars_to_graph(parser->parsed_vars,
+                                              parser->parsed_potentials,
+                                              parser->parsed_graph);
   if(nip_parser_error != 0){
     nip_report_error(__FILE__, __LINE__, nip_parser_error, 1);
     YYABORT;
   }
 
-  nip_parser_error = interface_to_vars(nip_interface_relations, nip_parsed_vars);
+  nip_parser_error = interface_to_vars(parser->interface_relations, parser->parsed_vars);
   if(nip_parser_error != 0){
     nip_report_error(__FILE__, __LINE__, nip_parser_error, 1);
-    yyerror("Invalid timeslice specification!\nCheck NIP_next declarations.");
+    yyerror(parser, "Invalid timeslice specification!\nCheck NIP_next declarations.");
     YYABORT;
   }
-  nip_free_interface_list(nip_interface_relations);
+  nip_free_interface_list(parser->interface_relations);
+  parser->interface_relations = NULL;
 
-  nip_n_cliques = nip_graph_to_cliques(nip_parsed_graph, &nip_cliques);
-  nip_free_graph(nip_parsed_graph); /* Get rid of the graph (?) */
-  nip_parsed_graph = NULL;
-  if(nip_n_cliques < 0){
+  parser->n_cliques = nip_graph_to_cliques(parser->parsed_graph, &parser->cliques);
+  nip_free_graph(parser->parsed_graph); /* Get rid of the graph (?) */
+  parser->parsed_graph = NULL;
+  if(parser->n_cliques < 0){
     nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     YYABORT;
   }
 
-  nip_parser_error = parsed_potentials_to_jtree(nip_parsed_potentials, 
-						nip_cliques, nip_n_cliques);
+  nip_parser_error = parsed_potentials_to_jtree(parser->parsed_potentials, 
+						parser->cliques, parser->n_cliques);
   if(nip_parser_error != 0){
     nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     YYABORT;
   }
 #ifdef DEBUG_BISON
-  print_parsed_stuff(nip_parsed_potentials);
+  print_parsed_stuff(parser->parsed_potentials);
 #endif
-  nip_free_potential_list(nip_parsed_potentials); /* frees potentials also */
+  nip_free_potential_list(parser->parsed_potentials); /* frees potentials also */
+  parser->parsed_potentials = NULL;
 }
 
 /* optional net block */
 |  netDeclaration nodes potentials {
-  int nip_parser_error = parsed_vars_to_graph(nip_parsed_vars, nip_parsed_graph);
+  int nip_parser_error = parsed_vars_to_graph(parser->parsed_vars,
+                                              parser->parsed_potentials,
+                                              parser->parsed_graph);
   if(nip_parser_error != 0){
     nip_report_error(__FILE__, __LINE__, nip_parser_error, 1);
     YYABORT;
   }
 
-  nip_parser_error = interface_to_vars(nip_interface_relations, nip_parsed_vars);
+  nip_parser_error = interface_to_vars(parser->interface_relations, parser->parsed_vars);
   if(nip_parser_error != 0){
     nip_report_error(__FILE__, __LINE__, nip_parser_error, 1);
-    yyerror("Invalid timeslice specification!\nCheck NIP_next declarations.");
+    yyerror(parser, "Invalid timeslice specification!\nCheck NIP_next declarations.");
     YYABORT;
   }
-  nip_free_interface_list(nip_interface_relations);
+  nip_free_interface_list(parser->interface_relations);
+  parser->interface_relations = NULL;
 
-  nip_n_cliques = nip_graph_to_cliques(nip_parsed_graph, &nip_cliques);
-  nip_free_graph(nip_parsed_graph); /* Get rid of the graph (?) */
-  nip_parsed_graph = NULL;
-  if(nip_n_cliques < 0){
+  parser->n_cliques = nip_graph_to_cliques(parser->parsed_graph, &parser->cliques);
+  nip_free_graph(parser->parsed_graph); /* Get rid of the graph (?) */
+  parser->parsed_graph = NULL;
+  if(parser->n_cliques < 0){
     nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     YYABORT;
   }
 
-  nip_parser_error = parsed_potentials_to_jtree(nip_parsed_potentials, 
-						nip_cliques, nip_n_cliques);
+  nip_parser_error = parsed_potentials_to_jtree(parser->parsed_potentials, 
+						parser->cliques, parser->n_cliques);
   if(nip_parser_error != 0){
     nip_report_error(__FILE__, __LINE__, nip_parser_error, 1);
     YYABORT;
   }
 #ifdef DEBUG_BISON
-  print_parsed_stuff(nip_parsed_potentials);
+  print_parsed_stuff(parser->parsed_potentials);
 #endif
-  nip_free_potential_list(nip_parsed_potentials); /* frees potentials also */
+  nip_free_potential_list(parser->parsed_potentials); /* frees potentials also */
+  parser->parsed_potentials = NULL;
 }
 
 /* possible old class statement */
 | token_class UNQUOTED_STRING '{' parameters nodes potentials '}' {
   free($2); /* the classname is useless */
-  int nip_parser_error = parsed_vars_to_graph(nip_parsed_vars, nip_parsed_graph);
+  int nip_parser_error = parsed_vars_to_graph(parser->parsed_vars,
+                                              parser->parsed_potentials,
+                                              parser->parsed_graph);
   if(nip_parser_error != 0){
     nip_report_error(__FILE__, __LINE__, nip_parser_error, 1);
     YYABORT;
   }
 
-  nip_parser_error = interface_to_vars(nip_interface_relations, nip_parsed_vars);
+  nip_parser_error = interface_to_vars(parser->interface_relations, parser->parsed_vars);
   if(nip_parser_error != 0){
     nip_report_error(__FILE__, __LINE__, nip_parser_error, 1);    
-    yyerror("Invalid timeslice specification!\nCheck NIP_next declarations.");
+    yyerror(parser, "Invalid timeslice specification!\nCheck NIP_next declarations.");
     YYABORT;
   }
-  nip_free_interface_list(nip_interface_relations);
+  nip_free_interface_list(parser->interface_relations);
+  parser->interface_relations = NULL;
 
-  nip_n_cliques = nip_graph_to_cliques(nip_parsed_graph, &nip_cliques);
-  nip_free_graph(nip_parsed_graph); /* Get rid of the graph (?) */
-  nip_parsed_graph = NULL;
-  if(nip_n_cliques < 0){
+  parser->n_cliques = nip_graph_to_cliques(parser->parsed_graph, &parser->cliques);
+  nip_free_graph(parser->parsed_graph); /* Get rid of the graph (?) */
+  parser->parsed_graph = NULL;
+  if(parser->n_cliques < 0){
     nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     YYABORT;
   }
 
-  nip_parser_error = parsed_potentials_to_jtree(nip_parsed_potentials, 
-						nip_cliques, nip_n_cliques);
+  nip_parser_error = parsed_potentials_to_jtree(parser->parsed_potentials, 
+						parser->cliques, parser->n_cliques);
   if(nip_parser_error != 0){
     nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     YYABORT;
   }
 #ifdef DEBUG_BISON
-  print_parsed_stuff(nip_parsed_potentials);
+  print_parsed_stuff(parser->parsed_potentials);
 #endif
-  nip_free_potential_list(nip_parsed_potentials); /* frees potentials also */
+  nip_free_potential_list(parser->parsed_potentials); /* frees potentials also */
+  parser->parsed_potentials = NULL;
 };
 
 
-nodes:    /* empty */ { nip_parsed_graph = nip_new_graph(nip_parsed_vars->length); }
+nodes:    /* empty */ {
+  if(parser->parsed_vars == NULL)
+    parser->parsed_vars = nip_new_variable_list();
+  parser->parsed_graph = nip_new_graph(parser->parsed_vars->length); }
 |         nodeDeclaration nodes {/* a variable added */}
 ;
 
@@ -323,8 +361,8 @@ potentials:    /* empty */ {/* list of initialisation data ready */}
 
 nodeDeclaration:    token_node UNQUOTED_STRING '{' node_params '}' {
   int i,retval;
-  char *label = nip_label;
-  char **states = nip_statenames;
+  char *label = parser->label;
+  char **states = parser->statenames;
   nip_variable v = NULL;
   
   /* have to check that all the necessary fields were included */
@@ -332,67 +370,66 @@ nodeDeclaration:    token_node UNQUOTED_STRING '{' node_params '}' {
     asprintf(&label, " "); /* default label is empty */
 
   if(states == NULL){
-    free(label); nip_label = NULL;
+    free(label); parser->label = NULL;
     asprintf(&label, "NIP parser: The states field is missing (node %s)", $2);
-    yyerror(label);
+    yyerror(parser, label);
     nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     free($2);
     free(label);
-    free(nip_persistence); nip_persistence = NULL;
+    free(parser->persistence); parser->persistence = NULL;
     YYABORT;
   }
 
-  v = nip_new_variable($2, label, states, nip_n_statenames);
+  v = nip_new_variable($2, label, states, parser->n_statenames);
 
   if(v == NULL){
     nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     free($2);
-    free(label); nip_label = NULL;
-    free(nip_persistence); nip_persistence = NULL;
-    for(i = 0; i < nip_n_statenames; i++)
-      free(nip_statenames[i]);
-    free(nip_statenames); nip_statenames = NULL; nip_n_statenames = 0;
+    free(label); parser->label = NULL;
+    free(parser->persistence); parser->persistence = NULL;
+    for(i = 0; i < parser->n_statenames; i++)
+      free(parser->statenames[i]);
+    free(parser->statenames); parser->statenames = NULL; parser->n_statenames = 0;
     YYABORT;
   }
   /* set the parsed position values */
-  nip_set_variable_position(v, nip_node_position_x, nip_node_position_y);
-  nip_node_position_x = 100; nip_node_position_y = 100; /* reset */
+  nip_set_variable_position(v, parser->node_position_x, parser->node_position_y);
+  parser->node_position_x = 100; parser->node_position_y = 100; /* reset */
 
-  if(nip_parsed_vars == NULL)
-    nip_parsed_vars = nip_new_variable_list();
-  nip_append_variable(nip_parsed_vars, v);
+  if(parser->parsed_vars == NULL)
+    parser->parsed_vars = nip_new_variable_list();
+  nip_append_variable(parser->parsed_vars, v);
 
-  if(nip_persistence != NULL){
+  if(parser->persistence != NULL){
     
-    if(nip_interface_relations == NULL)
-      nip_interface_relations = nip_new_interface_list();
-    retval = nip_append_interface(nip_interface_relations, v, nip_persistence);
+    if(parser->interface_relations == NULL)
+      parser->interface_relations = nip_new_interface_list();
+    retval = nip_append_interface(parser->interface_relations, v, parser->persistence);
 
     if(retval != 0){
       nip_report_error(__FILE__, __LINE__, retval, 1);
       free($2);
-      free(label); nip_label = NULL;
-      free(nip_persistence); nip_persistence = NULL;
-      for(i = 0; i < nip_n_statenames; i++)
-	free(nip_statenames[i]);
-      free(nip_statenames); nip_statenames = NULL; nip_n_statenames = 0;
-      nip_free_variable(v);
-      YYABORT;
+      free(label); parser->label = NULL;
+      free(parser->persistence); parser->persistence = NULL;
+      for(i = 0; i < parser->n_statenames; i++)
+	free(parser->statenames[i]);
+      free(parser->statenames); parser->statenames = NULL; parser->n_statenames = 0;
+      YYABORT; /* v is freed with the other parsed variables */
     }
   }
 
   free($2);
-  free(label);
-  for(i = 0; i < nip_n_statenames; i++)
-    free(nip_statenames[i]);
-  free(nip_statenames); nip_statenames = NULL; nip_n_statenames = 0;
-  nip_persistence = NULL;
+  free(label); parser->label = NULL;
+  for(i = 0; i < parser->n_statenames; i++)
+    free(parser->statenames[i]);
+  free(parser->statenames); parser->statenames = NULL; parser->n_statenames = 0;
+  parser->persistence = NULL;
   $$ = v;}
 
 |    token_discrete token_node UNQUOTED_STRING '{' node_params '}' {
   int i,retval;
-  char *label = nip_label;
-  char **states = nip_statenames;
+  char *label = parser->label;
+  char **states = parser->statenames;
   nip_variable v = NULL;
   
   /* have to check that all the necessary fields were included */
@@ -401,129 +438,128 @@ nodeDeclaration:    token_node UNQUOTED_STRING '{' node_params '}' {
 
   if(states == NULL){
     free(label);
-    nip_label = NULL;
+    parser->label = NULL;
     asprintf(&label, "NIP parser: The states field is missing (node %s)", $3);
-    yyerror(label);
+    yyerror(parser, label);
     nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     free($3);
     free(label);
-    free(nip_persistence); nip_persistence = NULL;
+    free(parser->persistence); parser->persistence = NULL;
     YYABORT;
   }
 
-  v = nip_new_variable($3, label, states, nip_n_statenames);
+  v = nip_new_variable($3, label, states, parser->n_statenames);
 
   if(v == NULL){
     nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     free($3);
     free(label);
-    nip_label = NULL;
-    free(nip_persistence); nip_persistence = NULL;
-    for(i = 0; i < nip_n_statenames; i++)
-      free(nip_statenames[i]);
-    free(nip_statenames); nip_statenames = NULL; nip_n_statenames = 0;
+    parser->label = NULL;
+    free(parser->persistence); parser->persistence = NULL;
+    for(i = 0; i < parser->n_statenames; i++)
+      free(parser->statenames[i]);
+    free(parser->statenames); parser->statenames = NULL; parser->n_statenames = 0;
     YYABORT;
   }
   /* set the parsed position values */
-  nip_set_variable_position(v, nip_node_position_x, nip_node_position_y);
-  nip_node_position_x = 100; nip_node_position_y = 100; /* reset */
+  nip_set_variable_position(v, parser->node_position_x, parser->node_position_y);
+  parser->node_position_x = 100; parser->node_position_y = 100; /* reset */
 
-  if(nip_parsed_vars == NULL)
-    nip_parsed_vars = nip_new_variable_list();
-  nip_append_variable(nip_parsed_vars, v);
+  if(parser->parsed_vars == NULL)
+    parser->parsed_vars = nip_new_variable_list();
+  nip_append_variable(parser->parsed_vars, v);
 
-  if(nip_persistence != NULL){
-    if(nip_interface_relations == NULL)
-      nip_interface_relations = nip_new_interface_list();
-    retval = nip_append_interface(nip_interface_relations, v, nip_persistence);
+  if(parser->persistence != NULL){
+    if(parser->interface_relations == NULL)
+      parser->interface_relations = nip_new_interface_list();
+    retval = nip_append_interface(parser->interface_relations, v, parser->persistence);
     if(retval != 0){
       nip_report_error(__FILE__, __LINE__, retval, 1);
       free($3);
-      free(label); nip_label = NULL;
-      free(nip_persistence); nip_persistence = NULL;
-      for(i = 0; i < nip_n_statenames; i++)
-	free(nip_statenames[i]);
-      free(nip_statenames); nip_statenames = NULL; nip_n_statenames = 0;
-      nip_free_variable(v);
-      YYABORT;
+      free(label); parser->label = NULL;
+      free(parser->persistence); parser->persistence = NULL;
+      for(i = 0; i < parser->n_statenames; i++)
+	free(parser->statenames[i]);
+      free(parser->statenames); parser->statenames = NULL; parser->n_statenames = 0;
+      YYABORT; /* v is freed with the other parsed variables */
     }
   }
 
   free($3);
-  free(label);
-  for(i = 0; i < nip_n_statenames; i++)
-    free(nip_statenames[i]);
-  free(nip_statenames); nip_statenames = NULL; nip_n_statenames = 0;
-  nip_persistence = NULL;
+  free(label); parser->label = NULL;
+  for(i = 0; i < parser->n_statenames; i++)
+    free(parser->statenames[i]);
+  free(parser->statenames); parser->statenames = NULL; parser->n_statenames = 0;
+  parser->persistence = NULL;
   $$ = v;}
 
 | token_continuous token_node UNQUOTED_STRING '{' ignored_params '}' { 
   int i;
-  char *label = nip_label;
-  free(label); nip_label = NULL;
+  char *label = parser->label;
+  free(label); parser->label = NULL;
   asprintf(&label, "NET parser: Continuous variables (node %s) %s", $3, 
 	   "are not supported.");
-  yyerror(label);
+  yyerror(parser, label);
   nip_report_error(__FILE__, __LINE__, ENOSYS, 1);
   free($3);
   free(label);
-  free(nip_persistence); nip_persistence = NULL;
-  for(i = 0; i < nip_n_statenames; i++)
-    free(nip_statenames[i]);
-  free(nip_statenames); nip_statenames = NULL; nip_n_statenames = 0;
+  free(parser->persistence); parser->persistence = NULL;
+  for(i = 0; i < parser->n_statenames; i++)
+    free(parser->statenames[i]);
+  free(parser->statenames); parser->statenames = NULL; parser->n_statenames = 0;
   YYABORT;
   $$=NULL;}
 
 | token_utility UNQUOTED_STRING '{' ignored_params '}' { 
   int i;
-  char *label = nip_label;
-  free(label); nip_label = NULL;
+  char *label = parser->label;
+  free(label); parser->label = NULL;
   asprintf(&label, "NET parser: Utility nodes (node %s) %s", $2, 
 	   "are not supported.");
-  yyerror(label);
+  yyerror(parser, label);
   nip_report_error(__FILE__, __LINE__, ENOSYS, 1);
   free($2);
   free(label);
-  free(nip_persistence); nip_persistence = NULL;
-  for(i = 0; i < nip_n_statenames; i++)
-    free(nip_statenames[i]);
-  free(nip_statenames); nip_statenames = NULL; nip_n_statenames = 0;
+  free(parser->persistence); parser->persistence = NULL;
+  for(i = 0; i < parser->n_statenames; i++)
+    free(parser->statenames[i]);
+  free(parser->statenames); parser->statenames = NULL; parser->n_statenames = 0;
   YYABORT;
   $$=NULL;}
 
 | token_decision UNQUOTED_STRING '{' ignored_params '}' { 
   int i;
-  char *label = nip_label;
+  char *label = parser->label;
 
-  free(label); nip_label = NULL;
+  free(label); parser->label = NULL;
   asprintf(&label, "NET parser: Decision nodes (node %s) %s", $2, 
 	   "are not supported.");
-  yyerror(label);
+  yyerror(parser, label);
   nip_report_error(__FILE__, __LINE__, ENOSYS, 1);
   free($2);
   free(label);
-  free(nip_persistence); nip_persistence = NULL;
-  for(i = 0; i < nip_n_statenames; i++)
-    free(nip_statenames[i]);
-  free(nip_statenames); nip_statenames = NULL; nip_n_statenames = 0;
+  free(parser->persistence); parser->persistence = NULL;
+  for(i = 0; i < parser->n_statenames; i++)
+    free(parser->statenames[i]);
+  free(parser->statenames); parser->statenames = NULL; parser->n_statenames = 0;
   YYABORT;
   $$=NULL;}
 ;
 
 ignored_params: /* end of list */
 |            unknownDeclaration ignored_params
-|            statesDeclaration ignored_params { /*nip_statenames = $1;*/ }
-|            labelDeclaration ignored_params { nip_label = $1; }
-|            persistenceDeclaration ignored_params { nip_persistence = $1; }
+|            statesDeclaration ignored_params { /*parser->statenames = $1;*/ }
+|            labelDeclaration ignored_params { parser->label = $1; }
+|            persistenceDeclaration ignored_params { parser->persistence = $1; }
 |            positionDeclaration ignored_params
 ;
 
 
 node_params: /* end of definitions */
 |            unknownDeclaration node_params
-|            statesDeclaration node_params { /*nip_statenames = $1;*/ }
-|            labelDeclaration node_params { nip_label = $1; }
-|            persistenceDeclaration node_params { nip_persistence = $1; }
+|            statesDeclaration node_params { /*parser->statenames = $1;*/ }
+|            labelDeclaration node_params { parser->label = $1; }
+|            persistenceDeclaration node_params { parser->persistence = $1; }
 |            positionDeclaration node_params
 ;
 
@@ -549,32 +585,32 @@ persistenceDeclaration: token_persistence '=' QUOTED_STRING ';' { $$ = $3; }
 statesDeclaration:    token_states '=' '(' strings ')' ';' { 
 
   /* makes an array of strings out of the parsed list of strings */
-  nip_statenames = nip_string_list_to_array(nip_parsed_strings);
-  nip_n_statenames = nip_parsed_strings->length;
+  parser->statenames = nip_string_list_to_array(parser->parsed_strings);
+  parser->n_statenames = parser->parsed_strings->length;
 
   /* free the list (not the strings) */
-  nip_empty_string_list(nip_parsed_strings);
-  free(nip_parsed_strings); nip_parsed_strings = NULL;
+  nip_empty_string_list(parser->parsed_strings);
+  free(parser->parsed_strings); parser->parsed_strings = NULL;
 
-  if(!nip_statenames){
+  if(!parser->statenames){
     nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     YYABORT;
   }
 
-  $$ = nip_statenames;
+  $$ = parser->statenames;
 }
 ;
 
 
 positionDeclaration:  token_position '=' '(' NUMBER NUMBER ')' ';' {
-  nip_node_position_x = abs((int)$4); 
-  nip_node_position_y = abs((int)$5);}
+  parser->node_position_x = abs((int)$4); 
+  parser->node_position_y = abs((int)$5);}
 ;
 
 
 nodeSizeDeclaration:  token_node_size '=' '(' NUMBER NUMBER ')' ';' {
-  nip_node_size_x = abs((int)$4); 
-  nip_node_size_y = abs((int)$5);}
+  parser->node_size_x = abs((int)$4); 
+  parser->node_size_y = abs((int)$5);}
 ;
 
 
@@ -593,13 +629,13 @@ potentialDeclaration: token_potential '(' child '|' symbols ')' '{' dataList '}'
   char* error = NULL;
   nip_potential p = NULL;
 
-  if(nip_parent_vars != NULL)
-    nparents = nip_parent_vars->length;
+  if(parser->parent_vars != NULL)
+    nparents = parser->parent_vars->length;
 
   family = (nip_variable*) calloc(nparents + 1, sizeof(nip_variable));
 
-  if(nip_parent_vars != NULL)
-    parents = nip_variable_list_to_array(nip_parent_vars);
+  if(parser->parent_vars != NULL)
+    parents = nip_variable_list_to_array(parser->parent_vars);
 
   /* TODO: parser could survive even when "potential(A| )" happens... */
   if(!parents || !family){
@@ -619,30 +655,30 @@ potentialDeclaration: token_potential '(' child '|' symbols ')' '{' dataList '}'
     family[i + 1] = parents[i];
     size = size * NIP_CARDINALITY(parents[i]);
   }
-  /* check that nip_data_size >= product of variable cardinalities! */
-  if(size > nip_data_size){
+  /* check that parser->data_size >= product of variable cardinalities! */
+  if(size > parser->data_size){
     /* too few elements in the specified potential */
     asprintf(&error, 
 	     "NET parser: Not enough elements in potential( %s... )!", 
 	     nip_variable_symbol(family[0]));
-    yyerror(error);
+    yyerror(parser, error);
     free(family);
     free(parents);
     free(doubles);
     YYABORT;
   }
 
-  if(nip_parsed_potentials == NULL)
-    nip_parsed_potentials = nip_new_potential_list();
+  if(parser->parsed_potentials == NULL)
+    parser->parsed_potentials = nip_new_potential_list();
 
   p = nip_create_potential(family, nparents + 1, doubles);
   nip_normalise_cpd(p); /* useless? */
-  retval = nip_append_potential(nip_parsed_potentials, p, family[0], parents);
+  retval = nip_append_potential(parser->parsed_potentials, p, family[0], parents);
 
   free(doubles); /* the data was copied at create_potential */
-  nip_empty_variable_list(nip_parent_vars);
-  free(nip_parent_vars);
-  nip_parent_vars = NULL;
+  nip_empty_variable_list(parser->parent_vars);
+  free(parser->parent_vars);
+  parser->parent_vars = NULL;
   free(family);
   if(retval != NIP_NO_ERROR){
     nip_report_error(__FILE__, __LINE__, retval, 1);
@@ -655,21 +691,21 @@ potentialDeclaration: token_potential '(' child '|' symbols ')' '{' dataList '}'
   double *doubles = $6;
   char* error = NULL;
   nip_potential p = NULL;
-  if(NIP_CARDINALITY($3) > nip_data_size){
+  if(NIP_CARDINALITY($3) > parser->data_size){
     /* too few elements in the specified potential */
     asprintf(&error, 
 	     "NET parser: Not enough elements in potential( %s )!", 
 	     nip_variable_symbol($3));
-    yyerror(error);
+    yyerror(parser, error);
     free(doubles);
     YYABORT;
   }
   family = &$3;
-  if(nip_parsed_potentials == NULL)
-    nip_parsed_potentials = nip_new_potential_list();
+  if(parser->parsed_potentials == NULL)
+    parser->parsed_potentials = nip_new_potential_list();
   p = nip_create_potential(family, 1, doubles);
   nip_normalise_potential(p); /* <=> normalise_cpd(p) in this case */
-  retval = nip_append_potential(nip_parsed_potentials, p, family[0], NULL); 
+  retval = nip_append_potential(parser->parsed_potentials, p, family[0], NULL); 
   free(doubles); /* the data was copied at create_potential */
   if(retval != NIP_NO_ERROR){
     nip_report_error(__FILE__, __LINE__, retval, 1);
@@ -681,9 +717,9 @@ potentialDeclaration: token_potential '(' child '|' symbols ')' '{' dataList '}'
   nip_variable* family;
   family = &$3;
 
-  if(nip_parsed_potentials == NULL)
-    nip_parsed_potentials = nip_new_potential_list();
-  retval = nip_append_potential(nip_parsed_potentials, 
+  if(parser->parsed_potentials == NULL)
+    parser->parsed_potentials = nip_new_potential_list();
+  retval = nip_append_potential(parser->parsed_potentials, 
 				nip_create_potential(family, 1, NULL), 
 				family[0], NULL); 
   if(retval != NIP_NO_ERROR){
@@ -700,13 +736,13 @@ potentialDeclaration: token_potential '(' child '|' symbols ')' '{' dataList '}'
   nip_variable *parents = NULL;
   nip_potential p = NULL;
 
-  if(nip_parent_vars != NULL)
-    nparents = nip_parent_vars->length;
+  if(parser->parent_vars != NULL)
+    nparents = parser->parent_vars->length;
 
   family = (nip_variable*) calloc(nparents + 1, sizeof(nip_variable));
 
-  if(nip_parent_vars != NULL)
-    parents = nip_variable_list_to_array(nip_parent_vars);
+  if(parser->parent_vars != NULL)
+    parents = nip_variable_list_to_array(parser->parent_vars);
 
   /* TODO: parser could survive even when "potential(A| )" happens... */
   if(!parents || !family){
@@ -726,16 +762,16 @@ potentialDeclaration: token_potential '(' child '|' symbols ')' '{' dataList '}'
     size = size * NIP_CARDINALITY(parents[i]);
   }
 
-  if(nip_parsed_potentials == NULL)
-    nip_parsed_potentials = nip_new_potential_list();
+  if(parser->parsed_potentials == NULL)
+    parser->parsed_potentials = nip_new_potential_list();
 
   p = nip_create_potential(family, nparents + 1, NULL);
   nip_normalise_cpd(p); /* useless? */
-  retval = nip_append_potential(nip_parsed_potentials, p, family[0], parents);
+  retval = nip_append_potential(parser->parsed_potentials, p, family[0], parents);
 
-  nip_empty_variable_list(nip_parent_vars);
-  free(nip_parent_vars);
-  nip_parent_vars = NULL;
+  nip_empty_variable_list(parser->parent_vars);
+  free(parser->parent_vars);
+  parser->parent_vars = NULL;
   free(family);
   if(retval != NIP_NO_ERROR){
     nip_report_error(__FILE__, __LINE__, retval, 1);
@@ -746,7 +782,7 @@ potentialDeclaration: token_potential '(' child '|' symbols ')' '{' dataList '}'
 
 
 child:        UNQUOTED_STRING { 
-  $$ = nip_search_variable_list(nip_parsed_vars, $1);
+  $$ = nip_search_variable_list(parser->parsed_vars, $1);
   /* NOTE: you could check unrecognized child variables here */
   free($1); }
 ;
@@ -760,31 +796,31 @@ symbols:       /* end of list */
 symbol:       UNQUOTED_STRING { 
 	       /* NOTE: inverted list takes care of the correct order... */
 	       int retval;
-	       if(nip_parent_vars == NULL)
-		 nip_parent_vars = nip_new_variable_list();
-	       retval = nip_prepend_variable(nip_parent_vars, 
-                                             nip_search_variable_list(nip_parsed_vars, $1));
+	       if(parser->parent_vars == NULL)
+		 parser->parent_vars = nip_new_variable_list();
+	       retval = nip_prepend_variable(parser->parent_vars, 
+                                             nip_search_variable_list(parser->parsed_vars, $1));
+	       free($1);
 	       if(retval != NIP_NO_ERROR){
 		 /* NOTE: you could check unrecognized parent variables here */
 		 nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
 		 YYABORT;
-	       }
-	       free($1); }
+	       }}
 ;
 
 
 strings:       /* end of list */
-             | string strings
+             | strings string
 ;
 
 
 string:        QUOTED_STRING {
 	       int retval;
 
-	       if(nip_parsed_strings == NULL)
-		 nip_parsed_strings = nip_new_string_list();
+	       if(parser->parsed_strings == NULL)
+		 parser->parsed_strings = nip_new_string_list();
 
-	       retval = nip_append_string(nip_parsed_strings, $1);
+	       retval = nip_append_string(parser->parsed_strings, $1);
 	       if(retval != NIP_NO_ERROR){
 		 nip_report_error(__FILE__, __LINE__, retval, 1);
 		 YYABORT;
@@ -793,31 +829,36 @@ string:        QUOTED_STRING {
 ;
 
 
+/* Left recursion keeps the parser stack shallow for long lists */
 numbers:     /* end of list */
-           | num numbers
-           | '(' numbers ')' numbers
+           | numbers num
+           | numbers '(' numbers ')'
 ;
 
 
 num:       NUMBER {
-	     int retval;
-
-	     /* If the list is not created yet */
-	     if(nip_parsed_doubles == NULL)
-	       nip_parsed_doubles = nip_new_double_list();
-
-	     retval = nip_append_double(nip_parsed_doubles, $1);
-	     if(retval != NIP_NO_ERROR){
-	       nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-	       YYABORT;
+	     double* bigger;
+
+	     /* Grow the array by doubling, if it is full (or not created) */
+	     if(parser->n_doubles == parser->doubles_size){
+	       bigger = (double*) realloc(parser->parsed_doubles,
+					  2 * (parser->doubles_size + 32) *
+					  sizeof(double));
+	       if(!bigger){
+		 nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+		 YYABORT;
+	       }
+	       parser->parsed_doubles = bigger;
+	       parser->doubles_size = 2 * (parser->doubles_size + 32);
 	     }
+	     parser->parsed_doubles[parser->n_doubles++] = $1;
 }
 ;
 
 
 ignored_numbers:     /* end of list */
-           | NUMBER ignored_numbers {}
-           | '(' ignored_numbers ')' ignored_numbers
+           | ignored_numbers NUMBER {}
+           | ignored_numbers '(' ignored_numbers ')'
 ;
 
 
@@ -827,16 +868,13 @@ value:         QUOTED_STRING { free($1); }
 
 
 dataList: token_data '=' '(' numbers ')' ';' {
-  /* Note: this doesn't normalise them in any way */
-  double *doubles = nip_double_list_to_array(nip_parsed_doubles);
-  nip_data_size = nip_parsed_doubles->length;
-  nip_empty_double_list(nip_parsed_doubles); 
-  free(nip_parsed_doubles); nip_parsed_doubles = NULL;
-  if(!doubles){
-    nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-    YYABORT;
-  }
-  $$ = doubles;
+  /* Note: this doesn't normalise them in any way.
+   * The array itself is handed over without copying. */
+  $$ = parser->parsed_doubles;
+  parser->data_size = parser->n_doubles;
+  parser->parsed_doubles = NULL;
+  parser->n_doubles = 0;
+  parser->doubles_size = 0;
 }
 ;
 
@@ -849,14 +887,26 @@ dataList: token_data '=' '(' numbers ')' ';' {
 
 #include <ctype.h>
 
+/* Makes a null terminated copy of a token */
+static char* copy_token(const char* token, int length){
+  char* copy = (char *) malloc((length + 1) * sizeof(char));
+  if(!copy){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NULL;
+  }
+  memcpy(copy, token, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+
+/* The tokens are read from the file buffer without copying, and only
+ * the semantic values of strings are allocated. */
 static int
-yylex (void)
+yylex (YYSTYPE* lvalp, nip_net_parser parser)
 {
-  int tokenlength;
-  int retval = 0;
-  char *token = nip_next_hugin_token(nip_net_file, &tokenlength);
-  char *nullterminated;
-  char *endptr;
+  char *token = NULL;
+  int tokenlength = nip_next_hugin_span(parser->file, &token);
   double numval;
 
   /* EOF or error */
@@ -865,39 +915,24 @@ yylex (void)
 
   /* Single character */
   else if(tokenlength == 1){
-    retval = *token;
-
-    nullterminated = (char *) calloc(2, sizeof(char));
-    if(!nullterminated){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-      free(token);
-      return 0; /* In the case of an (unlikely) error, stop the parser */
-    }
-    nullterminated[0] = *token;
-    nullterminated[1] = '\0';
 
     /* Single letter ('A' - 'Z' or 'a' - 'z') is UNQUOTED_STRING. */
     if(isalpha((int)*token)){
-      yylval.name = nullterminated;
-      free(token);
-
+      lvalp->name = copy_token(token, 1);
+      if(!lvalp->name)
+	return 0; /* In the case of an (unlikely) error, stop the parser */
       return UNQUOTED_STRING;
     }
 
     /* Single digit ('0' - '9') is NUMBER. */
     else if(isdigit((int)*token)){
-      yylval.numval = strtod(nullterminated, 0);
-      free(token);
-      free(nullterminated);
+      lvalp->numval = (double)(*token - '0');
       return NUMBER;
     }
 
     /* Other chars (';' '(', ')', etc. ) */
-    else {
-      free(token);
-      free(nullterminated);
-      return retval;
-    }
+    else
+      return *token;
   }
 
   /* Multicharacter tokens */
@@ -905,100 +940,70 @@ yylex (void)
     /* Literal string tokens */ 
 
     /* net */
-    if(tokenlength == 3 && strncmp("net", token, 3) == 0){
-      free(token);
+    if(tokenlength == 3 && strncmp("net", token, 3) == 0)
       return token_net;
-    }
 
     if(tokenlength == 4){
       /* node */
-      if(strncmp("node", token, 4) == 0){
-	free(token);
+      if(strncmp("node", token, 4) == 0)
 	return token_node;
-      }
       /* data */
-      else if(strncmp("data", token, 4) == 0){
-	free(token);
+      else if(strncmp("data", token, 4) == 0)
 	return token_data;
-      }
     }
 
     if(tokenlength == 5){
       /* label */
-      if(strncmp("label", token, 5) == 0){
-	free(token);
+      if(strncmp("label", token, 5) == 0)
 	return token_label;
-      }
       /* class */
-      else if(strncmp("class", token, 5) == 0){
-	free(token);
+      else if(strncmp("class", token, 5) == 0)
 	return token_class;
-      }
     }
 
     if(tokenlength == 6){
       /* states */
-      if(strncmp("states", token, 6) == 0){
-	free(token);
+      if(strncmp("states", token, 6) == 0)
 	return token_states;
-      }
       /* normal */
-      else if(strncmp("normal", token, 6) == 0){
-	free(token);
+      else if(strncmp("normal", token, 6) == 0)
 	return token_normal;
-      }
     }
 
     if(tokenlength == 7){
       /* utility */
-      if(strncmp("utility", token, 7) == 0){
-	free(token);
+      if(strncmp("utility", token, 7) == 0)
 	return token_utility;
-      }      
     }
 
     if(tokenlength == 8){
       /* position */
-      if(strncmp("position", token, 8) == 0){
-	free(token);
+      if(strncmp("position", token, 8) == 0)
 	return token_position;
-      }
       /* decision */
-      else if(strncmp("decision", token, 8) == 0){
-	free(token);
+      else if(strncmp("decision", token, 8) == 0)
 	return token_decision;
-      }
       /* discrete */
-      else if(strncmp("discrete", token, 8) == 0){
-	free(token);
+      else if(strncmp("discrete", token, 8) == 0)
 	return token_discrete;
-      }
       /* NIP_next */
-      else if(strncmp("NIP_next", token, 8) == 0){
-	free(token);
+      else if(strncmp("NIP_next", token, 8) == 0)
 	return token_persistence;
-      }
     }
 
     if(tokenlength == 9){ 
       /* node_size */
-      if(strncmp("node_size", token, 9) == 0){
-	free(token);
+      if(strncmp("node_size", token, 9) == 0)
 	return token_node_size;
-      }
       /* potential */
-      else if(strncmp("potential", token, 9) == 0){
-	free(token);
+      else if(strncmp("potential", token, 9) == 0)
 	return token_potential;
-      }
     }
 
     /* continuous */
     if(tokenlength == 10 &&
-       strncmp("continuous", token, 10) == 0){
-      free(token);
+       strncmp("continuous", token, 10) == 0)
       return token_continuous;
-    }
 
     /* End of literal string tokens */
 
@@ -1006,73 +1011,50 @@ yylex (void)
     /* QUOTED_STRING (enclosed in double quotes) */
     if(token[0] == '"' &&
        token[tokenlength - 1] == '"'){
-      nullterminated = (char *) calloc(tokenlength - 1, sizeof(char));
-      if(!nullterminated){
-	nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-	free(token);
+      /* For the semantic value of the string, strip off double quotes */
+      lvalp->name = copy_token(&(token[1]), tokenlength - 2);
+      if(!lvalp->name)
 	return 0; /* In the case of an (unlikely) error, stop the parser */
-      }
-      /* For the semantic value of the string, strip off double quotes
-       * and insert terminating null character. */
-      strncpy(nullterminated, &(token[1]), tokenlength - 2);
-      nullterminated[tokenlength - 2] = '\0';
-      yylval.name = nullterminated;
-
-      free(token);
-
       return QUOTED_STRING;
     }
 
-    nullterminated = (char *) calloc(tokenlength + 1, sizeof(char));
-    if(!nullterminated){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-      free(token);
-      return 0; /* In the case of an (unlikely) error, stop the parser */
-    }
-    strncpy(nullterminated, token, tokenlength);
-    nullterminated[tokenlength] = '\0';
-
     /* NUMBER ? */
-    numval = strtod(nullterminated, &endptr);
-    /* No error, so the token is a valid double. */
-    if(!(nullterminated == endptr && numval == 0)){
-      yylval.numval = numval;
-      free(token);
-      free(nullterminated);
+    if(nip_parse_number(token, tokenlength, &numval) > 0){
+      lvalp->numval = numval;
       return NUMBER;
     }
 
     /* Everything else is UNQUOTED_STRING */
-    yylval.name = nullterminated;
-
-    free(token);
-
+    lvalp->name = copy_token(token, tokenlength);
+    if(!lvalp->name)
+      return 0; /* In the case of an (unlikely) error, stop the parser */
     return UNQUOTED_STRING;
-
   }
-
 }
 
 
 static void
-yyerror (const char *s)  /* Called by yyparse on error */
+yyerror (nip_net_parser parser, const char *s)  /* Called by yyparse on error */
 {
   fprintf (stderr, "%s\n", s);
 }
 
 
 /* Puts the variables into the graph */
-static int parsed_vars_to_graph(nip_variable_list vl, nip_graph g){
+static int parsed_vars_to_graph(nip_variable_list vl, nip_potential_list pl,
+                                nip_graph g){
   int i, retval;
   nip_variable v;
   nip_variable_iterator it;
-  nip_potential_link initlist = nip_parsed_potentials->first;
+  nip_potential_link initlist = pl ? pl->first : NULL;
 
-  /* Add parsed variables to the graph. */
+  /* Add parsed variables to the graph, and number them for bitsets. */
   /*assert(vl != NULL);*/
+  i = 0;
   it = NIP_LIST_ITERATOR(vl);
   v = nip_next_variable(&it);
   while(v != NULL){
+    nip_set_variable_index(v, i++);
     retval = nip_graph_add_node(g, v);
     if(retval != NIP_NO_ERROR){
       nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
@@ -1141,7 +1123,7 @@ static int parsed_potentials_to_jtree(nip_potential_list potentials,
       else{
 	/* Priors of the independent variables are stored into the variable 
 	 * itself, but NOT entered into the model YET. */
-	/*retval = enter_evidence(vars, nvars, nip_cliques, 
+	/*retval = enter_evidence(vars, nvars, parser->cliques, 
 	 *			nip_num_of_cliques, initlist->child, 
 	 *			initlist->data->data); OLD STUFF */
 	retval = nip_set_prior(initlist->child, initlist->data->data);
@@ -1341,44 +1323,103 @@ static void print_parsed_stuff(nip_potential_list pl){
 }
 
 
-FILE *open_net_file(const char *filename){
-  if(!nip_net_file_open){
-    nip_net_file = fopen(filename,"r");
-    if (!nip_net_file){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
-      return NULL; /* fopen(...) failed */
-    }
-    else{
-      nip_net_file_open = 1;
-      /* nip_read_line = 1; Was this necessary? JJT 5.1.2007 */
-    }
+nip_net_parser open_net_file(const char *filename){
+  nip_net_parser parser = (nip_net_parser) malloc(sizeof(nip_net_parser_struct));
+  if(!parser){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NULL;
+  }
+  parser->file = nip_open_net_file(filename);
+  if(!parser->file){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    free(parser);
+    return NULL; /* fopen(...) failed */
   }
-  return nip_net_file;
+  parser->node_position_x = 100;
+  parser->node_position_y = 100;
+  parser->node_size_x = 80;
+  parser->node_size_y = 60;
+  parser->parsed_doubles = NULL;
+  parser->n_doubles = 0;
+  parser->doubles_size = 0;
+  parser->data_size = 0;
+  parser->parsed_strings = NULL;
+  parser->statenames = NULL;
+  parser->n_statenames = 0;
+  parser->ignored_net_fields = NULL;
+  parser->ignored_node_fields = NULL;
+  parser->ignored_potential_fields = NULL;
+  parser->label = NULL;
+  parser->persistence = NULL;
+  parser->parsed_vars = NULL;
+  parser->parent_vars = NULL;
+  parser->parsed_graph = NULL;
+  parser->parsed_potentials = NULL;
+  parser->interface_relations = NULL;
+  parser->cliques = NULL;
+  parser->n_cliques = 0;
+  return parser;
 }
 
 
-void close_net_file(){
-  if(nip_net_file_open){
-    fclose(nip_net_file);
-    nip_net_file_open = 0;
+void close_net_file(nip_net_parser parser){
+  int i;
+  nip_variable v;
+  nip_variable_iterator it;
+
+  if(!parser)
+    return;
+  nip_close_net_file(parser->file);
+
+  /* Whatever was left after an error or not taken by the caller */
+  free(parser->parsed_doubles);
+  nip_free_string_list(parser->parsed_strings);
+  for(i = 0; i < parser->n_statenames; i++)
+    free(parser->statenames[i]);
+  free(parser->statenames);
+  nip_free_string_pair_list(parser->ignored_net_fields);
+  nip_free_string_pair_list(parser->ignored_node_fields);
+  nip_free_string_pair_list(parser->ignored_potential_fields);
+  free(parser->label);
+  free(parser->persistence);
+  nip_empty_variable_list(parser->parent_vars);
+  free(parser->parent_vars);
+  nip_free_graph(parser->parsed_graph);
+  nip_free_potential_list(parser->parsed_potentials);
+  nip_free_interface_list(parser->interface_relations);
+  for(i = 0; i < parser->n_cliques; i++)
+    nip_free_clique(parser->cliques[i]);
+  free(parser->cliques);
+  if(parser->parsed_vars){
+    it = NIP_LIST_ITERATOR(parser->parsed_vars);
+    while((v = nip_next_variable(&it)) != NULL)
+      nip_free_variable(v);
+    nip_empty_variable_list(parser->parsed_vars);
+    free(parser->parsed_vars);
   }
+  free(parser);
 }
 
 
 /* Gives you the list of variables after yyparse() */
-nip_variable_list get_parsed_variables (void){
-  return nip_parsed_vars;
+nip_variable_list get_parsed_variables(nip_net_parser parser){
+  nip_variable_list vl = parser->parsed_vars;
+  parser->parsed_vars = NULL;
+  return vl;
 }
 
 
 /* Gives you the array of cliques after yyparse() */
-int get_cliques (nip_clique** clique_array_pointer){
-  *clique_array_pointer = nip_cliques;
-  return nip_n_cliques;
+int get_cliques(nip_net_parser parser, nip_clique** clique_array_pointer){
+  int n = parser->n_cliques;
+  *clique_array_pointer = parser->cliques;
+  parser->cliques = NULL;
+  parser->n_cliques = 0;
+  return n;
 }
 
 
-void get_parsed_node_size(int* x, int* y){
-  *x = nip_node_size_x;
-  *y = nip_node_size_y;
+void get_parsed_node_size(nip_net_parser parser, int* x, int* y){
+  *x = parser->node_size_x;
+  *y = parser->node_size_y;
 }
@@ -16,6 +16,9 @@
  * with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 #include "nip.h"
 
 
@@ -25,25 +28,53 @@
 /** This many probabilities / row of text */
 #define POTENTIAL_ELEMENTS_PER_LINE 7
 
+/** Size of the buffer for writing text files */
+#define OUTPUT_BUFFER_SIZE 65536
+
 /** Run EM steps at least this many times unless limited by maximum count */
 #define MIN_EM_ITERATIONS 3
 
+/** Identifies a file of expected counts, followed by a format version */
+#define EXPECTED_COUNTS_MAGIC "NIPC"
+#define EXPECTED_COUNTS_VERSION 1
+
+/** Identifies a binary time series file, followed by a format version */
+#define BINARY_TIMESERIES_MAGIC "NIPT"
+#define BINARY_TIMESERIES_VERSION 1
+
+/** Identifies a compiled model file, followed by a format version */
+#define COMPILED_MODEL_MAGIC "NIPM"
+#define COMPILED_MODEL_VERSION 1
+
+/** Keep at most this many pruned models in the cache of a model */
+#define PRUNED_MODEL_CACHE_SIZE 16
+
 /*#define DEBUG_NIP*/
 
-/* External Hugin Net parser functions */
-#include "huginnet.tab.h" // int yyparse();
+/* External Hugin Net parser functions: yyparse(), open_net_file(), etc. */
+#include "huginnet.tab.h"
+
 
-/* TODO: Put these guys into a separate shared header?
- * Or find The Proper Way to do stuff without global variables!
- * Hint: %parse-param in huginnet.y? */
-FILE* open_net_file(const char *filename);
-void close_net_file();
-nip_variable_list get_parsed_variables();
-int get_cliques(nip_clique** clique_array_pointer);
-void get_parsed_node_size(int* x, int* y);
+/* Decimals of written probabilities, or -1 for the default */
+static int output_precision = -1;
+
+/* Text written into a file through a buffer */
+typedef struct {
+  FILE* file;      /* the output file */
+  int precision;   /* decimals of numbers */
+  int length;      /* characters in the buffer */
+  int error;       /* NIP_NO_ERROR, or the first failure */
+  char data[OUTPUT_BUFFER_SIZE];
+} output_buffer_struct;
+typedef output_buffer_struct* output_buffer;
 
 
 /* Internal helper functions */
+static output_buffer new_output_buffer(FILE* f);
+static void buffer_string(output_buffer b, const char* s);
+static void buffer_char(output_buffer b, char c);
+static void buffer_number(output_buffer b, double x);
+static int flush_output_buffer(output_buffer b);
 static int start_timeslice_message_pass(nip_model model,
                                         nip_direction dir,
                                         nip_potential sepset);
@@ -52,10 +83,70 @@ static int finish_timeslice_message_pass(nip_model model,
                                          nip_potential num,
                                          nip_potential den);
 
+static int init_model(nip_model new);
+static int build_symbol_table(nip_model model);
+static int compare_variable_ids(const void* a, const void* b);
+static int sorted_variable_index(nip_variable* vars, int nvars,
+                                 nip_variable v);
+static int clique_index(nip_model model, nip_clique c);
+static nip_sepset* sepset_order(nip_model model, int* n_sepsets);
+
+/* Time series of a data file, read by one thread */
+typedef struct {
+  timeseries_reader reader; /* the open data file */
+  int first;             /* the first time series to read */
+  int last;              /* the one after the last time series to read */
+  time_series* results;  /* where to put the time series */
+  int offset;            /* index of the time series in results[0] */
+  int error;             /* NIP_NO_ERROR, or what went wrong */
+} timeseries_chunk_struct;
+
+static time_series new_timeseries(nip_model model, nip_variable* columns,
+                                  int ncolumns, int length);
+static int open_text_timeseries(timeseries_reader r);
+static int open_binary_timeseries(timeseries_reader r);
+static int read_timeseries_range(timeseries_reader r, int first, int last,
+                                 time_series* results);
+static void* read_timeseries_chunk(void* chunk);
+static time_series read_binary_series(timeseries_reader r, int n);
+static void free_timeseries_batch(timeseries_reader r);
+static int write_uncertainseries_to(uncertain_series *ucs_set, int n_series,
+                                    nip_variable v, char* filename,
+                                    int header);
+static nip_variable* observed_variables(time_series* ts_set, int n_series,
+                                        int* n_observed);
+static int write_binary_string(FILE* f, char* s);
+static int starts_with_magic(char* filename, char* magic);
+static char* read_binary_string(FILE* f);
+
+static unsigned long timeseries_hash(time_series ts);
+static int equal_timeseries(time_series a, time_series b);
+
 static int e_step(time_series ts, nip_potential* parameters,
                   double* loglikelihood);
 static int m_step(nip_potential* results, nip_model model);
 
+/* A child variable (index) and its family clique, for grouping in m_step */
+typedef struct {
+  nip_clique clique;
+  int var;
+} family_link;
+static int compare_family_links(const void* a, const void* b);
+static int set_family_potentials(nip_model model, nip_potential* parameters);
+
+/* A pruned model in the cache of its full model, see prune_model() */
+struct nip_pruned_model {
+  unsigned long signature; /* hash of the following */
+  int keep_likelihood;     /* only barren variables left out? */
+  int num_of_query;        /* number of query variables */
+  int num_of_ids;          /* number of query and evidence variables */
+  unsigned long* ids;      /* sorted query ids, then sorted evidence ids */
+  nip_model model;         /* the pruned model, or the full model itself */
+  struct nip_pruned_model* next; /* the next most recently used */
+};
+static void free_pruned_models(nip_model model);
+static nip_variable model_counterpart(nip_model model, nip_variable v);
+
 
 void reset_model(nip_model model){
   int i, retval;
@@ -79,6 +170,7 @@ void total_reset(nip_model model){
     c = model->cliques[i];
     nip_uniform_potential(c->original_p, 1.0);
   }
+  free_pruned_models(model); /* no longer the same parameters */
   /* Q: Reset priors? */
   reset_model(model); /* Could that be enough? */
 }
@@ -116,36 +208,89 @@ void use_priors(nip_model model, int has_history){
 
 
 nip_model parse_model(char* file){
-  int i, j, k, m, retval;
-  nip_variable temp;
+  int retval;
+#ifdef DEBUG_NIP
+  int i;
+#endif
   nip_variable_list vl;
-  nip_model new = (nip_model) malloc(sizeof(nip_model_struct));
+  nip_net_parser parser = NULL;
+  nip_model new = NULL;
 
+  /* compiled models need no parsing */
+  if(starts_with_magic(file, COMPILED_MODEL_MAGIC))
+    return read_compiled_model(file);
+
+  new = (nip_model) malloc(sizeof(nip_model_struct));
   if(!new){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
     return NULL;
   }
 
   /* 1. Parse */
-  if(open_net_file(file) == NULL){
+  parser = open_net_file(file);
+  if(parser == NULL){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    free(new);
     return NULL;
   }
 
-  retval = yyparse(); /* Reminder: priors not entered yet?! */
+  retval = yyparse(parser); /* Reminder: priors not entered yet?! */
 
-  close_net_file();
-
-  if(retval != 0)
+  if(retval != 0){
+    close_net_file(parser); /* frees the partial results */
+    free(new);
     return NULL;
+  }
 
   /* 2. Get the parsed stuff and make a model out of them */
-  new->num_of_cliques = get_cliques(&(new->cliques));
-  vl = get_parsed_variables();
+  new->num_of_cliques = get_cliques(parser, &(new->cliques));
+  vl = get_parsed_variables(parser);
   new->num_of_vars = NIP_LIST_LENGTH(vl);
   new->variables = nip_variable_list_to_array(vl);
   nip_empty_variable_list(vl);
   free(vl);
+  get_parsed_node_size(parser, &(new->node_size_x), &(new->node_size_y));
+  close_net_file(parser);
+
+  /* 3. Find the special variables and index them by symbol */
+  if(init_model(new) != NIP_NO_ERROR){
+    free(new->variables);
+    free(new);
+    return NULL;
+  }
+
+#ifdef DEBUG_NIP
+  if(new->out_clique){
+    printf("Out clique:\n");
+    nip_fprintf_clique(stdout, new->out_clique);
+  }
+  printf("Incoming interface:\n");
+  for(i = 0; i < new->incoming_interface_size; i++)
+    printf("%s, ", new->incoming_interface[i]->symbol);
+  printf("\n");
+  printf("Outgoing interface:\n");
+  for(i = 0; i < new->outgoing_interface_size; i++)
+    printf("%s, ", new->outgoing_interface[i]->symbol);
+  printf("\n");
+  printf("Old outgoing interface:\n");
+  for(i = 0; i < new->outgoing_interface_size; i++)
+    printf("%s, ", new->previous_outgoing_interface[i]->symbol);
+  printf("\n");
+#endif
+
+  return new;
+}
+
+
+/* Finds the special variables (children, interfaces, etc.) and the
+ * interface cliques of a model whose variables and cliques are set */
+static int init_model(nip_model new){
+  int i, j, k, m;
+  nip_variable temp;
+
+  new->symbol_table = NULL;
+  new->symbol_table_size = 0;
+  new->pruned = NULL;
 
   /* count the number of various kinds of "special" variables */
   new->num_of_nexts = 0;
@@ -199,15 +344,14 @@ nip_model parse_model(char* file){
        new->previous &&
        new->next)){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-    free(new->variables);
     free(new->next);
     free(new->previous);
     free(new->outgoing_interface);
     free(new->previous_outgoing_interface);
     free(new->incoming_interface);
     free(new->children);
-    free(new);
-    return NULL;
+    free(new->independent);
+    return NIP_ERROR_OUTOFMEMORY;
   }
 
   /* This selects the variables for various special purposes */
@@ -259,35 +403,97 @@ nip_model parse_model(char* file){
     new->in_clique = NULL;
     new->out_clique = NULL;
   }
-  get_parsed_node_size(&(new->node_size_x), &(new->node_size_y));
 
   /* Let's check one detail */
   for(i = 0; i < new->num_of_vars - new->num_of_children; i++)
     assert(new->independent[i]->num_of_parents == 0);
 
-  /* 4. Reset parser globals? */
-  /*nip_empty_variable_list(vl); free(vl);*/
+  /* Index the variables by symbol (linear search if this fails) */
+  build_symbol_table(new);
+  return NIP_NO_ERROR;
+}
+
 
-#ifdef DEBUG_NIP
-  if(new->out_clique){
-    printf("Out clique:\n");
-    nip_fprintf_clique(stdout, new->out_clique);
+
+void set_output_precision(int decimals){
+  output_precision = (decimals < 0) ? -1 : decimals;
+}
+
+
+/* A buffer for writing text into the file f */
+static output_buffer new_output_buffer(FILE* f){
+  char* setting = NULL;
+  output_buffer b = (output_buffer) malloc(sizeof(output_buffer_struct));
+  if(!b){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NULL;
   }
-  printf("Incoming interface:\n");
-  for(i = 0; i < new->incoming_interface_size; i++)
-    printf("%s, ", new->incoming_interface[i]->symbol);
-  printf("\n");
-  printf("Outgoing interface:\n");
-  for(i = 0; i < new->outgoing_interface_size; i++)
-    printf("%s, ", new->outgoing_interface[i]->symbol);
-  printf("\n");
-  printf("Old outgoing interface:\n");
-  for(i = 0; i < new->outgoing_interface_size; i++)
-    printf("%s, ", new->previous_outgoing_interface[i]->symbol);
-  printf("\n");
-#endif
+  b->file = f;
+  b->length = 0;
+  b->error = NIP_NO_ERROR;
+
+  /* explicitly set, or from the environment, or the default */
+  b->precision = output_precision;
+  if(b->precision < 0){
+    setting = getenv("NIP_PRECISION");
+    if(setting && *setting >= '0' && *setting <= '9')
+      b->precision = atoi(setting);
+    else
+      b->precision = NIP_OUTPUT_PRECISION;
+  }
+  return b;
+}
 
-  return new;
+
+/* Writes the buffered text into the file, reports any failure so far */
+static int flush_output_buffer(output_buffer b){
+  if(b->length > 0 && b->error == NIP_NO_ERROR &&
+     fwrite(b->data, 1, b->length, b->file) != (size_t)b->length)
+    b->error = NIP_ERROR_IO;
+  b->length = 0;
+  return b->error;
+}
+
+
+static void buffer_string(output_buffer b, const char* s){
+  while(*s != '\0'){
+    if(b->length == OUTPUT_BUFFER_SIZE)
+      flush_output_buffer(b);
+    b->data[b->length++] = *s++;
+  }
+}
+
+
+static void buffer_char(output_buffer b, char c){
+  if(b->length == OUTPUT_BUFFER_SIZE)
+    flush_output_buffer(b);
+  b->data[b->length++] = c;
+}
+
+
+/* Writes x with the chosen number of decimals, like "%.*f" */
+static void buffer_number(output_buffer b, double x){
+  int n;
+  char* copy = NULL;
+
+  if(b->length > OUTPUT_BUFFER_SIZE - 64)
+    flush_output_buffer(b);
+  n = nip_format_number(x, b->precision, &(b->data[b->length]),
+                        OUTPUT_BUFFER_SIZE - b->length);
+  if(n < OUTPUT_BUFFER_SIZE - b->length){
+    b->length += n;
+    return;
+  }
+
+  /* huge numbers with many decimals */
+  copy = (char*) malloc(n + 1);
+  if(!copy){
+    b->error = NIP_ERROR_OUTOFMEMORY;
+    return;
+  }
+  nip_format_number(x, b->precision, copy, n + 1);
+  buffer_string(b, copy);
+  free(copy);
 }
 
 
@@ -302,6 +508,7 @@ int write_model(nip_model model, char* filename){
   int *map = NULL;
   nip_clique c = NULL;
   nip_potential p = NULL;
+  output_buffer b = NULL;
   char *indent;
 
 #ifdef NET_LANG_V1
@@ -316,6 +523,12 @@ int write_model(nip_model model, char* filename){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
     return NIP_ERROR_IO;
   }
+  /* the potentials are formatted in a buffer */
+  b = new_output_buffer(f);
+  if(!b){
+    fclose(f);
+    return NIP_ERROR_OUTOFMEMORY;
+  }
 
   /* remove the evidence */
   reset_model(model);
@@ -323,8 +536,8 @@ int write_model(nip_model model, char* filename){
   /* Reminder:
    * fputs("some text", f);
    * fprintf(f, "value = %g", 1.23400000); */
-  /*******************************************************/
-  /* Replace %f with %g if you don't like trailing zeros */
+  /*************************************************************/
+  /* The probabilities have set_output_precision() decimals    */
 
   /** Lets print the NET file **/
 
@@ -370,25 +583,31 @@ int write_model(nip_model model, char* filename){
   for(i = 0; i < model->num_of_vars - model->num_of_children; i++){
     v = model->independent[i];
     n = NIP_CARDINALITY(v);
-    fputs("\n", f);
+    buffer_char(b, '\n');
     /* independent variables have priors */
-    fprintf(f, "%spotential (%s)\n", indent, nip_variable_symbol(v));
-    fprintf(f, "%s{\n", indent);
-    fprintf(f, "%s    data = ( ", indent);
+    buffer_string(b, indent);
+    buffer_string(b, "potential (");
+    buffer_string(b, nip_variable_symbol(v));
+    buffer_string(b, ")\n");
+    buffer_string(b, indent);
+    buffer_string(b, "{\n");
+    buffer_string(b, indent);
+    buffer_string(b, "    data = ( ");
     for(j = 0; j < n; j++){
       /* limit the length of lines */
-      if (j > 0 && (j % POTENTIAL_ELEMENTS_PER_LINE) == 0)
-        fprintf(f, "\n%s             ", indent);
-
-      /* Print the value: change to %g if trailing zeros disturb you */
-      fprintf(f, "%f  ", v->prior[j]);
+      if (j > 0 && (j % POTENTIAL_ELEMENTS_PER_LINE) == 0){
+        buffer_char(b, '\n');
+        buffer_string(b, indent);
+        buffer_string(b, "             ");
+      }
 
-      /* NOTE: fprintf() returns the number of printed characters,
-       * and you could use it for limiting the line length smarter. */
+      /* Print the value with set_output_precision() decimals */
+      buffer_number(b, v->prior[j]);
+      buffer_string(b, "  ");
     }
-    fputs(");\n", f);
-    fprintf(f, "%s}\n", indent);
-    fflush(f);
+    buffer_string(b, ");\n");
+    buffer_string(b, indent);
+    buffer_string(b, "}\n");
   }
 
   /** the potentials **/
@@ -403,21 +622,29 @@ int write_model(nip_model model, char* filename){
       multiparent = 0;
 
     /* child variables have conditional distributions */
-    fputs("\n", f);
-    fprintf(f, "%spotential (%s | ", indent, nip_variable_symbol(v));
+    buffer_char(b, '\n');
+    buffer_string(b, indent);
+    buffer_string(b, "potential (");
+    buffer_string(b, nip_variable_symbol(v));
+    buffer_string(b, " | ");
     for(j = nparents-1; j > 0; j--){
       /* Hugin fellas put parents in reverse order */
-      fprintf(f, "%s ", nip_variable_symbol(v->parents[j]));
+      buffer_string(b, nip_variable_symbol(v->parents[j]));
+      buffer_char(b, ' ');
     }
-    fprintf(f, "%s)\n", nip_variable_symbol(v->parents[0]));
-    fprintf(f, "%s{ \n", indent);
-    fprintf(f, "%s    data = (", indent);
+    buffer_string(b, nip_variable_symbol(v->parents[0]));
+    buffer_string(b, ")\n");
+    buffer_string(b, indent);
+    buffer_string(b, "{ \n");
+    buffer_string(b, indent);
+    buffer_string(b, "    data = (");
     if (multiparent)
-      fputs("(", f);
+      buffer_char(b, '(');
 
     temp = (int*) calloc(nparents+1, sizeof(int));
     if(!temp){
       nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+      free(b);
       fclose(f);
       return NIP_ERROR_OUTOFMEMORY;
     }
@@ -448,40 +675,49 @@ int write_model(nip_model model, char* filename){
                 y % POTENTIAL_ELEMENTS_PER_LINE == 0))){
         if(n){
           if (multiparent)
-            fputs(")(", f);
+            buffer_string(b, ")(");
           /* print comments about parent values for previous line
            * NOTE: the last comment is left out */
-          fputs(" % ", f);
+          buffer_string(b, " % ");
           nip_inverse_mapping(p, j-1, temp);
           for(x = nparents-1; x >= 0; x--){
-            fprintf(f, "%s=%s ", nip_variable_symbol(v->parents[x]),
-                    nip_variable_state_name(v->parents[x], temp[x+1]));
+            buffer_string(b, nip_variable_symbol(v->parents[x]));
+            buffer_char(b, '=');
+            buffer_string(b, nip_variable_state_name(v->parents[x],
+                                                     temp[x+1]));
+            buffer_char(b, ' ');
           }
         }
         /* cut the line and indent */
-        fprintf(f, "\n%s            ", indent);
+        buffer_char(b, '\n');
+        buffer_string(b, indent);
+        buffer_string(b, "            ");
         y = 0;
       }
 
       /* Print the value... */
-      fprintf(f, " %f ", p->data[j]);
+      buffer_char(b, ' ');
+      buffer_number(b, p->data[j]);
+      buffer_char(b, ' ');
       y++;
     }
     if (multiparent)
-      fputs(")", f);
-    fputs(");\n", f);
-    fprintf(f, "%s}\n", indent);
+      buffer_char(b, ')');
+    buffer_string(b, ");\n");
+    buffer_string(b, indent);
+    buffer_string(b, "}\n");
     free(temp);
     nip_free_potential(p);
-    fflush(f);
   }
 
 #ifdef NET_LANG_V1
-  fputs("} \n", f); /* the last brace */
+  buffer_string(b, "} \n"); /* the last brace */
 #endif
 
   /* close the file */
-  if(fclose(f)){
+  i = flush_output_buffer(b);
+  free(b);
+  if(fclose(f) || i != NIP_NO_ERROR){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
     return NIP_ERROR_IO;
   }
@@ -489,248 +725,1181 @@ int write_model(nip_model model, char* filename){
 }
 
 
-void free_model(nip_model model){
-  int i;
+/* Orders variables by their ids, like the variables of cliques */
+static int compare_variable_ids(const void* a, const void* b){
+  nip_variable u = *((nip_variable*)a);
+  nip_variable v = *((nip_variable*)b);
+  if(u->id < v->id)
+    return -1;
+  return (u->id > v->id);
+}
 
-  if (!model)
-    return;
 
-  /* 1. Free cliques and adjacent sepsets */
-  for(i = 0; i < model->num_of_cliques; i++)
-    nip_free_clique(model->cliques[i]);
-  free(model->cliques);
+/* Index of v in an array sorted by compare_variable_ids(), or -1 */
+static int sorted_variable_index(nip_variable* vars, int nvars,
+                                 nip_variable v){
+  nip_variable* found;
+  if(!v)
+    return -1;
+  found = (nip_variable*) bsearch(&v, vars, nvars, sizeof(nip_variable),
+                                  compare_variable_ids);
+  return found ? (int)(found - vars) : -1;
+}
 
-  /* 2. Free the variables */
-  for(i = 0; i < model->num_of_vars; i++)
-    nip_free_variable(model->variables[i]);
-  free(model->variables);
 
-  free(model->next);
-  free(model->previous);
-  free(model->outgoing_interface);
-  free(model->previous_outgoing_interface);
-  free(model->incoming_interface);
-  free(model->children);
-  free(model->independent);
-  free(model);
+/* Index of clique c in the join tree of the model, or -1 */
+static int clique_index(nip_model model, nip_clique c){
+  int i;
+  for(i = 0; i < model->num_of_cliques; i++)
+    if(model->cliques[i] == c)
+      return i;
+  return -1;
 }
 
 
-int read_timeseries(nip_model model, char* filename, time_series** results,
-                    int (*ts_progress)(int, int)){
-  int i, j, k, m, n, N;
-  int obs;
-  char** tokens = NULL;
-  time_series ts = NULL;
-  nip_data_file df = NULL;
-  nip_variable v = NULL;
+/* Lists the sepsets of the join tree in such an order that confirming
+ * them with nip_confirm_sepset() reproduces the sepset lists of every
+ * clique, i.e. the order of message passing. Since confirming prepends
+ * to the lists, the last sepset of both neighbours is confirmed first.
+ * Returns NULL and sets *n_sepsets < 0 if something went wrong. */
+static nip_sepset* sepset_order(nip_model model, int* n_sepsets){
+  int i, j, a, b, n, placed, progress;
+  int* start = NULL;     /* where the list of each clique begins in links */
+  int* remaining = NULL; /* how many sepsets of each clique not placed */
+  int* ends = NULL;      /* clique indices of the neighbours of a sepset */
+  nip_sepset* links = NULL;
+  nip_sepset* sepsets = NULL;
+  nip_sepset* results = NULL;
+  nip_sepset s;
+  nip_sepset_link l;
 
-  df = nip_open_data_file(filename, NIP_FIELD_SEPARATOR, 0, 1);
-  if(df == NULL){
-    nip_report_error(__FILE__, __LINE__, ENOENT, 1);
-    fprintf(stderr, "%s\n", filename);
-    return 0;
+  *n_sepsets = -1;
+  start = (int*) calloc(model->num_of_cliques + 1, sizeof(int));
+  remaining = (int*) calloc(model->num_of_cliques, sizeof(int));
+  if(!(start && remaining)){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free(start);
+    free(remaining);
+    return NULL;
   }
-  if(nip_analyse_data_file(df) < 0){
-    nip_report_error(__FILE__, __LINE__, EIO, 1);
-    return 0;
+
+  /* every sepset is in the lists of both of its neighbours */
+  for(i = 0; i < model->num_of_cliques; i++){
+    n = 0;
+    for(l = model->cliques[i]->sepsets; l != NULL; l = l->fwd)
+      n++;
+    remaining[i] = n;
+    start[i + 1] = start[i] + n;
   }
+  n = start[model->num_of_cliques] / 2;
 
-  /* N time series */
-  N = df->ndatarows;
-  *results = (time_series*) calloc(N, sizeof(time_series));
-  if(!*results){
+  links = (nip_sepset*) calloc(2 * n + 1, sizeof(nip_sepset));
+  sepsets = (nip_sepset*) calloc(n + 1, sizeof(nip_sepset));
+  results = (nip_sepset*) calloc(n + 1, sizeof(nip_sepset));
+  ends = (int*) calloc(2 * n + 1, sizeof(int));
+  if(!(links && sepsets && results && ends)){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-    nip_close_data_file(df);
-    return 0;
+    free(start);
+    free(remaining);
+    free(links);
+    free(sepsets);
+    free(results);
+    free(ends);
+    return NULL;
   }
 
-  for(n = 0; n < N; n++){
-    ts = (time_series) malloc(sizeof(time_series_struct));
-    if(!ts){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-      free(*results);
-      nip_close_data_file(df);
-      return 0;
-    }
-    ts->model = model;
-    ts->hidden = NULL;
-    ts->observed = NULL;
-    ts->data = NULL;
-    ts->length = df->datarows[n];
-
-    /* Check the contents of data file */
-    obs = 0;
-    for(i = 0; i < df->num_of_nodes; i++){
-      v = model_variable(model, df->node_symbols[i]);
-      if(v)
-        obs++;
-    }
-
-    /* Find out how many (totally) latent variables there are. */
-    ts->num_of_hidden = model->num_of_vars - obs;
-    ts->num_of_observed = obs; /* Must be "final" */
-
-    /* Allocate the array for the hidden variables. */
-    ts->hidden = (nip_variable *) calloc(ts->num_of_hidden,
-                                         sizeof(nip_variable));
-    if(obs > 0)
-      ts->observed = (nip_variable *) calloc(obs, sizeof(nip_variable));
-    if(!(ts->hidden && (ts->observed || obs == 0))){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-      free(ts->hidden);
-      free(ts);
-      free(*results);
-      nip_close_data_file(df);
-      return 0;
-    }
-
-    /* Set the pointers to the hidden variables. */
-    m = 0;
-    for(k = 0; k < model->num_of_vars; k++){
-      j = 1;
-      for(i = 0; i < df->num_of_nodes; i++){
-        if(nip_equal_variables(model->variables[k],
-                               model_variable(model, df->node_symbols[i])))
-          j = 0;
+  j = 0;
+  for(i = 0; i < model->num_of_cliques; i++){
+    a = start[i];
+    for(l = model->cliques[i]->sepsets; l != NULL; l = l->fwd){
+      s = (nip_sepset)l->data;
+      links[a++] = s;
+      if(s->first_neighbour == model->cliques[i] && j < n){
+        ends[2*j] = clique_index(model, s->first_neighbour);
+        ends[2*j + 1] = clique_index(model, s->second_neighbour);
+        sepsets[j++] = s;
       }
-      if(j)
-        ts->hidden[m++] = model->variables[k];
     }
+  }
 
-    if(obs > 0){
-      k = 0;
-      for(i = 0; i < df->num_of_nodes; i++){
-        v = model_variable(model, df->node_symbols[i]);
-        if(v)
-          ts->observed[k++] = v;
-        /* note that these are coupled with ts->data */
-      }
-
-      /* Allocate some space for data */
-      ts->data = (int**) calloc(ts->length, sizeof(int*));
-      if(!(ts->data)){
-        nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-        free(ts->hidden);
-        free(ts->observed);
-        free(ts);
-        free(*results);
-        nip_close_data_file(df);
-        return 0;
-      }
-      for(i = 0; i < ts->length; i++){
-        ts->data[i] = (int*) calloc(obs, sizeof(int));
-        if(!(ts->data[i])){
-          nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-          for(j = 0; j < i; j++)
-            free(ts->data[j]);
-          free(ts->data);
-          free(ts->hidden);
-          free(ts->observed);
-          free(ts);
-          free(*results);
-          nip_close_data_file(df);
-          return 0;
-        }
-      }
-
-      /* Get the data */
-      for(j = 0; j < ts->length; j++){
-        /* 2. Read */
-        m = nip_next_line_tokens(df, NIP_FIELD_SEPARATOR, &tokens);
-
-        if(m != df->num_of_nodes){
-          fprintf(stderr, "Warning: (%s): time series %d (t=%d) ",
-                  filename, n, j);
-          fprintf(stderr, "has %d tokens, ", m);
-          fprintf(stderr, "%d expected instead.\n", df->num_of_nodes);
-        }
-
-        /* 3. Put into the data array
-         * (the same loop as above to ensure the data is in
-         *  the same order as variables ts->observed) */
-        k = 0;
-        for(i = 0; i < df->num_of_nodes; i++){
-          v = model_variable(model, df->node_symbols[i]);
-          if(i == m)
-            break; /* the line was too short */
-          if(v)
-            ts->data[j][k++] = nip_variable_state_index(v, tokens[i]);
-          /* note that these are coupled with ts->observed */
-
-          /* Q: Should missing data be allowed?   A: Yes. */
-          /* assert(data[j][i] >= 0); */
-        }
-
-        for(i = 0; i < m; i++) /* 4. Dump away */
-          free(tokens[i]);
-        free(tokens);
+  /* repeatedly take the sepsets at the end of both neighbouring lists */
+  placed = 0;
+  do{
+    progress = 0;
+    for(j = 0; j < n; j++){
+      a = ends[2*j];
+      b = ends[2*j + 1];
+      if(sepsets[j] && a >= 0 && b >= 0 &&
+         remaining[a] > 0 && links[start[a] + remaining[a] - 1] == sepsets[j] &&
+         remaining[b] > 0 && links[start[b] + remaining[b] - 1] == sepsets[j]){
+        results[placed++] = sepsets[j];
+        sepsets[j] = NULL;
+        remaining[a]--;
+        remaining[b]--;
+        progress = 1;
       }
     }
+  } while(progress);
 
-    (*results)[n] = ts;
-    if(ts_progress != NULL)
-      ts_progress(n, ts->length);
-  }
+  free(start);
+  free(remaining);
+  free(links);
+  free(sepsets);
+  free(ends);
 
-  nip_close_data_file(df);
-  return N;
+  if(placed < n){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    free(results);
+    return NULL;
+  }
+  *n_sepsets = n;
+  return results;
 }
 
 
-int write_timeseries(time_series *ts_set, int n_series, char *filename){
-  int i, n, t;
-  int d;
-  int *record;
-  int n_observed;
-  int *map;
+int write_compiled_model(nip_model model, char* filename){
+  int i, j, n;
+  int ok;
+  int n_sepsets;
+  int index[3];
   nip_variable v;
-  nip_variable *observed;
-  nip_variable *observed_more;
-  time_series ts;
-  nip_model the_model;
-  FILE *f = NULL;
+  nip_variable* vars = NULL;
+  nip_sepset* sepsets = NULL;
+  nip_clique c;
+  FILE* f = NULL;
 
-  /* Check stuff */
-  if(!(n_series > 0 && ts_set && filename)){
+  if(!(model && filename)){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
     return NIP_ERROR_INVALID_ARGUMENT;
   }
 
-  /* Check all the models are same */
-  the_model = ts_set[0]->model;
-  for(n = 1; n < n_series; n++){
-    if(ts_set[n]->model != the_model){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
-      return NIP_ERROR_INVALID_ARGUMENT;
-    }
+  /* Variables are stored in the order of their ids, so that creating
+   * them in the same order reproduces the order of clique variables */
+  vars = (nip_variable*) calloc(model->num_of_vars, sizeof(nip_variable));
+  if(!vars){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NIP_ERROR_OUTOFMEMORY;
   }
+  memcpy(vars, model->variables, model->num_of_vars * sizeof(nip_variable));
+  qsort(vars, model->num_of_vars, sizeof(nip_variable), compare_variable_ids);
 
-  /* Find out union of observed variables */
-  ts = ts_set[0];
-  observed = nip_variable_union(ts->observed, NULL,
-                                the_model->num_of_vars - ts->num_of_hidden,
-                                0, &n_observed);
-  if(n_observed < 0){
-    nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+  sepsets = sepset_order(model, &n_sepsets);
+  if(!sepsets){
+    free(vars);
     return NIP_ERROR_GENERAL;
   }
 
+  f = fopen(filename, "wb");
+  if(!f){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    free(vars);
+    free(sepsets);
+    return NIP_ERROR_IO;
+  }
+
+  n = COMPILED_MODEL_VERSION;
+  ok = (fwrite(COMPILED_MODEL_MAGIC, 1, 4, f) == 4 &&
+        fwrite(&n, sizeof(int), 1, f) == 1 &&
+        fwrite(&(model->node_size_x), sizeof(int), 1, f) == 1 &&
+        fwrite(&(model->node_size_y), sizeof(int), 1, f) == 1 &&
+        fwrite(&(model->num_of_vars), sizeof(int), 1, f) == 1);
+
+  /* the variables and their relations as indices into the file order */
+  for(i = 0; ok && i < model->num_of_vars; i++){
+    v = vars[i];
+    ok = (write_binary_string(f, nip_variable_symbol(v)) &&
+          write_binary_string(f, v->name ? v->name : "") &&
+          fwrite(&NIP_CARDINALITY(v), sizeof(int), 1, f) == 1);
+    for(j = 0; ok && j < NIP_CARDINALITY(v); j++)
+      ok = write_binary_string(f, nip_variable_state_name(v, j));
+
+    index[0] = sorted_variable_index(vars, model->num_of_vars, v->next);
+    index[1] = sorted_variable_index(vars, model->num_of_vars, v->previous);
+    index[2] = v->num_of_parents;
+    ok = (ok &&
+          fwrite(&(v->interface_status), sizeof(int), 1, f) == 1 &&
+          fwrite(&(v->pos_x), sizeof(int), 1, f) == 1 &&
+          fwrite(&(v->pos_y), sizeof(int), 1, f) == 1 &&
+          fwrite(index, sizeof(int), 3, f) == 3);
+    for(j = 0; ok && j < v->num_of_parents; j++){
+      n = sorted_variable_index(vars, model->num_of_vars, v->parents[j]);
+      ok = (fwrite(&n, sizeof(int), 1, f) == 1);
+    }
+
+    n = (v->prior != NULL);
+    ok = (ok && fwrite(&n, sizeof(int), 1, f) == 1);
+    if(ok && n)
+      ok = (fwrite(v->prior, sizeof(double), NIP_CARDINALITY(v), f) ==
+            NIP_CARDINALITY(v));
+  }
+
+  /* the order of variables in the model */
+  for(i = 0; ok && i < model->num_of_vars; i++){
+    n = sorted_variable_index(vars, model->num_of_vars, model->variables[i]);
+    ok = (fwrite(&n, sizeof(int), 1, f) == 1);
+  }
+
+  /* the cliques and their parameters without any evidence */
+  ok = (ok && fwrite(&(model->num_of_cliques), sizeof(int), 1, f) == 1);
+  for(i = 0; ok && i < model->num_of_cliques; i++){
+    c = model->cliques[i];
+    n = nip_clique_size(c);
+    ok = (fwrite(&n, sizeof(int), 1, f) == 1);
+    for(j = 0; ok && j < nip_clique_size(c); j++){
+      n = sorted_variable_index(vars, model->num_of_vars, c->variables[j]);
+      ok = (fwrite(&n, sizeof(int), 1, f) == 1);
+    }
+    n = c->original_p->size_of_data;
+    ok = (ok && fwrite(c->original_p->data, sizeof(double), n, f) == n);
+  }
+
+  /* the sepsets in the order of confirming them */
+  ok = (ok && fwrite(&n_sepsets, sizeof(int), 1, f) == 1);
+  for(i = 0; ok && i < n_sepsets; i++){
+    index[0] = clique_index(model, sepsets[i]->first_neighbour);
+    index[1] = clique_index(model, sepsets[i]->second_neighbour);
+    ok = (fwrite(index, sizeof(int), 2, f) == 2);
+  }
+  free(vars);
+  free(sepsets);
+
+  if(fclose(f) || !ok){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    return NIP_ERROR_IO;
+  }
+  return NIP_NO_ERROR;
+}
+
+
+nip_model read_compiled_model(char* filename){
+  int i, j, n, s;
+  int ok;
+  int n_vars = 0;
+  int n_cliques = 0;
+  int n_sepsets = 0;
+  int cardinality = 0;
+  int index[2];
+  char magic[4];
+  char* symbol = NULL;
+  char* name = NULL;
+  char** states = NULL;
+  int* links = NULL;    /* next, previous and number of parents */
+  int** parents = NULL; /* indices of the parents of each variable */
+  double* prior = NULL;
+  nip_variable* vars = NULL;   /* in the order of the file (ids) */
+  nip_variable* family = NULL; /* space for the variables of a clique etc. */
+  nip_clique c = NULL;
+  nip_sepset sepset = NULL;
+  nip_model new = NULL;
+  FILE* f = NULL;
+
+  f = fopen(filename, "rb");
+  if(!f){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    fprintf(stderr, "%s\n", filename);
+    return NULL;
+  }
+
+  new = (nip_model) calloc(1, sizeof(nip_model_struct));
+  ok = (new != NULL &&
+        fread(magic, 1, 4, f) == 4 &&
+        strncmp(magic, COMPILED_MODEL_MAGIC, 4) == 0 &&
+        fread(&n, sizeof(int), 1, f) == 1 &&
+        n == COMPILED_MODEL_VERSION &&
+        fread(&(new->node_size_x), sizeof(int), 1, f) == 1 &&
+        fread(&(new->node_size_y), sizeof(int), 1, f) == 1 &&
+        fread(&n_vars, sizeof(int), 1, f) == 1 &&
+        n_vars > 0);
+  if(ok){
+    vars = (nip_variable*) calloc(n_vars, sizeof(nip_variable));
+    family = (nip_variable*) calloc(n_vars, sizeof(nip_variable));
+    links = (int*) calloc(3 * n_vars, sizeof(int));
+    parents = (int**) calloc(n_vars, sizeof(int*));
+    ok = (vars && family && links && parents);
+  }
+
+  /* 1. The variables (creating them in this order preserves the order
+   *    of their ids) */
+  for(i = 0; ok && i < n_vars; i++){
+    symbol = read_binary_string(f);
+    name = read_binary_string(f);
+    ok = (symbol && name &&
+          fread(&cardinality, sizeof(int), 1, f) == 1 &&
+          cardinality > 0);
+    if(ok){
+      states = (char**) calloc(cardinality, sizeof(char*));
+      ok = (states != NULL);
+    }
+    for(s = 0; ok && s < cardinality; s++){
+      states[s] = read_binary_string(f);
+      ok = (states[s] != NULL);
+    }
+    if(ok){
+      vars[i] = nip_new_variable(symbol, name, states, cardinality);
+      ok = (vars[i] != NULL);
+      nip_set_variable_index(vars[i], i); /* dense, for bitsets */
+    }
+    free(symbol);
+    free(name);
+    if(states)
+      for(s = 0; s < cardinality; s++)
+        free(states[s]);
+    free(states);
+    states = NULL;
+
+    ok = (ok &&
+          fread(&(vars[i]->interface_status), sizeof(int), 1, f) == 1 &&
+          fread(&(vars[i]->pos_x), sizeof(int), 1, f) == 1 &&
+          fread(&(vars[i]->pos_y), sizeof(int), 1, f) == 1 &&
+          fread(&(links[3*i]), sizeof(int), 3, f) == 3 &&
+          links[3*i + 2] >= 0 && links[3*i + 2] < n_vars);
+    if(ok && links[3*i + 2] > 0){
+      parents[i] = (int*) calloc(links[3*i + 2], sizeof(int));
+      ok = (parents[i] != NULL &&
+            fread(parents[i], sizeof(int), links[3*i + 2], f) ==
+            links[3*i + 2]);
+    }
+
+    ok = (ok && fread(&n, sizeof(int), 1, f) == 1);
+    if(ok && n){
+      prior = (double*) calloc(cardinality, sizeof(double));
+      ok = (prior != NULL &&
+            fread(prior, sizeof(double), cardinality, f) == cardinality &&
+            nip_set_prior(vars[i], prior) == NIP_NO_ERROR);
+      free(prior);
+    }
+  }
+
+  /* 2. The relations between the variables */
+  for(i = 0; ok && i < n_vars; i++){
+    ok = (links[3*i] < n_vars && links[3*i + 1] < n_vars);
+    if(ok){
+      vars[i]->next = (links[3*i] >= 0) ? vars[links[3*i]] : NULL;
+      vars[i]->previous = (links[3*i + 1] >= 0) ? vars[links[3*i + 1]] : NULL;
+    }
+    for(j = 0; ok && j < links[3*i + 2]; j++){
+      ok = (parents[i][j] >= 0 && parents[i][j] < n_vars);
+      if(ok)
+        family[j] = vars[parents[i][j]];
+    }
+    if(ok && links[3*i + 2] > 0)
+      ok = (nip_set_parents(vars[i], family, links[3*i + 2]) == NIP_NO_ERROR);
+  }
+
+  /* 3. The order of the variables in the model (a permutation) */
+  if(ok){
+    new->num_of_vars = n_vars;
+    new->variables = (nip_variable*) calloc(n_vars, sizeof(nip_variable));
+    ok = (new->variables != NULL);
+    for(i = 0; i < n_vars; i++)
+      family[i] = NULL;
+  }
+  for(i = 0; ok && i < n_vars; i++){
+    ok = (fread(&n, sizeof(int), 1, f) == 1 &&
+          n >= 0 && n < n_vars && family[n] == NULL);
+    if(ok)
+      new->variables[i] = family[n] = vars[n];
+  }
+
+  /* 4. The cliques */
+  ok = (ok &&
+        fread(&n_cliques, sizeof(int), 1, f) == 1 &&
+        n_cliques > 0);
+  if(ok){
+    new->cliques = (nip_clique*) calloc(n_cliques, sizeof(nip_clique));
+    ok = (new->cliques != NULL);
+  }
+  for(i = 0; ok && i < n_cliques; i++){
+    ok = (fread(&s, sizeof(int), 1, f) == 1 && s > 0 && s <= n_vars);
+    for(j = 0; ok && j < s; j++){
+      ok = (fread(&n, sizeof(int), 1, f) == 1 && n >= 0 && n < n_vars);
+      if(ok)
+        family[j] = vars[n];
+    }
+    if(ok){
+      c = nip_new_clique(family, s);
+      ok = (c != NULL);
+    }
+    if(ok){
+      new->cliques[i] = c;
+      new->num_of_cliques = i + 1;
+      /* the data is in the order of the variables */
+      ok = (nip_reorder_clique(c, family) == NIP_NO_ERROR);
+      for(j = 0; ok && j < s; j++)
+        if(c->variables[j] != family[j])
+          ok = 0;
+      n = c->original_p->size_of_data;
+      ok = (ok && fread(c->original_p->data, sizeof(double), n, f) == n);
+      if(ok)
+        memcpy(c->p->data, c->original_p->data, n * sizeof(double));
+    }
+  }
+
+  /* 5. The sepsets */
+  ok = (ok &&
+        fread(&n_sepsets, sizeof(int), 1, f) == 1 &&
+        n_sepsets >= 0 && n_sepsets < n_cliques);
+  for(i = 0; ok && i < n_sepsets; i++){
+    ok = (fread(index, sizeof(int), 2, f) == 2 &&
+          index[0] >= 0 && index[0] < n_cliques &&
+          index[1] >= 0 && index[1] < n_cliques &&
+          index[0] != index[1]);
+    if(ok){
+      sepset = nip_new_sepset(new->cliques[index[0]], new->cliques[index[1]]);
+      ok = (sepset != NULL);
+    }
+    if(ok && nip_confirm_sepset(sepset) != NIP_NO_ERROR){
+      nip_free_sepset(sepset);
+      ok = 0;
+    }
+  }
+  fclose(f);
+
+  if(parents)
+    for(i = 0; i < n_vars; i++)
+      free(parents[i]);
+  free(parents);
+  free(links);
+  free(family);
+
+  /* 6. The rest like in parse_model() */
+  ok = (ok && init_model(new) == NIP_NO_ERROR);
+
+  if(!ok){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    fprintf(stderr, "%s: not a valid compiled model file\n", filename);
+    if(new){
+      for(i = 0; i < new->num_of_cliques; i++)
+        nip_free_clique(new->cliques[i]);
+      free(new->cliques);
+      free(new->variables);
+      free(new);
+    }
+    if(vars)
+      for(i = 0; i < n_vars; i++)
+        nip_free_variable(vars[i]);
+    free(vars);
+    return NULL;
+  }
+  free(vars);
+  return new;
+}
+
+
+void free_model(nip_model model){
+  int i;
+
+  if (!model)
+    return;
+
+  /* 0. Free the cached smaller models */
+  free_pruned_models(model);
+
+  /* 1. Free cliques and adjacent sepsets */
+  for(i = 0; i < model->num_of_cliques; i++)
+    nip_free_clique(model->cliques[i]);
+  free(model->cliques);
+
+  /* 2. Free the variables */
+  for(i = 0; i < model->num_of_vars; i++)
+    nip_free_variable(model->variables[i]);
+  free(model->variables);
+
+  free(model->next);
+  free(model->previous);
+  free(model->outgoing_interface);
+  free(model->previous_outgoing_interface);
+  free(model->incoming_interface);
+  free(model->children);
+  free(model->independent);
+  free(model->symbol_table);
+  free(model);
+}
+
+
+/* Allocates a time series of given length for the model: the variables
+ * columns[i] != NULL are observed (in that order), others are hidden */
+static time_series new_timeseries(nip_model model, nip_variable* columns,
+                                  int ncolumns, int length){
+  int i, j, k, m, obs;
+  time_series ts = NULL;
+
+  obs = 0;
+  for(i = 0; i < ncolumns; i++)
+    if(columns[i])
+      obs++;
+
+  ts = (time_series) malloc(sizeof(time_series_struct));
+  if(!ts){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NULL;
+  }
+  ts->model = model;
+  ts->hidden = NULL;
+  ts->observed = NULL;
+  ts->data = NULL;
+  ts->length = length;
+  ts->weight = 1;
+
+  /* Find out how many (totally) latent variables there are. */
+  ts->num_of_hidden = model->num_of_vars - obs;
+  ts->num_of_observed = obs; /* Must be "final" */
+
+  /* Allocate the array for the hidden variables. */
+  ts->hidden = (nip_variable *) calloc(ts->num_of_hidden,
+                                       sizeof(nip_variable));
+  if(obs > 0)
+    ts->observed = (nip_variable *) calloc(obs, sizeof(nip_variable));
+  if(!(ts->hidden && (ts->observed || obs == 0))){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free(ts->hidden);
+    free(ts);
+    return NULL;
+  }
+
+  /* Set the pointers to the hidden variables. */
+  m = 0;
+  for(k = 0; k < model->num_of_vars; k++){
+    j = 1;
+    for(i = 0; i < ncolumns; i++){
+      if(nip_equal_variables(model->variables[k], columns[i]))
+        j = 0;
+    }
+    if(j)
+      ts->hidden[m++] = model->variables[k];
+  }
+
+  if(obs > 0){
+    k = 0;
+    for(i = 0; i < ncolumns; i++){
+      if(columns[i])
+        ts->observed[k++] = columns[i];
+      /* note that these are coupled with ts->data */
+    }
+
+    /* Allocate some space for data */
+    ts->data = (int**) calloc(ts->length, sizeof(int*));
+    if(!(ts->data)){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+      free(ts->hidden);
+      free(ts->observed);
+      free(ts);
+      return NULL;
+    }
+    for(i = 0; i < ts->length; i++){
+      ts->data[i] = (int*) calloc(obs, sizeof(int));
+      if(!(ts->data[i])){
+        nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+        for(j = 0; j < i; j++)
+          free(ts->data[j]);
+        free(ts->data);
+        free(ts->hidden);
+        free(ts->observed);
+        free(ts);
+        return NULL;
+      }
+    }
+  }
+  return ts;
+}
+
+
+/* Tells if the file starts with the given 4 magic characters */
+static int starts_with_magic(char* filename, char* magic){
+  char buffer[4];
+  int ok;
+  FILE* f = fopen(filename, "rb");
+  if(!f)
+    return 0;
+  ok = (fread(buffer, 1, 4, f) == 4 &&
+        strncmp(buffer, magic, 4) == 0);
+  fclose(f);
+  return ok;
+}
+
+
+int read_timeseries(nip_model model, char* filename, time_series** results,
+                    int (*ts_progress)(int, int)){
+  int n, N, e;
+  timeseries_reader r = NULL;
+
+  /* binary files need no parsing */
+  if(starts_with_magic(filename, BINARY_TIMESERIES_MAGIC))
+    return read_timeseries_binary(model, filename, results, ts_progress);
+
+  r = open_timeseries(model, filename, 0, 0);
+  if(!r)
+    return 0;
+
+  /* N time series */
+  N = r->num_of_series;
+  *results = (time_series*) calloc(N, sizeof(time_series));
+  if(!*results){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    close_timeseries(r);
+    return 0;
+  }
+
+  e = read_timeseries_range(r, 0, N, *results);
+  close_timeseries(r);
+  if(e != NIP_NO_ERROR){
+    free(*results);
+    *results = NULL;
+    return 0;
+  }
+
+  if(ts_progress != NULL)
+    for(n = 0; n < N; n++)
+      ts_progress(n, (*results)[n]->length);
+  return N;
+}
+
+
+timeseries_reader open_timeseries(nip_model model, char* filename,
+                                  int batch_size, int collapse){
+  int e;
+  timeseries_reader r = NULL;
+
+  if(!model || !filename){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NULL;
+  }
+  r = (timeseries_reader) calloc(1, sizeof(timeseries_reader_struct));
+  if(r)
+    r->filename = (char*) calloc(strlen(filename) + 1, sizeof(char));
+  if(!r || !r->filename){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free(r);
+    return NULL;
+  }
+  strcpy(r->filename, filename);
+  r->model = model;
+  r->collapse = collapse;
+
+  if(starts_with_magic(filename, BINARY_TIMESERIES_MAGIC))
+    e = open_binary_timeseries(r);
+  else
+    e = open_text_timeseries(r);
+
+  if(e == NIP_NO_ERROR){
+    r->batch_size = r->num_of_series;
+    if(batch_size > 0 && batch_size < r->num_of_series)
+      r->batch_size = batch_size;
+    r->batch = (time_series*) calloc(r->batch_size + 1, sizeof(time_series));
+    if(!r->batch){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+      e = NIP_ERROR_OUTOFMEMORY;
+    }
+  }
+  if(e != NIP_NO_ERROR){
+    close_timeseries(r);
+    return NULL;
+  }
+  return r;
+}
+
+
+timeseries_reader open_timeseries_array(time_series* ts_set, int n_series){
+  timeseries_reader r = NULL;
+
+  if(!ts_set || n_series < 1 || !ts_set[0]){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NULL;
+  }
+  r = (timeseries_reader) calloc(1, sizeof(timeseries_reader_struct));
+  if(!r){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NULL;
+  }
+  r->model = ts_set[0]->model;
+  r->num_of_series = n_series;
+  r->batch_size = n_series;
+  r->array = ts_set;
+  return r;
+}
+
+
+int next_timeseries(timeseries_reader data, time_series** batch){
+  int i, n, e;
+
+  if(!data || !batch){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return -1;
+  }
+
+  /* the whole data set as one batch is read only once */
+  if(data->cached){
+    *batch = data->batch;
+    if(data->next > 0)
+      return 0;
+    data->next = data->num_of_series;
+    return data->batch_count;
+  }
+
+  free_timeseries_batch(data);
+  if(data->next >= data->num_of_series)
+    return 0;
+  n = data->num_of_series - data->next;
+  if(n > data->batch_size)
+    n = data->batch_size;
+
+  if(data->array){
+    *batch = &(data->array[data->next]);
+    data->next += n;
+    return n;
+  }
+
+  e = NIP_NO_ERROR;
+  if(data->file)
+    e = read_timeseries_range(data, data->next, data->next + n, data->batch);
+  else{
+    for(i = 0; e == NIP_NO_ERROR && i < n; i++){
+      data->batch[i] = read_binary_series(data, data->next + i);
+      if(!data->batch[i]){
+        for(i--; i >= 0; i--)
+          free_timeseries(data->batch[i]);
+        e = NIP_ERROR_IO;
+      }
+    }
+  }
+  if(e != NIP_NO_ERROR)
+    return -1;
+
+  data->next += n;
+  data->batch_count = n;
+  if(data->collapse){
+    i = collapse_timeseries(data->batch, n);
+    if(i > 0)
+      data->batch_count = i;
+  }
+  if(data->batch_size == data->num_of_series)
+    data->cached = 1;
+  *batch = data->batch;
+  return data->batch_count;
+}
+
+
+int rewind_timeseries(timeseries_reader data){
+  if(!data){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NIP_ERROR_INVALID_ARGUMENT;
+  }
+  if(!data->cached)
+    free_timeseries_batch(data);
+  data->next = 0;
+  if(data->binary && !data->cached &&
+     fseek(data->binary, data->data_position, SEEK_SET) != 0){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    return NIP_ERROR_IO;
+  }
+  return NIP_NO_ERROR;
+}
+
+
+void close_timeseries(timeseries_reader data){
+  int i;
+  if(!data)
+    return;
+  data->cached = 0;
+  free_timeseries_batch(data);
+  free(data->batch);
+  if(data->file)
+    nip_close_data_file(data->file);
+  if(data->binary)
+    fclose(data->binary);
+  if(data->states)
+    for(i = 0; i < data->n_columns; i++)
+      free(data->states[i]);
+  free(data->states);
+  free(data->cardinalities);
+  free(data->table);
+  free(data->values);
+  free(data->columns);
+  free(data->filename);
+  free(data);
+}
+
+
+/* Frees the time series of the current batch, unless they are
+ * cached or not owned by the iterator */
+static void free_timeseries_batch(timeseries_reader r){
+  int i;
+  if(!r->array && !r->cached)
+    for(i = 0; i < r->batch_count; i++)
+      free_timeseries(r->batch[i]);
+  r->batch_count = 0;
+}
+
+
+/* Analyses a text file for the iterator and matches its columns
+ * with the variables of the model */
+static int open_text_timeseries(timeseries_reader r){
+  int i;
+  nip_data_file df = NULL;
+
+  df = nip_open_data_file(r->filename, NIP_FIELD_SEPARATOR, 0, 1);
+  if(df == NULL){
+    nip_report_error(__FILE__, __LINE__, ENOENT, 1);
+    fprintf(stderr, "%s\n", r->filename);
+    return ENOENT;
+  }
+  if(nip_analyse_data_file(df) < 0){
+    nip_report_error(__FILE__, __LINE__, EIO, 1);
+    nip_close_data_file(df);
+    return EIO;
+  }
+  r->file = df;
+
+  /* The variable of each column (or NULL) */
+  r->n_columns = df->num_of_nodes;
+  r->columns = (nip_variable*) calloc(df->num_of_nodes + 1,
+                                      sizeof(nip_variable));
+  if(!r->columns){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NIP_ERROR_OUTOFMEMORY;
+  }
+  for(i = 0; i < df->num_of_nodes; i++)
+    r->columns[i] = model_variable(r->model, df->node_symbols[i]);
+
+  r->num_of_series = df->ndatarows;
+  return NIP_NO_ERROR;
+}
+
+
+/* Reads the time series first ... last - 1 of an analysed text file in
+ * parallel into results[0 ... last - first - 1]. */
+static int read_timeseries_range(timeseries_reader r, int first, int last,
+                                 time_series* results){
+  int k, n, rows, total, nthreads;
+  int e = NIP_NO_ERROR;
+  nip_data_file df = r->file;
+  timeseries_chunk_struct* chunks = NULL;
+  pthread_t* threads = NULL;
+  int* started = NULL;
+
+  if(last <= first)
+    return NIP_NO_ERROR;
+
+  /* Divide the time series between threads, about equal rows for each */
+  total = 0;
+  for(n = first; n < last; n++)
+    total += df->datarows[n];
+  nthreads = nip_data_threads((df->nrows > 0) ?
+                              (df->buffer_size / df->nrows) * total : 0);
+  if(nthreads > last - first)
+    nthreads = last - first;
+  chunks = (timeseries_chunk_struct*) calloc(nthreads,
+                                             sizeof(timeseries_chunk_struct));
+  threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+  started = (int*) calloc(nthreads, sizeof(int));
+  if(!chunks || !threads || !started){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free(chunks);
+    free(threads);
+    free(started);
+    return NIP_ERROR_OUTOFMEMORY;
+  }
+  n = first;
+  rows = 0;
+  for(k = 0; k < nthreads; k++){
+    chunks[k].reader = r;
+    chunks[k].results = results;
+    chunks[k].offset = first;
+    chunks[k].first = n;
+    while(n < last && (k == nthreads - 1 ||
+                       rows < (long)total * (k + 1) / nthreads))
+      rows += df->datarows[n++];
+    chunks[k].last = n;
+  }
+
+  /* The first part is read by this thread and the rest in parallel,
+   * or also here if no more threads can be created */
+  for(k = 1; k < nthreads; k++)
+    started[k] = (pthread_create(&(threads[k]), NULL,
+                                 read_timeseries_chunk, &(chunks[k])) == 0);
+  read_timeseries_chunk(&(chunks[0]));
+  for(k = 1; k < nthreads; k++){
+    if(started[k])
+      pthread_join(threads[k], NULL);
+    else
+      read_timeseries_chunk(&(chunks[k]));
+  }
+  for(k = 0; k < nthreads && e == NIP_NO_ERROR; k++)
+    e = chunks[k].error;
+  free(chunks);
+  free(threads);
+  free(started);
+
+  if(e != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, e, 1);
+    for(n = 0; n < last - first; n++){
+      free_timeseries(results[n]);
+      results[n] = NULL;
+    }
+  }
+  return e;
+}
+
+
+/* Reads the time series chunk->first ... chunk->last - 1 of an analysed
+ * data file from a copy of their rows, so that memory use follows the
+ * size of the batch. Runs in a thread of its own. */
+static void* read_timeseries_chunk(void* chunk){
+  timeseries_chunk_struct* c = (timeseries_chunk_struct*) chunk;
+  nip_data_file df = c->reader->file;
+  nip_variable* columns = c->reader->columns;
+  int i, j, k, m, n;
+  int obs = 0;
+  size_t position, size = 0;
+  char* rows = NULL;
+  char** tokens = NULL;
+  time_series ts = NULL;
+  nip_variable v = NULL;
+  char** previous = NULL; /* the previous token in each column */
+  int* previous_state = NULL; /* ...and its state index */
+
+  c->error = NIP_NO_ERROR;
+  for(i = 0; i < df->num_of_nodes; i++)
+    if(columns[i])
+      obs++;
+
+  /* Space for a row of data */
+  tokens = (char**) calloc(2 * (df->num_of_nodes + 1), sizeof(char*));
+  previous_state = (int*) calloc(df->num_of_nodes + 1, sizeof(int));
+  if(!tokens || !previous_state){
+    free(tokens);
+    free(previous_state);
+    c->error = NIP_ERROR_OUTOFMEMORY;
+    return NULL;
+  }
+  previous = &(tokens[df->num_of_nodes + 1]); /* initially NULLs */
+  if(obs > 0 && c->last > c->first){
+    rows = nip_copy_data_rows(df, c->first, c->last, &size);
+    if(!rows){
+      free(tokens);
+      free(previous_state);
+      c->error = NIP_ERROR_OUTOFMEMORY;
+      return NULL;
+    }
+  }
+
+  for(n = c->first; n < c->last; n++){
+    ts = new_timeseries(c->reader->model, columns, df->num_of_nodes,
+                        df->datarows[n]);
+    if(!ts){
+      c->error = NIP_ERROR_OUTOFMEMORY;
+      break;
+    }
+
+    if(obs > 0){
+      /* Get the data */
+      position = df->series_positions[n] - df->series_positions[c->first];
+      for(j = 0; j < ts->length; j++){
+        /* 2. Read (the tokens are valid as long as the rows) */
+        m = nip_row_tokens_at(df, rows, size, &position, tokens);
+
+        if(m != df->num_of_nodes){
+          fprintf(stderr, "Warning: (%s): time series %d (t=%d) ",
+                  c->reader->filename, n, j);
+          fprintf(stderr, "has %d tokens, ", m);
+          fprintf(stderr, "%d expected instead.\n", df->num_of_nodes);
+        }
+
+        /* 3. Put into the data array
+         * (the same loop as above to ensure the data is in
+         *  the same order as variables ts->observed) */
+        k = 0;
+        for(i = 0; i < df->num_of_nodes; i++){
+          v = columns[i];
+          if(i == m)
+            break; /* the line was too short */
+          if(v){
+            /* Consecutive observations are often the same:
+             * compare only to the previous one before searching */
+            if(!previous[i] || strcmp(previous[i], tokens[i]) != 0){
+              previous[i] = tokens[i];
+              previous_state[i] = nip_variable_state_index(v, tokens[i]);
+            }
+            ts->data[j][k++] = previous_state[i];
+          }
+          /* note that these are coupled with ts->observed */
+
+          /* Q: Should missing data be allowed?   A: Yes. */
+          /* assert(data[j][i] >= 0); */
+        }
+      }
+    }
+    c->results[n - c->offset] = ts;
+  }
+
+  free(rows);
+  free(tokens);
+  free(previous_state);
+  return NULL;
+}
+
+
+/* FNV-1a style hash over the length, observed variables and data */
+static unsigned long timeseries_hash(time_series ts){
+  int i, t;
+  unsigned long h = 2166136261UL;
+  h = (h ^ (unsigned long)ts->length) * 16777619UL;
+  for(i = 0; i < ts->num_of_observed; i++)
+    h = (h ^ nip_variable_id(ts->observed[i])) * 16777619UL;
+  for(t = 0; t < ts->length; t++)
+    for(i = 0; i < ts->num_of_observed; i++)
+      h = (h ^ (unsigned long)(ts->data[t][i] + 1)) * 16777619UL;
+  return h;
+}
+
+
+/* Returns non-zero if the time series contain exactly the same data */
+static int equal_timeseries(time_series a, time_series b){
+  int i, t;
+  if(a->model != b->model ||
+     a->length != b->length ||
+     a->num_of_observed != b->num_of_observed)
+    return 0;
+  for(i = 0; i < a->num_of_observed; i++)
+    if(!nip_equal_variables(a->observed[i], b->observed[i]))
+      return 0;
+  for(t = 0; t < a->length; t++)
+    for(i = 0; i < a->num_of_observed; i++)
+      if(a->data[t][i] != b->data[t][i])
+        return 0;
+  return 1;
+}
+
+
+int collapse_timeseries(time_series *ts_set, int n_series){
+  int i, n, m, size;
+  unsigned long h;
+  unsigned long *hashes = NULL;
+  int *table = NULL;
+  time_series ts;
+
+  if(!ts_set || n_series < 0){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return -1;
+  }
+  if(n_series < 2)
+    return n_series;
+
+  /* Open addressing table of indices, at most half full */
+  size = 1;
+  while(size < 2 * n_series)
+    size <<= 1;
+  table = (int*) calloc(size, sizeof(int));
+  hashes = (unsigned long*) calloc(n_series, sizeof(unsigned long));
+  if(!(table && hashes)){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free(table);
+    free(hashes);
+    return -1;
+  }
+  for(i = 0; i < size; i++)
+    table[i] = -1;
+
+  m = 0; /* number of distinct series so far */
+  for(n = 0; n < n_series; n++){
+    ts = ts_set[n];
+    h = timeseries_hash(ts);
+    i = (int)(h & (unsigned long)(size - 1));
+    while(table[i] >= 0){
+      if(hashes[table[i]] == h && equal_timeseries(ts_set[table[i]], ts))
+        break;
+      i = (i + 1) & (size - 1); /* linear probing */
+    }
+
+    if(table[i] >= 0){ /* a duplicate */
+      ts_set[table[i]]->weight += ts->weight;
+      free_timeseries(ts);
+    }
+    else{ /* first occurrence */
+      table[i] = m;
+      hashes[m] = h;
+      ts_set[m++] = ts;
+    }
+  }
+  for(n = m; n < n_series; n++)
+    ts_set[n] = NULL;
+
+  free(table);
+  free(hashes);
+  return m;
+}
+
+
+/* Union of the observed variables in a set of time series (of the same
+ * model), or NULL if none: *n_observed is then 0, or negative on errors */
+static nip_variable* observed_variables(time_series* ts_set, int n_series,
+                                        int* n_observed){
+  int n;
+  nip_variable *observed;
+  nip_variable *observed_more;
+  time_series ts;
+  nip_model the_model = ts_set[0]->model;
+
+  ts = ts_set[0];
+  observed = nip_variable_union(ts->observed, NULL,
+                                the_model->num_of_vars - ts->num_of_hidden,
+                                0, n_observed);
+  if(*n_observed < 0){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    return NULL;
+  }
+
   for(n = 1; n < n_series; n++){
     ts = ts_set[n];
     observed_more =
-      nip_variable_union(observed, ts->observed, n_observed,
+      nip_variable_union(observed, ts->observed, *n_observed,
                          the_model->num_of_vars - ts->num_of_hidden,
-                         &n_observed);
+                         n_observed);
     free(observed); /* nice to create the same array again and again? */
     observed = observed_more;
   }
 
-  if(!n_observed){ /* no observations in any time series? */
+  if(!*n_observed){ /* no observations in any time series? */
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    free(observed);
+    return NULL;
+  }
+  return observed;
+}
+
+
+int write_timeseries(time_series *ts_set, int n_series, char *filename){
+  int i, n, t, w;
+  int d;
+  int *record;
+  int n_observed;
+  int *map;
+  nip_variable v;
+  nip_variable *observed;
+  time_series ts;
+  nip_model the_model;
+  FILE *f = NULL;
+
+  /* Check stuff */
+  if(!(n_series > 0 && ts_set && filename)){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
     return NIP_ERROR_INVALID_ARGUMENT;
   }
 
+  /* Check all the models are same */
+  the_model = ts_set[0]->model;
+  for(n = 1; n < n_series; n++){
+    if(ts_set[n]->model != the_model){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+      return NIP_ERROR_INVALID_ARGUMENT;
+    }
+  }
+
+  /* Find out union of observed variables */
+  observed = observed_variables(ts_set, n_series, &n_observed);
+  if(!observed)
+    return (n_observed < 0) ? NIP_ERROR_GENERAL : NIP_ERROR_INVALID_ARGUMENT;
+
   /* Temporary space for a sorted record (time step) */
   record = (int*) calloc(n_observed, sizeof(int));
   if(!record){
@@ -748,58 +1917,369 @@ int write_timeseries(time_series *ts_set, int n_series, char *filename){
     return NIP_ERROR_IO;
   }
 
-  /* Write names of the variables */
-  for(i = 0; i < n_observed; i++){
+  /* Write names of the variables */
+  for(i = 0; i < n_observed; i++){
+    v = observed[i];
+    if(i > 0)
+      fprintf(f, "%c", NIP_FIELD_SEPARATOR);
+    fprintf(f, "%s", nip_variable_symbol(v));
+  }
+  fputs("\n", f);
+
+  /* Write the data */
+  for(n = 0; n < n_series; n++){ /* for each time series */
+    ts = ts_set[n];
+    map = nip_mapper(observed, ts->observed, n_observed, ts->num_of_observed);
+
+    for(w = 0; w < ts->weight; w++){ /* for each copy */
+      for(t = 0; t < ts->length; t++){ /* for each time step */
+
+        /* Fill record with indicators of missing data */
+        for(i = 0; i < n_observed; i++)
+          record[i] = -1;
+
+        /* Extract data from the time series */
+        for(i = 0; i < ts->num_of_observed; i++)
+          record[map[i]] = ts->data[t][i];
+
+        /* Print the data */
+        for(i = 0; i < n_observed; i++){
+          v = observed[i];
+          d = record[i];
+          if(i > 0)
+            fprintf(f, "%c", NIP_FIELD_SEPARATOR);
+          if(d >= 0)
+            fprintf(f, "%s", nip_variable_state_name(v, d));
+          else
+            fputs("null", f);
+        }
+        fputs("\n", f);
+      }
+      fputs("\n", f); /* TS separator */
+    }
+    free(map);
+  }
+  free(observed);
+  free(record);
+
+  /* Close the file */
+  if(fclose(f)){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    return NIP_ERROR_IO;
+  }
+  return NIP_NO_ERROR;
+}
+
+
+/* Writes a string into a binary file: length, then the characters */
+static int write_binary_string(FILE* f, char* s){
+  int n = strlen(s);
+  return (fwrite(&n, sizeof(int), 1, f) == 1 &&
+          fwrite(s, sizeof(char), n, f) == n);
+}
+
+
+/* Reads a string written by write_binary_string(), or NULL */
+static char* read_binary_string(FILE* f){
+  int n;
+  char* s = NULL;
+  if(fread(&n, sizeof(int), 1, f) != 1 || n < 0)
+    return NULL;
+  s = (char*) calloc(n + 1, sizeof(char));
+  if(s && fread(s, sizeof(char), n, f) != n){
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+
+int write_timeseries_binary(time_series *ts_set, int n_series, char *filename){
+  int i, n, t, s;
+  int ok;
+  int n_observed;
+  int value_size;
+  int *map = NULL;
+  int *record = NULL;
+  nip_variable v;
+  nip_variable *observed;
+  time_series ts;
+  signed char *bytes;
+  short *shorts;
+  void *row = NULL;
+  FILE *f = NULL;
+
+  /* Check stuff */
+  if(!(n_series > 0 && ts_set && filename)){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NIP_ERROR_INVALID_ARGUMENT;
+  }
+  for(n = 1; n < n_series; n++){
+    if(ts_set[n]->model != ts_set[0]->model){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+      return NIP_ERROR_INVALID_ARGUMENT;
+    }
+  }
+
+  /* Find out union of observed variables */
+  observed = observed_variables(ts_set, n_series, &n_observed);
+  if(!observed)
+    return (n_observed < 0) ? NIP_ERROR_GENERAL : NIP_ERROR_INVALID_ARGUMENT;
+
+  /* The smallest integer type for all the state indices (and -1) */
+  value_size = sizeof(signed char);
+  for(i = 0; i < n_observed; i++){
+    if(NIP_CARDINALITY(observed[i]) > SCHAR_MAX && value_size < sizeof(short))
+      value_size = sizeof(short);
+    if(NIP_CARDINALITY(observed[i]) > SHRT_MAX)
+      value_size = sizeof(int);
+  }
+
+  record = (int*) calloc(n_observed, sizeof(int));
+  row = calloc(n_observed, value_size);
+  if(!record || !row){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free(observed);
+    free(record);
+    free(row);
+    return NIP_ERROR_OUTOFMEMORY;
+  }
+  bytes = (signed char*) row;
+  shorts = (short*) row;
+
+  f = fopen(filename, "wb");
+  if(!f){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    free(observed);
+    free(record);
+    free(row);
+    return NIP_ERROR_IO;
+  }
+
+  /* The header: the columns and their state dictionaries... */
+  n = BINARY_TIMESERIES_VERSION;
+  ok = (fwrite(BINARY_TIMESERIES_MAGIC, 1, 4, f) == 4 &&
+        fwrite(&n, sizeof(int), 1, f) == 1 &&
+        fwrite(&n_observed, sizeof(int), 1, f) == 1);
+  for(i = 0; ok && i < n_observed; i++){
     v = observed[i];
-    if(i > 0)
-      fprintf(f, "%c", NIP_FIELD_SEPARATOR);
-    fprintf(f, "%s", nip_variable_symbol(v));
+    ok = (write_binary_string(f, nip_variable_symbol(v)) &&
+          fwrite(&NIP_CARDINALITY(v), sizeof(int), 1, f) == 1);
+    for(s = 0; ok && s < NIP_CARDINALITY(v); s++)
+      ok = write_binary_string(f, nip_variable_state_name(v, s));
   }
-  fputs("\n", f);
 
-  /* Write the data */
-  for(n = 0; n < n_series; n++){ /* for each time series */
+  /* ...and the lengths and weights of the sequences */
+  ok = (ok &&
+        fwrite(&value_size, sizeof(int), 1, f) == 1 &&
+        fwrite(&n_series, sizeof(int), 1, f) == 1);
+  for(n = 0; ok && n < n_series; n++)
+    ok = (fwrite(&(ts_set[n]->length), sizeof(int), 1, f) == 1 &&
+          fwrite(&(ts_set[n]->weight), sizeof(int), 1, f) == 1);
+
+  /* The data: packed state indices, -1 for missing values */
+  for(n = 0; ok && n < n_series; n++){
     ts = ts_set[n];
     map = nip_mapper(observed, ts->observed, n_observed, ts->num_of_observed);
-
-    for(t = 0; t < ts->length; t++){ /* for each time step */
-
-      /* Fill record with indicators of missing data */
+    for(t = 0; ok && t < ts->length; t++){
       for(i = 0; i < n_observed; i++)
         record[i] = -1;
-
-      /* Extract data from the time series */
       for(i = 0; i < ts->num_of_observed; i++)
         record[map[i]] = ts->data[t][i];
-
-      /* Print the data */
       for(i = 0; i < n_observed; i++){
-        v = observed[i];
-        d = record[i];
-        if(i > 0)
-          fprintf(f, "%c", NIP_FIELD_SEPARATOR);
-        if(d >= 0)
-          fprintf(f, "%s", nip_variable_state_name(v, d));
-        else
-          fputs("null", f);
+        if(value_size == sizeof(signed char))
+          bytes[i] = (signed char)record[i];
+        else if(value_size == sizeof(short))
+          shorts[i] = (short)record[i];
       }
-      fputs("\n", f);
+      if(value_size == sizeof(int))
+        ok = (fwrite(record, value_size, n_observed, f) == n_observed);
+      else
+        ok = (fwrite(row, value_size, n_observed, f) == n_observed);
     }
-    fputs("\n", f); /* TS separator */
     free(map);
   }
   free(observed);
   free(record);
+  free(row);
 
-  /* Close the file */
-  if(fclose(f)){
+  if(fclose(f) || !ok){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    return NIP_ERROR_IO;
+  }
+  return NIP_NO_ERROR;
+}
+
+
+int read_timeseries_binary(nip_model model, char* filename,
+                           time_series** results,
+                           int (*ts_progress)(int, int)){
+  int j, n;
+  int n_series;
+  timeseries_reader r = NULL;
+
+  *results = NULL;
+  if(!starts_with_magic(filename, BINARY_TIMESERIES_MAGIC)){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    fprintf(stderr, "%s: not a valid binary data file\n", filename);
+    return 0;
+  }
+  r = open_timeseries(model, filename, 0, 0);
+  if(!r)
+    return 0;
+
+  n_series = r->num_of_series;
+  *results = (time_series*) calloc(n_series, sizeof(time_series));
+  if(!*results){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    close_timeseries(r);
+    return 0;
+  }
+
+  for(n = 0; n < n_series; n++){
+    (*results)[n] = read_binary_series(r, n);
+    if(!(*results)[n]){
+      for(j = 0; j < n; j++)
+        free_timeseries((*results)[j]);
+      free(*results);
+      *results = NULL;
+      close_timeseries(r);
+      return 0;
+    }
+    if(ts_progress != NULL)
+      ts_progress(n, (*results)[n]->length);
+  }
+  close_timeseries(r);
+  return n_series;
+}
+
+
+/* Reads the header of a binary file for the iterator: columns of the
+ * data matched with the model, and the length and weight of each
+ * sequence. The file is left at the beginning of the sequences. */
+static int open_binary_timeseries(timeseries_reader r){
+  int i, n, s;
+  int ok;
+  int cardinality;
+  char magic[4];
+  char* name = NULL;
+  FILE* f = NULL;
+
+  f = fopen(r->filename, "rb");
+  if(!f){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    fprintf(stderr, "%s\n", r->filename);
+    return NIP_ERROR_IO;
+  }
+  r->binary = f;
+
+  /* the header: columns of the data matched with the model */
+  ok = (fread(magic, 1, 4, f) == 4 &&
+        strncmp(magic, BINARY_TIMESERIES_MAGIC, 4) == 0 &&
+        fread(&n, sizeof(int), 1, f) == 1 &&
+        n == BINARY_TIMESERIES_VERSION &&
+        fread(&(r->n_columns), sizeof(int), 1, f) == 1 &&
+        r->n_columns > 0);
+  if(ok){
+    r->columns = (nip_variable*) calloc(r->n_columns, sizeof(nip_variable));
+    r->cardinalities = (int*) calloc(r->n_columns, sizeof(int));
+    r->states = (int**) calloc(r->n_columns, sizeof(int*));
+    ok = (r->columns && r->cardinalities && r->states);
+    if(!ok)
+      r->n_columns = 0;
+  }
+  for(i = 0; ok && i < r->n_columns; i++){
+    name = read_binary_string(f);
+    ok = (name && fread(&cardinality, sizeof(int), 1, f) == 1 &&
+          cardinality > 0);
+    if(ok){
+      r->cardinalities[i] = cardinality;
+      r->columns[i] = model_variable(r->model, name);
+      r->states[i] = (int*) calloc(cardinality + 1, sizeof(int));
+      ok = (r->states[i] != NULL);
+    }
+    free(name);
+    for(s = 0; ok && s < cardinality; s++){
+      name = read_binary_string(f);
+      ok = (name != NULL);
+      if(ok && r->columns[i])
+        r->states[i][s + 1] = nip_variable_state_index(r->columns[i], name);
+      free(name);
+    }
+    if(ok)
+      r->states[i][0] = -1; /* missing value */
+  }
+
+  /* the sequences */
+  ok = (ok &&
+        fread(&(r->value_size), sizeof(int), 1, f) == 1 &&
+        (r->value_size == sizeof(signed char) ||
+         r->value_size == sizeof(short) ||
+         r->value_size == sizeof(int)) &&
+        fread(&(r->num_of_series), sizeof(int), 1, f) == 1 &&
+        r->num_of_series > 0);
+  if(ok){
+    r->table = (int*) calloc(2 * r->num_of_series, sizeof(int));
+    r->values = (unsigned char*) calloc(r->n_columns, r->value_size);
+    ok = (r->table && r->values &&
+          fread(r->table, sizeof(int), 2 * r->num_of_series, f) ==
+          2 * r->num_of_series);
+  }
+  if(ok){
+    r->data_position = ftell(f);
+    ok = (r->data_position >= 0);
+  }
+
+  if(!ok){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    fprintf(stderr, "%s: not a valid binary data file\n", r->filename);
     return NIP_ERROR_IO;
   }
   return NIP_NO_ERROR;
 }
 
 
+/* Reads the next sequence (number n) from a binary file */
+static time_series read_binary_series(timeseries_reader r, int n){
+  int i, k, t;
+  int ok = 1;
+  int value;
+  time_series ts = NULL;
+
+  ts = new_timeseries(r->model, r->columns, r->n_columns, r->table[2*n]);
+  if(!ts)
+    return NULL;
+  ts->weight = r->table[2*n + 1];
+
+  for(t = 0; ok && t < ts->length; t++){
+    ok = (fread(r->values, r->value_size, r->n_columns, r->binary) ==
+          r->n_columns);
+    k = 0;
+    for(i = 0; ok && i < r->n_columns; i++){
+      if(!r->columns[i])
+        continue;
+      if(r->value_size == sizeof(signed char))
+        value = ((signed char*)r->values)[i];
+      else if(r->value_size == sizeof(short))
+        value = ((short*)r->values)[i];
+      else
+        value = ((int*)r->values)[i];
+      if(value < r->cardinalities[i])
+        ts->data[t][k++] = (value >= 0) ? r->states[i][value + 1] : -1;
+      else
+        ok = 0;
+    }
+  }
+  if(!ok){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    fprintf(stderr, "%s: not a valid binary data file\n", r->filename);
+    free_timeseries(ts);
+    return NULL;
+  }
+  return ts;
+}
+
+
 void free_timeseries(time_series ts){
   int t;
   if(ts){
@@ -825,10 +2305,26 @@ int timeseries_length(time_series ts){
 
 int write_uncertainseries(uncertain_series *ucs_set, int n_series,
                           nip_variable v, char *filename){
+  return write_uncertainseries_to(ucs_set, n_series, v, filename, 1);
+}
+
+
+int append_uncertainseries(uncertain_series *ucs_set, int n_series,
+                           nip_variable v, char *filename){
+  return write_uncertainseries_to(ucs_set, n_series, v, filename, 0);
+}
+
+
+/* Writes the series into a new file with a header of state names,
+ * or appends them to an existing file without the header */
+static int write_uncertainseries_to(uncertain_series *ucs_set, int n_series,
+                                    nip_variable v, char *filename,
+                                    int header){
   int i, n, t, s;
   int *v_index;
   uncertain_series ucs;
   FILE *f = NULL;
+  output_buffer buffer = NULL;
 
   /* Check stuff */
   n = NIP_CARDINALITY(v);
@@ -855,26 +2351,34 @@ int write_uncertainseries(uncertain_series *ucs_set, int n_series,
     }
     if(v_index[s] < 0){ /* no such variable in the UCS */
       nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
-      return NIP_ERROR_INVALID_ARGUMENT;
       free(v_index);
+      return NIP_ERROR_INVALID_ARGUMENT;
     }
   }
 
   /* Try to open the file for write */
-  f = fopen(filename, "w");
+  f = fopen(filename, header ? "w" : "a");
   if(!f){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
     free(v_index);
     return NIP_ERROR_IO;
   }
 
+  buffer = new_output_buffer(f);
+  if(!buffer){
+    fclose(f);
+    free(v_index);
+    return NIP_ERROR_OUTOFMEMORY;
+  }
+
   /* Write names of the states */
-  for(i = 0; i < n; i++){
+  for(i = 0; header && i < n; i++){
     if(i > 0)
-      fprintf(f, "%c", NIP_FIELD_SEPARATOR);
-    fprintf(f, "%s", nip_variable_state_name(v, i));
+      buffer_char(buffer, NIP_FIELD_SEPARATOR);
+    buffer_string(buffer, nip_variable_state_name(v, i));
   }
-  fputs("\n", f);
+  if(header)
+    buffer_char(buffer, '\n');
 
   /* Write the data: probabilities... */
   for(s = 0; s < n_series; s++){ /* ...for each series... */
@@ -884,16 +2388,18 @@ int write_uncertainseries(uncertain_series *ucs_set, int n_series,
 
       for(i = 0; i < n; i++){ /* ...for each state. */
         if(i > 0)
-          fprintf(f, "%c", NIP_FIELD_SEPARATOR);
-        fprintf(f, "%f", ucs->data[t][v_index[s]][i]);
+          buffer_char(buffer, NIP_FIELD_SEPARATOR);
+        buffer_number(buffer, ucs->data[t][v_index[s]][i]);
       }
-      fputs("\n", f);
+      buffer_char(buffer, '\n');
     }
-    fputs("\n", f); /* series separator */
+    buffer_char(buffer, '\n'); /* series separator */
   }
 
   /* Close the file */
-  if(fclose(f)){
+  i = flush_output_buffer(buffer);
+  free(buffer);
+  if(fclose(f) || i != NIP_NO_ERROR){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
     free(v_index);
     return NIP_ERROR_IO;
@@ -1018,7 +2524,9 @@ int insert_ts_step(time_series ts, int t, nip_model model, char mark_mask){
   for(i = 0; i < ts->model->num_of_vars - ts->num_of_hidden; i++){
     v = ts->observed[i];
     if(NIP_MARK(v) & mark_mask){ /* Only the suitably marked variables */
-      if(ts->data[t][i] >= 0)
+      if(model != ts->model)
+        v = model_counterpart(model, v); /* NULL if pruned */
+      if(v && ts->data[t][i] >= 0)
         nip_enter_index_observation(model->variables, model->num_of_vars,
                                     model->cliques, model->num_of_cliques,
                                     v, ts->data[t][i]);
@@ -1041,6 +2549,9 @@ int insert_ucs_step(uncertain_series ucs, int t, nip_model model, char mark_mask
   for(i = 0; i < ucs->num_of_vars; i++){
     v = ucs->variables[i];
     if(NIP_MARK(v) & mark_mask){
+      v = model_counterpart(model, v); /* NULL if pruned */
+      if(!v)
+        continue;
       e = nip_enter_evidence(model->variables, model->num_of_vars,
                              model->cliques, model->num_of_cliques,
                              v, ucs->data[t][i]);
@@ -1599,14 +3110,54 @@ uncertain_series forward_backward_inference(time_series ts,
 }
 
 
+/* Builds a hash table of variable indices, at most half full */
+static int build_symbol_table(nip_model model){
+  int i, size;
+  unsigned long h;
+
+  size = 4;
+  while(size < 2 * model->num_of_vars)
+    size *= 2;
+
+  model->symbol_table = (int*) malloc(size * sizeof(int));
+  if(!model->symbol_table){
+    model->symbol_table_size = 0;
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NIP_ERROR_OUTOFMEMORY;
+  }
+  model->symbol_table_size = size;
+  for(i = 0; i < size; i++)
+    model->symbol_table[i] = -1; /* empty */
+
+  for(i = 0; i < model->num_of_vars; i++){
+    h = nip_hash_string(model->variables[i]->symbol) & (size - 1);
+    while(model->symbol_table[h] >= 0)
+      h = (h + 1) & (size - 1); /* linear probing */
+    model->symbol_table[h] = i;
+  }
+  return NIP_NO_ERROR;
+}
+
+
 nip_variable model_variable(nip_model model, char* symbol){
   int i;
+  unsigned long h;
 
   if(!model){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_NULLPOINTER, 1);
     return NULL;
   }
 
+  if(model->symbol_table){
+    h = nip_hash_string(symbol) & (model->symbol_table_size - 1);
+    while((i = model->symbol_table[h]) >= 0){
+      if(strcmp(symbol, model->variables[i]->symbol) == 0)
+        return model->variables[i];
+      h = (h + 1) & (model->symbol_table_size - 1);
+    }
+    return NULL;
+  }
+
   for(i = 0; i < model->num_of_vars; i++)
     if(strcmp(symbol, model->variables[i]->symbol) == 0)
       return model->variables[i];
@@ -1615,20 +3166,22 @@ nip_variable model_variable(nip_model model, char* symbol){
 }
 
 
-void make_consistent(nip_model model){
-  int i;
-  for (i = 0; i < model->num_of_cliques; i++)
-    nip_unmark_clique(model->cliques[i]);
+/* The variable of the model with the same symbol as v: v itself, or its
+ * copy in a model from prune_model(), or NULL if it was left out */
+static nip_variable model_counterpart(nip_model model, nip_variable v){
+  int i = nip_variable_index(v);
+  if(i >= 0 && i < model->num_of_vars && model->variables[i] == v)
+    return v; /* without hashing */
+  return model_variable(model, nip_variable_symbol(v));
+}
 
-  if(nip_collect_evidence(NULL, NULL, model->cliques[0]) != NIP_NO_ERROR){
-    nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-    return;
-  }
 
-  for (i = 0; i < model->num_of_cliques; i++)
-    nip_unmark_clique(model->cliques[i]);
+void make_consistent(nip_model model){
+  if(model->num_of_cliques < 1)
+    return;
 
-  if(nip_distribute_evidence(model->cliques[0]) != NIP_NO_ERROR)
+  /* collect and distribute, in parallel if the join tree is large */
+  if(nip_propagate_evidence(model->cliques[0]) != NIP_NO_ERROR)
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
 
   return;
@@ -1654,6 +3207,7 @@ time_series mlss(nip_variable vars[], int nvars, time_series ts){
                                         sizeof(nip_variable));
   mlss->observed = (nip_variable*) calloc(nvars, sizeof(nip_variable));
   mlss->length = ts->length;
+  mlss->weight = 1;
   mlss->data = (int**) calloc(mlss->length, sizeof(int*));
   if(!(mlss->data && mlss->observed && mlss->hidden)){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
@@ -1972,8 +3526,9 @@ static int e_step(time_series ts, nip_potential* parameters, double* loglikeliho
       /********************/
       nip_normalise_potential(p); /* Does this cause numerical problems? */
 
-      /* 5. THE SUM of expected counts over time */
-      nip_sum_potential(parameters[i], p); /* "parameters[i] += p" */
+      /* 5. THE SUM of expected counts over time (and identical series) */
+      nip_weighted_sum_potential(parameters[i], p, (double)ts->weight);
+      /* "parameters[i] += weight * p" */
     }
     /*** Finished writing results for this timestep ***/
 
@@ -2001,79 +3556,359 @@ static int e_step(time_series ts, nip_potential* parameters, double* loglikeliho
       use_priors(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
   }
 
-  /* free the space for calculations */
-  for(i = 0; i < model->num_of_vars; i++)
-    nip_free_potential(results[i]);
-  free(results);
-  free(data);
-  free(observed);
+  /* free the space for calculations */
+  for(i = 0; i < model->num_of_vars; i++)
+    nip_free_potential(results[i]);
+  free(results);
+  free(data);
+  free(observed);
+
+  /* free the intermediate potentials */
+  for(t = 0; t <= ts->length; t++)
+    nip_free_potential(alpha_gamma[t]);
+  free(alpha_gamma);
+
+  return NIP_NO_ERROR;
+}
+
+
+static int compare_family_links(const void* a, const void* b){
+  uintptr_t x = (uintptr_t)(((const family_link*)a)->clique);
+  uintptr_t y = (uintptr_t)(((const family_link*)b)->clique);
+  if(x != y)
+    return (x < y) ? -1 : 1;
+  /* keep the order of variables within a clique */
+  return ((const family_link*)a)->var - ((const family_link*)b)->var;
+}
+
+
+/* Sets the original clique potentials to the products of the conditional
+ * distributions parameters[i] of the variables model->variables[i] with
+ * parents: each clique is a product of the distributions of the children
+ * whose family it is (memoized by nip_find_family()) */
+static int set_family_potentials(nip_model model, nip_potential* parameters){
+  int i, j, k, c, n;
+  int** fam_maps = NULL;
+  nip_potential* fam_probs = NULL;
+  family_link* families = NULL;
+  nip_clique fam_clique = NULL;
+  nip_variable child = NULL;
+
+  families = (family_link*) calloc(model->num_of_vars, sizeof(family_link));
+  fam_probs = (nip_potential*) calloc(model->num_of_vars,
+                                      sizeof(nip_potential));
+  fam_maps = (int**) calloc(model->num_of_vars, sizeof(int*));
+  if(!families || !fam_probs || !fam_maps){
+    free(families);
+    free(fam_probs);
+    free(fam_maps);
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NIP_ERROR_OUTOFMEMORY;
+  }
+  n = 0;
+  for(i = 0; i < model->num_of_vars; i++){
+    child = model->variables[i];
+    if(nip_number_of_parents(child) > 0){
+      families[n].clique = nip_find_family(model->cliques,
+                                           model->num_of_cliques,
+                                           child);
+      families[n].var = i;
+      n++;
+    }
+  }
+  /* group the children by their family clique */
+  qsort(families, n, sizeof(family_link), compare_family_links);
+
+  /* cliques without any children keep uniform original potentials */
+  for(c = 0; c < model->num_of_cliques; c++)
+    nip_uniform_potential(model->cliques[c]->original_p, 1.0);
+
+  for(i = 0; i < n; i = j){
+    fam_clique = families[i].clique;
+    for(j = i; j < n && families[j].clique == fam_clique; j++){
+      /* NOTE: parameters have children as the 1st dimension,
+       * but cliques have dimensions in the order chosen by
+       * nip_arrange_clique_dimensions() */
+      child = model->variables[families[j].var];
+      fam_probs[j - i] = parameters[families[j].var];
+      fam_maps[j - i] = nip_find_family_mapping(fam_clique, child);
+    }
+    k = nip_product_potential(fam_clique->original_p,
+                              fam_probs, fam_maps, j - i);
+    if(k != NIP_NO_ERROR){
+      free(families);
+      free(fam_probs);
+      free(fam_maps);
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+      return NIP_ERROR_GENERAL;
+    }
+  }
+  free(families);
+  free(fam_probs);
+  free(fam_maps);
+  return NIP_NO_ERROR;
+}
+
+
+static int m_step(nip_potential* parameters, nip_model model){
+  int i, k;
+#ifdef PARAMETER_EPSILON
+  int j;
+#endif
+  nip_variable child = NULL;
+
+#ifdef PARAMETER_EPSILON
+  /* 0. Make sure there are no zero probabilities
+   * TODO: hide the access to private data... */
+  for(i = 0; i < model->num_of_vars; i++){
+    k = parameters[i]->size_of_data;
+    for(j = 0; j < k; j++)
+      if(parameters[i]->data[j] < PARAMETER_EPSILON){
+        /*assert(parameters[i]->data[j] > 0.0);*/
+        parameters[i]->data[j] = PARAMETER_EPSILON;
+        /* Q: Should the tiny value be (inversely) proportional to the number
+         *    of zeros so that the added weight is constant? */
+      }
+  }
+#endif
+
+  /* 1. Normalise parameters by dividing with the sums over child variables */
+  for(i = 0; i < model->num_of_vars; i++){
+    /* NOTE: parameter potentials have children as the 1st dimension */
+    nip_normalise_cpd(parameters[i]);
+  }
+
+  /* 2. Rebuild the original clique potentials from the new parameters */
+  k = set_family_potentials(model, parameters);
+  if(k != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, k, 1);
+    return k;
+  }
+  free_pruned_models(model); /* pruned with the old parameters */
+
+  /* 3. Update the priors of independent variables */
+  for(i = 0; i < model->num_of_vars; i++){
+    child = model->variables[i];
+    if(nip_number_of_parents(child) == 0)
+      nip_total_marginalise(parameters[i], child->prior, 0);
+  }
+
+  /* 4. Reset everything: current potentials are copied from the originals */
+  reset_model(model);
+
+  return NIP_NO_ERROR;
+}
+
+
+nip_potential* new_expected_counts(nip_model model, double pseudo_count){
+  int i, n, v;
+  int *card;
+  nip_potential* counts = NULL;
+
+  if(!model){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_NULLPOINTER, 1);
+    return NULL;
+  }
+
+  counts = (nip_potential*) calloc(model->num_of_vars, sizeof(nip_potential));
+  if(!counts){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NULL;
+  }
+
+  for(v = 0; v < model->num_of_vars; v++){
+    n = nip_number_of_parents(model->variables[v]) + 1;
+    card = (int*) calloc(n, sizeof(int));
+    if(!card){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+      while(v > 0)
+        nip_free_potential(counts[--v]);
+      free(counts);
+      return NULL;
+    }
+    /* The child MUST be the first variable in order to normalize potentials */
+    card[0] = NIP_CARDINALITY(model->variables[v]);
+    for(i = 1; i < n; i++)
+      card[i] = NIP_CARDINALITY(model->variables[v]->parents[i-1]);
+    counts[v] = nip_new_potential(card, n, NULL);
+    free(card);
+    if(!counts[v]){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+      while(v > 0)
+        nip_free_potential(counts[--v]);
+      free(counts);
+      return NULL;
+    }
+    nip_uniform_potential(counts[v], pseudo_count);
+  }
+  return counts;
+}
+
+
+void free_expected_counts(nip_model model, nip_potential* counts){
+  int v;
+  if(!model || !counts)
+    return;
+  for(v = 0; v < model->num_of_vars; v++)
+    nip_free_potential(counts[v]);
+  free(counts);
+}
+
+
+int accumulate_expected_counts(time_series ts, nip_potential* counts,
+                               double* loglikelihood){
+  int e;
+  double probe = 0;
+
+  if(!ts || !counts || !loglikelihood){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NIP_ERROR_INVALID_ARGUMENT;
+  }
+
+  e = e_step(ts, counts, &probe);
+  if(e != NIP_NO_ERROR){
+    if(e != NIP_ERROR_BAD_LUCK)
+      nip_report_error(__FILE__, __LINE__, e, 1);
+    return e;
+  }
+  *loglikelihood = ts->weight * probe;
+  return NIP_NO_ERROR;
+}
+
+
+int set_expected_counts(nip_model model, nip_potential* counts){
+  int e;
+
+  if(!model || !counts){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NIP_ERROR_INVALID_ARGUMENT;
+  }
+
+  e = m_step(counts, model);
+  if(e != NIP_NO_ERROR)
+    nip_report_error(__FILE__, __LINE__, e, 1);
+  return e;
+}
+
+
+int write_expected_counts(nip_model model, nip_potential* counts,
+                          double loglikelihood, long ts_steps, char* filename){
+  int i, v, n;
+  int ok;
+  nip_variable var;
+  nip_potential p;
+  FILE* f = NULL;
+
+  if(!model || !counts || !filename){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NIP_ERROR_INVALID_ARGUMENT;
+  }
+
+  f = fopen(filename, "wb");
+  if(!f){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    return NIP_ERROR_IO;
+  }
 
-  /* free the intermediate potentials */
-  for(t = 0; t <= ts->length; t++)
-    nip_free_potential(alpha_gamma[t]);
-  free(alpha_gamma);
+  /* the header */
+  n = EXPECTED_COUNTS_VERSION;
+  ok = (fwrite(EXPECTED_COUNTS_MAGIC, 1, 4, f) == 4 &&
+        fwrite(&n, sizeof(int), 1, f) == 1 &&
+        fwrite(&(model->num_of_vars), sizeof(int), 1, f) == 1 &&
+        fwrite(&loglikelihood, sizeof(double), 1, f) == 1 &&
+        fwrite(&ts_steps, sizeof(long), 1, f) == 1);
+
+  /* the variables and their counts */
+  for(v = 0; ok && v < model->num_of_vars; v++){
+    var = model->variables[v];
+    p = counts[v];
+    n = strlen(nip_variable_symbol(var));
+    ok = (fwrite(&n, sizeof(int), 1, f) == 1 &&
+          fwrite(nip_variable_symbol(var), 1, n, f) == n &&
+          fwrite(&(p->dimensionality), sizeof(int), 1, f) == 1);
+    for(i = 0; ok && i < p->dimensionality; i++)
+      ok = (fwrite(&(p->cardinality[i]), sizeof(int), 1, f) == 1);
+    if(ok)
+      ok = (fwrite(p->data, sizeof(double), p->size_of_data, f) ==
+            p->size_of_data);
+  }
 
+  if(fclose(f) || !ok){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    return NIP_ERROR_IO;
+  }
   return NIP_NO_ERROR;
 }
 
 
-static int m_step(nip_potential* parameters, nip_model model){
-  int i, j, k;
-  int* fam_map;
-  nip_clique fam_clique = NULL;
-  nip_variable child = NULL;
+nip_potential* read_expected_counts(nip_model model, char* filename,
+                                    double* loglikelihood, long* ts_steps){
+  int i, v, n;
+  int ok;
+  char magic[4];
+  char* symbol = NULL;
+  nip_potential p;
+  nip_potential* counts = NULL;
+  FILE* f = NULL;
 
-#ifdef PARAMETER_EPSILON
-  /* 0. Make sure there are no zero probabilities
-   * TODO: hide the access to private data... */
-  for(i = 0; i < model->num_of_vars; i++){
-    k = parameters[i]->size_of_data;
-    for(j = 0; j < k; j++)
-      if(parameters[i]->data[j] < PARAMETER_EPSILON){
-        /*assert(parameters[i]->data[j] > 0.0);*/
-        parameters[i]->data[j] = PARAMETER_EPSILON;
-        /* Q: Should the tiny value be (inversely) proportional to the number
-         *    of zeros so that the added weight is constant? */
-      }
+  if(!model || !filename || !loglikelihood || !ts_steps){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NULL;
   }
-#endif
 
-  /* 1. Normalise parameters by dividing with the sums over child variables */
-  for(i = 0; i < model->num_of_vars; i++){
-    /* NOTE: parameter potentials have children as the 1st dimension */
-    nip_normalise_cpd(parameters[i]);
+  f = fopen(filename, "rb");
+  if(!f){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    return NULL;
   }
 
-  /* 2. Reset the clique potentials and everything */
-  total_reset(model);
-
-  /* 3. Initialise the model with the new parameters */
-  for(i = 0; i < model->num_of_vars; i++){
-    child = model->variables[i];
+  counts = new_expected_counts(model, 0.0);
+  if(!counts){
+    fclose(f);
+    return NULL;
+  }
 
-    if(nip_number_of_parents(child) > 0){
-      /* NOTE: parameters have children as the 1st dimension,
-       * but cliques have dimensions ordered by variable ID */
-      fam_clique = nip_find_family(model->cliques,
-                                   model->num_of_cliques,
-                                   child);
-      fam_map = nip_find_family_mapping(fam_clique, child);
-
-      /* Update the conditional probability distributions (dependencies) */
-      j = nip_init_potential(parameters[i], fam_clique->p, fam_map);
-      k = nip_init_potential(parameters[i], fam_clique->original_p, fam_map);
-      if(j != NIP_NO_ERROR || k != NIP_NO_ERROR){
-        nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-        return NIP_ERROR_GENERAL;
-      }
-    }
-    else{
-      /* Update the priors of independent variables */
-      nip_total_marginalise(parameters[i], child->prior, 0);
+  /* the header */
+  ok = (fread(magic, 1, 4, f) == 4 &&
+        strncmp(magic, EXPECTED_COUNTS_MAGIC, 4) == 0 &&
+        fread(&n, sizeof(int), 1, f) == 1 &&
+        n == EXPECTED_COUNTS_VERSION &&
+        fread(&n, sizeof(int), 1, f) == 1 &&
+        n == model->num_of_vars &&
+        fread(loglikelihood, sizeof(double), 1, f) == 1 &&
+        fread(ts_steps, sizeof(long), 1, f) == 1);
+
+  /* the variables must match the model */
+  for(v = 0; ok && v < model->num_of_vars; v++){
+    p = counts[v];
+    ok = (fread(&n, sizeof(int), 1, f) == 1 &&
+          n == strlen(nip_variable_symbol(model->variables[v])));
+    if(ok){
+      symbol = (char*) calloc(n + 1, sizeof(char));
+      ok = (symbol != NULL &&
+            fread(symbol, 1, n, f) == n &&
+            strcmp(symbol, nip_variable_symbol(model->variables[v])) == 0);
+      free(symbol);
     }
+    ok = (ok &&
+          fread(&n, sizeof(int), 1, f) == 1 &&
+          n == p->dimensionality);
+    for(i = 0; ok && i < p->dimensionality; i++)
+      ok = (fread(&n, sizeof(int), 1, f) == 1 &&
+            n == p->cardinality[i]);
+    if(ok)
+      ok = (fread(p->data, sizeof(double), p->size_of_data, f) ==
+            p->size_of_data);
   }
+  fclose(f);
 
-  return NIP_NO_ERROR;
+  if(!ok){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+    fprintf(stderr, "%s: not expected counts of this model\n", filename);
+    free_expected_counts(model, counts);
+    return NULL;
+  }
+  return counts;
 }
 
 
@@ -2083,46 +3918,54 @@ int em_learn(nip_model model, time_series* ts, int n_ts, int have_random_init,
              long max_iterations, double threshold,
              nip_double_list learning_curve, nip_convergence* stopping_criterion,
              int (*em_progress)(nip_double_list, double), int (*ts_progress)(int, int)){
-  int i, n, v;
-  int *card, *mapping;
-  int ts_steps;
+  int e;
+  timeseries_reader data = NULL;
+
+  if(!ts || !ts[0] || !model){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NIP_ERROR_INVALID_ARGUMENT;
+  }
+  data = open_timeseries_array(ts, n_ts);
+  if(!data)
+    return NIP_ERROR_INVALID_ARGUMENT;
+  e = em_learn_stream(model, data, have_random_init, max_iterations,
+                      threshold, learning_curve, stopping_criterion,
+                      em_progress, ts_progress);
+  close_timeseries(data);
+  return e;
+}
+
+
+int em_learn_stream(nip_model model, timeseries_reader data,
+                    int have_random_init, long max_iterations,
+                    double threshold, nip_double_list learning_curve,
+                    nip_convergence* stopping_criterion,
+                    int (*em_progress)(nip_double_list, double),
+                    int (*ts_progress)(int, int)){
+  int i, k, n, v;
+  int n_ts;
+  int *mapping;
+  long ts_steps;
   double old_loglikelihood;
   double loglikelihood = -DBL_MAX;
   double probe = 0;
   nip_potential* parameters = NULL;
+  time_series* ts = NULL;
   nip_clique clique;
   int e, converged;
 
-  if(!ts[0] || !model){
+  if(!data || !model){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
     return NIP_ERROR_INVALID_ARGUMENT;
   }
 
   /* Reserve some memory for calculation */
-  parameters = (nip_potential*) calloc(model->num_of_vars, sizeof(nip_potential));
+  parameters = new_expected_counts(model, 0.0);
   if(!parameters){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
     return NIP_ERROR_OUTOFMEMORY;
   }
 
-  for(v = 0; v < model->num_of_vars; v++){
-    n = nip_number_of_parents(model->variables[v]) + 1;
-    card = (int*) calloc(n, sizeof(int));
-    if(!card){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-      while(v > 0)
-        nip_free_potential(parameters[--v]);
-      free(parameters);
-      return NIP_ERROR_OUTOFMEMORY;
-    }
-    /* The child MUST be the first variable in order to normalize potentials */
-    card[0] = NIP_CARDINALITY(model->variables[v]);
-    for(i = 1; i < n; i++)
-      card[i] = NIP_CARDINALITY(model->variables[v]->parents[i-1]);
-    parameters[v] = nip_new_potential(card, n, NULL);
-    free(card);
-  }
-
   /* Randomize the parameters. (TODO: move this operation to potential.c?)
    * NOTE: parameters near zero are a numerical problem...
    *       on the other hand, zeros are needed in some cases.
@@ -2138,11 +3981,19 @@ int em_learn(nip_model model, time_series* ts, int n_ts, int have_random_init,
                                model->variables[v]);
       if(!clique){
         nip_report_error(__FILE__, __LINE__, EINVAL, 1);
-        while(v > 0)
-          nip_free_potential(parameters[--v]);
-        free(parameters);
+        free_expected_counts(model, parameters);
         return NIP_ERROR_OUTOFMEMORY;
       }
+      if(nip_number_of_parents(model->variables[v]) == 0){
+        /* priors are not part of the clique potentials */
+        probe = 0;
+        for(i = 0; i < NIP_CARDINALITY(model->variables[v]); i++){
+          parameters[v]->data[i] = model->variables[v]->prior[i];
+          probe += parameters[v]->data[i];
+        }
+        if(probe > 0)
+          continue; /* else a missing prior: use the clique instead */
+      }
       mapping = nip_find_family_mapping(clique, model->variables[v]);
       nip_general_marginalise(clique->original_p, parameters[v], mapping);
       // TODO: minor drop in learning curve when continuing, but recovered during the 3 minimum iterations ?
@@ -2151,10 +4002,9 @@ int em_learn(nip_model model, time_series* ts, int n_ts, int have_random_init,
       nip_normalise_cpd(p); */
     }
 
-  /* Compute total number of time steps */
+  /* Total number of time steps (including identical series)
+   * is computed during the first E-step */
   ts_steps = 0;
-  for(n = 0; n < n_ts; n++)
-    ts_steps += timeseries_length(ts[n]);
 
   /************/
   /* THE Loop */
@@ -2187,39 +4037,65 @@ int em_learn(nip_model model, time_series* ts, int n_ts, int have_random_init,
     }
 
     /* E-Step: Now this is the heavy stuff..!
-     * (for each time series separately to save memory) */
-    for(n = 0; n < n_ts; n++){
-      e = e_step(ts[n], parameters, &probe);
-      if(e != NIP_NO_ERROR){
-        if(e != NIP_ERROR_BAD_LUCK)
-          nip_report_error(__FILE__, __LINE__, e, 1);
-        /* don't report invalid random parameters */
-        for(v = 0; v < model->num_of_vars; v++){
-          nip_free_potential(parameters[v]);
-        }
-        free(parameters);
-        if(e != NIP_ERROR_BAD_LUCK){
-          if(learning_curve != NULL)
-            nip_empty_double_list(learning_curve);
-        }
-        /* else let the list be */
-
-        return e;
+     * (for each time series separately to save memory,
+     *  a batch of them at a time from the data) */
+    e = rewind_timeseries(data);
+    k = 0;
+    while(e == NIP_NO_ERROR && (n_ts = next_timeseries(data, &ts)) != 0){
+      if(n_ts < 0){
+        e = NIP_ERROR_IO;
+        break;
       }
+      for(n = 0; n < n_ts; n++, k++){
+        if(i == 0)
+          ts_steps += ts[n]->weight * timeseries_length(ts[n]);
+        e = e_step(ts[n], parameters, &probe);
+        if(e != NIP_NO_ERROR){
+          if(e != NIP_ERROR_BAD_LUCK)
+            nip_report_error(__FILE__, __LINE__, e, 1);
+          /* don't report invalid random parameters */
+          for(v = 0; v < model->num_of_vars; v++){
+            nip_free_potential(parameters[v]);
+          }
+          free(parameters);
+          if(e != NIP_ERROR_BAD_LUCK){
+            if(learning_curve != NULL)
+              nip_empty_double_list(learning_curve);
+          }
+          /* else let the list be */
+
+          return e;
+        }
 
-      /** DEBUG **/
-      assert(-HUGE_DOUBLE < probe  &&  probe <= 0.0  && probe == probe);
-      /* probe != probe  =>  probe == NaN  */
+        /** DEBUG **/
+        assert(-HUGE_DOUBLE < probe  &&  probe <= 0.0  && probe == probe);
+        /* probe != probe  =>  probe == NaN  */
 
-      loglikelihood += probe;
-      if(ts_progress != NULL)
-        ts_progress(n, ts[n]->length);
+        loglikelihood += ts[n]->weight * probe;
+        if(ts_progress != NULL)
+          ts_progress(k, ts[n]->length);
+      }
+    }
+    if(e != NIP_NO_ERROR || ts_steps == 0){
+      if(e == NIP_NO_ERROR)
+        e = NIP_ERROR_INVALID_ARGUMENT;
+      nip_report_error(__FILE__, __LINE__, e, 1);
+      free_expected_counts(model, parameters);
+      if(learning_curve != NULL)
+        nip_empty_double_list(learning_curve);
+      return e;
     }
 
     /* Add an element to the linked list */
     if(learning_curve != NULL){
       e = em_progress(learning_curve, loglikelihood / ts_steps);
-      if(e != NIP_NO_ERROR){
+      if(e == EM_INTERRUPT){
+        /* the model has the parameters of the latest M-step */
+        converged = 1;
+        if (stopping_criterion)
+          *stopping_criterion = INTERRUPTED;
+      }
+      else if(e != NIP_NO_ERROR){
         nip_report_error(__FILE__, __LINE__, e, 1);
         for(v = 0; v < model->num_of_vars; v++){
           nip_free_potential(parameters[v]);
@@ -2247,7 +4123,9 @@ int em_learn(nip_model model, time_series* ts, int n_ts, int have_random_init,
     i++;
 
     /* Check for convergence or other stopping criteria */
-    if (i >= MIN_EM_ITERATIONS) {
+    if (converged) {
+      break; /* interrupted */
+    } else if (i >= MIN_EM_ITERATIONS) {
       if ((loglikelihood - old_loglikelihood) > (ts_steps * threshold)) {
         if (i >= max_iterations) {
           converged = 1;
@@ -2293,6 +4171,11 @@ double* get_probability(nip_model model, nip_variable v){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_NULLPOINTER, 1);
     return NULL;
   }
+  v = model_counterpart(model, v); /* in case the model was pruned */
+  if(!v){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NULL;
+  }
   cardinality = NIP_CARDINALITY(v);
   result = (double *) calloc(cardinality, sizeof(double));
   if(!result){
@@ -2324,15 +4207,32 @@ nip_potential get_joint_probability(nip_model model,
                                     nip_variable *vars,
                                     int nvars){
   nip_potential p;
+  nip_variable* found;
   int i;
 
+  /* The variables of the model, in case it was pruned */
+  found = (nip_variable*) calloc(nvars, sizeof(nip_variable));
+  if(!found){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NULL;
+  }
+  for(i = 0; i < nvars; i++){
+    found[i] = model_counterpart(model, vars[i]);
+    if(!found[i]){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+      free(found);
+      return NULL;
+    }
+  }
+
   /* Unmark all cliques */
   for (i = 0; i < model->num_of_cliques; i++)
     nip_unmark_clique(model->cliques[i]);
 
   /* Make a DFS in the tree... */
   p = nip_gather_joint_probability(model->cliques[0],
-                                   vars, nvars, NULL, 0);
+                                   found, nvars, NULL, 0);
+  free(found);
   if(p == NULL){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
     return NULL;
@@ -2344,6 +4244,504 @@ nip_potential get_joint_probability(nip_model model,
 }
 
 
+/* Roles and relevance of the variables when pruning a model */
+#define PRUNE_QUERY    1  /* variable of interest */
+#define PRUNE_EVIDENCE 2  /* observed, not a variable of interest */
+#define PRUNE_ANCESTOR 4  /* ancestor of the query or evidence (not barren) */
+#define PRUNE_KEPT     8  /* connected to the query given the evidence */
+#define PRUNE_FAMILY  16  /* keeps its conditional distribution or prior */
+
+
+/* Orders variable ids for the signatures of pruned models */
+static int compare_ids(const void* a, const void* b){
+  unsigned long x = *((const unsigned long*)a);
+  unsigned long y = *((const unsigned long*)b);
+  if(x < y)
+    return -1;
+  return (x > y);
+}
+
+
+/* Sorts the ids and removes duplicates, returns the number left */
+static int unique_ids(unsigned long* ids, int n){
+  int i, m = 0;
+  qsort(ids, n, sizeof(unsigned long), compare_ids);
+  for(i = 0; i < n; i++)
+    if(m == 0 || ids[i] != ids[m-1])
+      ids[m++] = ids[i];
+  return m;
+}
+
+
+/* Marks the variables relevant to the query given the evidence:
+ * ancestors of the query and evidence are kept (barren variables are
+ * not), and unless keep_likelihood, only those connected to the query
+ * in the moral graph of the ancestors without passing the evidence.
+ * Conditional distributions of observed variables are kept only if
+ * they depend on an unobserved variable that was kept.
+ * Returns the number of variables kept, or a negative error code. */
+static int mark_relevant_variables(nip_model model, int* status,
+                                   nip_variable* query, int nq,
+                                   nip_variable* evidence, int ne,
+                                   int keep_likelihood){
+  int i, j, k, m, u, x, y, n_kept;
+  int n = model->num_of_vars;
+  int* position = NULL; /* [index of a variable] -> position in model */
+  int* stack = NULL;
+  int* first = NULL;    /* where the children of each variable start */
+  int* children = NULL; /* positions of the children of ancestors */
+  nip_variable v;
+
+  position = (int*) calloc(n, sizeof(int));
+  stack = (int*) calloc(n, sizeof(int));
+  first = (int*) calloc(n + 1, sizeof(int));
+  if(!position || !stack || !first){
+    free(position);
+    free(stack);
+    free(first);
+    return -NIP_ERROR_OUTOFMEMORY;
+  }
+  for(i = 0; i < n; i++){
+    k = nip_variable_index(model->variables[i]);
+    if(k < 0 || k >= n){
+      free(position);
+      free(stack);
+      free(first);
+      return -NIP_ERROR_INVALID_ARGUMENT;
+    }
+    position[k] = i;
+    status[i] = 0;
+  }
+
+  /* 1. Roles of the given variables (must be in the model) */
+  for(i = 0; i < nq + ne; i++){
+    v = (i < nq) ? query[i] : evidence[i - nq];
+    k = nip_variable_index(v);
+    if(!v || k < 0 || k >= n || model->variables[position[k]] != v){
+      free(position);
+      free(stack);
+      free(first);
+      return -NIP_ERROR_INVALID_ARGUMENT;
+    }
+    if(i < nq)
+      status[position[k]] = PRUNE_QUERY;
+    else if(!(status[position[k]] & PRUNE_QUERY))
+      status[position[k]] = PRUNE_EVIDENCE;
+  }
+
+  /* 2. Ancestors of the query and evidence: the rest are barren */
+  m = 0;
+  for(i = 0; i < n; i++)
+    if(status[i]){
+      status[i] |= PRUNE_ANCESTOR;
+      stack[m++] = i;
+    }
+  while(m > 0){
+    v = model->variables[stack[--m]];
+    for(j = 0; j < v->num_of_parents; j++){
+      u = position[nip_variable_index(v->parents[j])];
+      if(!(status[u] & PRUNE_ANCESTOR)){
+        status[u] |= PRUNE_ANCESTOR;
+        stack[m++] = u;
+      }
+    }
+  }
+
+  n_kept = 0;
+  if(keep_likelihood || nq == 0){
+    for(i = 0; i < n; i++)
+      if(status[i] & PRUNE_ANCESTOR){
+        status[i] |= PRUNE_KEPT | PRUNE_FAMILY;
+        n_kept++;
+      }
+    free(position);
+    free(stack);
+    free(first);
+    return n_kept;
+  }
+
+  /* 3. Children of the ancestors, for the edges of the moral graph */
+  for(i = 0; i < n; i++){
+    v = model->variables[i];
+    if(status[i] & PRUNE_ANCESTOR)
+      for(j = 0; j < v->num_of_parents; j++)
+        first[position[nip_variable_index(v->parents[j])] + 1]++;
+  }
+  for(i = 0; i < n; i++)
+    first[i + 1] += first[i];
+  children = (int*) calloc(first[n] + 1, sizeof(int));
+  if(!children){
+    free(position);
+    free(stack);
+    free(first);
+    return -NIP_ERROR_OUTOFMEMORY;
+  }
+  for(i = 0; i < n; i++){
+    v = model->variables[i];
+    if(status[i] & PRUNE_ANCESTOR)
+      for(j = 0; j < v->num_of_parents; j++){
+        u = position[nip_variable_index(v->parents[j])];
+        children[first[u]++] = i;
+      }
+  }
+  for(i = n; i > 0; i--)
+    first[i] = first[i - 1]; /* undo the increments */
+  first[0] = 0;
+
+  /* 4. Search from the query over parents, children and their other
+   *    parents, stopping at the evidence (d-separation) */
+  m = 0;
+  for(i = 0; i < n; i++)
+    if(status[i] & PRUNE_QUERY){
+      status[i] |= PRUNE_KEPT;
+      stack[m++] = i;
+    }
+  while(m > 0){
+    x = stack[--m];
+    if(status[x] & PRUNE_EVIDENCE)
+      continue; /* observed: does not connect its neighbours */
+    v = model->variables[x];
+    for(j = 0; j < v->num_of_parents; j++){
+      u = position[nip_variable_index(v->parents[j])];
+      if(!(status[u] & PRUNE_KEPT)){
+        status[u] |= PRUNE_KEPT;
+        stack[m++] = u;
+      }
+    }
+    for(k = first[x]; k < first[x + 1]; k++){
+      y = children[k];
+      if(!(status[y] & PRUNE_KEPT)){
+        status[y] |= PRUNE_KEPT;
+        stack[m++] = y;
+      }
+      for(j = 0; j < model->variables[y]->num_of_parents; j++){
+        u = position[nip_variable_index(model->variables[y]->parents[j])];
+        if(!(status[u] & PRUNE_KEPT)){
+          status[u] |= PRUNE_KEPT;
+          stack[m++] = u;
+        }
+      }
+    }
+  }
+
+  /* 5. Observed variables need their distribution only if it depends
+   *    on something unobserved that was kept */
+  for(i = 0; i < n; i++){
+    if(!(status[i] & PRUNE_KEPT))
+      continue;
+    n_kept++;
+    if(!(status[i] & PRUNE_EVIDENCE)){
+      status[i] |= PRUNE_FAMILY;
+      continue;
+    }
+    v = model->variables[i];
+    for(j = 0; j < v->num_of_parents; j++){
+      u = position[nip_variable_index(v->parents[j])];
+      if((status[u] & PRUNE_KEPT) && !(status[u] & PRUNE_EVIDENCE))
+        status[i] |= PRUNE_FAMILY;
+    }
+  }
+
+  free(position);
+  free(stack);
+  free(first);
+  free(children);
+  return n_kept;
+}
+
+
+/* Compiles a model of the variables marked PRUNE_KEPT, with the
+ * conditional distributions of those marked PRUNE_FAMILY taken from
+ * the join tree of the full model and uniform priors for the rest */
+static nip_model new_pruned_model(nip_model model, int* status, int n_kept){
+  int i, j, k, e = NIP_NO_ERROR;
+  int ready = 0;             /* init_model() done? */
+  int* kept = NULL;          /* positions of the kept variables in model */
+  nip_variable* copy = NULL; /* [index of a variable] -> copy or NULL */
+  nip_variable* family = NULL;
+  double* prior = NULL;
+  nip_variable v, w;
+  nip_graph g = NULL;
+  nip_clique c;
+  nip_potential* parameters = NULL;
+  nip_model new = NULL;
+
+  new = (nip_model) calloc(1, sizeof(nip_model_struct));
+  kept = (int*) calloc(n_kept, sizeof(int));
+  copy = (nip_variable*) calloc(model->num_of_vars, sizeof(nip_variable));
+  family = (nip_variable*) calloc(model->num_of_vars, sizeof(nip_variable));
+  if(new)
+    new->variables = (nip_variable*) calloc(n_kept, sizeof(nip_variable));
+  if(!new || !kept || !copy || !family || !new->variables){
+    if(new)
+      free(new->variables);
+    free(new);
+    free(kept);
+    free(copy);
+    free(family);
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NULL;
+  }
+  new->node_size_x = model->node_size_x;
+  new->node_size_y = model->node_size_y;
+
+  /* 1. Copies of the variables, numbered for bitsets */
+  for(i = 0; e == NIP_NO_ERROR && i < model->num_of_vars; i++){
+    if(!(status[i] & PRUNE_KEPT))
+      continue;
+    v = model->variables[i];
+    w = nip_new_variable(v->symbol, v->name, v->state_names,
+                         NIP_CARDINALITY(v));
+    if(!w){
+      e = NIP_ERROR_OUTOFMEMORY;
+      break;
+    }
+    nip_set_variable_index(w, new->num_of_vars);
+    nip_set_variable_position(w, v->pos_x, v->pos_y);
+    kept[new->num_of_vars] = i;
+    new->variables[new->num_of_vars++] = w;
+    copy[nip_variable_index(v)] = w;
+  }
+
+  /* 2. Parents, or priors (uniform if the distribution is irrelevant) */
+  for(j = 0; e == NIP_NO_ERROR && j < new->num_of_vars; j++){
+    v = model->variables[kept[j]];
+    w = new->variables[j];
+    if(!(status[kept[j]] & PRUNE_FAMILY)){
+      prior = (double*) calloc(NIP_CARDINALITY(w), sizeof(double));
+      if(!prior){
+        e = NIP_ERROR_OUTOFMEMORY;
+        break;
+      }
+      for(k = 0; k < NIP_CARDINALITY(w); k++)
+        prior[k] = 1.0 / NIP_CARDINALITY(w);
+      e = nip_set_prior(w, prior);
+      free(prior);
+    }
+    else if(v->num_of_parents > 0){
+      for(k = 0; k < v->num_of_parents; k++)
+        family[k] = copy[nip_variable_index(v->parents[k])];
+      e = nip_set_parents(w, family, v->num_of_parents);
+    }
+    else
+      e = nip_set_prior(w, v->prior);
+  }
+
+  /* 3. The join tree */
+  if(e == NIP_NO_ERROR){
+    g = nip_new_graph(new->num_of_vars);
+    if(!g)
+      e = NIP_ERROR_OUTOFMEMORY;
+  }
+  for(j = 0; e == NIP_NO_ERROR && j < new->num_of_vars; j++)
+    e = nip_graph_add_node(g, new->variables[j]);
+  for(j = 0; e == NIP_NO_ERROR && j < new->num_of_vars; j++){
+    w = new->variables[j];
+    for(k = 0; e == NIP_NO_ERROR && k < w->num_of_parents; k++)
+      e = nip_graph_add_child(g, w->parents[k], w);
+  }
+  if(e == NIP_NO_ERROR){
+    new->num_of_cliques = nip_graph_to_cliques(g, &(new->cliques));
+    if(new->num_of_cliques < 1){
+      new->num_of_cliques = 0;
+      e = NIP_ERROR_GENERAL;
+    }
+  }
+  nip_free_graph(g);
+
+  /* 4. The rest like in parse_model() */
+  if(e == NIP_NO_ERROR){
+    e = init_model(new);
+    ready = (e == NIP_NO_ERROR);
+  }
+
+  /* 5. Conditional distributions from the family cliques of the full
+   *    model: the other distributions multiplied into the same clique
+   *    vanish when normalising over the child */
+  if(e == NIP_NO_ERROR){
+    parameters = new_expected_counts(new, 0.0);
+    if(!parameters)
+      e = NIP_ERROR_OUTOFMEMORY;
+  }
+  for(j = 0; e == NIP_NO_ERROR && j < new->num_of_vars; j++){
+    if(new->variables[j]->num_of_parents == 0)
+      continue;
+    v = model->variables[kept[j]];
+    c = nip_find_family(model->cliques, model->num_of_cliques, v);
+    if(!c){
+      e = NIP_ERROR_GENERAL;
+      break;
+    }
+    e = nip_general_marginalise(c->original_p, parameters[j],
+                                nip_find_family_mapping(c, v));
+    if(e == NIP_NO_ERROR)
+      e = nip_normalise_cpd(parameters[j]);
+  }
+  if(e == NIP_NO_ERROR)
+    e = set_family_potentials(new, parameters);
+  if(parameters)
+    free_expected_counts(new, parameters);
+
+  free(kept);
+  free(copy);
+  free(family);
+  if(e != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, e, 1);
+    if(ready){
+      free_model(new);
+      return NULL;
+    }
+    for(i = 0; i < new->num_of_cliques; i++)
+      nip_free_clique(new->cliques[i]);
+    free(new->cliques);
+    for(i = 0; i < new->num_of_vars; i++)
+      nip_free_variable(new->variables[i]);
+    free(new->variables);
+    free(new);
+    return NULL;
+  }
+  reset_model(new);
+  return new;
+}
+
+
+/* Forgets the cached pruned models, e.g. when the parameters change */
+static void free_pruned_models(nip_model model){
+  struct nip_pruned_model* link;
+  while(model->pruned){
+    link = model->pruned;
+    model->pruned = link->next;
+    if(link->model != model)
+      free_model(link->model);
+    free(link->ids);
+    free(link);
+  }
+}
+
+
+nip_model prune_model(nip_model model, nip_variable* query, int nq,
+                      nip_variable* evidence, int ne, int keep_likelihood){
+  int i, n, n_query, n_kept, count;
+  int* status = NULL;
+  unsigned long h;
+  unsigned long* ids = NULL;
+  char* setting = getenv("NIP_PRUNING");
+  struct nip_pruned_model* link;
+  struct nip_pruned_model** where;
+
+  if(!model || nq < 0 || ne < 0 || (nq > 0 && !query) ||
+     (ne > 0 && !evidence)){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NULL;
+  }
+
+  /* Time slices would need the interfaces intact */
+  if(model->num_of_nexts > 0 ||
+     model->outgoing_interface_size > 0 ||
+     model->incoming_interface_size > 0 ||
+     (setting && strcmp(setting, "0") == 0))
+    return model;
+
+  /* 1. Signature: the query, then the rest of the evidence */
+  ids = (unsigned long*) calloc(nq + ne + 1, sizeof(unsigned long));
+  if(!ids){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NULL;
+  }
+  for(i = 0; i < nq; i++)
+    ids[i] = nip_variable_id(query[i]);
+  n_query = unique_ids(ids, nq);
+  n = n_query;
+  for(i = 0; i < ne; i++){
+    ids[n] = nip_variable_id(evidence[i]);
+    if(!bsearch(&(ids[n]), ids, n_query, sizeof(unsigned long), compare_ids))
+      n++;
+  }
+  n = n_query + unique_ids(ids + n_query, n - n_query);
+  keep_likelihood = (keep_likelihood != 0);
+
+  h = 2166136261UL;
+  h = (h ^ (unsigned long)keep_likelihood) * 16777619UL;
+  h = (h ^ (unsigned long)n_query) * 16777619UL;
+  for(i = 0; i < n; i++)
+    h = (h ^ ids[i]) * 16777619UL;
+
+  /* 2. Already cached? Keep the most recently used first */
+  count = 0;
+  for(where = &(model->pruned); *where; where = &((*where)->next)){
+    link = *where;
+    if(link->signature == h &&
+       link->keep_likelihood == keep_likelihood &&
+       link->num_of_query == n_query &&
+       link->num_of_ids == n &&
+       memcmp(link->ids, ids, n * sizeof(unsigned long)) == 0){
+      *where = link->next;
+      link->next = model->pruned;
+      model->pruned = link;
+      free(ids);
+      return link->model;
+    }
+    count++;
+  }
+
+  /* 3. Compile a new one, unless nothing can be left out */
+  link = (struct nip_pruned_model*) calloc(1, sizeof(struct nip_pruned_model));
+  status = (int*) calloc(model->num_of_vars, sizeof(int));
+  if(!link || !status){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free(link);
+    free(status);
+    free(ids);
+    return NULL;
+  }
+  n_kept = mark_relevant_variables(model, status, query, nq,
+                                   evidence, ne, keep_likelihood);
+  if(n_kept < 0){
+    nip_report_error(__FILE__, __LINE__, -n_kept, 1);
+    free(link);
+    free(status);
+    free(ids);
+    return NULL;
+  }
+  link->model = model;
+  for(i = 0; i < model->num_of_vars; i++)
+    if(!((status[i] & PRUNE_KEPT) && (status[i] & PRUNE_FAMILY)))
+      break;
+  if(n_kept > 0 && i < model->num_of_vars){
+    link->model = new_pruned_model(model, status, n_kept);
+    if(!link->model){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+      free(link);
+      free(status);
+      free(ids);
+      return NULL;
+    }
+  }
+  free(status);
+
+  link->signature = h;
+  link->keep_likelihood = keep_likelihood;
+  link->num_of_query = n_query;
+  link->num_of_ids = n;
+  link->ids = ids;
+  link->next = model->pruned;
+  model->pruned = link;
+
+  /* 4. Forget the least recently used if the cache is full */
+  if(count >= PRUNED_MODEL_CACHE_SIZE){
+    for(where = &(model->pruned); (*where)->next; where = &((*where)->next))
+      ;
+    link = *where;
+    *where = NULL;
+    if(link->model != model)
+      free_model(link->model);
+    free(link->ids);
+    free(link);
+  }
+  return model->pruned->model;
+}
+
+
 /* JJ: this has some common elements with the forward_inference function */
 time_series generate_data(nip_model model, int length){
   int i, j, k, t;
@@ -2410,6 +4808,7 @@ time_series generate_data(nip_model model, int length){
   ts->num_of_observed = nvars;
   ts->observed = vars;
   ts->length = length;
+  ts->weight = 1;
   ts->data = NULL;
 
   ts->data = (int**) calloc(ts->length, sizeof(int*));
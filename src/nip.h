@@ -49,9 +49,12 @@
 
 /* TODO: consider separating these from NIP core, let users have their own */
 #define TIME_SERIES_LENGTH(ts) ( (ts)->length ) ///< gets time series length
+#define TIME_SERIES_WEIGHT(ts) ( (ts)->weight ) ///< gets sequence multiplicity
 #define UNCERTAIN_SERIES_LENGTH(ucs) ( (ucs)->length ) ///< gets ucs length
 
 #define NIP_FIELD_SEPARATOR ','         ///< data file field separator
+#define TIMESERIES_BATCH 1024           ///< time series read at once by utils
+#define NIP_OUTPUT_PRECISION 6          ///< decimals of written probabilities
 #define NIP_HAD_A_PREVIOUS_TIMESLICE 1  ///< true
 
 /* "How probable is the impossible" (0 < epsilon << 1) */
@@ -68,10 +71,14 @@ typedef enum nip_direction_type nip_direction; ///< hide enum notation
  * - DELTA: change in likelihood was small
  * - LIKELIHOOD: data seems probable enough given current model
  * - ITERATIONS: given number of iterations reached
+ * - INTERRUPTED: progress callback asked to stop (e.g. out of time)
  */
-enum nip_convergence_type {DELTA, LIKELIHOOD, ITERATIONS};
+enum nip_convergence_type {DELTA, LIKELIHOOD, ITERATIONS, INTERRUPTED};
 typedef enum nip_convergence_type nip_convergence;
 
+/** Return value of an EM progress callback for stopping em_learn() */
+#define EM_INTERRUPT -1
+
 /**
  * Data structure containing all necessary stuff for running
  * probabilistic inference with a model for a single time step,
@@ -83,6 +90,9 @@ typedef struct {
 
   int num_of_vars;         ///< number of random variables in the model
   nip_variable *variables; ///< the actual variables (names of values etc.)
+  int* symbol_table;       /**< Hash table (open addressing) of variable
+                              indices by symbol, or NULL */
+  int symbol_table_size;   ///< size of \p symbol_table, a power of two
 
   int num_of_nexts;        ///< Number of variables in 'next' and 'previous'
   nip_variable *next;      /**< The variables that will substitute
@@ -109,6 +119,9 @@ typedef struct {
   int node_size_x; ///< node width, for drawing the graph
   int node_size_y; ///< node height, for drawing the graph
 
+  struct nip_pruned_model* pruned; /**< Cache of smaller models for
+                                      queries, see prune_model() */
+
   // TODO: Any extra data parsed from the model file?
 } nip_model_struct;
 
@@ -127,6 +140,8 @@ typedef struct {
 			     (even if missing in each time step) */
   int length;           ///< Number of time steps
   int** data;           ///< The time series data
+  int weight;           /**< Multiplicity: number of identical sequences
+                           represented by this one (usually 1) */
   /* TODO: Should there be a cache for extremely large time series? */
 } time_series_struct;
 
@@ -147,6 +162,41 @@ typedef struct {
 typedef uncertain_series_struct* uncertain_series; ///< Reference to soft data
 
 
+/**
+ * Iterator for reading the time series of a data file one batch at a
+ * time, so that the whole data set need not fit in memory. It can be
+ * rewound for algorithms making several passes over the data.
+ */
+typedef struct {
+  nip_model model;       ///< The model (variables and state names)
+  char* filename;        ///< Name of the data file
+  int num_of_series;     ///< Number of time series in the file
+  int next;              ///< Index of the next time series to read
+  int batch_size;        ///< Maximum number of time series in a batch
+  int batch_count;       ///< Number of time series in the current batch
+  time_series* batch;    ///< The current batch, owned by the iterator
+  int collapse;          ///< Flag for collapsing identical series in a batch
+  int cached;            ///< Flag if all the series fit in the one batch
+
+  int n_columns;         ///< Number of columns in the file
+  nip_variable* columns; ///< The variable of each column, or NULL
+
+  nip_data_file file;    ///< Analysed text file, or NULL
+
+  FILE* binary;          ///< Binary file, or NULL
+  long data_position;    ///< Where the sequences start in the binary file
+  int value_size;        ///< Size of each value in the binary file
+  int* cardinalities;    ///< Number of states in each column of the file
+  int** states;          ///< File state index + 1 -> model state index
+  int* table;            ///< Length and weight of each binary sequence
+  unsigned char* values; ///< Space for a row of binary data
+
+  time_series* array;    ///< Time series already in memory, or NULL
+} timeseries_reader_struct;
+
+typedef timeseries_reader_struct* timeseries_reader; ///< Reference to data
+
+
 /**
  * Makes the model forget all the given evidence.
  *
@@ -184,6 +234,8 @@ void use_priors(nip_model model, int has_history);
 
 /**
  * Creates a model according to a net file.
+ * Compiled model files written by write_compiled_model() are detected
+ * and loaded without parsing.
  * Remember to free the model when done with it.
  * @param file the name of the net file as a string
  * @return null in case of any errors, or a pointer to the whole
@@ -201,6 +253,41 @@ nip_model parse_model(char* file);
 int write_model(nip_model model, char* filename);
 
 
+/**
+ * Sets the number of decimals in the probabilities written by
+ * write_model() and write_uncertainseries(). By default, this is
+ * NIP_OUTPUT_PRECISION or the environment variable NIP_PRECISION.
+ * @param decimals number of digits after the decimal point, or
+ * a negative value for the default
+ */
+void set_output_precision(int decimals);
+
+
+/**
+ * Writes \p model into a binary file that can be loaded without parsing
+ * or triangulation: the variables, the join tree (cliques and sepsets),
+ * and the parameters without any evidence. parse_model() detects such
+ * files, so they can be used in place of NET files.
+ * NOTE: numbers are written in the native byte order of the machine.
+ * @param model the model to write
+ * @param filename the name of output file
+ * @return NIP_NO_ERROR if successful
+ * @see read_compiled_model()
+ */
+int write_compiled_model(nip_model model, char* filename);
+
+
+/**
+ * Loads a model written by write_compiled_model(). The join tree is
+ * restored as it was, including the order of message passing.
+ * Remember to free the model when done with it.
+ * @param filename the name of the compiled model file
+ * @return null in case of any errors, or a pointer to the whole
+ * probabilistic model
+ */
+nip_model read_compiled_model(char* filename);
+
+
 /**
  * Gets rid of \p model and frees some memory.
  * @param model Your pointer to the whole probabilistic model
@@ -211,6 +298,8 @@ void free_model(nip_model model);
 /**
  * Reads data from the data file and constructs a set of time series
  * according to the given model. Remember to free results afterwards.
+ * Binary files written by write_timeseries_binary() are detected and
+ * read without parsing.
  * @param model The random variables and all
  * @param datafile Name of the input file as a string
  * @param results Pointer where the time_series is set, if N>0
@@ -221,10 +310,25 @@ int read_timeseries(nip_model model, char* datafile, time_series **results,
                     int (*ts_progress)(int, int));
 
 
+/**
+ * Collapses identical time series into one weighted sequence each.
+ * Sequences are identical if they have the same length, the same set
+ * of observed variables and the same data. The weight of the remaining
+ * sequence becomes the sum of the weights, and the duplicates are freed.
+ * The order of the first occurrences is preserved.
+ * @param ts_set Array of time series, compacted in place
+ * @param n_series Number of time series in \p ts_set
+ * @return Number of distinct time series left in \p ts_set,
+ * or a negative value in case of errors (\p ts_set left intact)
+ * @see em_learn() which takes the weights into account
+ */
+int collapse_timeseries(time_series *ts_set, int n_series);
+
+
 /**
  * Writes a set of time series data into a file. Essentially CSV with
  * blank rows as separators between each time series, and value "null"
- * for missing data.
+ * for missing data. A sequence with weight w is written w times.
  * TODO: quotes and escape sequences for odd characters.
  * @param ts_set Array of time_series'
  * @param n_series Number of time_series'
@@ -234,6 +338,38 @@ int read_timeseries(nip_model model, char* datafile, time_series **results,
 int write_timeseries(time_series *ts_set, int n_series, char* filename);
 
 
+/**
+ * Writes a set of time series data into a compact binary file, which
+ * can be read without parsing any text. The header contains the symbols
+ * of the observed variables, the names of their states, and the length
+ * and weight of each sequence. It is followed by the state indices of
+ * each time step, packed into the smallest integer type that fits them
+ * (-1 for missing data). Numbers are written in native byte order.
+ * @param ts_set Array of time series
+ * @param n_series Number of time series in \p ts_set
+ * @param filename Name of the output file
+ * @return NIP_NO_ERROR if successful
+ * @see read_timeseries_binary()
+ */
+int write_timeseries_binary(time_series *ts_set, int n_series, char* filename);
+
+
+/**
+ * Reads a set of time series from a binary file written by
+ * write_timeseries_binary(). Variables and states are matched with
+ * \p model by their names, like in read_timeseries().
+ * @param model The random variables and all
+ * @param filename Name of the input file
+ * @param results Pointer where the array of time series is set
+ * @param ts_progress Optional function for reporting progress, or null
+ * @return Number of time series read, or 0 in case of any issues
+ * @see read_timeseries() which also detects binary files
+ */
+int read_timeseries_binary(nip_model model, char* filename,
+                           time_series** results,
+                           int (*ts_progress)(int, int));
+
+
 /**
  * Method for freeing the huge chunk of memory used by a time series.
  * Note that this does not free the model that was passed as a
@@ -243,6 +379,60 @@ int write_timeseries(time_series *ts_set, int n_series, char* filename);
 void free_timeseries(time_series ts);
 
 
+/**
+ * Opens a data file for reading its time series one batch at a time,
+ * according to the given model. Binary files written by
+ * write_timeseries_binary() are detected and read without parsing.
+ * Only the current batch is kept in memory, except if all the time
+ * series fit in a single batch: then they are read only once.
+ * @param model The random variables and all
+ * @param filename Name of the input file
+ * @param batch_size Maximum number of time series in a batch,
+ * or 0 for all of them at once
+ * @param collapse Non-zero if identical time series in each batch should
+ * be collapsed into weighted ones, like collapse_timeseries() does
+ * @return a new iterator, or NULL in case of errors
+ * @see next_timeseries()
+ * @see close_timeseries() */
+timeseries_reader open_timeseries(nip_model model, char* filename,
+                                  int batch_size, int collapse);
+
+
+/**
+ * Makes an iterator over time series already in memory, e.g. for
+ * algorithms that accept iterators. The whole array is a single batch,
+ * and it is not freed by the iterator.
+ * @param ts_set Array of time series
+ * @param n_series Number of time series in \p ts_set
+ * @return a new iterator, or NULL in case of errors */
+timeseries_reader open_timeseries_array(time_series* ts_set, int n_series);
+
+
+/**
+ * Reads the next batch of time series. The previous batch is freed
+ * (unless all the data fits in one batch), so don't keep references
+ * to it.
+ * @param data An iterator from open_timeseries()
+ * @param batch Pointer where the array of time series is set: valid until
+ * the next call, rewind_timeseries() or close_timeseries()
+ * @return Number of time series in \p *batch, 0 at the end of data,
+ * or a negative value in case of errors */
+int next_timeseries(timeseries_reader data, time_series** batch);
+
+
+/**
+ * Starts reading the time series from the beginning again.
+ * @param data An iterator from open_timeseries()
+ * @return NIP_NO_ERROR if successful */
+int rewind_timeseries(timeseries_reader data);
+
+
+/**
+ * Closes the data file and frees the iterator and the current batch.
+ * @param data An iterator from open_timeseries() */
+void close_timeseries(timeseries_reader data);
+
+
 /**
  * Tells the length of a time series.
  * (Yes, we are dealing with batch processing.)
@@ -265,6 +455,20 @@ int write_uncertainseries(uncertain_series *ucs_set, int n_series,
                           nip_variable v, char* filename);
 
 
+/**
+ * Appends inferred probabilities of a given variable to a file written
+ * by write_uncertainseries(), e.g. for each batch of time series.
+ * @param ucs_set Array of inference results (one series each)
+ * @param n_series Number of time series in \p ucs_set
+ * @param v Variable of interest
+ * @param filename Name of the output file
+ * @return NIP_NO_ERROR if successful
+ * @see next_timeseries()
+ */
+int append_uncertainseries(uncertain_series *ucs_set, int n_series,
+                           nip_variable v, char* filename);
+
+
 /**
  * The method for freeing the memory used by inference results.
  * @param ucs Inference result (one series) to be freed
@@ -347,7 +551,8 @@ int insert_soft_evidence(nip_model model, char* varname, double* distribution);
  * Method for inserting part of the evidence at a specified step \p t in a
  * time series \p ts into the (time slice) \p model.
  *
- * NOTE: \p model may be different from the one used for reading the data.
+ * NOTE: \p model may be different from the one used for reading the data,
+ * e.g. a model from prune_model() which may lack some of the variables.
  *
  * Only the variables marked with \p mark_mask will be considered:
  * - mark_mask == MARK_BOTH : all suitable evidence of the time step is used
@@ -474,6 +679,10 @@ time_series mlss(nip_variable vars[], int nvars, time_series ts);
  * NOTE: Only evidence for the marked variables is used. Unmarked are
  * ignored and you can thus easily omit evidence for an entire variable.
  *
+ * NOTE: Expected counts and log. likelihood of each time series are
+ * multiplied by its weight, i.e. a sequence with weight w counts as
+ * w identical sequences.
+ *
  * @param model Model structure and possible initial parameters
  * @param ts The input data for training: an array of time series'
  * @param n_ts Number of time series' in \p ts
@@ -483,7 +692,9 @@ time_series mlss(nip_variable vars[], int nvars, time_series ts);
  * @param learning_curve Possible list of log. likelihood numbers, or null
  * @param stopping_criterion Reason why iterations ended, or null
  * @param em_progress Possible pointer to a function which
- * accumulates learning_curve, or null if not required
+ * accumulates learning_curve, or null if not required. It is called
+ * after each iteration, when the model contains the current parameters,
+ * and it may return EM_INTERRUPT for stopping early without errors.
  * @param ts_progress Optional time series progress callback, or null
  * @return An error code in case of any errors
  */
@@ -493,6 +704,103 @@ int em_learn(nip_model model, time_series* ts, int n_ts, int have_random_init,
              int (*em_progress)(nip_double_list, double), int (*ts_progress)(int, int));
 
 
+/**
+ * Trains the given model with EM like em_learn(), but reads the time
+ * series one batch at a time during each iteration, so that the data
+ * set need not fit in memory.
+ * @param model Model structure and possible initial parameters
+ * @param data The input data for training, from open_timeseries()
+ * @param have_random_init 0 if starting with model parameters, 1 if random
+ * @param max_iterations Maximum number of iterations
+ * @param threshold Minimum required improvement in log. likelihood / slice
+ * @param learning_curve Possible list of log. likelihood numbers, or null
+ * @param stopping_criterion Reason why iterations ended, or null
+ * @param em_progress Possible progress callback, see em_learn()
+ * @param ts_progress Optional time series progress callback, or null
+ * @return An error code in case of any errors
+ * @see em_learn() */
+int em_learn_stream(nip_model model, timeseries_reader data,
+                    int have_random_init, long max_iterations,
+                    double threshold, nip_double_list learning_curve,
+                    nip_convergence* stopping_criterion,
+                    int (*em_progress)(nip_double_list, double),
+                    int (*ts_progress)(int, int));
+
+
+/**
+ * Allocates potentials for accumulating expected counts, i.e. the
+ * sufficient statistics of the model parameters in EM: one potential
+ * for each variable in the order of \p model->variables, with the child
+ * as the first dimension followed by its parents.
+ * @param model The model whose parameters are considered
+ * @param pseudo_count Initial value of every count (e.g. 1.0 or 0.0)
+ * @return Array of \p model->num_of_vars potentials, or NULL
+ * @see free_expected_counts() */
+nip_potential* new_expected_counts(nip_model model, double pseudo_count);
+
+
+/**
+ * Frees the expected counts allocated with new_expected_counts().
+ * @param model The model whose parameters were considered
+ * @param counts The potentials to free */
+void free_expected_counts(nip_model model, nip_potential* counts);
+
+
+/**
+ * Runs the E-step of EM for a single time series with the current
+ * parameters of its model: the expected counts are added into
+ * \p counts. Both the counts and the log. likelihood are multiplied
+ * by the weight of \p ts. Only evidence of marked variables is used.
+ * @param ts The data
+ * @param counts Expected counts from new_expected_counts()
+ * @param loglikelihood Pointer where the (weighted) log. likelihood
+ * of \p ts is written
+ * @return NIP_NO_ERROR, NIP_ERROR_BAD_LUCK if the data is impossible
+ * given the parameters, or some other error code */
+int accumulate_expected_counts(time_series ts, nip_potential* counts,
+                               double* loglikelihood);
+
+
+/**
+ * Runs the M-step of EM: sets the parameters of \p model according to
+ * the expected counts. This resets the model and normalises \p counts
+ * in place, so make a copy of them first if you still need the counts.
+ * @param model The model to modify
+ * @param counts Expected counts from new_expected_counts()
+ * @return NIP_NO_ERROR if successful */
+int set_expected_counts(nip_model model, nip_potential* counts);
+
+
+/**
+ * Writes expected counts into a binary file, e.g. for combining the
+ * E-steps of separate processes. The file contains the symbols and
+ * cardinalities of the variables for checking, the counts, the
+ * log. likelihood and the number of time steps they were computed from.
+ * NOTE: numbers are written in the native byte order of the machine.
+ * @param model The model whose parameters are considered
+ * @param counts Expected counts from new_expected_counts()
+ * @param loglikelihood Total log. likelihood of the data
+ * @param ts_steps Total number of time steps in the data
+ * @param filename Name of the output file
+ * @return NIP_NO_ERROR if successful
+ * @see read_expected_counts() */
+int write_expected_counts(nip_model model, nip_potential* counts,
+                          double loglikelihood, long ts_steps, char* filename);
+
+
+/**
+ * Reads expected counts written by write_expected_counts().
+ * The variables in the file must match those of \p model.
+ * @param model The model whose parameters are considered
+ * @param filename Name of the input file
+ * @param loglikelihood Pointer where the log. likelihood is written
+ * @param ts_steps Pointer where the number of time steps is written
+ * @return New expected counts (free with free_expected_counts()), or NULL
+ * @see write_expected_counts() */
+nip_potential* read_expected_counts(nip_model model, char* filename,
+                                    double* loglikelihood, long* ts_steps);
+
+
 /**
  * Tells the likelihood of observations (not normalised).
  * You must normalise the result with the mass computed before
@@ -506,6 +814,7 @@ double model_prob_mass(nip_model model);
 /**
  * Calculates the marginal probability distribution of a variable.
  * The join tree MUST be consistent before calling this.
+ * If \p model is from prune_model(), \p v may be of the full model.
  * @param model NIP model that contains the variable
  * @param v Random variable of interest
  * @return an array of doubles (remember to free the result when not needed).
@@ -519,6 +828,7 @@ double* get_probability(nip_model model, nip_variable v);
 /**
  * Calculates the joint probability distribution of a set of variables.
  * The join tree MUST be consistent before calling this.
+ * If \p model is from prune_model(), \p vars may be of the full model.
  * @param model The model that contains the variables
  * @param vars  The variables whose distribution we want
  * @param num_of_vars The number of variables (size of "vars")
@@ -531,6 +841,42 @@ nip_potential get_joint_probability(nip_model model, nip_variable *vars,
                                     int num_of_vars);
 
 
+/**
+ * Finds or compiles a smaller model for computing the distribution of
+ * the \p query variables given hard evidence on the \p evidence
+ * variables. Unobserved variables without any queried or observed
+ * descendants (barren nodes) are left out. Unless \p keep_likelihood
+ * is set, so are the variables d-separated from the query by the
+ * evidence, and the distributions of the observed variables which do
+ * not depend on the rest: the conditional distribution of the query
+ * stays the same, but the probability mass of the evidence does not.
+ *
+ * The pruned models are cached in \p model by the sets of query and
+ * evidence variables, and \p model owns them: do not free the result.
+ * The result is valid only until the next call of prune_model() with
+ * \p model (which may evict it from the cache), total_reset(),
+ * set_expected_counts(), em_learn(), em_learn_stream() or
+ * free_model() on \p model.
+ * Use reset_model(), use_priors(), insert_ts_step() and
+ * make_consistent() on the result like on any model: they (and
+ * get_probability() etc.) accept the variables of \p model and ignore
+ * evidence on the variables left out. Models with time slices are not
+ * pruned, and neither is any model if the environment variable
+ * NIP_PRUNING is 0: \p model itself is returned then.
+ * @param model The full model
+ * @param query Variables of interest (soft evidence allowed)
+ * @param nq Number of variables in \p query
+ * @param evidence Variables that will be observed
+ * @param ne Number of variables in \p evidence
+ * @param keep_likelihood Non-zero if model_prob_mass() must stay the
+ * same as in \p model, i.e. only barren nodes may be left out
+ * @return A pruned model, \p model itself, or NULL in case of errors
+ * @see get_joint_probability()
+ */
+nip_model prune_model(nip_model model, nip_variable* query, int nq,
+                      nip_variable* evidence, int ne, int keep_likelihood);
+
+
 /**
  * Samples time series data according to a model.
  *
@@ -0,0 +1,163 @@
+/**
+ * @file 
+ * @brief Fixed size sets of small non-negative integers as bit arrays, 
+ * for fast set algebra on e.g. the variables of cliques.
+ *
+ * @author NIP contributors
+ * @copyright &copy; 2026 NIP contributors <br>
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. <br>
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nipbitset.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "niperrorhandler.h"
+
+/* Number of bits set in a word */
+static int nip_count_bits(unsigned long w);
+
+
+nip_bitset nip_new_bitset(int n) {
+  int size;
+  nip_bitset b;
+
+  if (n < 0) {
+    nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+    return NULL;
+  }
+  size = NIP_BITSET_WORDS(n);
+  b = (nip_bitset) calloc(1, sizeof(nip_bitset_struct) + 
+			  size * sizeof(unsigned long));
+  if (!b) {
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+  b->size = size;
+  return b;
+}
+
+
+nip_bitset nip_copy_bitset(nip_bitset b) {
+  nip_bitset copy;
+
+  if (!b)
+    return NULL;
+  copy = nip_new_bitset(b->size * NIP_BITSET_WORD_BITS);
+  if (!copy)
+    return NULL;
+  memcpy(copy->words, b->words, b->size * sizeof(unsigned long));
+  return copy;
+}
+
+
+void nip_free_bitset(nip_bitset b) {
+  free(b);
+}
+
+
+int nip_bitset_add(nip_bitset b, int i) {
+  if (!b || i < 0 || i / NIP_BITSET_WORD_BITS >= b->size)
+    return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+  b->words[i / NIP_BITSET_WORD_BITS] |= 1UL << (i % NIP_BITSET_WORD_BITS);
+  return 0;
+}
+
+
+void nip_bitset_remove(nip_bitset b, int i) {
+  if (b && i >= 0 && i / NIP_BITSET_WORD_BITS < b->size)
+    b->words[i / NIP_BITSET_WORD_BITS] &= ~(1UL << (i % NIP_BITSET_WORD_BITS));
+}
+
+
+int nip_bitset_count(nip_bitset b) {
+  int k, n = 0;
+  if (!b)
+    return 0;
+  for (k = 0; k < b->size; k++)
+    n += nip_count_bits(b->words[k]);
+  return n;
+}
+
+
+int nip_bitset_is_subset(nip_bitset a, nip_bitset b) {
+  int k;
+  if (!a)
+    return 1;
+  for (k = 0; k < a->size; k++) {
+    if (!a->words[k])
+      continue;
+    if (!b || k >= b->size || (a->words[k] & ~(b->words[k])))
+      return 0;
+  }
+  return 1;
+}
+
+
+int nip_bitset_intersection_size(nip_bitset a, nip_bitset b) {
+  int k, n = 0;
+  if (!a || !b)
+    return 0;
+  for (k = 0; k < a->size && k < b->size; k++)
+    n += nip_count_bits(a->words[k] & b->words[k]);
+  return n;
+}
+
+
+nip_bitset nip_bitset_intersection(nip_bitset a, nip_bitset b) {
+  int k, size;
+  nip_bitset c;
+
+  size = (a && b) ? ((a->size < b->size) ? a->size : b->size) : 0;
+  c = nip_new_bitset(size * NIP_BITSET_WORD_BITS);
+  if (!c)
+    return NULL;
+  for (k = 0; k < size; k++)
+    c->words[k] = a->words[k] & b->words[k];
+  return c;
+}
+
+
+int nip_bitset_next(nip_bitset b, int i) {
+  int k;
+  unsigned long w;
+
+  if (!b || i < 0)
+    return -1;
+  k = i / NIP_BITSET_WORD_BITS;
+  if (k >= b->size)
+    return -1;
+  w = b->words[k] >> (i % NIP_BITSET_WORD_BITS);
+  while (!w) {
+    /* skip the empty words */
+    if (++k >= b->size)
+      return -1;
+    w = b->words[k];
+    i = k * NIP_BITSET_WORD_BITS;
+  }
+  while (!(w & 1UL)) {
+    w >>= 1;
+    i++;
+  }
+  return i;
+}
+
+
+static int nip_count_bits(unsigned long w) {
+  int n = 0;
+  while (w) {
+    w &= w - 1; /* clears the lowest bit */
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,112 @@
+/**
+ * @file 
+ * @brief Fixed size sets of small non-negative integers as bit arrays, 
+ * for fast set algebra on e.g. the variables of cliques.
+ *
+ * @author NIP contributors
+ * @copyright &copy; 2026 NIP contributors <br>
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. <br>
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NIPBITSET_H__
+#define __NIPBITSET_H__
+
+/** Number of bits in each word of a bitset */
+#define NIP_BITSET_WORD_BITS (8 * (int)sizeof(unsigned long))
+
+/** Number of words needed for the integers 0...n-1 */
+#define NIP_BITSET_WORDS(n) ( ((n) + NIP_BITSET_WORD_BITS - 1) / \
+			      NIP_BITSET_WORD_BITS )
+
+/** Tells if integer \p i (>= 0) is in bitset \p b */
+#define NIP_BITSET_CONTAINS(b, i) \
+  ( (i) / NIP_BITSET_WORD_BITS < (b)->size && \
+    ((b)->words[(i) / NIP_BITSET_WORD_BITS] >> \
+     ((i) % NIP_BITSET_WORD_BITS) & 1UL) )
+
+/**
+ * Structure for a set of integers, one bit for each. 
+ * Sets of different sizes can be combined: the missing words are 
+ * considered empty. */
+typedef struct {
+  int size;              ///< Number of words
+  unsigned long words[]; ///< Bit (i % word size) of word (i / word size)
+} nip_bitset_struct;
+typedef nip_bitset_struct* nip_bitset; ///< reference to a bitset
+
+/**
+ * Creates an empty set with room for the integers 0...n-1
+ * @param n Upper limit for the integers (exclusive)
+ * @return reference to a new bitset, or NULL if out of memory
+ * @see nip_free_bitset() */
+nip_bitset nip_new_bitset(int n);
+
+/**
+ * Creates a copy of a bitset
+ * @param b The set to copy
+ * @return reference to a new bitset, or NULL if out of memory */
+nip_bitset nip_copy_bitset(nip_bitset b);
+
+/**
+ * Frees the memory used by a bitset
+ * @param b The set to free */
+void nip_free_bitset(nip_bitset b);
+
+/**
+ * Adds an integer to a set
+ * @param b The set to modify
+ * @param i An integer below the limit given to nip_new_bitset()
+ * @return an error code, or 0 if successful */
+int nip_bitset_add(nip_bitset b, int i);
+
+/**
+ * Removes an integer from a set, if it was there
+ * @param b The set to modify
+ * @param i The integer to remove */
+void nip_bitset_remove(nip_bitset b, int i);
+
+/**
+ * Counts the integers in a set
+ * @param b The set
+ * @return size of the set */
+int nip_bitset_count(nip_bitset b);
+
+/**
+ * Tells if set \p a is a subset of set \p b
+ * @param a A set
+ * @param b Another set
+ * @return 1 if every integer in \p a is in \p b, 0 otherwise */
+int nip_bitset_is_subset(nip_bitset a, nip_bitset b);
+
+/**
+ * Counts the integers in both sets (size of the intersection)
+ * @param a A set
+ * @param b Another set
+ * @return size of the intersection */
+int nip_bitset_intersection_size(nip_bitset a, nip_bitset b);
+
+/**
+ * Creates the intersection of two sets
+ * @param a A set
+ * @param b Another set
+ * @return reference to a new bitset, or NULL if out of memory */
+nip_bitset nip_bitset_intersection(nip_bitset a, nip_bitset b);
+
+/**
+ * Finds the smallest integer in a set, not smaller than \p i. 
+ * Useful for going through the set in ascending order.
+ * @param b The set
+ * @param i Where to start looking
+ * @return The next integer in the set, or -1 if there are none */
+int nip_bitset_next(nip_bitset b, int i);
+
+#endif /* __NIPBITSET_H__ */
@@ -23,46 +23,76 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
 #include <assert.h>
 
 #include "niperrorhandler.h"
 #include "niplists.h"
 #include "nipheap.h"
+#include "nipbitset.h"
 
 /*#define NIP_DEBUG_GRAPH*/
 
 /* Internal helper functions */
 static int nip_build_graph_index(nip_graph g);
 
-static nip_clique* nip_cluster_list_to_clique_array(nip_int_array_list clusters,
-						    nip_variable* vars, int n);
+/* Tells if there is a link from node i to node j */
+static int nip_graph_has_link(nip_graph g, int i, int j);
 
-/* Function for computing primary keys for cluster heap */
-static int nip_cluster_primary_cost(void* variables, int n);
+/* Adds a link from node i to node j, unless there is one already */
+static int nip_graph_add_link(nip_graph g, int i, int j);
 
-/* Function for computing secondary keys for cluster heap */
-static int nip_cluster_secondary_cost(void* variables, int n);
+/* Creates the cliques from sets of graph node indices */
+static nip_clique* nip_cluster_list_to_clique_array(nip_bitset* clusters,
+						    int ncliques,
+						    nip_variable* vars);
 
-/* Function for computing primary keys for sepset heap */
-static int nip_sepset_primary_cost(void* sepset, int n);
+/* Removes the link from node i to node j, if there is one */
+static void nip_graph_remove_link(nip_graph g, int i, int j);
 
-/* Function for computing secondary keys for sepset heap */
-static int nip_sepset_secondary_cost(void* sepset, int n);
+/* Adds the fill-in links between the neighbours of node v and 
+ * removes the links to v (but not the links from v) */
+static int nip_eliminate_node(nip_graph g, int v);
 
-/* Creates a heap of nip_variable arrays (possible cliques) from 
- * an undirected and moralized graph gm */
-static nip_heap nip_build_cluster_heap(nip_graph gm);
+/* Computes the heap keys for eliminating node v next */
+static void nip_elimination_cost(nip_graph g, int v, 
+				 nip_elimination_heuristic heuristic,
+				 unsigned long long* random_state,
+				 int* keys);
 
-/* Callback function for searching certain heap items */
-static int nip_family_cluster(void* i, int isize, void* r, int rsize);
+/* Functions for reading the keys for the elimination heap */
+static int nip_elimination_primary_key(void* keys, int n);
+static int nip_elimination_secondary_key(void* keys, int n);
 
-/* Updates remaining candidate clusters after removing one... */
-static int nip_update_cluster_heap(nip_heap h, 
-				   nip_variable* cluster, 
-				   int csize);
+/* A candidate sepset between cliques first and second */
+typedef struct {
+  int mass;    /* number of shared variables */
+  double cost; /* sum of the state spaces of the two cliques */
+  int first;
+  int second;
+} nip_sepset_candidate;
 
-/* Creates a heap of possible sepsets from a set of cliques */
-static nip_heap nip_build_sepset_heap(nip_clique* cliques, int num_of_cliques);
+/* A variable of a clique, for finding the cliques sharing variables */
+typedef struct {
+  unsigned long id;
+  int clique;
+} nip_clique_member;
+
+/* Finds the tree containing clique i (union-find) */
+static int nip_find_tree(int* root, int i);
+
+/* Lists the pairs of cliques sharing variables as candidate sepsets,
+ * sorted from the most promising, and returns the number of them */
+static int nip_find_sepset_candidates(nip_clique* cliques, 
+				      int num_of_cliques, 
+				      double* space,
+				      nip_sepset_candidate** candidates_p);
+
+/* Comparison functions for qsort */
+static int nip_compare_clique_members(const void* a, const void* b);
+static int nip_compare_sepset_candidates(const void* a, const void* b);
 
 
 /*** GRAPH MANAGEMENT ***/
@@ -77,18 +107,18 @@ nip_graph nip_new_graph(unsigned n) {
   newgraph->size = n; 
   newgraph->top = 0;
   
-  newgraph->adj_matrix = (int*) calloc(n*n, sizeof(int));
-  if(!(newgraph->adj_matrix)) {
-    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-    free(newgraph);
-    return NULL;
-  }
-  memset(newgraph->adj_matrix, 0, n*n*sizeof(int)); /* calloc does this? */
-  
-  newgraph->variables = (nip_variable*) calloc(n, sizeof(nip_variable));
-  if(!(newgraph->variables)){
+  /* the adjacency lists are allocated when links are added */
+  newgraph->adj_lists = (int**) calloc(n + 1, sizeof(int*));
+  newgraph->degrees = (int*) calloc(n + 1, sizeof(int));
+  newgraph->adj_sizes = (int*) calloc(n + 1, sizeof(int));
+  newgraph->variables = (nip_variable*) calloc(n + 1, sizeof(nip_variable));
+  if(!(newgraph->adj_lists && newgraph->degrees && 
+       newgraph->adj_sizes && newgraph->variables)) {
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-    free(newgraph->adj_matrix);
+    free(newgraph->adj_lists);
+    free(newgraph->degrees);
+    free(newgraph->adj_sizes);
+    free(newgraph->variables);
     free(newgraph);
     return NULL;
   }
@@ -100,7 +130,7 @@ nip_graph nip_new_graph(unsigned n) {
 }
 
 nip_graph nip_copy_graph(nip_graph g) {
-  int n;
+  int i, n;
   nip_graph g_copy;
   
   n = g->size;
@@ -110,7 +140,19 @@ nip_graph nip_copy_graph(nip_graph g) {
     return NULL;
   }
   
-  memcpy(g_copy->adj_matrix, g->adj_matrix, n*n*sizeof(int));
+  for(i = 0; i < n; i++) {
+    if(g->degrees[i] == 0)
+      continue;
+    g_copy->adj_lists[i] = (int*) calloc(g->degrees[i], sizeof(int));
+    if(!g_copy->adj_lists[i]) {
+      nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+      nip_free_graph(g_copy);
+      return NULL;
+    }
+    memcpy(g_copy->adj_lists[i], g->adj_lists[i], g->degrees[i]*sizeof(int));
+    g_copy->degrees[i] = g->degrees[i];
+    g_copy->adj_sizes[i] = g->degrees[i];
+  }
   memcpy(g_copy->variables, g->variables, n*sizeof(nip_variable));
   g_copy->max_id = g->max_id;
   g_copy->min_id = g->min_id;
@@ -122,9 +164,14 @@ nip_graph nip_copy_graph(nip_graph g) {
 }
 
 void nip_free_graph(nip_graph g) { 
+  unsigned i;
   if(g == NULL)
     return;
-  free(g->adj_matrix);
+  for(i = 0; i < g->size; i++)
+    free(g->adj_lists[i]);
+  free(g->adj_lists);
+  free(g->degrees);
+  free(g->adj_sizes);
   free(g->variables); // NOTE: variables owned by the user elsewhere
   free(g->var_ind);
   free(g);
@@ -191,14 +238,10 @@ int nip_graph_cluster(nip_graph g, nip_variable v, nip_variable** neighbours) {
     return -1; /* invalid input */
   }
   
-  /* Count number of neighbours */
-  j = 0;
-  for (i = 0; i < n; i++)
-    if (NIP_ADJM(g, vi, i)) /* NOTE: assumes ADJM(g, i, i) == 0 !!! */
-      j++;
-
-  /* Allocate array */
-  cluster = (nip_variable*) calloc(j+1, sizeof(nip_variable));
+  /* Allocate array for the neighbours
+   * NOTE: assumes there is no link from vi to itself !!! */
+  cluster = (nip_variable*) calloc(NIP_GRAPH_DEGREE(g, vi) + 1, 
+				   sizeof(nip_variable));
   if (cluster == NULL){
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
     return -1;
@@ -207,9 +250,8 @@ int nip_graph_cluster(nip_graph g, nip_variable v, nip_variable** neighbours) {
   /* Populate the array */
   cluster[0] = v;
   j = 1;
-  for (i = 0; i < n; i++)
-    if (NIP_ADJM(g, vi, i))
-      cluster[j++] = g->variables[i];
+  for (i = 0; i < NIP_GRAPH_DEGREE(g, vi); i++)
+    cluster[j++] = g->variables[NIP_GRAPH_NEIGHBOUR(g, vi, i)];
   
   *neighbours = cluster;
   return j; /* # of neighbours + 1 */
@@ -222,7 +264,7 @@ int nip_graph_linked(nip_graph g, nip_variable parent, nip_variable child) {
   j = nip_graph_index(g, child);
   if(i<0 || j<0)
     return 0;
-  return NIP_ADJM(g, i, j);
+  return nip_graph_has_link(g, i, j);
 }
 
 /*** SETTERS ***/
@@ -264,9 +306,7 @@ int nip_graph_add_child(nip_graph g, nip_variable parent, nip_variable child){
   if (parent_i < 0 || child_i < 0)
     return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
   
-  NIP_ADJM(g, parent_i, child_i) = 1;
-  
-  return 0;
+  return nip_graph_add_link(g, parent_i, child_i);
 }
 
 /*** OPERATIONS (methods) ***/
@@ -297,9 +337,66 @@ static int nip_build_graph_index(nip_graph g) {
 }
 
 
+static int nip_graph_has_link(nip_graph g, int i, int j) {
+  int low, high, k;
+  int* list = g->adj_lists[i];
+  
+  /* binary search in the sorted list */
+  low = 0;
+  high = g->degrees[i] - 1;
+  while (low <= high) {
+    k = (low + high) / 2;
+    if (list[k] == j)
+      return 1;
+    if (list[k] < j)
+      low = k + 1;
+    else
+      high = k - 1;
+  }
+  return 0;
+}
+
+
+static int nip_graph_add_link(nip_graph g, int i, int j) {
+  int k, size;
+  int* list = g->adj_lists[i];
+  
+  /* find the place in the sorted list */
+  for (k = g->degrees[i]; k > 0 && list[k-1] > j; k--);
+  if (k > 0 && list[k-1] == j)
+    return 0; /* linked already */
+  
+  if (g->degrees[i] == g->adj_sizes[i]) {
+    /* time to expand */
+    size = (g->adj_sizes[i] > 0) ? 2 * g->adj_sizes[i] : 4;
+    list = (int*) realloc(list, size * sizeof(int));
+    if (!list)
+      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    g->adj_lists[i] = list;
+    g->adj_sizes[i] = size;
+  }
+  memmove(&(list[k+1]), &(list[k]), (g->degrees[i] - k) * sizeof(int));
+  list[k] = j;
+  g->degrees[i]++;
+  return 0;
+}
+
+
+static void nip_graph_remove_link(nip_graph g, int i, int j) {
+  int k;
+  int* list = g->adj_lists[i];
+  
+  for (k = 0; k < g->degrees[i] && list[k] < j; k++);
+  if (k == g->degrees[i] || list[k] != j)
+    return; /* not linked */
+  memmove(&(list[k]), &(list[k+1]), (g->degrees[i] - k - 1) * sizeof(int));
+  g->degrees[i]--;
+}
+
+
 nip_graph nip_make_graph_undirected(nip_graph g) {
   nip_graph gu;   
-  int i,j,n;
+  int i,k,n;
   
   if (g == NULL || g->variables == NULL) {
     nip_report_error(__FILE__, __LINE__, EFAULT, 1);
@@ -313,18 +410,21 @@ nip_graph nip_make_graph_undirected(nip_graph g) {
     return NULL;
   }
   
-  /* Create the undirected graph */
+  /* Create the undirected graph: a link back for each link */
   for (i = 0; i < n; i++)
-    for (j = 0; j < n; j++)
-      NIP_ADJM(gu, i, j) = NIP_ADJM(g, i, j) || NIP_ADJM(g, j, i);
+    for (k = 0; k < NIP_GRAPH_DEGREE(g, i); k++)
+      if (nip_graph_add_link(gu, NIP_GRAPH_NEIGHBOUR(g, i, k), i) != 0) {
+	nip_free_graph(gu);
+	return NULL;
+      }
   
   return gu;
 }
 
 
 nip_graph nip_moralise_graph(nip_graph g) {
-  int i,j,n,v;
-  nip_graph gm;
+  int i,j,k,n,v,e;
+  nip_graph gm, gp;
   
   if (g == NULL || g->variables == NULL) {
     nip_report_error(__FILE__, __LINE__, EFAULT, 1);
@@ -333,27 +433,46 @@ nip_graph nip_moralise_graph(nip_graph g) {
   
   n = g->size;
   gm = nip_copy_graph(g);
-  if (gm == NULL) {
+  gp = nip_new_graph(n); /* links from each variable to its parents */
+  if (gm == NULL || gp == NULL) {
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    nip_free_graph(gm);
+    nip_free_graph(gp);
     return NULL;
   }
   
+  /* Find the parents by reversing the links */
+  e = 0;
+  for (i = 0; i < n && e == 0; i++)
+    for (k = 0; k < NIP_GRAPH_DEGREE(g, i) && e == 0; k++)
+      e = nip_graph_add_link(gp, NIP_GRAPH_NEIGHBOUR(g, i, k), i);
+  
   /* Moralisation */
-  for (v = 0; v < n; v++)       /* Iterate variables */
-    for (i = 0; i < n; i++) 
-      if (NIP_ADJM(g, i, v))        /* If i parent of v, find those */
-	for (j = i+1; j < n; j++) { /* parents of v which are > i */
-	  NIP_ADJM(gm, i, j) |= NIP_ADJM(g, j, v);
-	  NIP_ADJM(gm, j, i) |= NIP_ADJM(g, j, v);
-	}
+  for (v = 0; v < n && e == 0; v++)     /* Iterate variables */
+    for (i = 0; i < NIP_GRAPH_DEGREE(gp, v); i++) /* Parents of v... */
+      for (j = i+1; j < NIP_GRAPH_DEGREE(gp, v) && e == 0; j++) {
+	/* ...get married */
+	e = nip_graph_add_link(gm, NIP_GRAPH_NEIGHBOUR(gp, v, i),
+			       NIP_GRAPH_NEIGHBOUR(gp, v, j));
+	if (e == 0)
+	  e = nip_graph_add_link(gm, NIP_GRAPH_NEIGHBOUR(gp, v, j),
+				 NIP_GRAPH_NEIGHBOUR(gp, v, i));
+      }
   
+  nip_free_graph(gp);
+  if (e != 0) {
+    nip_free_graph(gm);
+    return NULL;
+  }
   return gm;
 }
 
 /* Additional interface edges. By Janne Toivola */
 nip_graph nip_add_interface_edges(nip_graph g){
-  int i,j,n;
-  nip_variable v1, v2;
+  int i,j,k,n,e;
+  int n_if[2] = {0, 0};
+  int* interface[2];
+  nip_variable v;
   nip_graph gi;
   
   if (g == NULL || g->variables == NULL) {
@@ -363,158 +482,416 @@ nip_graph nip_add_interface_edges(nip_graph g){
   
   n = g->size;
   gi = nip_copy_graph(g);
-  if (gi == NULL) {
+  interface[0] = (int*) calloc(n + 1, sizeof(int));
+  interface[1] = (int*) calloc(n + 1, sizeof(int));
+  if (gi == NULL || interface[0] == NULL || interface[1] == NULL) {
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    nip_free_graph(gi);
+    free(interface[0]);
+    free(interface[1]);
     return NULL;
   }
   
-  /* compare variable by variable */
-  for (i = 0; i < n; i++)       /* Iterate variables */
-    for (j = i+1; j < n; j++) {
-      v1 = g->variables[i];
-      v2 = g->variables[j];
-      /* join interface variables */
-      if (((NIP_IF(v1) & NIP_INTERFACE_OLD_OUTGOING) && 
-	   (NIP_IF(v2) & NIP_INTERFACE_OLD_OUTGOING)) ||
-	  ((NIP_IF(v1) & NIP_INTERFACE_OUTGOING) && 
-	   (NIP_IF(v2) & NIP_INTERFACE_OUTGOING))) {
-	NIP_ADJM(gi, i, j) = 1;
-	NIP_ADJM(gi, j, i) = 1;
+  /* find the old and the new outgoing interface variables */
+  for (i = 0; i < n; i++) {
+    v = g->variables[i];
+    if (NIP_IF(v) & NIP_INTERFACE_OLD_OUTGOING)
+      interface[0][n_if[0]++] = i;
+    if (NIP_IF(v) & NIP_INTERFACE_OUTGOING)
+      interface[1][n_if[1]++] = i;
+  }
+  
+  /* join interface variables */
+  e = 0;
+  for (k = 0; k < 2; k++)
+    for (i = 0; i < n_if[k]; i++)
+      for (j = i+1; j < n_if[k] && e == 0; j++) {
+	e = nip_graph_add_link(gi, interface[k][i], interface[k][j]);
+	if (e == 0)
+	  e = nip_graph_add_link(gi, interface[k][j], interface[k][i]);
       }
-    }
+  
+  free(interface[0]);
+  free(interface[1]);
+  if (e != 0) {
+    nip_free_graph(gi);
+    return NULL;
+  }
   return gi;
 }
 
 
-static nip_clique* nip_cluster_list_to_clique_array(nip_int_array_list clusters,
-						    nip_variable* vars, int n) {
-  int n_vars, i;
-  int ncliques, clique_counter;
-  nip_int_array_link lnk;
+static nip_clique* nip_cluster_list_to_clique_array(nip_bitset* clusters,
+						    int ncliques,
+						    nip_variable* vars) {
+  int n_vars, i, j;
   nip_clique* cliques;
   nip_variable* clique_vars;
   
-  ncliques = NIP_LIST_LENGTH(clusters);
-  
-  cliques = (nip_clique*) calloc(ncliques, sizeof(nip_clique));
+  cliques = (nip_clique*) calloc(ncliques + 1, sizeof(nip_clique));
   if (!cliques) {
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
     return NULL;
   }
   
-  clique_vars = (nip_variable*) calloc(n, sizeof(nip_variable));
-  if (!clique_vars) {
-    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-    free(cliques);
-    return NULL;
-  }
-  
-  clique_counter = ncliques;
-  for (lnk = NIP_LIST_ITERATOR(clusters); 
-       lnk != NULL; 
-       lnk = NIP_LIST_NEXT(lnk)) {
-    
+  for (i = 0; i < ncliques; i++) {
     /* Fill the array of clique variables */
-    n_vars = 0;
-    for (i = 0; i < n; i++)
-      if (lnk->data[i])
-	clique_vars[n_vars++] = vars[i];
-    
-    /* Create a new clique */
-    cliques[--clique_counter] = nip_new_clique(clique_vars, n_vars);
-    /* This ^^^^^^^^^^^^^^^^ is sort of dangerous. */
+    n_vars = nip_bitset_count(clusters[i]);
+    clique_vars = (nip_variable*) calloc(n_vars, sizeof(nip_variable));
+    if (clique_vars) {
+      n_vars = 0;
+      for (j = nip_bitset_next(clusters[i], 0); j >= 0; 
+	   j = nip_bitset_next(clusters[i], j + 1))
+	clique_vars[n_vars++] = vars[j];
+      
+      /* Create a new clique */
+      cliques[i] = nip_new_clique(clique_vars, n_vars);
+      free(clique_vars);
+    }
     
     /* Clean up in case of errors */
-    if(cliques[clique_counter] == NULL){
-      for(i = clique_counter + 1; i < ncliques; i++)
-	nip_free_clique(cliques[i]);
-      free(clique_vars);
+    if(cliques[i] == NULL){
+      for(j = 0; j < i; j++)
+	nip_free_clique(cliques[j]);
       free(cliques);
       nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
       return NULL;
     }
   }
   
-  free(clique_vars);
   return cliques;
 }
 
 
 int nip_triangulate_graph(nip_graph gm, nip_clique** clique_p) {
-  int i, j, j_index, k, k_index, n;
+  int i, j, k, n, r, u, v;
+  int e = 0;
   int clique_count = 0;
-  int cluster_size;
-  void* min_item;
-  nip_variable* min_cluster;
-  nip_heap h;
-  nip_int_array_list clusters = NULL;
-  int* variable_set; /* [i] true, if variable[i] is in the cluster */
+  int* order = NULL;
+  int* best_order = NULL;
+  int* swap;
+  int* kept = NULL; /* [v] index of a cluster containing that of v */
+  double cost, best_cost;
+  int restarts = NIP_TRIANGULATION_RESTARTS;
+  double budget = -1; /* no time limit */
+  unsigned long long random_state = 1;
+  char* setting = getenv("NIP_TRIANGULATION_RESTARTS");
+  clock_t start = clock();
+  nip_graph gt = NULL;
+  nip_bitset* clusters = NULL;
+  nip_bitset variable_set; /* [i] true, if variable[i] is in the cluster */
   
-  n = gm->size;
+  n = nip_graph_size(gm);
   
   /* JJT: does the clique listing have anything to do with 
    * the Bron-Kerbosch algorithm or Tsukiyama et al. 1977? */
   
-  /* Create a heap of variable clusters */
-  h = nip_build_cluster_heap(gm);
+  order = (int*) calloc(n + 1, sizeof(int));
+  best_order = (int*) calloc(n + 1, sizeof(int));
+  if(!order || !best_order) {
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    free(order);
+    free(best_order);
+    return -1;
+  }
+  
+  /* Find the elimination order with the smallest total state space:
+   * each heuristic once, then random tie-breaking for a fixed number 
+   * of restarts (and as long as there is time left, if limited) */
+  if(setting && *setting != '\0' && atoi(setting) >= 0)
+    restarts = atoi(setting);
+  setting = getenv("NIP_TRIANGULATION_TIME");
+  if(setting && *setting != '\0')
+    budget = atof(setting);
+  best_cost = -1;
+  for (r = 0; r < 4 + restarts; r++) {
+    if (r >= 4 && budget >= 0 &&
+	(double)(clock() - start) / CLOCKS_PER_SEC >= budget)
+      break;
+    cost = nip_elimination_order(gm, (nip_elimination_heuristic)(r % 4),
+				 (r < 4) ? NULL : &random_state, 
+				 best_cost, order);
+    if (cost < 0) {
+      free(order);
+      free(best_order);
+      return -1;
+    }
+    if (best_cost < 0 || cost < best_cost) {
+      best_cost = cost;
+      swap = best_order; best_order = order; order = swap;
+    }
+  }
+  free(order);
+  
+  /* Eliminate the variables in the chosen order, 
+   * and add the fill-in links also to gm */
+  gt = nip_copy_graph(gm);
+  clusters = (nip_bitset*) calloc(n + 1, sizeof(nip_bitset));
+  kept = (int*) calloc(n + 1, sizeof(int));
+  if(!gt || !clusters || !kept) {
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    nip_free_graph(gt);
+    free(clusters);
+    free(kept);
+    free(best_order);
+    return -1;
+  }
+  for (i = 0; i < n; i++)
+    kept[i] = -1; /* not eliminated yet */
   
-  /* Extract a list of potentially good clusters */
-  clusters = nip_new_int_array_list();
   for (i = 0; i < n; i++) {
-    min_item = nip_heap_extract_min(h, &cluster_size);
-    min_cluster = (nip_variable*) min_item;
+    v = best_order[i];
     
     /* New variable_set for this cluster */
-    variable_set = (int*) calloc(n, sizeof(int));
-    if(!variable_set) {
+    variable_set = nip_new_bitset(n);
+    if(!variable_set || nip_eliminate_node(gt, v) != 0) {
       nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-      nip_free_int_array_list(clusters);
-      while(NULL != (min_item = nip_heap_extract_min(h, NULL)))
-	free((nip_variable*)min_item);
-      nip_free_heap(h);
-      return -1;
+      nip_free_bitset(variable_set);
+      e = ENOMEM;
+      break;
     }
-    /*memset(variable_set, 0, n*sizeof(int)); // calloc did this*/
     
-    for (j = 0; j < cluster_size; j++) {
-      /* Find out which variables belong to the cluster */
-      j_index = nip_graph_index(gm, min_cluster[j]);
-      variable_set[j_index] = 1;
-      
-      /* Add new edges to Gm. */
-      for (k = j+1; k < cluster_size; k++) {
-	k_index = nip_graph_index(gm, min_cluster[k]);	  
-	NIP_ADJM(gm, j_index, k_index) = 1;
-	NIP_ADJM(gm, k_index, j_index) = 1;
+    /* The variable and its remaining neighbours form the cluster.
+     * (nip_eliminate_node() left the links from v to them.) */
+    nip_bitset_add(variable_set, v);
+    for (j = 0; j < NIP_GRAPH_DEGREE(gt, v) && e == 0; j++) {
+      k = NIP_GRAPH_NEIGHBOUR(gt, v, j);
+      nip_bitset_add(variable_set, k);
+      for (r = j+1; r < NIP_GRAPH_DEGREE(gt, v); r++) {
+	if (nip_graph_add_link(gm, k, NIP_GRAPH_NEIGHBOUR(gt, v, r)) != 0 ||
+	    nip_graph_add_link(gm, NIP_GRAPH_NEIGHBOUR(gt, v, r), k) != 0) {
+	  e = ENOMEM;
+	  break;
+	}
       }
     }
+    if (e != 0) {
+      nip_free_bitset(variable_set);
+      break;
+    }
+    free(gt->adj_lists[v]);
+    gt->adj_lists[v] = NULL;
+    gt->degrees[v] = 0;
+    gt->adj_sizes[v] = 0;
     
-    /* Update certain clusters, heapify appropriately */
-    nip_update_cluster_heap(h, min_cluster, cluster_size);
-    
-    /* Add the cluster to a list of cliques if valid */
-    if (!nip_int_array_list_contains_subset(clusters, variable_set, n))
-      nip_prepend_int_array(clusters, variable_set, n);
+    /* Add the cluster to the cliques if valid, i.e. not a subset of 
+     * an earlier one. Such a superset contains v, so it must be the 
+     * cluster of a neighbour eliminated earlier. */
+    for (j = 0; j < NIP_GRAPH_DEGREE(gm, v) && kept[v] < 0; j++) {
+      u = kept[NIP_GRAPH_NEIGHBOUR(gm, v, j)];
+      if (u >= 0 && nip_bitset_is_subset(variable_set, clusters[u]))
+	kept[v] = u;
+    }
+    if (kept[v] < 0) {
+      kept[v] = clique_count;
+      clusters[clique_count++] = variable_set;
+    }
     else
-      free(variable_set);
-    
-    free(min_cluster); /* MVK: memory leak fix */
+      nip_free_bitset(variable_set);
   }
   
   /* Create a set of cliques from the found variable sets */
-  *clique_p = nip_cluster_list_to_clique_array(clusters, gm->variables, n);
-  clique_count = NIP_LIST_LENGTH(clusters);
+  if (e == 0) {
+    *clique_p = nip_cluster_list_to_clique_array(clusters, clique_count, 
+						 gm->variables);
+    if (!(*clique_p))
+      e = ENOMEM;
+  }
   
-  /* free the rest of nip_variable arrays stored in the heap */
-  while(NULL != (min_item = nip_heap_extract_min(h, NULL)))
-    free((nip_variable*) min_item);
-  nip_free_heap(h);
-  nip_free_int_array_list(clusters); /* JJT: Free the cluster list */
+  for (i = 0; i < n && clusters[i]; i++)
+    nip_free_bitset(clusters[i]);
+  free(clusters);
+  free(kept);
+  nip_free_graph(gt);
+  free(best_order);
   
+  if (e != 0)
+    return -1;
   return clique_count;
 }
 
 
+double nip_elimination_order(nip_graph g, 
+			     nip_elimination_heuristic heuristic,
+			     unsigned long long* random_state,
+			     double bound, int* order) {
+  int i, j, k, m, n, u, v, w;
+  int visit = 0;
+  int* costs = NULL;    /* primary and secondary key of each node */
+  int* visited = NULL;  /* when the cost of each node was updated */
+  int* affected = NULL; /* nodes to update after an elimination */
+  double space, total = 0;
+  void* item;
+  nip_graph gt = NULL;
+  nip_heap h = NULL;
+  
+  n = nip_graph_size(g);
+  gt = nip_copy_graph(g);
+  costs = (int*) calloc(2 * n + 1, sizeof(int));
+  visited = (int*) calloc(n + 1, sizeof(int));
+  affected = (int*) calloc(n + 1, sizeof(int));
+  h = nip_new_heap(n, nip_elimination_primary_key, 
+		   nip_elimination_secondary_key);
+  if (!gt || !costs || !visited || !affected || !h) {
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    nip_free_graph(gt);
+    free(costs);
+    free(visited);
+    free(affected);
+    nip_free_heap(h);
+    return -1;
+  }
+  
+  /* The heap items are numbered by the node index */
+  for (v = 0; v < n; v++) {
+    nip_elimination_cost(gt, v, heuristic, random_state, &(costs[2*v]));
+    nip_heap_insert(h, &(costs[2*v]), 1);
+  }
+  nip_build_min_heap(h);
+  
+  for (i = 0; i < n; i++) {
+    item = nip_heap_extract_min(h, NULL);
+    v = ((int*)item - costs) / 2;
+    order[i] = v;
+    
+    /* State space of the cluster induced by v */
+    space = NIP_CARDINALITY(gt->variables[v]);
+    for (j = 0; j < NIP_GRAPH_DEGREE(gt, v); j++)
+      space *= NIP_CARDINALITY(gt->variables[NIP_GRAPH_NEIGHBOUR(gt, v, j)]);
+    total += space;
+    if (bound > 0 && total >= bound)
+      break; /* no better than the bound */
+    
+    if (nip_eliminate_node(gt, v) != 0) {
+      total = -1;
+      break;
+    }
+    
+    /* Update the costs of the neighbours, and for the fill-in 
+     * heuristics also the costs of their neighbours */
+    m = 0;
+    visit++;
+    visited[v] = visit;
+    for (j = 0; j < NIP_GRAPH_DEGREE(gt, v); j++) {
+      u = NIP_GRAPH_NEIGHBOUR(gt, v, j);
+      if (visited[u] != visit) {
+	visited[u] = visit;
+	affected[m++] = u;
+      }
+      if (heuristic != NIP_MIN_FILL && heuristic != NIP_WEIGHTED_MIN_FILL)
+	continue;
+      for (k = 0; k < NIP_GRAPH_DEGREE(gt, u); k++) {
+	w = NIP_GRAPH_NEIGHBOUR(gt, u, k);
+	if (visited[w] != visit) {
+	  visited[w] = visit;
+	  affected[m++] = w;
+	}
+      }
+    }
+    for (j = 0; j < m; j++) {
+      u = affected[j];
+      nip_elimination_cost(gt, u, heuristic, random_state, &(costs[2*u]));
+      nip_update_heap_item(h, nip_heap_position(h, u), &(costs[2*u]), 1);
+    }
+    free(gt->adj_lists[v]);
+    gt->adj_lists[v] = NULL;
+    gt->degrees[v] = 0;
+    gt->adj_sizes[v] = 0;
+  }
+  
+  nip_free_heap(h);
+  nip_free_graph(gt);
+  free(costs);
+  free(visited);
+  free(affected);
+  return total;
+}
+
+
+static int nip_eliminate_node(nip_graph g, int v) {
+  int i, j, a, b;
+  
+  /* Connect the neighbours of v to each other... */
+  for (i = 0; i < NIP_GRAPH_DEGREE(g, v); i++) {
+    a = NIP_GRAPH_NEIGHBOUR(g, v, i);
+    for (j = i+1; j < NIP_GRAPH_DEGREE(g, v); j++) {
+      b = NIP_GRAPH_NEIGHBOUR(g, v, j);
+      if (nip_graph_add_link(g, a, b) != 0 ||
+	  nip_graph_add_link(g, b, a) != 0)
+	return ENOMEM;
+    }
+    /* ...and remove the links back to v */
+    nip_graph_remove_link(g, a, v);
+  }
+  return 0;
+}
+
+
+static void nip_elimination_cost(nip_graph g, int v, 
+				 nip_elimination_heuristic heuristic,
+				 unsigned long long* random_state,
+				 int* keys) {
+  int i, j, a, b, d;
+  double fill = 0, weight;
+  
+  /* log. state space of the cluster, in 1/1024 bits (no overflow) */
+  weight = log(NIP_CARDINALITY(g->variables[v]));
+  d = NIP_GRAPH_DEGREE(g, v);
+  for (i = 0; i < d; i++)
+    weight += log(NIP_CARDINALITY(g->variables[NIP_GRAPH_NEIGHBOUR(g, v, i)]));
+  weight *= 1024 / log(2);
+  
+  /* links to add between the neighbours, or their weight */
+  if (heuristic == NIP_MIN_FILL || heuristic == NIP_WEIGHTED_MIN_FILL) {
+    for (i = 0; i < d; i++) {
+      a = NIP_GRAPH_NEIGHBOUR(g, v, i);
+      for (j = i+1; j < d; j++) {
+	b = NIP_GRAPH_NEIGHBOUR(g, v, j);
+	if (nip_graph_has_link(g, a, b))
+	  continue;
+	if (heuristic == NIP_MIN_FILL)
+	  fill += 1;
+	else
+	  fill += ((double)NIP_CARDINALITY(g->variables[a]) * 
+		   NIP_CARDINALITY(g->variables[b]));
+      }
+    }
+  }
+  
+  switch (heuristic) {
+  case NIP_MIN_FILL:
+  case NIP_WEIGHTED_MIN_FILL:
+    keys[0] = (fill < INT_MAX) ? (int)fill : INT_MAX;
+    keys[1] = (int)weight;
+    break;
+  case NIP_MIN_WEIGHT:
+    keys[0] = (int)weight;
+    keys[1] = d;
+    break;
+  default: /* NIP_MIN_DEGREE */
+    keys[0] = d;
+    keys[1] = (int)weight;
+  }
+  
+  /* random tie-breaking */
+  if (random_state) {
+    *random_state = (*random_state * 6364136223846793005ULL + 
+		     1442695040888963407ULL);
+    keys[1] = (int)(*random_state >> 33);
+  }
+}
+
+
+static int nip_elimination_primary_key(void* keys, int n) {
+  return ((int*)keys)[0];
+}
+
+
+static int nip_elimination_secondary_key(void* keys, int n) {
+  return ((int*)keys)[1];
+}
+
+
 int nip_graph_to_cliques(nip_graph g, nip_clique** cliques_p) {
   nip_graph gu, gm, gi;
   int e, n_cliques = 0;
@@ -536,6 +913,14 @@ int nip_graph_to_cliques(nip_graph g, nip_clique** cliques_p) {
   e = nip_create_sepsets(*cliques_p, n_cliques);
   if(e != 0)
     nip_report_error(__FILE__, __LINE__, e, 1);
+
+  /* shape the join tree for propagating evidence */
+  if(e == 0)
+    e = nip_balance_join_tree(*cliques_p, n_cliques);
+  if(e == 0)
+    e = nip_arrange_clique_dimensions(*cliques_p, n_cliques);
+  if(e != 0)
+    nip_report_error(__FILE__, __LINE__, e, 1);
   
   /* free the modified graph */
   nip_free_graph(gu);
@@ -545,278 +930,249 @@ int nip_graph_to_cliques(nip_graph g, nip_clique** cliques_p) {
 
 /*** Used to be in clique.c for some odd reason ***/
 int nip_create_sepsets(nip_clique *cliques, int num_of_cliques){
-  
+  int i, k, n, a, b;
   int inserted = 0;
-  int i;
-  void* item;
+  int num_of_candidates;
+  int* root = NULL;
+  double* space = NULL;
+  nip_sepset_candidate* candidates = NULL;
   nip_sepset s;
-  nip_clique one, two;
 
-  /* Create a heap of candidate sepsets */
-  nip_heap h = nip_build_sepset_heap(cliques, num_of_cliques);
-  if (!h)
-    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  if (num_of_cliques < 2)
+    return 0; /* nothing to connect */
 
-  /* Take the n-1 most promising and useful sepsets */
-  while(inserted < num_of_cliques - 1){
-    /* Extract the "best" candidate sepset */
-    if(NULL == (item = nip_heap_extract_min(h, NULL))){
-      /* Heap empty, but not supposed to be */
-      nip_free_heap(h);
-      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-    }
-    s = (nip_sepset) item;
+  space = (double*) calloc(num_of_cliques, sizeof(double));
+  root = (int*) calloc(num_of_cliques, sizeof(int));
+  if (!space || !root) {
+    free(space);
+    free(root);
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  }
+  for (i = 0; i < num_of_cliques; i++) {
+    /* state space of each clique */
+    space[i] = 1;
+    n = nip_clique_size(cliques[i]);
+    for (k = 0; k < n; k++)
+      space[i] *= NIP_CARDINALITY(cliques[i]->variables[k]);
+    root[i] = i; /* each clique is a tree of its own */
+  }
 
-    /* Check who the neighbour cliques would be */
-    one = s->first_neighbour;
-    two = s->second_neighbour;
+  /* Candidate sepsets, sorted from the most promising */
+  num_of_candidates = nip_find_sepset_candidates(cliques, num_of_cliques, 
+						 space, &candidates);
+  free(space);
+  if (num_of_candidates < 0) {
+    free(root);
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  }
 
-    /* Unmark MUST be done before searching (cliques_connected). */
-    for(i = 0; i < num_of_cliques; i++)
-      nip_unmark_clique(cliques[i]);
+  /* Take the best candidates that do not create loops in the join tree, 
+   * i.e. connect two separate trees (Kruskal's algorithm) */
+  for (i = 0; i < num_of_candidates && inserted < num_of_cliques - 1; i++) {
+    a = nip_find_tree(root, candidates[i].first);
+    b = nip_find_tree(root, candidates[i].second);
+    if (a == b)
+      continue;
 
-    /* Prevent loops in the join tree by checking if the cliques
-     * are already in the same tree. */
-    if(!nip_cliques_connected(one, two)){
+    s = nip_new_sepset(cliques[candidates[i].first], 
+		       cliques[candidates[i].second]);
 
 #ifdef NIP_DEBUG_GRAPH
-      printf("%s: Trying to add ", __FILE__);
-      nip_fprintf_sepset(stdout,s);
-
-      printf(" between ");
-      nip_fprintf_clique(stdout,one);
-
-      printf(" and ");
-      nip_fprintf_clique(stdout,two);
+    printf("%s: Adding ", __FILE__);
+    nip_fprintf_sepset(stdout, s);
+    printf(" between ");
+    nip_fprintf_clique(stdout, cliques[candidates[i].first]);
+    printf(" and ");
+    nip_fprintf_clique(stdout, cliques[candidates[i].second]);
 #endif
 
-      /* Connect s */
-      if(nip_confirm_sepset(s) != 0){
-	nip_free_sepset(s); /* free all remaining sepsets and heap */
-	while(NULL != (item = nip_heap_extract_min(h, NULL)))
-	  nip_free_sepset((nip_sepset)item);
-	nip_free_heap(h);
-	return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-      }	
-
-      inserted++; /* successfully added one sepset */
+    if (!s || nip_confirm_sepset(s) != 0) {
+      nip_free_sepset(s);
+      free(candidates);
+      free(root);
+      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
     }
+    root[b] = a;
+    inserted++;
+  }
+  free(candidates);
+
+  /* Connect the remaining trees (independent parts of the model)
+   * with empty sepsets */
+  for (i = 1; i < num_of_cliques && inserted < num_of_cliques - 1; i++) {
+    a = nip_find_tree(root, 0);
+    b = nip_find_tree(root, i);
+    if (a == b)
+      continue;
+    s = nip_new_sepset(cliques[0], cliques[i]);
+    if (!s || nip_confirm_sepset(s) != 0) {
+      nip_free_sepset(s);
+      free(root);
+      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    }
+    root[b] = a;
+    inserted++;
   }
-    
-  /* Free the useless sepsets and the heap */
-  while(NULL != (item = nip_heap_extract_min(h, NULL)))
-    nip_free_sepset((nip_sepset)item);
-  nip_free_heap(h);
 
+  free(root);
   return 0;
 }
 
 
-/*** Refactored from Heap.c ***/
-static int nip_cluster_primary_cost(void* variables, int n) {
-  /* vs is the array of variables in the cluster induced by vs[0] */
-  int i,j, sum = 0;
-  
-  for (i = 0; i < n; i++)
-    for (j = i+1; j < n; j++)
-      sum += !nip_variable_is_parent(((nip_variable*)variables)[i], 
-				     ((nip_variable*)variables)[j]);
-  /*sum += !nip_graph_linked(g, vs[i], vs[j]);*/
-  /* JJT: Not sure if this is supposed to be true "childrenship" in the
-     original Bayes network, or just neigbourhood in the subsequent
-     moralised and undirected graph. */
-  
-  /* AR: Joo, po. logical not. The purpose is to count how many
-     edges must be added to the graph, i.e. all the cases, 
-     when A is not child of B. Here the table is traversed only 
-     to one direction, which differs from the original idea by 
-     factor of 2.*/
-  
-  return sum; /* Number of links to add */
-}
-
-static int nip_cluster_secondary_cost(void* variables, int n) {
-  /* vs is the array of variables in the cluster induced by vs[0] */
-  int i, prod = 1;    
-  for (i = 0; i < n; i++)
-    prod *= NIP_CARDINALITY(((nip_variable*)variables)[i]);
-  return prod;
-}
-
-static int nip_sepset_primary_cost(void* sepset, int n) {
-  if (n>0)
-    return -(nip_sepset_size((nip_sepset)sepset));
-  return 0;
-}
-
-static int nip_sepset_secondary_cost(void* sepset, int n) {
-  int c = 0;
-  nip_sepset s = (nip_sepset) sepset;
-  nip_clique nc;
-  if(!s){
-    nc = s->first_neighbour;
-    if(nc)
-      c += nip_cluster_secondary_cost((void*)(nc->variables), 
-				      nip_clique_size(nc));
-    nc = s->second_neighbour;
-    if(nc)
-      c += nip_cluster_secondary_cost((void*)(nc->variables),
-				      nip_clique_size(nc));
-  }
-  return c;
+static int nip_find_tree(int* root, int i) {
+  /* path halving keeps the trees flat */
+  while (root[i] != i) {
+    root[i] = root[root[i]];
+    i = root[i];
+  }
+  return i;
 }
 
 
-static nip_heap nip_build_cluster_heap(nip_graph gm) {
-  int i,n;
-  int csize;
-  void* item;
-  nip_variable* cluster;
-  nip_heap h;
-  
-  n = nip_graph_size(gm);
-
-  /* content[0] is the cluster-inducing child variable in the array, 
-   * rest are neighbours, when clusters of variables are concerned */
-  
-  /* Create an empty heap */
-  h = nip_new_heap(n, nip_cluster_primary_cost, nip_cluster_secondary_cost);
-  if (!h) {
+static int nip_find_sepset_candidates(nip_clique* cliques, 
+				      int num_of_cliques, 
+				      double* space,
+				      nip_sepset_candidate** candidates_p) {
+  int i, j, k, m, n, g, t;
+  int num_of_members = 0;
+  int num_of_groups = 0;
+  int num_of_candidates = 0;
+  int allocated = 0;
+  int* groups = NULL;  /* where each variable starts in members */
+  int* offsets = NULL; /* where each clique starts in clique_groups */
+  int* clique_groups = NULL; /* variables of each clique as groups */
+  int* shared = NULL;  /* number of variables shared with each clique */
+  int* touched = NULL; /* cliques sharing variables with the current one */
+  nip_clique_member* members = NULL;
+  nip_sepset_candidate* candidates = NULL;
+  nip_sepset_candidate* bigger;
+
+  for (i = 0; i < num_of_cliques; i++)
+    num_of_members += nip_clique_size(cliques[i]);
+  members = (nip_clique_member*) calloc(num_of_members + 1, 
+					sizeof(nip_clique_member));
+  groups = (int*) calloc(num_of_members + 1, sizeof(int));
+  offsets = (int*) calloc(num_of_cliques + 1, sizeof(int));
+  clique_groups = (int*) calloc(num_of_members + 1, sizeof(int));
+  shared = (int*) calloc(num_of_cliques, sizeof(int));
+  touched = (int*) calloc(num_of_cliques, sizeof(int));
+  if (!members || !groups || !offsets || !clique_groups || 
+      !shared || !touched) {
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-    return NULL;
+    free(members);
+    free(groups);
+    free(offsets);
+    free(clique_groups);
+    free(shared);
+    free(touched);
+    return -1;
   }
-  
-  /* Populate the heap */
-  for (i = 0; i < n; i++) {
-    csize = nip_graph_cluster(gm, gm->variables[i], &cluster);
-    if(csize < 0){
-      /* Something went wrong, clean up */
-      while(NULL != (item = nip_heap_extract_min(h, NULL)))
-	free((nip_variable*)item);
-      nip_free_heap(h);
-    }
-
-    nip_heap_insert(h, (void*) cluster, csize);
 
-#ifdef NIP_DEBUG_GRAPH
-    printf("%s: possible clique ", __FILE__);
-    while (0 < csize--)
-      printf("%s,", nip_variable_symbol(cluster[csize]));
-    printf("\n");
-#endif
+  /* List the (variable, clique) pairs sorted by variable, so that 
+   * the cliques containing the same variable form a group */
+  m = 0;
+  for (i = 0; i < num_of_cliques; i++) {
+    n = nip_clique_size(cliques[i]);
+    offsets[i] = m;
+    for (k = 0; k < n; k++) {
+      members[m].id = nip_variable_id(cliques[i]->variables[k]);
+      members[m].clique = i;
+      m++;
+    }
   }
-
-  /* Make it obey the heap property */
-  nip_build_min_heap(h);
-  
-  return h;
-}
-
-
-static int nip_family_cluster(void* i, int isize, void* r, int rsize){
-  if (isize < 1 || rsize != 1)
-    return 0; /* invalid input */
-  if (nip_equal_variables(((nip_variable*)i)[0], ((nip_variable*)r)[0]))
-    return 1;
-  return 0;
-}
-
-
-static int nip_update_cluster_heap(nip_heap h, nip_variable* cluster, int csize){
-  int i, j, k, index;
-  int osize;
-  void* old_item;
-  nip_variable* old_cluster;
-  int nsize;
-  nip_variable* new_cluster;
-  nip_variable v, v_i;
-  nip_variable v_removed = cluster[0];
-  
-  /* Iterate over potential join tree neighbours where the child node of the 
-   * just removed (minimum cost) cluster has its neighbours as the center
-   * ("neighbour clusters") and update keys. The loop could be heavy. */
-  for (i = 1; i < csize; i++){
-    v = cluster[i]; /* search for neighbour clusters */
-    index = nip_search_heap_item(h, *nip_family_cluster, &v, 1);
-    old_item = nip_get_heap_item(h, index, &osize);
-    old_cluster = (nip_variable*) old_item;
-
-    /* Union of old_cluster[1...end] and cluster[1...end] 
-     * NOTE: new_cluster[0] == old_cluster[0] */
-    new_cluster = nip_variable_union(old_cluster, cluster,
-				      osize, csize, &nsize);
-    if(!new_cluster)
-      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-    assert(new_cluster[0] == old_cluster[0]);
-
-    /* Remove cluster[0] */
-    k = 0;
-    for (j = 0; j < nsize; j++) {
-      v_i = new_cluster[j];
-      new_cluster[j] = NULL;
-      if (!nip_equal_variables(v_removed, v_i))
-	new_cluster[k++] = v_i; /* Note: overwrites itself */
+  offsets[num_of_cliques] = m;
+  qsort(members, num_of_members, sizeof(nip_clique_member), 
+	nip_compare_clique_members);
+
+  /* Find the groups and list them for each clique */
+  for (m = 0; m < num_of_members; m++) {
+    if (m == 0 || members[m].id != members[m-1].id)
+      groups[num_of_groups++] = m;
+    i = members[m].clique;
+    clique_groups[offsets[i]++] = num_of_groups - 1;
+  }
+  groups[num_of_groups] = num_of_members;
+  for (i = num_of_cliques; i > 0; i--)
+    offsets[i] = offsets[i-1]; /* undo the shifting */
+  offsets[0] = 0;
+
+  /* For each clique i, count the variables shared with cliques j > i. 
+   * Only these pairs are candidates, so the memory needed depends on 
+   * how much the cliques overlap, not on the square of their number. */
+  for (i = 0; i < num_of_cliques; i++) {
+    t = 0;
+    for (k = offsets[i]; k < offsets[i+1]; k++) {
+      g = clique_groups[k];
+      for (m = groups[g]; m < groups[g+1]; m++) {
+	j = members[m].clique;
+	if (j <= i)
+	  continue;
+	if (shared[j]++ == 0)
+	  touched[t++] = j;
+      }
     }
-    /* if (k == nsize-1), new_cluster was allocated one element too much */
-
-#ifdef NIP_DEBUG_HEAP
-    printf("%s: changing cluster from ", __FILE__);
-    for (j=0; j<osize; j++)
-      printf("%s ", nip_variable_symbol(old_cluster[j]));
-    printf("to ");
-    for (j=0; j<k; j++)
-      printf("%s ", nip_variable_symbol(new_cluster[j]));
-    printf("\n");
-#endif
 
-    free(old_cluster); /* FIXME: here or in nip_set_heap_item? */
-    nip_set_heap_item(h, index, (void*)new_cluster, k);
+    for (k = 0; k < t; k++) {
+      j = touched[k];
+      if (num_of_candidates == allocated) {
+	/* time to expand */
+	allocated = (allocated > 0) ? 2 * allocated : num_of_cliques;
+	bigger = (nip_sepset_candidate*) 
+	  realloc(candidates, allocated * sizeof(nip_sepset_candidate));
+	if (!bigger) {
+	  nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+	  free(candidates);
+	  free(members);
+	  free(groups);
+	  free(offsets);
+	  free(clique_groups);
+	  free(shared);
+	  free(touched);
+	  return -1;
+	}
+	candidates = bigger;
+      }
+      candidates[num_of_candidates].mass = shared[j];
+      candidates[num_of_candidates].cost = space[i] + space[j];
+      candidates[num_of_candidates].first = i;
+      candidates[num_of_candidates].second = j;
+      num_of_candidates++;
+      shared[j] = 0;
+    }
   }
 
-  nip_build_min_heap(h); /* Rebuild the heap. */
-  return 0;
+  /* The largest sepsets first, then the smallest cliques */
+  qsort(candidates, num_of_candidates, sizeof(nip_sepset_candidate), 
+	nip_compare_sepset_candidates);
+
+  free(members);
+  free(groups);
+  free(offsets);
+  free(clique_groups);
+  free(shared);
+  free(touched);
+  *candidates_p = candidates;
+  return num_of_candidates;
 }
 
 
-static nip_heap nip_build_sepset_heap(nip_clique* cliques, 
-				      int num_of_cliques) {
-  int i,j;
-  int n = (num_of_cliques * (num_of_cliques - 1)) / 2;
-  nip_clique nca, ncb;
-  nip_sepset s;
-  void* item;
-  
-  nip_heap h = nip_new_heap(n, nip_sepset_primary_cost, 
-			    nip_sepset_secondary_cost);
-  if (!h) {
-    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-    return NULL;
-  }
-  
-  /* Go through each pair of cliques. Create candidate sepsets. */
-  for(i = 0; i < num_of_cliques - 1; i++) {
-    for(j = i + 1; j < num_of_cliques; j++) {
-      nca = cliques[i];
-      ncb = cliques[j];
-
-      /* Make a new sepset */
-      s = nip_new_sepset(nca, ncb);
-      if (!s) {
-	/* In case of failure, free all sepsets and the heap. */
-	nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-	while(NULL != (item = nip_heap_extract_min(h, NULL)))
-	  nip_free_sepset((nip_sepset)item);
-	nip_free_heap(h);
-	return NULL;
-      }
+static int nip_compare_clique_members(const void* a, const void* b) {
+  const nip_clique_member* x = (const nip_clique_member*) a;
+  const nip_clique_member* y = (const nip_clique_member*) b;
+  if (x->id != y->id)
+    return (x->id < y->id) ? -1 : 1;
+  return x->clique - y->clique;
+}
 
-      /* Put it in the heap */
-      nip_heap_insert(h, s, 1);
-    }
-  }
-  
-  /* Sort the heap */
-  nip_build_min_heap(h);
-  
-  return h;
+
+static int nip_compare_sepset_candidates(const void* a, const void* b) {
+  const nip_sepset_candidate* x = (const nip_sepset_candidate*) a;
+  const nip_sepset_candidate* y = (const nip_sepset_candidate*) b;
+  if (x->mass != y->mass)
+    return y->mass - x->mass; /* more shared variables first */
+  if (x->cost != y->cost)
+    return (x->cost < y->cost) ? -1 : 1;
+  if (x->first != y->first)
+    return x->first - y->first;
+  return x->second - y->second;
 }
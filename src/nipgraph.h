@@ -25,16 +25,46 @@
 #include "nipjointree.h"
 
 /**
- * Access the adjacency matrix of graph \p g at element \p i, \p j (0-based) */
-#define NIP_ADJM(g, i, j) ( (g)->adj_matrix[(i)*(g)->size + (j)] )
+ * Number of links from node \p i of graph \p g (0-based) */
+#define NIP_GRAPH_DEGREE(g, i) ( (g)->degrees[(i)] )
 
 /**
- * Structure for representing graphs of random variables, Bayes nets etc. */
+ * Index of the \p k:th node linked from node \p i of graph \p g,
+ * in ascending order of the indices */
+#define NIP_GRAPH_NEIGHBOUR(g, i, k) ( (g)->adj_lists[(i)][(k)] )
+
+/**
+ * Number of randomised elimination orders tried in addition to the 
+ * deterministic heuristics, when triangulating a graph. The random
+ * generator always starts from the same seed, so the result depends
+ * only on the graph. Environment variable NIP_TRIANGULATION_RESTARTS
+ * overrides this, and 0 disables the restarts. If the environment
+ * variable NIP_TRIANGULATION_TIME is set, the restarts also stop after
+ * that many seconds of CPU time, and the result may then depend on the
+ * speed of the machine. */
+#define NIP_TRIANGULATION_RESTARTS 16
+
+/**
+ * Greedy heuristics for choosing the next node to eliminate */
+typedef enum {
+  NIP_MIN_FILL,          ///< Fewest links to add between the neighbours
+  NIP_WEIGHTED_MIN_FILL, ///< Smallest sum of state spaces of the added links
+  NIP_MIN_WEIGHT,        ///< Smallest state space of the induced cluster
+  NIP_MIN_DEGREE         ///< Fewest neighbours
+} nip_elimination_heuristic;
+
+/**
+ * Structure for representing graphs of random variables, Bayes nets etc.
+ * The links are stored as sorted adjacency lists, so that the memory
+ * and the time for going through the neighbours of a node are
+ * proportional to the number of links, not the number of nodes. */
 typedef struct {
   unsigned size;           ///< Number of nodes in the graph (allocated size)
   int top;                 ///< Number of variables (nodes) added so far
-  int* adj_matrix;         ///< Two dimensional adjacency matrix
-  unsigned long* var_ind;  ///< Possible array for [variable id] -> adjm index
+  int** adj_lists;         ///< Sorted indices of the nodes linked from each
+  int* degrees;            ///< Number of links from each node
+  int* adj_sizes;          ///< Allocated size of each adjacency list
+  unsigned long* var_ind;  ///< Possible array for [variable id] -> node index
   unsigned long min_id;    ///< Minimum ID of variables, an invariant
   unsigned long max_id;    ///< Maximum ID of variables, an invariant
   nip_variable* variables; ///< Array of all the variables (nodes) */
@@ -43,8 +73,8 @@ typedef struct {
 typedef nip_graph_struct* nip_graph; ///< reference to a graph
 
 /**
- * Creates a new graph allocating memory for the whole adjacency matrix.
- * Memory requirements are O(n)
+ * Creates a new graph without any links.
+ * Memory requirements are O(n) plus O(1) for each link added later
  * @param n The (maximum) number of variables in the graph
  * @return reference to a new graph, remember to free it
  * @see nip_free_graph()
@@ -81,10 +111,10 @@ int nip_graph_size(nip_graph g);
 nip_variable* nip_graph_nodes(nip_graph g);
 
 /**
- * Returns the index of a node in the adjacency matrix.
+ * Returns the index of a node in the graph.
  * @param g Reference to the graph
  * @param v The node (variable) of interest
- * @return a 0-based index in the adjacency matrix, or -1 if not found
+ * @return a 0-based index of the node, or -1 if not found
  */
 int nip_graph_index(nip_graph g, nip_variable v);
 
@@ -132,7 +162,7 @@ int nip_graph_add_child(nip_graph g, nip_variable parent, nip_variable child);
 /**
  * Returns an undirected copy of a graph.
  * @param g Reference to the graph
- * @return a new graph with symmetrical adjacency matrix, or NULL
+ * @return a new graph with symmetrical links, or NULL
  * @see nip_free_graph() */
 nip_graph nip_make_graph_undirected(nip_graph g);
 
@@ -176,4 +206,23 @@ int nip_create_sepsets(nip_clique *cliques, int num_of_cliques);
  * @return Size of the found clique array */
 int nip_triangulate_graph(nip_graph gm, nip_clique** clique_p);
 
+/**
+ * Finds an elimination order for the nodes of an undirected graph 
+ * greedily, and computes the total state space of the clusters induced 
+ * by eliminating the nodes in that order. 
+ * nip_triangulate_graph() tries each heuristic and some random 
+ * tie-breaking to find the order with the smallest total.
+ * @param g The moral and undirected graph (not modified)
+ * @param heuristic Cost of eliminating each node
+ * @param random_state State of a random generator for breaking ties,
+ * or NULL for deterministic tie-breaking by the cluster state space
+ * @param bound The search stops when the total reaches this, 
+ * unless \p bound <= 0
+ * @param order Array of nip_graph_size(g) node indices to fill
+ * @return The total state space (or at least \p bound), or -1 on error */
+double nip_elimination_order(nip_graph g, 
+			     nip_elimination_heuristic heuristic,
+			     unsigned long long* random_state,
+			     double bound, int* order);
+
 #endif /* __GRAPH_H__ */
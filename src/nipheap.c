@@ -36,6 +36,12 @@ static int nip_heap_less_than(nip_heap_item h1, nip_heap_item h2);
 /* Helper function for nip_build_min_heap */
 static void nip_min_heapify(nip_heap h, int i);
 
+/* Moves item i up towards the root until the heap property holds */
+static int nip_heap_sift_up(nip_heap h, int i);
+
+/* Puts an item into index i and keeps track of its position */
+static void nip_heap_place(nip_heap h, int i, nip_heap_item hi);
+
 
 
 /*** Public functions ***/
@@ -44,10 +50,12 @@ nip_heap nip_new_heap(int initial_size,
 		      int (*secondary)(void* item, int size)) {
   nip_heap h;
 
-  if (initial_size <= 0){
+  if (initial_size < 0){
     nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     return NULL;
   }
+  if (initial_size == 0)
+    initial_size = 1; /* e.g. no sepsets for a single clique */
 
   h = (nip_heap) malloc(sizeof(nip_heap_struct));
   if(!h){
@@ -62,14 +70,25 @@ nip_heap nip_new_heap(int initial_size,
     return NULL;
   }
 
+  h->positions = (int*) calloc(initial_size, sizeof(int));
+  if(!h->positions){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    free(h->heap_items);
+    free(h);
+    return NULL;
+  }
+
   h->heap_size = 0;
   h->allocated_size = initial_size;
+  h->num_of_ids = 0;
+  h->allocated_ids = initial_size;
   h->primary_key = primary;
   h->secondary_key = secondary;
   h->heapified = 0;
   h->updated_items = nip_new_int_list();
   if(!h->updated_items){
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    free(h->positions);
     free(h->heap_items);
     free(h);
     return NULL;
@@ -83,21 +102,14 @@ int nip_heap_insert(nip_heap h, void* content, int size) {
   int i;
   nip_heap_item hi;
   nip_heap_item* bigger;
-
-  /* Create a new heap element */
-  hi = (nip_heap_item) malloc(sizeof(nip_heap_item_struct));
-  if(!hi)
-    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-  hi->content = content;
-  hi->content_size = size;
-  hi->primary_key = (*h->primary_key)(hi->content, hi->content_size);
-  hi->secondary_key = (*h->secondary_key)(hi->content, hi->content_size);
+  int* more;
 
   /* Assign it to the heap */
   if(h->heap_size == h->allocated_size){
     /* time to expand */
     i = 2 * h->allocated_size;
-    bigger = (nip_heap_item*) realloc(h->heap_items, i); /* realloc */
+    bigger = (nip_heap_item*) realloc(h->heap_items, 
+				      i * sizeof(nip_heap_item));
     if(bigger != NULL){
       h->heap_items = bigger;
       h->allocated_size = i;
@@ -107,7 +119,26 @@ int nip_heap_insert(nip_heap h, void* content, int size) {
     else
       return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
   }
-  h->heap_items[h->heap_size] = hi;
+  if(h->num_of_ids == h->allocated_ids){
+    i = 2 * h->allocated_ids;
+    more = (int*) realloc(h->positions, i * sizeof(int));
+    if(!more)
+      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    h->positions = more;
+    h->allocated_ids = i;
+  }
+
+  /* Create a new heap element */
+  hi = (nip_heap_item) malloc(sizeof(nip_heap_item_struct));
+  if(!hi)
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  hi->content = content;
+  hi->content_size = size;
+  hi->primary_key = (*h->primary_key)(hi->content, hi->content_size);
+  hi->secondary_key = (*h->secondary_key)(hi->content, hi->content_size);
+  hi->id = h->num_of_ids++;
+
+  nip_heap_place(h, h->heap_size, hi);
   h->heap_size++;
   h->heapified = 0;
   /* TODO: Just prepend index to h->updated_items? */
@@ -136,6 +167,13 @@ int nip_search_heap_item(nip_heap h,
 }
 
 
+int nip_heap_position(nip_heap h, int id) {
+  if (h == NULL || id < 0 || id >= h->num_of_ids)
+    return -1;
+  return h->positions[id];
+}
+
+
 void* nip_get_heap_item(nip_heap h, int index, int* size) {
   nip_heap_item hi;
   if (h == NULL || index < 0 || index >= h->heap_size){
@@ -170,6 +208,26 @@ int nip_set_heap_item(nip_heap h, int index,
 }
 
 
+int nip_update_heap_item(nip_heap h, int index,
+			 void* content, int size) {
+  nip_heap_item hi; 
+  
+  if (h == NULL || index < 0 || index >= h->heap_size || size <= 0)
+    return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+
+  hi = h->heap_items[index];
+  hi->content = content;
+  hi->content_size = size;
+  hi->primary_key = (*h->primary_key)(hi->content, hi->content_size);
+  hi->secondary_key = (*h->secondary_key)(hi->content, hi->content_size);
+
+  /* decrease-key moves the item up, increase-key down */
+  index = nip_heap_sift_up(h, index);
+  nip_min_heapify(h, index);
+  return 0;
+}
+
+
 void nip_build_min_heap(nip_heap h) {
   int i, index;
   nip_int_link il;
@@ -181,10 +239,10 @@ void nip_build_min_heap(nip_heap h) {
       nip_min_heapify(h, i);
   }
   else {
-    /* heapify only updated items */
+    /* heapify only updated items (in either direction) */
     il = NIP_LIST_ITERATOR(h->updated_items);
     while (il != NULL){
-      index = NIP_LIST_ELEMENT(il);
+      index = nip_heap_sift_up(h, NIP_LIST_ELEMENT(il));
       nip_min_heapify(h, index);
       il = NIP_LIST_NEXT(il);
     }
@@ -210,7 +268,8 @@ void* nip_heap_extract_min(nip_heap h, int* size) {
     min = h->heap_items[0];
 
     /* Move the last one to the top */
-    h->heap_items[0] = h->heap_items[h->heap_size-1]; 
+    nip_heap_place(h, 0, h->heap_items[h->heap_size-1]);
+    h->positions[min->id] = -1;
     h->heap_items[h->heap_size-1] = NULL;
     h->heap_size--;
 
@@ -242,6 +301,7 @@ void nip_free_heap(nip_heap h) {
     }
   }
   free(h->heap_items);
+  free(h->positions);
   nip_empty_int_list(h->updated_items);
   free(h->updated_items);
   free(h);
@@ -290,9 +350,32 @@ static void nip_min_heapify(nip_heap h, int i) {
         if (min != i) {
             /* Exchange array[min] and array[i] */
             temp = h->heap_items[min];
-            h->heap_items[min] = h->heap_items[i];
-            h->heap_items[i] = temp;
+            nip_heap_place(h, min, h->heap_items[i]);
+            nip_heap_place(h, i, temp);
             i = min; flag = 1;
         }
     } while (flag);
 }
+
+
+static int nip_heap_sift_up(nip_heap h, int i) {
+  nip_heap_item temp;
+
+  while (i > 0 && 
+	 nip_heap_less_than(h->heap_items[i], 
+			    h->heap_items[NIP_HEAP_PARENT(i)])) {
+    /* Exchange the item and its parent */
+    temp = h->heap_items[NIP_HEAP_PARENT(i)];
+    nip_heap_place(h, NIP_HEAP_PARENT(i), h->heap_items[i]);
+    nip_heap_place(h, i, temp);
+    i = NIP_HEAP_PARENT(i);
+  }
+  return i;
+}
+
+
+static void nip_heap_place(nip_heap h, int i, nip_heap_item hi) {
+  h->heap_items[i] = hi;
+  if (hi)
+    h->positions[hi->id] = i;
+}
@@ -35,6 +35,7 @@ typedef struct {
   void* content;     ///< the pointer to the content (possibly array)
   int primary_key;   ///< key determining the order in the heap
   int secondary_key; ///< secondary key determining the order in case of ties
+  int id;            ///< number of the item in the order of insertion
 } nip_heap_item_struct;
 typedef nip_heap_item_struct* nip_heap_item; ///< reference to a heap item
 
@@ -50,6 +51,9 @@ typedef struct {
   int heapified;    ///< Flag if someone has seen the trouble of heapifying
   nip_int_list updated_items; /**< List of indices of updated elements 
 				 which potentially violate heap property */
+  int* positions;   ///< Current index of each item by id, or -1 if extracted
+  int num_of_ids;   ///< Number of items ever inserted (next id)
+  int allocated_ids; ///< Size of the currently allocated positions
 } nip_heap_struct;
 typedef nip_heap_struct* nip_heap; ///< reference to a heap
 
@@ -69,12 +73,23 @@ nip_heap nip_new_heap(int initial_size,
 /**
  * Inserts a new element into the heap h. 
  * The heap property is not valid after this, so remember to heapify...
+ * The elements are numbered (by id) in the order of insertion, 
+ * starting from 0, for finding them with nip_heap_position().
  * @param h The heap
  * @param content Pointer to the stored element
  * @param size Size of \p content */
 int nip_heap_insert(nip_heap h, void* content, int size);
 
 
+/**
+ * Finds the current heap index of an element in constant time, 
+ * by the number of the element in the order of insertion. 
+ * @param h The heap
+ * @param id Number of the element: 0 for the first inserted etc.
+ * @return Index of the heap item, or -1 if already extracted */
+int nip_heap_position(nip_heap h, int id);
+
+
 /**
  * Makes a linear search through all items in the heap by using 
  * the supplied comparison operation and reference content. 
@@ -113,6 +128,20 @@ void* nip_get_heap_item(nip_heap h, int index, int* size);
 int nip_set_heap_item(nip_heap h, int index, void* content, int size);
 
 
+/**
+ * Replaces the heap item referenced by index with the given content, 
+ * and moves it up (decrease-key) or down (increase-key) in O(log n) 
+ * time according to the new keys. Unlike nip_set_heap_item(), the heap 
+ * property stays valid without rebuilding the heap.
+ * @param h The heap, already heapified
+ * @param index Flat index to the heap
+ * @param content Stuff to be stored
+ * @param size Size of \p content
+ * @return error code, or 0 if successful
+ * @see nip_heap_position() */
+int nip_update_heap_item(nip_heap h, int index, void* content, int size);
+
+
 /**
  * Makes the heap obey the heap property after modifications to the root
  * @param h The heap */
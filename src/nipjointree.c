@@ -22,8 +22,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "niperrorhandler.h"
+#include "nipthreads.h"
 
 /*
 #define NIP_DEBUG_CLIQUE
@@ -71,6 +73,102 @@ static int nip_neg_sepset_mass(nip_sepset s, double* ptr);
 /* Internal function for removing s from c */
 static void nip_remove_sepset(nip_clique c, nip_sepset s);
 
+/* A clique of the join tree, as seen from the root of propagation */
+typedef struct {
+  nip_clique clique;
+  nip_sepset sepset;   /* towards the parent, or NULL for the root */
+  int parent;          /* index of the parent, or -1 for the root */
+  int first_child;     /* children are first_child...+num_of_children-1 */
+  int num_of_children;
+  double entries;      /* size of the potentials in the subtree */
+  int pending;         /* children yet to collect evidence from */
+} nip_tree_node;
+
+/* Shared state of the threads propagating evidence */
+typedef struct {
+  nip_tree_node* nodes;
+  int* ready;          /* stack of tasks (node indices) ready to run */
+  int num_of_ready;
+  int remaining;       /* tasks not finished yet */
+  int collecting;      /* 1 when collecting, 0 when distributing */
+  int error;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} nip_propagation_struct;
+
+/* Work space for reshaping the groups of a join tree */
+typedef struct {
+  nip_tree_node* nodes;
+  double* reach;       /* the longest path among the children of a node */
+  double* cost;        /* cost of the messages from the children */
+  double* group_reach; /* the same for the children within a group */
+  double* group_cost;
+  int* parents;        /* the chosen parent of each node */
+  int* shape;          /* the parents in a candidate shape of a group */
+  int* members;        /* the current group, parents before children */
+  int* order;          /* the members in a candidate order */
+  int num_of_members;
+} nip_reshape_struct;
+
+/* A member of a group, sorted for a candidate shape */
+typedef struct {
+  double primary;
+  double secondary;
+  int node;
+} nip_group_item;
+
+/* Lists the cliques in breadth-first order from root, so that 
+ * the children of each node are next to each other */
+static int nip_list_tree_nodes(nip_clique root, nip_tree_node** nodes_p);
+
+/* Passes messages from the children of node i to it, and first from 
+ * their subtrees if recursive */
+static int nip_absorb_children(nip_tree_node* nodes, int i, int recursive);
+
+/* Passes messages from node i to its children, and then on to their 
+ * subtrees if recursive */
+static int nip_distribute_children(nip_tree_node* nodes, int i, 
+				   int recursive);
+
+/* Tells if node i is processed in a task of its own */
+static int nip_tree_task(nip_tree_node* nodes, int i);
+
+/* Runs the tasks of a propagation phase in nthreads threads */
+static int nip_run_propagation(nip_propagation_struct* p, int nthreads);
+
+/* The loop of each thread in nip_run_propagation() */
+static void* nip_propagation_worker(void* arg);
+
+/* Number of threads worth using for a join tree */
+static int nip_propagation_threads(double entries);
+
+
+/* Cost of a message between two cliques */
+static double nip_message_cost(nip_clique c1, nip_clique c2);
+
+/* Tells if two sepsets have the same variables */
+static int nip_same_scope(nip_sepset s1, nip_sepset s2);
+
+/* Finds the clique with the shortest critical path of propagation, 
+ * or returns NULL if something went wrong */
+static nip_clique nip_best_root(nip_clique start);
+
+/* Rearranges groups of sepsets with the same variables, as seen 
+ * from root, and connects the cliques again accordingly */
+static int nip_reshape_join_tree(nip_clique root);
+
+/* Chooses the shape of the current group below node top */
+static void nip_reshape_group(nip_reshape_struct* r, int top,
+			      nip_group_item* items);
+
+/* Computes the critical path down to node top, if the group members 
+ * in order[] (parents first) had the given parents. Returns the total 
+ * cost of the messages in the group. */
+static double nip_group_path(nip_reshape_struct* r, int top, int* order,
+			     int* parents, double* path);
+
+/* For sorting the members of a group with qsort() */
+static int nip_compare_group_items(const void* a, const void* b);
 
 nip_clique nip_new_clique(nip_variable vars[], int nvars){
   nip_clique c;
@@ -149,15 +247,17 @@ nip_clique nip_new_clique(nip_variable vars[], int nvars){
 
   c->p = nip_new_potential(cardinality, nvars, NULL);
   c->original_p = nip_new_potential(cardinality, nvars, NULL);
+  c->scope = nip_variable_bitset(c->variables, nvars);
 
   /* Propagation of error */
-  if(c->p == NULL || c->original_p == NULL){
+  if(c->p == NULL || c->original_p == NULL || c->scope == NULL){
     free(cardinality);
     free(indices);
     free(reorder);
     free(c->variables);
     nip_free_potential(c->p);
     nip_free_potential(c->original_p);
+    nip_free_bitset(c->scope);
     free(c);
     nip_report_error(__FILE__, __LINE__, EFAULT, 1);
     return NULL;
@@ -202,6 +302,7 @@ void nip_free_clique(nip_clique c){
   nip_free_potential(c->p);
   nip_free_potential(c->original_p);
   free(c->variables);
+  nip_free_bitset(c->scope);
   free(c);
   return;
 }
@@ -283,13 +384,13 @@ nip_sepset nip_new_sepset(nip_clique neighbour_a, nip_clique neighbour_b){
   /* Take the intersection of two cliques. */
   s->first_neighbour = neighbour_a;
   s->second_neighbour = neighbour_b;
-  s->variables = nip_variable_isect(neighbour_a->variables,
-                                    neighbour_b->variables,
-                                    NIP_DIMENSIONALITY(neighbour_a->p),
-                                    NIP_DIMENSIONALITY(neighbour_b->p),
-                                    &isect_size);
-
-  if(isect_size < 0){
+  s->old = NULL;
+  s->new = NULL;
+  s->scope = nip_bitset_intersection(neighbour_a->scope, neighbour_b->scope);
+  if(nip_clique_intersection(neighbour_a, neighbour_b, 
+			     &(s->variables), &isect_size) != 0 || 
+     s->scope == NULL){
+    nip_free_bitset(s->scope);
     free(s);
     nip_report_error(__FILE__, __LINE__, EFAULT, 1);
     return NULL;
@@ -329,6 +430,7 @@ void nip_free_sepset(nip_sepset s){
     nip_free_potential(s->old);
     nip_free_potential(s->new);
     free(s->variables);
+    nip_free_bitset(s->scope);
     free(s);
   }
   return;
@@ -642,6 +744,771 @@ int nip_collect_evidence(nip_clique c1, nip_sepset s12, nip_clique c2){
 }
 
 
+int nip_propagate_evidence(nip_clique root){
+  int i, n, nthreads, err = 0;
+  nip_tree_node* nodes = NULL;
+  nip_propagation_struct p;
+
+  n = nip_list_tree_nodes(root, &nodes);
+  if(n < 0)
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+
+  nthreads = nip_propagation_threads(nodes[0].entries);
+  if(nthreads < 2){
+    /* the serial way */
+    err = nip_absorb_children(nodes, 0, 1);
+    if(!err)
+      err = nip_distribute_children(nodes, 0, 1);
+  }
+  else{
+    p.nodes = nodes;
+    p.ready = (int*) calloc(n, sizeof(int));
+    if(!p.ready){
+      free(nodes);
+      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    }
+
+    /* Collect: a task can start when the tasks of its children are
+     * done, and small subtrees are collected in one task */
+    p.collecting = 1;
+    p.num_of_ready = 0;
+    p.remaining = 0;
+    for(i = 0; i < n; i++){
+      if(!nip_tree_task(nodes, i))
+	continue;
+      p.remaining++;
+      nodes[i].pending = 0;
+      if(nodes[i].entries >= NIP_PARALLEL_MIN_ENTRIES)
+	nodes[i].pending = nodes[i].num_of_children;
+      if(nodes[i].pending == 0)
+	p.ready[p.num_of_ready++] = i;
+    }
+    err = nip_run_propagation(&p, nthreads);
+
+    /* Distribute: starting from the root, each task enables 
+     * the tasks of its children */
+    if(!err){
+      p.collecting = 0;
+      p.num_of_ready = 1;
+      p.ready[0] = 0;
+      p.remaining = 0;
+      for(i = 0; i < n; i++)
+	p.remaining += nip_tree_task(nodes, i);
+      err = nip_run_propagation(&p, nthreads);
+    }
+    free(p.ready);
+  }
+
+  /* leave the cliques marked, like nip_distribute_evidence() does */
+  for(i = 0; i < n; i++)
+    nodes[i].clique->mark = NIP_MARK_ON;
+  free(nodes);
+  if(err != 0)
+    return nip_report_error(__FILE__, __LINE__, err, 1);
+  return 0;
+}
+
+
+static int nip_list_tree_nodes(nip_clique root, nip_tree_node** nodes_p){
+  int i, n, size;
+  nip_tree_node* nodes = NULL;
+  nip_tree_node* more;
+  nip_sepset_link l;
+  nip_sepset s;
+  nip_clique c, other;
+
+  if(!root){
+    nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+    return -1;
+  }
+  size = 16;
+  nodes = (nip_tree_node*) calloc(size, sizeof(nip_tree_node));
+  if(!nodes){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return -1;
+  }
+  nodes[0].clique = root;
+  nodes[0].sepset = NULL;
+  nodes[0].parent = -1;
+  n = 1;
+
+  /* breadth-first: the tree has no loops, only the way back to the 
+   * parent needs to be skipped */
+  for(i = 0; i < n; i++){
+    c = nodes[i].clique;
+    nodes[i].first_child = n;
+    for(l = c->sepsets; l != NULL; l = l->fwd){
+      s = (nip_sepset) l->data;
+      if(s == nodes[i].sepset)
+	continue;
+      other = (s->first_neighbour == c) ? 
+	s->second_neighbour : s->first_neighbour;
+      if(n == size){
+	size *= 2;
+	more = (nip_tree_node*) realloc(nodes, size * sizeof(nip_tree_node));
+	if(!more){
+	  free(nodes);
+	  nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+	  return -1;
+	}
+	nodes = more;
+      }
+      nodes[n].clique = other;
+      nodes[n].sepset = s;
+      nodes[n].parent = i;
+      n++;
+    }
+    nodes[i].num_of_children = n - nodes[i].first_child;
+  }
+
+  /* sizes of the subtrees, children before parents */
+  for(i = n - 1; i >= 0; i--){
+    nodes[i].entries += nodes[i].clique->p->size_of_data;
+    if(nodes[i].parent >= 0)
+      nodes[nodes[i].parent].entries += nodes[i].entries;
+  }
+
+  *nodes_p = nodes;
+  return n;
+}
+
+
+static int nip_absorb_children(nip_tree_node* nodes, int i, int recursive){
+  int k, err;
+  nip_tree_node* child;
+
+  for(k = 0; k < nodes[i].num_of_children; k++){
+    child = &(nodes[nodes[i].first_child + k]);
+    if(recursive){
+      err = nip_absorb_children(nodes, nodes[i].first_child + k, 1);
+      if(err != 0)
+	return err;
+    }
+    err = nip_message_pass(child->clique, child->sepset, nodes[i].clique);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+  }
+  return 0;
+}
+
+
+static int nip_distribute_children(nip_tree_node* nodes, int i, 
+				   int recursive){
+  int k, err;
+  nip_tree_node* child;
+
+  for(k = 0; k < nodes[i].num_of_children; k++){
+    child = &(nodes[nodes[i].first_child + k]);
+    err = nip_message_pass(nodes[i].clique, child->sepset, child->clique);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+  }
+  for(k = 0; recursive && k < nodes[i].num_of_children; k++){
+    err = nip_distribute_children(nodes, nodes[i].first_child + k, 1);
+    if(err != 0)
+      return err;
+  }
+  return 0;
+}
+
+
+static int nip_tree_task(nip_tree_node* nodes, int i){
+  /* large subtrees, and the small ones hanging from them */
+  return (nodes[i].parent < 0 || 
+	  nodes[i].entries >= NIP_PARALLEL_MIN_ENTRIES ||
+	  nodes[nodes[i].parent].entries >= NIP_PARALLEL_MIN_ENTRIES);
+}
+
+
+static int nip_run_propagation(nip_propagation_struct* p, int nthreads){
+  int k, started = 0;
+  pthread_t* threads = NULL;
+
+  p->error = 0;
+  if(pthread_mutex_init(&(p->lock), NULL) != 0)
+    return NIP_ERROR_GENERAL;
+  if(pthread_cond_init(&(p->wake), NULL) != 0){
+    pthread_mutex_destroy(&(p->lock));
+    return NIP_ERROR_GENERAL;
+  }
+  threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+
+  /* the calling thread works too */
+  for(k = 1; threads && k < nthreads; k++)
+    if(pthread_create(&(threads[started]), NULL, 
+		      nip_propagation_worker, p) == 0)
+      started++;
+  nip_propagation_worker(p);
+  for(k = 0; k < started; k++)
+    pthread_join(threads[k], NULL);
+
+  free(threads);
+  pthread_cond_destroy(&(p->wake));
+  pthread_mutex_destroy(&(p->lock));
+  return p->error;
+}
+
+
+static void* nip_propagation_worker(void* arg){
+  int i, k, err, big;
+  nip_propagation_struct* p = (nip_propagation_struct*) arg;
+  nip_tree_node* nodes = p->nodes;
+
+  pthread_mutex_lock(&(p->lock));
+  while(1){
+    while(p->num_of_ready == 0 && p->remaining > 0 && !p->error)
+      pthread_cond_wait(&(p->wake), &(p->lock));
+    if(p->remaining == 0 || p->error)
+      break;
+    i = p->ready[--(p->num_of_ready)];
+    pthread_mutex_unlock(&(p->lock));
+
+    /* a small subtree is handled as a whole */
+    big = (nodes[i].entries >= NIP_PARALLEL_MIN_ENTRIES);
+    if(p->collecting)
+      err = nip_absorb_children(nodes, i, !big);
+    else
+      err = nip_distribute_children(nodes, i, !big);
+
+    pthread_mutex_lock(&(p->lock));
+    p->remaining--;
+    if(err != 0)
+      p->error = err;
+    else if(p->collecting){
+      k = nodes[i].parent;
+      if(k >= 0 && --(nodes[k].pending) == 0)
+	p->ready[p->num_of_ready++] = k;
+    }
+    else if(big){
+      for(k = 0; k < nodes[i].num_of_children; k++)
+	p->ready[p->num_of_ready++] = nodes[i].first_child + k;
+    }
+    pthread_cond_broadcast(&(p->wake));
+  }
+  pthread_mutex_unlock(&(p->lock));
+  return NULL;
+}
+
+
+static int nip_propagation_threads(double entries){
+  long n;
+
+  /* small trees are not worth asking about the processors */
+  if(entries < 2 * NIP_PARALLEL_MIN_ENTRIES)
+    return 1;
+  n = nip_max_threads();
+  if(n > NIP_MAX_PROPAGATION_THREADS)
+    n = NIP_MAX_PROPAGATION_THREADS;
+  if(n > (long)(entries / NIP_PARALLEL_MIN_ENTRIES))
+    n = (long)(entries / NIP_PARALLEL_MIN_ENTRIES);
+  return (n < 1) ? 1 : (int)n;
+}
+
+
+int nip_balance_join_tree(nip_clique cliques[], int num_of_cliques){
+  int i, err;
+  nip_clique root;
+
+  if(num_of_cliques < 2)
+    return 0;
+  if(!cliques)
+    return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+
+  /* the groups are seen from a good root, which may change after 
+   * reshaping them */
+  root = nip_best_root(cliques[0]);
+  if(!root)
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  err = nip_reshape_join_tree(root);
+  if(err != 0)
+    return nip_report_error(__FILE__, __LINE__, err, 1);
+  root = nip_best_root(root);
+  if(!root)
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+
+  for(i = 0; i < num_of_cliques; i++){
+    if(cliques[i] == root){
+      cliques[i] = cliques[0];
+      cliques[0] = root;
+      break;
+    }
+  }
+  return 0;
+}
+
+
+int nip_reorder_clique(nip_clique c, nip_variable vars[]){
+  int i, n, err;
+  int* mapping = NULL;
+  int* cardinality = NULL;
+  nip_potential p = NULL;
+  nip_potential original_p = NULL;
+
+  if(!c || !vars)
+    return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+  n = NIP_DIMENSIONALITY(c->p);
+
+  /* the new dimension i is the old dimension mapping[i] */
+  mapping = nip_mapper(c->variables, vars, n, n);
+  cardinality = (int*) calloc(n + 1, sizeof(int));
+  if(!mapping || !cardinality){
+    free(mapping);
+    free(cardinality);
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  }
+  for(i = 0; i < n; i++)
+    cardinality[i] = NIP_CARDINALITY(vars[i]);
+  p = nip_new_potential(cardinality, n, NULL);
+  original_p = nip_new_potential(cardinality, n, NULL);
+  free(cardinality);
+  if(!p || !original_p){
+    free(mapping);
+    nip_free_potential(p);
+    nip_free_potential(original_p);
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  }
+
+  /* "marginalising" without summing anything */
+  err = nip_general_marginalise(c->p, p, mapping);
+  if(!err)
+    err = nip_general_marginalise(c->original_p, original_p, mapping);
+  free(mapping);
+  if(err != 0){
+    nip_free_potential(p);
+    nip_free_potential(original_p);
+    return nip_report_error(__FILE__, __LINE__, err, 1);
+  }
+
+  nip_free_potential(c->p);
+  nip_free_potential(c->original_p);
+  c->p = p;
+  c->original_p = original_p;
+  for(i = 0; i < n; i++)
+    c->variables[i] = vars[i];
+  return 0;
+}
+
+
+double nip_get_clique_value(nip_clique c, nip_variable vars[], int indices[]){
+  int i, j, n;
+  int index = 0;
+  int step = 1;
+
+  if(!c || !vars || !indices){
+    nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+    return -1;
+  }
+  n = NIP_DIMENSIONALITY(c->p);
+
+  /* the first dimension is the least significant */
+  for(i = 0; i < n; i++){
+    for(j = 0; j < n && !nip_equal_variables(vars[j], c->variables[i]); j++);
+    if(j == n){
+      nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+      return -1;
+    }
+    index += indices[j] * step;
+    step *= NIP_CARDINALITY(c->variables[i]);
+  }
+  return c->p->data[index];
+}
+
+
+nip_potential nip_clique_potential(nip_clique c, nip_variable vars[]){
+  int i, n, err;
+  int* mapping = NULL;
+  int* cardinality = NULL;
+  nip_potential p = NULL;
+
+  if(!c || !vars){
+    nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+    return NULL;
+  }
+  n = NIP_DIMENSIONALITY(c->p);
+
+  /* dimension i of the copy is dimension mapping[i] of the clique */
+  mapping = nip_mapper(c->variables, vars, n, n);
+  cardinality = (int*) calloc(n + 1, sizeof(int));
+  if(!mapping || !cardinality){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    free(mapping);
+    free(cardinality);
+    return NULL;
+  }
+  for(i = 0; i < n; i++)
+    cardinality[i] = NIP_CARDINALITY(vars[i]);
+  p = nip_new_potential(cardinality, n, NULL);
+  free(cardinality);
+  if(!p){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    free(mapping);
+    return NULL;
+  }
+
+  /* "marginalising" without summing anything */
+  err = nip_general_marginalise(c->p, p, mapping);
+  free(mapping);
+  if(err != 0){
+    nip_report_error(__FILE__, __LINE__, err, 1);
+    nip_free_potential(p);
+    return NULL;
+  }
+  return p;
+}
+
+
+int nip_arrange_clique_dimensions(nip_clique cliques[], int num_of_cliques){
+  int i, j, k, n, m, t, err;
+  int* placed = NULL;
+  nip_variable* vars = NULL;
+  nip_variable* tail = NULL;
+  nip_sepset s, low, high;
+  nip_sepset_link l;
+  nip_clique c;
+
+  for(i = 0; i < num_of_cliques; i++){
+    c = cliques[i];
+    n = NIP_DIMENSIONALITY(c->p);
+
+    /* the two largest sepsets with any variables */
+    low = NULL;
+    high = NULL;
+    for(l = c->sepsets; l != NULL; l = l->fwd){
+      s = (nip_sepset) l->data;
+      if(NIP_DIMENSIONALITY(s->new) == 0)
+	continue;
+      if(!low || s->new->size_of_data > low->new->size_of_data){
+	high = low;
+	low = s;
+      }
+      else if(!high || s->new->size_of_data > high->new->size_of_data)
+	high = s;
+    }
+    if(!low || n < 2)
+      continue;
+
+    placed = (int*) calloc(n, sizeof(int));
+    vars = (nip_variable*) calloc(n, sizeof(nip_variable));
+    tail = (nip_variable*) calloc(n, sizeof(nip_variable));
+    if(!placed || !vars || !tail){
+      free(placed);
+      free(vars);
+      free(tail);
+      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    }
+
+    /* the variables of low in the order of the sepset potential, 
+     * then the rest, and last the rest of high in its order */
+    m = 0;
+    for(j = 0; j < NIP_DIMENSIONALITY(low->new); j++){
+      k = nip_clique_var_index(c, low->variables[j]);
+      placed[k] = 1;
+      vars[m++] = low->variables[j];
+    }
+    t = 0;
+    for(j = 0; high && j < NIP_DIMENSIONALITY(high->new); j++){
+      k = nip_clique_var_index(c, high->variables[j]);
+      if(!placed[k]){
+	placed[k] = 1;
+	tail[t++] = high->variables[j];
+      }
+    }
+    for(j = 0; j < n; j++)
+      if(!placed[j])
+	vars[m++] = c->variables[j];
+    for(j = 0; j < t; j++)
+      vars[m++] = tail[j];
+
+    for(j = 0; j < n && vars[j] == c->variables[j]; j++);
+    err = (j < n) ? nip_reorder_clique(c, vars) : 0;
+    free(placed);
+    free(vars);
+    free(tail);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+  }
+  return 0;
+}
+
+
+static double nip_message_cost(nip_clique c1, nip_clique c2){
+  /* marginalising one and updating the other */
+  return (double)c1->p->size_of_data + (double)c2->p->size_of_data;
+}
+
+
+static int nip_same_scope(nip_sepset s1, nip_sepset s2){
+  return (nip_bitset_is_subset(s1->scope, s2->scope) &&
+	  nip_bitset_is_subset(s2->scope, s1->scope));
+}
+
+
+static nip_clique nip_best_root(nip_clique start){
+  int i, k, c, n, best;
+  double w, t, shortest;
+  nip_tree_node* nodes = NULL;
+  double* down = NULL;  /* critical path of collecting each subtree */
+  double* up = NULL;    /* the same for the rest of the tree */
+  double* costs = NULL; /* messages to and from all neighbours */
+  int* deepest = NULL;  /* the child with the longest path */
+  double* second = NULL; /* the longest path of the other children */
+  nip_clique root;
+
+  n = nip_list_tree_nodes(start, &nodes);
+  if(n < 0)
+    return NULL;
+  down = (double*) calloc(n, sizeof(double));
+  up = (double*) calloc(n, sizeof(double));
+  costs = (double*) calloc(n, sizeof(double));
+  second = (double*) calloc(n, sizeof(double));
+  deepest = (int*) calloc(n, sizeof(int));
+  if(!down || !up || !costs || !second || !deepest){
+    free(nodes);
+    free(down);
+    free(up);
+    free(costs);
+    free(second);
+    free(deepest);
+    return NULL;
+  }
+
+  /* A task absorbs the messages of its children one by one, after the 
+   * tasks of the children are done: with node i as the root, the path
+   * is max(path of a neighbour) + sum(cost of the messages) */
+  for(i = n - 1; i >= 0; i--){
+    deepest[i] = -1;
+    for(k = 0; k < nodes[i].num_of_children; k++){
+      c = nodes[i].first_child + k;
+      w = nip_message_cost(nodes[i].clique, nodes[c].clique);
+      costs[i] += w;
+      costs[c] += w;
+      if(deepest[i] < 0 || down[c] > down[deepest[i]]){
+	if(deepest[i] >= 0)
+	  second[i] = down[deepest[i]];
+	deepest[i] = c;
+      }
+      else if(down[c] > second[i])
+	second[i] = down[c];
+    }
+    /* costs[i] has only the children, the parent comes later */
+    down[i] = ((deepest[i] >= 0) ? down[deepest[i]] : 0) + costs[i];
+  }
+
+  /* Rerooting: the rest of the tree as seen from each child */
+  for(i = 0; i < n; i++){
+    for(k = 0; k < nodes[i].num_of_children; k++){
+      c = nodes[i].first_child + k;
+      w = nip_message_cost(nodes[i].clique, nodes[c].clique);
+      t = (c == deepest[i]) ? second[i] : 
+	((deepest[i] >= 0) ? down[deepest[i]] : 0);
+      if(i > 0 && up[i] > t)
+	t = up[i];
+      up[c] = t + costs[i] - w;
+    }
+  }
+
+  best = 0;
+  shortest = -1;
+  for(i = 0; i < n; i++){
+    t = (deepest[i] >= 0) ? down[deepest[i]] : 0;
+    if(i > 0 && up[i] > t)
+      t = up[i];
+    t += costs[i];
+    if(shortest < 0 || t < shortest){
+      shortest = t;
+      best = i;
+    }
+  }
+  root = nodes[best].clique;
+
+  free(nodes);
+  free(down);
+  free(up);
+  free(costs);
+  free(second);
+  free(deepest);
+  return root;
+}
+
+
+static int nip_reshape_join_tree(nip_clique root){
+  int i, j, k, c, x, n, err = 0;
+  nip_reshape_struct r;
+  nip_group_item* items = NULL;
+  char* grouped = NULL;
+  nip_sepset s;
+
+  n = nip_list_tree_nodes(root, &(r.nodes));
+  if(n < 0)
+    return ENOMEM;
+  r.reach = (double*) calloc(n, sizeof(double));
+  r.cost = (double*) calloc(n, sizeof(double));
+  r.group_reach = (double*) calloc(n, sizeof(double));
+  r.group_cost = (double*) calloc(n, sizeof(double));
+  r.parents = (int*) calloc(n, sizeof(int));
+  r.shape = (int*) calloc(n, sizeof(int));
+  r.members = (int*) calloc(n, sizeof(int));
+  r.order = (int*) calloc(n, sizeof(int));
+  items = (nip_group_item*) calloc(n, sizeof(nip_group_item));
+  grouped = (char*) calloc(n, sizeof(char));
+  if(!r.reach || !r.cost || !r.group_reach || !r.group_cost || 
+     !r.parents || !r.shape || !r.members || !r.order || 
+     !items || !grouped)
+    err = ENOMEM;
+
+  for(i = 0; !err && i < n; i++)
+    r.parents[i] = r.nodes[i].parent;
+
+  /* From the leaves up: the groups hanging from node i, except the one
+   * continuing from above i, which is reshaped as a part of a bigger 
+   * group. The paths below the members are known by then. */
+  for(i = n - 1; !err && i >= 0; i--){
+    for(k = 0; k < r.nodes[i].num_of_children; k++){
+      c = r.nodes[i].first_child + k;
+      if(grouped[c] || 
+	 (i > 0 && nip_same_scope(r.nodes[c].sepset, r.nodes[i].sepset)))
+	continue;
+
+      /* the siblings and descendants connected by the same variables */
+      r.num_of_members = 0;
+      for(j = k; j < r.nodes[i].num_of_children; j++){
+	x = r.nodes[i].first_child + j;
+	if(!grouped[x] && nip_same_scope(r.nodes[x].sepset, 
+					 r.nodes[c].sepset)){
+	  grouped[x] = 1;
+	  r.members[r.num_of_members++] = x;
+	}
+      }
+      for(j = 0; j < r.num_of_members; j++){
+	x = r.members[j];
+	for(x = r.nodes[x].first_child; 
+	    x < r.nodes[r.members[j]].first_child + 
+	      r.nodes[r.members[j]].num_of_children; x++){
+	  if(nip_same_scope(r.nodes[x].sepset, r.nodes[c].sepset)){
+	    grouped[x] = 1;
+	    r.members[r.num_of_members++] = x;
+	  }
+	}
+      }
+      nip_reshape_group(&r, i, items);
+    }
+  }
+
+  /* Move the sepsets that got a new parent */
+  for(i = 1; !err && i < n; i++){
+    if(r.parents[i] == r.nodes[i].parent)
+      continue;
+    s = r.nodes[i].sepset;
+    nip_remove_sepset(s->first_neighbour, s);
+    nip_remove_sepset(s->second_neighbour, s);
+    s->first_neighbour = r.nodes[r.parents[i]].clique;
+    s->second_neighbour = r.nodes[i].clique;
+    err = nip_confirm_sepset(s);
+  }
+
+  free(r.nodes);
+  free(r.reach);
+  free(r.cost);
+  free(r.group_reach);
+  free(r.group_cost);
+  free(r.parents);
+  free(r.shape);
+  free(r.members);
+  free(r.order);
+  free(items);
+  free(grouped);
+  return err;
+}
+
+
+static void nip_reshape_group(nip_reshape_struct* r, int top,
+			      nip_group_item* items){
+  int j, x, candidate, m = r->num_of_members;
+  double path, total, best_path, best_total, limit;
+  nip_tree_node* nodes = r->nodes;
+
+  best_total = nip_group_path(r, top, r->members, r->parents, &best_path);
+  limit = best_total;
+
+  /* Candidates: balanced binary trees with the longest paths or 
+   * the smallest cliques on top */
+  for(candidate = 0; m > 1 && candidate < 2; candidate++){
+    for(j = 0; j < m; j++){
+      x = r->members[j];
+      path = r->reach[x] + r->cost[x];
+      items[j].node = x;
+      items[j].primary = (candidate == 0) ? 
+	-path : (double)nodes[x].clique->p->size_of_data;
+      items[j].secondary = (candidate == 0) ? 
+	(double)nodes[x].clique->p->size_of_data : -path;
+    }
+    qsort(items, m, sizeof(nip_group_item), nip_compare_group_items);
+    for(j = 0; j < m; j++){
+      r->order[j] = items[j].node;
+      r->shape[items[j].node] = (j < 2) ? top : r->order[j/2 - 1];
+    }
+
+    total = nip_group_path(r, top, r->order, r->shape, &path);
+    if(total <= limit && 
+       (path < best_path || (path == best_path && total < best_total))){
+      best_path = path;
+      best_total = total;
+      for(j = 0; j < m; j++){
+	r->members[j] = r->order[j];
+	r->parents[r->order[j]] = r->shape[r->order[j]];
+      }
+    }
+  }
+
+  /* the chosen shape adds to the path of top */
+  nip_group_path(r, top, r->members, r->parents, &path);
+  if(r->group_reach[top] > r->reach[top])
+    r->reach[top] = r->group_reach[top];
+  r->cost[top] += r->group_cost[top];
+  return;
+}
+
+
+static double nip_group_path(nip_reshape_struct* r, int top, int* order,
+			     int* parents, double* path){
+  int j, x, p, m = r->num_of_members;
+  double w, reach, total = 0;
+
+  r->group_reach[top] = 0;
+  r->group_cost[top] = 0;
+  for(j = 0; j < m; j++){
+    r->group_reach[order[j]] = 0;
+    r->group_cost[order[j]] = 0;
+  }
+
+  /* children before parents */
+  for(j = m - 1; j >= 0; j--){
+    x = order[j];
+    p = parents[x];
+    reach = r->reach[x];
+    if(r->group_reach[x] > reach)
+      reach = r->group_reach[x];
+    reach += r->cost[x] + r->group_cost[x];
+    w = nip_message_cost(r->nodes[x].clique, r->nodes[p].clique);
+    total += w;
+    r->group_cost[p] += w;
+    if(reach > r->group_reach[p])
+      r->group_reach[p] = reach;
+  }
+  *path = r->group_reach[top] + r->group_cost[top];
+  return total;
+}
+
+
+static int nip_compare_group_items(const void* a, const void* b){
+  const nip_group_item* i = (const nip_group_item*) a;
+  const nip_group_item* j = (const nip_group_item*) b;
+  if(i->primary != j->primary)
+    return (i->primary < j->primary) ? -1 : 1;
+  if(i->secondary != j->secondary)
+    return (i->secondary < j->secondary) ? -1 : 1;
+  return i->node - j->node;
+}
 static int nip_message_pass(nip_clique c1, nip_sepset s, nip_clique c2){
   int err;
   int *mapping;
@@ -686,33 +1553,27 @@ int nip_init_clique(nip_clique c, nip_variable child,
   nip_variable var = NULL;
   nip_variable* parents = nip_get_parents(child);
 
-  if(NIP_DIMENSIONALITY(p) < NIP_DIMENSIONALITY(c->p)){
-
-    mapping = (int *) calloc(NIP_DIMENSIONALITY(p), sizeof(int));
-    if(!mapping)
-      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  mapping = (int *) calloc(NIP_DIMENSIONALITY(p), sizeof(int));
+  if(!mapping)
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
 
-    /***************************************************************/
-    /* HEY! parents[] NOT assumed to be in any particular order!   */
-    /* But the variables of p are assumed to be in the same order  */
-    /* as in the clique c!                                         */
-    /***************************************************************/
-
-    /* initialisation with conditional distributions
-       first: select the variables (in a stupid but working way) */
-    /* FIXME: use mapper? */
-    k = 0;
-    for(i=0; i < NIP_DIMENSIONALITY(c->p); i++){
-      if(k == NIP_DIMENSIONALITY(p))
-        break; /* all found */
-      var = (c->variables)[i];
-
-      for(j=0; j < NIP_DIMENSIONALITY(p) - 1; j++)
-        if(nip_equal_variables(var, parents[j]))
-          mapping[k++] = i;
-
-      if(nip_equal_variables(var, child))
-        mapping[k++] = i;
+  /***************************************************************/
+  /* HEY! parents[] NOT assumed to be in any particular order!   */
+  /* The variables of p are in the order of their IDs, like      */
+  /* nip_create_potential() makes them, but the clique c can     */
+  /* have any order (see nip_arrange_clique_dimensions()).       */
+  /***************************************************************/
+  for(i = 0; i < NIP_DIMENSIONALITY(p); i++){
+    var = (i == 0) ? child : parents[i - 1];
+    k = 0; /* how many variables of the family come before var */
+    for(j = 0; j < NIP_DIMENSIONALITY(p); j++)
+      if(nip_variable_id((j == 0) ? child : parents[j - 1]) < 
+	 nip_variable_id(var))
+	k++;
+    mapping[k] = nip_clique_var_index(c, var);
+    if(mapping[k] < 0){
+      free(mapping);
+      return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
     }
   }
 
@@ -736,7 +1597,7 @@ int nip_init_clique(nip_clique c, nip_variable child,
    * some clique potentials need to be initialised but still
    * be retractable... */
 
-  free(mapping); /* free(NULL) is O.K. */
+  free(mapping);
   return 0;
 }
 
@@ -923,6 +1784,8 @@ static int nip_clique_var_index(nip_clique c, nip_variable v){
     nip_report_error(__FILE__, __LINE__, EFAULT, 1);
     return -1;
   }
+  if(!NIP_BITSET_CONTAINS(c->scope, nip_variable_index(v)))
+    return -1; /* without searching */
 
   while(!nip_equal_variables(v, c->variables[var])){
     var++;
@@ -1009,25 +1872,46 @@ int* nip_find_family_mapping(nip_clique family, nip_variable child){
 
 nip_clique nip_find_clique(nip_clique *cliques, int ncliques,
                            nip_variable *variables, int nvars){
-  int i, j, k;
-  int ok;
+  int i;
+  nip_clique found = NULL;
+  nip_bitset set = nip_variable_bitset(variables, nvars);
 
-  for(i = 0; i < ncliques; i++){
-    ok = 0;
-    for(j = 0; j < nvars; j++){
-      for(k = 0; k < NIP_DIMENSIONALITY(cliques[i]->p); k++){
-        if(nip_equal_variables(variables[j], cliques[i]->variables[k])){
-          ok++;
-          break; /* found the variable in the clique */
-        }
-      }
-    }
-    /* All variables found in the clique */
-    if(ok == nvars)
-      return cliques[i];
-  }
+  if(!set)
+    return NULL;
 
-  return NULL;
+  /* The first clique containing all the variables */
+  for(i = 0; i < ncliques && !found; i++)
+    if(nip_bitset_is_subset(set, cliques[i]->scope))
+      found = cliques[i];
+
+  nip_free_bitset(set);
+  return found;
+}
+
+
+int nip_clique_intersection(nip_clique cl1, nip_clique cl2,
+                            nip_variable **vars, int *n){
+  int i, m;
+  nip_variable* isect = NULL;
+
+  if(!(cl1 && cl2 && vars && n))
+    return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+
+  /* Variables of cl1 in the scope of cl2, in the order of cl1 */
+  m = nip_bitset_intersection_size(cl1->scope, cl2->scope);
+  if(m > 0){
+    isect = (nip_variable*) calloc(m, sizeof(nip_variable));
+    if(!isect)
+      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    m = 0;
+    for(i = 0; i < NIP_DIMENSIONALITY(cl1->p); i++)
+      if(NIP_BITSET_CONTAINS(cl2->scope, 
+			     nip_variable_index(cl1->variables[i])))
+	isect[m++] = cl1->variables[i];
+  }
+  *vars = isect;
+  *n = m;
+  return 0;
 }
 
 
@@ -1165,7 +2049,7 @@ double nip_probability_mass(nip_clique* cliques, int ncliques){
 nip_potential nip_gather_joint_probability(nip_clique start,
                                            nip_variable *vars, int n_vars,
                                            nip_variable *isect, int n_isect){
-  int i, err;
+  int i, j, k, err;
   int* mapping = NULL;
   int* cardinality = NULL;
 
@@ -1286,10 +2170,9 @@ nip_potential nip_gather_joint_probability(nip_clique start,
 	/* 3.3 Decide what kind of potential you need
 	 *     from the rest of the tree */
 
-	/* original <vars> and intersection of cliques */
-	msg_isect = nip_variable_isect(s->variables, vars,
-                                 NIP_DIMENSIONALITY(s->new), n_vars,
-                                 &nmsgi);
+	/* original <vars> and the rest of the sepset variables */
+	msg_isect = (nip_variable*) calloc(NIP_DIMENSIONALITY(s->new) + 1,
+					   sizeof(nip_variable));
 	if(!msg_isect){
 	  nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
 	  free(cardinality);
@@ -1297,14 +2180,31 @@ nip_potential nip_gather_joint_probability(nip_clique start,
 	  nip_free_potential(prod);
 	  return NULL;
 	}
+	nmsgi = 0;
+	for(j = 0; j < NIP_DIMENSIONALITY(s->new); j++){
+	  for(k = 0; k < n_vars; k++)
+	    if(nip_equal_variables(s->variables[j], vars[k]))
+	      break;
+	  if(k == n_vars)
+	    msg_isect[nmsgi++] = s->variables[j];
+	}
 
 	/* 3.4 Continue DFS */
 	msg = nip_gather_joint_probability(c, vars, n_vars, msg_isect, nmsgi);
+	if(!msg){
+	  nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+	  free(msg_isect);
+	  free(cardinality);
+	  free(prod_vars);
+	  nip_free_potential(prod);
+	  return NULL;
+	}
 
 	/* 3.5 Mapping between prod potential and recursive result */
 	msg_vars = nip_variable_union(vars, msg_isect, n_vars, nmsgi, &nmsg);
 	mapping = nip_mapper(prod_vars, msg_vars, nprod, nmsg);
 	free(msg_vars);
+	free(msg_isect);
 
 	/* 3.6 Multiplication with the recursive results */
 	err = nip_update_potential(msg, NULL, prod, mapping);
@@ -1313,6 +2213,7 @@ nip_potential nip_gather_joint_probability(nip_clique start,
 	if(err != 0){
 	  nip_report_error(__FILE__, __LINE__, err, 1);
 	  free(cardinality);
+	  free(prod_vars);
 	  nip_free_potential(prod);
 	  return NULL;
 	}
@@ -1321,13 +2222,26 @@ nip_potential nip_gather_joint_probability(nip_clique start,
 
     l = l->fwd; /* next neigboring sepset */
   }
-  free(prod_vars);
 
   /*** 4. Marginalisation (if any?) ***/
 
+  /* 4.0 Where the result variables (<vars> then <isect>) are in prod */
+  msg_vars = nip_variable_union(vars, isect, n_vars, n_isect, &nmsg);
+  mapping = nip_mapper(prod_vars, msg_vars, nprod, nmsg);
+  free(msg_vars);
+  free(prod_vars);
+  if(!mapping){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    free(cardinality);
+    nip_free_potential(prod);
+    return NULL;
+  }
+  for(i = 0; i < nmsg && mapping[i] == i; i++)
+    ;
+
   /* If we already have what we need, no marginalisation needed... */
-  if(nprod == n_vars + n_isect){
-    /* FIXME: is the above condition enough? */
+  if(nprod == n_vars + n_isect && i == nmsg){
+    free(mapping);
     free(cardinality);
     sum = prod;
   }
@@ -1341,12 +2255,7 @@ nip_potential nip_gather_joint_probability(nip_clique start,
     sum = nip_new_potential(cardinality, n_vars + n_isect, NULL);
     free(cardinality);
 
-    /* 4.2 Form the mapping between prod and sum potentials */
-    mapping = (int*) calloc(n_vars + n_isect, sizeof(int));
-    for(i = 0; i < n_vars + n_isect; i++)
-      mapping[i] = i; /* Trivial because of the union operation above */
-
-    /* 4.3 Marginalise */
+    /* 4.2 Marginalise (with the mapping formed above) */
     err = nip_general_marginalise(prod, sum, mapping);
     free(mapping);
     /* The gain of having a join tree in the first place: */
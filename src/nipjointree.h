@@ -38,12 +38,17 @@ typedef struct nip_sepsetlink {
 typedef nip_sepsetlink_struct* nip_sepset_link; ///< sepset list reference
 
 /**
- * Cliques: nodes of the join tree, containing a belief potential of related random variables
+ * Cliques: nodes of the join tree, containing a belief potential of related random variables.
+ * The order of \p variables (and the dimensions of the potentials) is the
+ * memory layout chosen by nip_arrange_clique_dimensions(), not the order
+ * of the variable IDs: use nip_get_clique_value() or nip_clique_potential()
+ * to read the potential in an order of your own.
  */
 typedef struct {
   nip_potential p; ///< current belief potential with evidence etc.
   nip_potential original_p; ///< the original model distribution, not messed with evidence
-  nip_variable* variables; ///< related random variables, array size == p->dimensionality
+  nip_variable* variables; ///< related random variables in the order of the dimensions, array size == p->dimensionality
+  nip_bitset scope; ///< the variables as a set of their indices
   nip_sepset_link sepsets; ///< list of neighboring sepsets (and other cliques behind each)
   int num_of_sepsets; ///< number of sepsets, TODO: coupled with the list, but efficient?
   char mark; ///< the way to prevent endless loops, either MARK_ON or MARK_OFF
@@ -57,6 +62,7 @@ typedef struct {
   nip_potential old; ///< previous potential (before latest evidence)
   nip_potential new; ///< current potential (after latest evidence)
   nip_variable* variables; ///< related variables, size == old->num_of_vars
+  nip_bitset scope; ///< the variables as a set of their indices
   nip_clique first_neighbour; ///< one of the two (neighbour) cliques
   nip_clique second_neighbour; ///< another of the two (neighbour) cliques
 } nip_sepset_struct;
@@ -176,6 +182,83 @@ int nip_distribute_evidence(nip_clique c);
  * @see nip_unmark_clique() */
 int nip_collect_evidence(nip_clique c1, nip_sepset s12, nip_clique c2);
 
+/**
+ * Minimum number of potential entries in a subtree of the join tree
+ * worth a task of its own in nip_propagate_evidence(). Smaller subtrees,
+ * and smaller join trees altogether, are handled serially. */
+#define NIP_PARALLEL_MIN_ENTRIES 32768
+
+/** Upper limit for the number of threads propagating evidence */
+#define NIP_MAX_PROPAGATION_THREADS 16
+
+/**
+ * Makes the join tree consistent: collects evidence to clique \p root
+ * and distributes it back, like nip_collect_evidence() followed by
+ * nip_distribute_evidence(). If the join tree is large enough,
+ * independent subtrees are processed concurrently by a pool of threads:
+ * the number of online processors, or the value of the NIP_THREADS
+ * environment variable. The messages are combined in the same order
+ * in any case, so the results do not depend on the number of threads.
+ * The cliques need not be unmarked before calling this.
+ * @param root The clique where the evidence is collected to
+ * @return an error code, or 0 if successful */
+int nip_propagate_evidence(nip_clique root);
+
+/**
+ * Reshapes a join tree and chooses its root so that the schedule of
+ * nip_propagate_evidence() is shallow and cheap. The cost of a message
+ * is the size of the two clique potentials involved, and the tasks 
+ * waiting for each other form the critical path of the schedule.
+ * Neighbours connected by sepsets of the same variables can be connected
+ * in any shape, since all of them contain those variables: such groups
+ * are rearranged into balanced trees, if that shortens the critical path
+ * without adding to the total size of the messages. Finally, the clique
+ * with the shortest critical path is swapped to \p cliques[0].
+ * @param cliques Array of all the cliques of the join tree
+ * @param num_of_cliques Size of the array \p cliques
+ * @return an error code, or 0 if successful */
+int nip_balance_join_tree(nip_clique cliques[], int num_of_cliques);
+
+/**
+ * Permutes the dimensions of the potentials of a clique, so that its
+ * variables are in the given order. The mappings between cliques and 
+ * other potentials come from the variables, so this changes only 
+ * the layout of the data in memory.
+ * @param c The clique to modify
+ * @param vars The variables of \p c in the new order
+ * @return an error code, or 0 if successful */
+int nip_reorder_clique(nip_clique c, nip_variable vars[]);
+
+/**
+ * Gets a value of the current belief potential of a clique by the
+ * variables, whatever the order of its dimensions.
+ * @param c The clique
+ * @param vars The variables of \p c in any order
+ * @param indices The state of each variable in \p vars
+ * @return the value, or -1 if \p vars are not those of \p c */
+double nip_get_clique_value(nip_clique c, nip_variable vars[], int indices[]);
+
+/**
+ * Copies the current belief potential of a clique, with the dimensions
+ * in the given order instead of the layout of the clique.
+ * @param c The clique
+ * @param vars The variables of \p c in the order of the copy
+ * @return a new potential (free after use), or NULL in case of errors
+ * @see nip_get_clique_value() */
+nip_potential nip_clique_potential(nip_clique c, nip_variable vars[]);
+
+/**
+ * Chooses the order of the dimensions of each clique potential for
+ * passing messages: the variables of the largest neighbouring sepset
+ * become the least significant, and the rest of the second largest 
+ * the most significant. Marginalising onto those sepsets and updating
+ * from them then reads contiguous blocks of the clique potential.
+ * @param cliques Array of all the cliques of the join tree
+ * @param num_of_cliques Size of the array \p cliques
+ * @return an error code, or 0 if successful
+ * @see nip_reorder_clique() */
+int nip_arrange_clique_dimensions(nip_clique cliques[], int num_of_cliques);
+
 /**
  * Method for finding out the joint probability distribution of arbitrary
  * variables by making a DFS in the join tree.
@@ -22,6 +22,11 @@
  */
 
 #include "nipparsers.h"
+#include <ctype.h>    // isspace
+#include <pthread.h>  // pthread_create
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include "nipthreads.h"
 
 /* #define DEBUG_PARSER */
 
@@ -29,17 +34,43 @@
 
 /* #define DEBUG_DATAFILE */
 
-#define NIP_PARSER_FOUND_DATA 0
-#define NIP_PARSER_EXPECT_DATA 1
-#define NIP_PARSER_EXPECT_HEADER 2
-
 static int nip_null_observation(char* token);
 
 static void nip_free_data_file(nip_data_file f);
 
-static int nip_count_data_rows(nip_data_file f);
-static int nip_set_node_symbols(nip_data_file file, char* line, int* token_bounds, int ntokens);
-static int nip_accumulate_state_names(nip_string_list* statenames, char* line, int* token_bounds, int ntokens);
+
+/* A part of a data file, analysed by one thread */
+typedef struct {
+  nip_data_file file; /* the file being analysed */
+  size_t begin;       /* the first character of the part */
+  size_t end;         /* the character after the part */
+  int nseries;        /* number of time series found in the part */
+  int* series_rows;   /* number of rows in each of them */
+  size_t* series_positions; /* position of each of them in the buffer */
+  int nrows;          /* number of rows of data in the part */
+  nip_string_list* statenames; /* state names found in each column */
+  int error;          /* NIP_NO_ERROR, or what went wrong */
+} nip_data_chunk_struct;
+
+typedef nip_data_chunk_struct* nip_data_chunk;
+
+static int nip_load_data_file(nip_data_file f);
+static int nip_data_delimiter(nip_data_file f, char ch);
+static int nip_copy_row(nip_data_file f, size_t* pos, size_t end,
+                        char** line, size_t* line_size);
+static int nip_split_row(nip_data_file f, char* buffer, size_t* pos,
+                         size_t end, char** tokens, int max_tokens);
+static int nip_tokenise_row(nip_data_file f, char* line, size_t length,
+                            char*** tokens, int* max_tokens);
+static int nip_count_row_tokens(nip_data_file f, size_t* pos, size_t end);
+static size_t nip_next_series_boundary(nip_data_file f, size_t pos);
+static void* nip_analyse_chunk(void* chunk);
+static int nip_merge_chunks(nip_data_file f, nip_data_chunk chunks, int n);
+static void nip_free_chunk(nip_data_chunk c, int n_columns);
+static int nip_set_node_symbols(nip_data_file file, char** tokens, int ntokens);
+static int nip_accumulate_state_names(nip_string_list* statenames, char** tokens, int ntokens);
+static void nip_free_state_names(nip_string_list* statenames, int n,
+                                 int keep_names);
 
 nip_data_file nip_open_data_file(char* filename, char separator,
                                  int write, int nodenames){
@@ -63,10 +94,18 @@ nip_data_file nip_open_data_file(char* filename, char separator,
   f->label_line = -1; /* headerless by default */
   f->ndatarows = 0;
   f->datarows = NULL;
+  f->series_positions = NULL;
   f->node_symbols = NULL;
   f->num_of_nodes = 0;
   f->node_states = NULL;
   f->num_of_states = NULL;
+  f->buffer = NULL;
+  f->buffer_size = 0;
+  f->mapped = 0;
+  f->position = 0;
+  f->nrows = 0;
+  f->row = NULL;
+  f->row_size = 0;
 
   if(write)
     f->file = fopen(filename,"w");
@@ -96,14 +135,18 @@ nip_data_file nip_open_data_file(char* filename, char separator,
 
 int nip_analyse_data_file(nip_data_file file){
 
-  int i, state = NIP_PARSER_FOUND_DATA;
+  int i, k, nthreads;
   int linecounter = 0;
-  int tscounter = 0;
-  char last_line[MAX_LINELENGTH];
   int num_of_tokens = 0;
-  int* token_bounds;
-  int empty_lines_read = 0;
-  nip_string_list* statenames = NULL;
+  int max_tokens = 0;
+  int e = NIP_NO_ERROR;
+  char** line_tokens = NULL;
+  char* row = NULL;
+  size_t row_size = 0;
+  size_t pos, line, size, data_begin, target;
+  nip_data_chunk chunks = NULL;
+  pthread_t* threads = NULL;
+  int* started = NULL;
 
   if (file->write){
     return 0;
@@ -111,188 +154,515 @@ int nip_analyse_data_file(nip_data_file file){
   /* If the file is opened in read mode, check the contents.
    * This includes names of nodes and their states.
    */
+  if(nip_load_data_file(file) != NIP_NO_ERROR)
+    return -1;
+  size = file->buffer_size;
+
+  /* The first non-empty line: node labels, or the first row of data
+   * that tells how many columns there are (left intact for later) */
+  pos = 0;
+  line = 0;
+  while(pos < size && num_of_tokens == 0){
+    linecounter++;
+    line = pos;
+    if(file->first_line_labels){
+      num_of_tokens = nip_copy_row(file, &pos, size, &row, &row_size);
+      if(num_of_tokens > 0)
+        num_of_tokens = nip_tokenise_row(file, row, num_of_tokens,
+                                         &line_tokens, &max_tokens);
+    }
+    else
+      num_of_tokens = nip_count_row_tokens(file, &pos, size);
+  }
+  if(num_of_tokens < 0){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    free(line_tokens);
+    free(row);
+    return -1;
+  }
+  if(num_of_tokens == 0){
+    free(line_tokens);
+    free(row);
+    return 0; /* no data at all */
+  }
 
-  /* the first pass: find header, count columns, count consecutive rows of data */
-  file->ndatarows = nip_count_data_rows(file);
+  /* Read node names or make them up. */
+  if (nip_set_node_symbols(file, line_tokens, num_of_tokens) < 0) {
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    free(line_tokens);
+    free(row);
+    return -1;
+  }
+  free(line_tokens);
+  free(row);
+  if(file->first_line_labels){
+    file->label_line = linecounter;
+    data_begin = pos; /* data starts after the header */
+  }
+  else
+    data_begin = line;
 
-  /* allocate file->datarows array */
-  file->datarows = (int*) calloc(file->ndatarows, sizeof(int));
-  /* NOTE: calloc resets the contents to zero! */
-  if(!file->datarows){
+  /* allocate memory for counting states */
+  file->num_of_states = (int *) calloc(file->num_of_nodes, sizeof(int));
+  file->node_states = (char ***) calloc(file->num_of_nodes, sizeof(char **));
+  if(!file->num_of_states || !file->node_states){
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
     return -1;
   }
 
-  /* the second pass: determine node labels (header) and unique states */
-  linecounter = 0;
-  state = NIP_PARSER_EXPECT_DATA;
-  if(file->first_line_labels)
-    state = NIP_PARSER_EXPECT_HEADER;
+  /* Split the data into parts at time series boundaries (empty lines),
+   * so that each part can be analysed by a separate thread */
+  nthreads = nip_data_threads(size - data_begin);
+  chunks = (nip_data_chunk) calloc(nthreads, sizeof(nip_data_chunk_struct));
+  threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+  started = (int*) calloc(nthreads, sizeof(int));
+  if(!chunks || !threads || !started){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    free(chunks);
+    free(threads);
+    free(started);
+    return -1;
+  }
+  for(k = 0; k < nthreads; k++){
+    chunks[k].file = file;
+    chunks[k].begin = (k == 0) ? data_begin : chunks[k - 1].end;
+    chunks[k].end = size;
+    if(k < nthreads - 1){
+      target = data_begin + ((size - data_begin) / nthreads) * (k + 1);
+      if(target < chunks[k].begin)
+        target = chunks[k].begin;
+      chunks[k].end = nip_next_series_boundary(file, target);
+    }
+  }
 
-  while(fgets(last_line, MAX_LINELENGTH, file->file)){
+  /* The first part is analysed by this thread and the rest in parallel,
+   * or also here if no more threads can be created */
+  for(k = 1; k < nthreads; k++)
+    started[k] = (pthread_create(&(threads[k]), NULL,
+                                 nip_analyse_chunk, &(chunks[k])) == 0);
+  nip_analyse_chunk(&(chunks[0]));
+  for(k = 1; k < nthreads; k++){
+    if(started[k])
+      pthread_join(threads[k], NULL);
+    else
+      nip_analyse_chunk(&(chunks[k]));
+  }
+  free(threads);
+  free(started);
+
+  for(k = 0; k < nthreads && e == NIP_NO_ERROR; k++)
+    e = chunks[k].error;
+  if(e == NIP_NO_ERROR)
+    e = nip_merge_chunks(file, chunks, nthreads);
+  if(e != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, e, 1);
+    for(k = 0; k < nthreads; k++)
+      nip_free_chunk(&(chunks[k]), file->num_of_nodes);
+    free(chunks);
+    return -1;
+  }
 
-    num_of_tokens = nip_count_tokens(last_line, NULL, 0,
-                                     &(file->separator), 1, 0, 1);
-    if(num_of_tokens > 0){
-      token_bounds =
-        nip_tokenise(last_line, num_of_tokens, 0, &(file->separator), 1, 0, 1);
-      if(!token_bounds){
-        nip_report_error(__FILE__, __LINE__, nip_check_error_type(), 1);
-        return -1;
-      }
-    }
-    (file->current_line)++;
+  /* Count number of states in each variable and convert lists into arrays */
+  for(i = 0; i < file->num_of_nodes; i++){
+    file->num_of_states[i] = NIP_LIST_LENGTH(chunks[0].statenames[i]);
+    file->node_states[i] = nip_string_list_to_array(chunks[0].statenames[i]);
+  }
+  nip_free_state_names(chunks[0].statenames, file->num_of_nodes, 1);
+  free(chunks);
 
-    /* Ignore empty lines...
-     * only the empty lines immediately after the node labels...
-     * and duplicate empty lines. Otherwise start a new timeseries */
-    if(num_of_tokens == 0){
-      empty_lines_read++;
-      continue; /* empty lines to be ignored */
-    }
-    else{
-      if(empty_lines_read){
-        linecounter = 1;
-        if(state < NIP_PARSER_EXPECT_DATA)
-          tscounter++;
-      }
-      else
-        linecounter++;
-      empty_lines_read = 0;
-      if(state > NIP_PARSER_FOUND_DATA)
-        state--; /* stop ignoring single empty lines */
-    }
- 
-    /* Read node names or make them up. */
-    if(state > NIP_PARSER_FOUND_DATA){
-      /* the first non-empty line and expecting node names: set file->num_of_nodes */
-      if (nip_set_node_symbols(file, last_line, token_bounds, num_of_tokens) < 0) {
-        nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-        free(token_bounds);
-        return -1;
-      }
+  file->current_line = 0;
+  file->position = data_begin;
 
-      /* allocate memory for counting states */
-      statenames = (nip_string_list *) calloc(file->num_of_nodes, sizeof(nip_string_list));
-      if(!statenames){
-        nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-        free(token_bounds);
-        return -1;
-      }
+  return file->ndatarows;
+}
 
-      for(i = 0; i < file->num_of_nodes; i++)
-        statenames[i] = nip_new_string_list();
 
-      file->num_of_states = (int *) calloc(file->num_of_nodes, sizeof(int));
-      if(!file->num_of_states){
-        nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-        for(i = 0; i < file->num_of_nodes; i++)
-          nip_free_string_list(statenames[i]);
-        free(statenames);
-        free(token_bounds);
-        return -1;
-      }
+int nip_data_threads(size_t size){
+  long n;
 
-      file->node_states = (char ***) calloc(file->num_of_nodes, sizeof(char **));
-      if(!file->node_states){
-        nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-        for(i = 0; i < file->num_of_nodes; i++)
-          nip_free_string_list(statenames[i]);
-        free(statenames);
-        free(token_bounds);
-        return -1;
-      }
-    }
-    else{
-      /* Read observations (just in order to see all the different
-         kinds of observations for each node). */
-      file->datarows[tscounter]++;
-      /* i == min(file->num_of_nodes, num_of_tokens) */
-      i = (file->num_of_nodes < num_of_tokens) ? file->num_of_nodes : num_of_tokens;
-      if (i > 0 &&
-          nip_accumulate_state_names(statenames, last_line, token_bounds, i) < 0){
-        nip_report_error(__FILE__, __LINE__, nip_check_error_type(), 1);
-        for(i = 0; i < file->num_of_nodes; i++)
-          nip_free_string_list(statenames[i]);
-        free(statenames);
-        free(token_bounds);
-        return -1;
-      }
+  /* small files are not worth asking about the processors */
+  if(size < 2 * NIP_MIN_DATA_CHUNK)
+    return 1;
+  n = nip_max_threads();
+  if(n > NIP_MAX_DATA_THREADS)
+    n = NIP_MAX_DATA_THREADS;
+  if(n > (long)(size / NIP_MIN_DATA_CHUNK))
+    n = (long)(size / NIP_MIN_DATA_CHUNK);
+  return (n < 1) ? 1 : (int)n;
+}
+
+
+/*
+ * Copies the line starting at *pos into *line (reallocated if needed),
+ * terminates it with '\0' and moves *pos to the beginning of the next
+ * line. Returns the length of the line, or -1 if there was no memory.
+ */
+static int nip_copy_row(nip_data_file f, size_t* pos, size_t end,
+                        char** line, size_t* line_size){
+  size_t i, n;
+  char* bigger = NULL;
+
+  for(i = *pos; i < end && f->buffer[i] != '\n'; i++);
+  n = i - *pos;
+  if(n + 1 > *line_size){
+    bigger = (char*) realloc(*line, n + 1);
+    if(!bigger)
+      return -1;
+    *line = bigger;
+    *line_size = n + 1;
+  }
+  memcpy(*line, &(f->buffer[*pos]), n);
+  (*line)[n] = '\0';
+  *pos = (i < end) ? i + 1 : i;
+  return (int)n;
+}
+
+
+/*
+ * Tokenises the line starting at *pos of a writable buffer in place:
+ * terminates each token with '\0', puts the first max_tokens of them
+ * into tokens and moves *pos to the beginning of the next line.
+ * buffer[end] must exist. Returns the number of tokens on the line.
+ */
+static int nip_split_row(nip_data_file f, char* buffer, size_t* pos,
+                         size_t end, char** tokens, int max_tokens){
+  int n = 0;
+  char ch = '\0';
+  size_t i = *pos;
+
+  while(i < end){
+    ch = buffer[i];
+    if(ch == '\n')
+      break;
+    if(nip_data_delimiter(f, ch)){
+      i++;
+      continue;
     }
-    free(token_bounds);
+
+    if(n < max_tokens)
+      tokens[n] = &(buffer[i]);
+    n++;
+
+    while(i < end && !nip_data_delimiter(f, buffer[i]))
+      i++;
+    ch = buffer[i];
+    buffer[i] = '\0';
+    if(ch == '\n')
+      break;
+    if(i < end)
+      i++;
   }
+  if(ch == '\n')
+    i++; /* also the terminated newline */
+  *pos = i;
+  return n;
+}
 
-  /* Count number of states in each variable and convert lists into arrays */
-  for(i = 0; i < file->num_of_nodes; i++){
-    file->num_of_states[i] = NIP_LIST_LENGTH(statenames[i]);
-    file->node_states[i] = nip_string_list_to_array(statenames[i]);
-    nip_empty_string_list(statenames[i]);
-    free(statenames[i]);
+
+/*
+ * Tokenises a line copied by nip_copy_row() in place, growing the
+ * *tokens array if needed. Returns the number of tokens, or -1 if
+ * there was no memory for them.
+ */
+static int nip_tokenise_row(nip_data_file f, char* line, size_t length,
+                            char*** tokens, int* max_tokens){
+  int n;
+  size_t pos = 0;
+  char** more_tokens = NULL;
+
+  n = nip_split_row(f, line, &pos, length, *tokens, *max_tokens);
+  if(n > *max_tokens){
+    more_tokens = (char**) realloc(*tokens, n * sizeof(char*));
+    if(!more_tokens)
+      return -1;
+    *tokens = more_tokens;
+    *max_tokens = n;
+    pos = 0; /* again: the terminators are delimiters too */
+    n = nip_split_row(f, line, &pos, length, *tokens, *max_tokens);
   }
-  free(statenames);
+  return n;
+}
+
+
+/* Counts the tokens on the line starting at *pos without modifying it,
+ * and moves *pos to the beginning of the next line. */
+static int nip_count_row_tokens(nip_data_file f, size_t* pos, size_t end){
+  int n = 0;
+  int in_token = 0;
+  size_t i;
+
+  for(i = *pos; i < end && f->buffer[i] != '\n'; i++){
+    if(nip_data_delimiter(f, f->buffer[i]))
+      in_token = 0;
+    else if(!in_token){
+      in_token = 1;
+      n++;
+    }
+  }
+  if(i < end)
+    i++;
+  *pos = i;
+  return n;
+}
 
-  rewind(file->file);
-  file->current_line = 0;
 
-  return tscounter;
+/* Finds the beginning of the first line after an empty line, after the
+ * line containing pos, i.e. where a new time series starts. */
+static size_t nip_next_series_boundary(nip_data_file f, size_t pos){
+  int empty;
+  size_t size = f->buffer_size;
+
+  while(pos < size && f->buffer[pos] != '\n')
+    pos++;
+  while(pos < size){
+    pos++; /* past the newline */
+    empty = 1;
+    while(pos < size && f->buffer[pos] != '\n'){
+      if(!nip_data_delimiter(f, f->buffer[pos]))
+        empty = 0;
+      pos++;
+    }
+    if(empty && pos < size)
+      return pos + 1;
+  }
+  return size;
 }
 
+
 /*
- * The first pass over a new data file to determine number of time series.
- * Ignores a header row unless f->first_line_labels==0.
- * Not useful for streaming / online processing.
+ * Analyses a part of a data file: tokenises a copy of each line, counts
+ * rows of data for each time series and collects state names. The part
+ * must start at a time series boundary. Runs in a thread of its own.
  */
-static int nip_count_data_rows(nip_data_file f) {
+static void* nip_analyse_chunk(void* chunk){
+  nip_data_chunk c = (nip_data_chunk) chunk;
+  nip_data_file f = c->file;
+  int i, n;
+  int new_series = 1; /* the next non-empty line starts a time series */
+  int num_of_tokens;
+  int max_tokens = 0;
+  int max_series = 0;
+  int* bigger = NULL;
+  size_t* more_positions = NULL;
+  char** line_tokens = NULL;
+  char* row = NULL;
+  size_t row_size = 0;
+  size_t line, pos = c->begin;
+
+  c->error = NIP_NO_ERROR;
+  c->statenames = (nip_string_list*) calloc(f->num_of_nodes,
+                                            sizeof(nip_string_list));
+  if(!c->statenames){
+    c->error = ENOMEM;
+    return NULL;
+  }
+  for(i = 0; i < f->num_of_nodes; i++){
+    c->statenames[i] = nip_new_string_list();
+    if(!c->statenames[i]){
+      c->error = ENOMEM;
+      return NULL;
+    }
+  }
 
-  char last_line[MAX_LINELENGTH]; /* buffer */
-  int linecounter = 0; /* number of consecutive non-empty lines this far */
-  int empty_lines_read = 0; /* number of consecutive empty lines */
-  int ndatarows = 0; /* number of groups of consecutive non-empty lines */
-  int state = NIP_PARSER_EXPECT_DATA; /* ignores empty lines before data */
-  int num_of_tokens = 0;
+  while(pos < c->end){
+    line = pos;
+    num_of_tokens = nip_copy_row(f, &pos, c->end, &row, &row_size);
+    if(num_of_tokens > 0)
+      num_of_tokens = nip_tokenise_row(f, row, num_of_tokens,
+                                       &line_tokens, &max_tokens);
+    if(num_of_tokens < 0){
+      c->error = ENOMEM;
+      break;
+    }
 
-  if(f->first_line_labels)
-    state = NIP_PARSER_EXPECT_HEADER; /* ignores empty lines before node labels */
+    /* Ignore empty lines, but each group of non-empty lines
+     * is a separate time series */
+    if(num_of_tokens == 0){
+      new_series = 1;
+      continue;
+    }
+
+    /* A row of data: count it */
+    if(new_series){
+      if(c->nseries == max_series){
+        max_series = 2 * max_series + 8;
+        bigger = (int*) realloc(c->series_rows, max_series * sizeof(int));
+        if(bigger)
+          c->series_rows = bigger;
+        more_positions = (size_t*) realloc(c->series_positions,
+                                           max_series * sizeof(size_t));
+        if(more_positions)
+          c->series_positions = more_positions;
+        if(!bigger || !more_positions){
+          c->error = ENOMEM;
+          break;
+        }
+      }
+      c->series_rows[c->nseries] = 0;
+      c->series_positions[c->nseries++] = line;
+      new_series = 0;
+    }
+    c->series_rows[c->nseries - 1]++;
+    c->nrows++;
+
+    /* Read observations (just in order to see all the different
+       kinds of observations for each node). */
+    /* n == min(f->num_of_nodes, num_of_tokens) */
+    n = (f->num_of_nodes < num_of_tokens) ? f->num_of_nodes : num_of_tokens;
+    if (nip_accumulate_state_names(c->statenames, line_tokens, n) < 0){
+      c->error = nip_check_error_type();
+      break;
+    }
+  }
+  free(line_tokens);
+  free(row);
+  return NULL;
+}
 
-  while(fgets(last_line, MAX_LINELENGTH, f->file)){
-    num_of_tokens = nip_count_tokens(last_line, NULL, 0,
-                                     &(f->separator), 1, 0, 1);
-    (f->current_line)++;
 
-    /* JJT  1.9.2004: A sort of bug fix. Ignore empty lines */
-    /* JJT 22.6.2005: Another fix. Ignore only the empty lines
-     * immediately after the node labels... and duplicate empty lines.
-     * Otherwise start a new timeseries */
-    if(num_of_tokens == 0){
-      linecounter = 0;
-      empty_lines_read++;
-      if(state > NIP_PARSER_FOUND_DATA || empty_lines_read > 1)
-        continue; /* empty lines to be ignored */
+/*
+ * Concatenates the results of the analysed parts (in file order) into
+ * the data file struct. The state names of all the parts are collected
+ * into the lists of the first part, in the order of first appearance.
+ */
+static int nip_merge_chunks(nip_data_file f, nip_data_chunk chunks, int n){
+  int i, k, s;
+  char* name;
+  nip_string_link link;
+
+  f->ndatarows = 0;
+  f->nrows = 0;
+  for(k = 0; k < n; k++){
+    f->ndatarows += chunks[k].nseries;
+    f->nrows += chunks[k].nrows;
+  }
+  if(f->ndatarows > 0){
+    f->datarows = (int*) calloc(f->ndatarows, sizeof(int));
+    f->series_positions = (size_t*) calloc(f->ndatarows, sizeof(size_t));
+    if(!f->datarows || !f->series_positions)
+      return ENOMEM;
+  }
+
+  s = 0;
+  for(k = 0; k < n; k++){
+    for(i = 0; i < chunks[k].nseries; i++, s++){
+      f->datarows[s] = chunks[k].series_rows[i];
+      f->series_positions[s] = chunks[k].series_positions[i];
     }
-    else{
-      linecounter++;
-      empty_lines_read = 0;
-      if(state >= NIP_PARSER_EXPECT_DATA){
-        if(state >= NIP_PARSER_EXPECT_HEADER){
-          f->label_line = f->current_line; // a side-effect
-          linecounter = 0; /* not counting header as data */
+    free(chunks[k].series_rows);
+    free(chunks[k].series_positions);
+    chunks[k].series_rows = NULL;
+    chunks[k].series_positions = NULL;
+    if(k == 0)
+      continue;
+
+    /* The lists are in reverse order of appearance (prepended) */
+    for(i = 0; i < f->num_of_nodes; i++){
+      for(link = chunks[k].statenames[i]->last; link; link = link->bwd){
+        name = link->data;
+        link->data = NULL;
+        if(nip_string_list_contains(chunks[0].statenames[i], name))
+          free(name);
+        else if(nip_prepend_string(chunks[0].statenames[i], name) !=
+                NIP_NO_ERROR){
+          free(name);
+          return ENOMEM;
         }
-        state--; /* stop ignoring single empty lines and the node names */
       }
-      if(state == NIP_PARSER_FOUND_DATA && linecounter == 1)
-        ndatarows++; /* at the first consecutive row of data */
     }
+    nip_free_state_names(chunks[k].statenames, f->num_of_nodes, 1);
+    chunks[k].statenames = NULL;
   }
+  return NIP_NO_ERROR;
+}
 
-  /* rewind */
-  rewind(f->file);
-  f->current_line = 0;
-  return ndatarows;
+
+/* Frees whatever is left of an analysed part */
+static void nip_free_chunk(nip_data_chunk c, int n_columns){
+  free(c->series_rows);
+  free(c->series_positions);
+  if(c->statenames){
+    for(; n_columns > 0; n_columns--)
+      if(c->statenames[n_columns - 1])
+        nip_free_string_list(c->statenames[n_columns - 1]);
+    free(c->statenames);
+  }
+}
+
+/*
+ * Reads the whole file into *buffer: memory-mapped read-only if
+ * possible, so that the pages are shared with the page cache, or else
+ * into allocated memory with an extra terminator.
+ */
+static int nip_load_file(FILE* file,
+                         char** buffer, size_t* buffer_size, int* mapped) {
+
+  struct stat info;
+  size_t size = 0;
+  size_t n;
+  size_t capacity;
+  char* contents = NULL;
+  char* bigger = NULL;
+  int fd = fileno(file);
+
+  if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0){
+    size = (size_t) info.st_size;
+    contents = (char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(contents != MAP_FAILED){
+      *buffer = contents;
+      *buffer_size = size;
+      *mapped = 1;
+      return NIP_NO_ERROR;
+    }
+  }
+
+  /* Otherwise (not a regular file etc.) read it all */
+  capacity = size + 1;
+  contents = (char*) malloc(capacity);
+  size = 0;
+  while(contents){
+    n = fread(&(contents[size]), sizeof(char), capacity - size - 1, file);
+    size += n;
+    if(size + 1 < capacity)
+      break; /* end of file or error */
+    capacity *= 2;
+    bigger = (char*) realloc(contents, capacity);
+    if(!bigger)
+      free(contents);
+    contents = bigger;
+  }
+  if(!contents){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return ENOMEM;
+  }
+  if(ferror(file)){
+    nip_report_error(__FILE__, __LINE__, EIO, 1);
+    free(contents);
+    return EIO;
+  }
+  contents[size] = '\0';
+  *buffer = contents;
+  *buffer_size = size;
+  *mapped = 0;
+  return NIP_NO_ERROR;
+}
+
+
+/* Reads the whole data file into f->buffer */
+static int nip_load_data_file(nip_data_file f) {
+  f->position = 0;
+  return nip_load_file(f->file, &(f->buffer), &(f->buffer_size),
+                       &(f->mapped));
+}
+
+/* Tells if the character ends (or separates) tokens in a data file */
+static int nip_data_delimiter(nip_data_file f, char ch){
+  return (ch == f->separator || ch == '\0' || isspace((int)ch));
 }
 
 /* Use the header row as node symbols (column names). Return ntokens, or negative if failed. */
-static int nip_set_node_symbols(nip_data_file file, char* line, int* token_bounds, int ntokens){
-  int i, dividend, length_of_name;
+static int nip_set_node_symbols(nip_data_file file, char** tokens, int ntokens){
+  int i, length_of_name;
 
   file->num_of_nodes = ntokens;
   file->node_symbols = (char **) calloc(ntokens, sizeof(char *));
@@ -304,25 +674,19 @@ static int nip_set_node_symbols(nip_data_file file, char* line, int* token_bound
 
   if(file->first_line_labels){
     for(i = 0; i < ntokens; i++){
-      file->node_symbols[i] = (char *) calloc(token_bounds[2*i+1] - token_bounds[2*i] + 1,
+      file->node_symbols[i] = (char *) calloc(strlen(tokens[i]) + 1,
                                               sizeof(char));
       if(!file->node_symbols[i]){
         nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
         return -1;
       }
-
-      strncpy(file->node_symbols[i], &(line[token_bounds[2*i]]),
-              token_bounds[2*i+1] - token_bounds[2*i]);
-      file->node_symbols[i][token_bounds[2*i+1] - token_bounds[2*i]] = '\0';
+      strcpy(file->node_symbols[i], tokens[i]);
     }
   }
   else{
     for(i = 0; i < ntokens; i++){
-      /* determine length of the made up name */
-      dividend = i + 1;
-      length_of_name = 5;
-      while((dividend /= 10) > 1)
-        length_of_name++;
+      /* determine length of the made up name (with the terminator) */
+      length_of_name = snprintf(NULL, 0, "node%d", i + 1) + 1;
 
       file->node_symbols[i] = (char *) calloc(length_of_name, sizeof(char));
       if(!file->node_symbols[i]){
@@ -336,44 +700,54 @@ static int nip_set_node_symbols(nip_data_file file, char* line, int* token_bound
   return ntokens;
 }
 
-/* Use a data row as state names. Return number of tokens, or negative if failed. */
-static int nip_accumulate_state_names(nip_string_list* statenames, char* line, int* token_bounds, int ntokens){
+/* Use a data row as state names. Return number of new names, or negative if failed. */
+static int nip_accumulate_state_names(nip_string_list* statenames, char** tokens, int ntokens){
   int i, count = 0;
   char *token = NULL;
 
   for(i = 0; i < ntokens; i++){
-    token = (char *) calloc(token_bounds[2*i+1] - token_bounds[2*i] + 1,
-                            sizeof(char));
+    /* If the string has not yet been observed, add a copy to a list 
+     * (ownership is passed on, string is not freed here) */
+    if(nip_null_observation(tokens[i]) ||
+       nip_string_list_contains(statenames[i], tokens[i]))
+      continue; /* was seen earlier, skip */
+
+    token = (char *) calloc(strlen(tokens[i]) + 1, sizeof(char));
     if(!token){
       nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
       return -1;
     }
+    strcpy(token, tokens[i]);
 
-    strncpy(token, &(line[token_bounds[2*i]]),
-            token_bounds[2*i+1] - token_bounds[2*i]);
-    token[token_bounds[2*i+1] - token_bounds[2*i]] = '\0';
-
-    /* If the string has not yet been observed, add it to a list 
-     * (ownership is passed on, string is not freed here) */
-    if(!nip_null_observation(token) && 
-       !nip_string_list_contains(statenames[i], token)){
-      if(nip_prepend_string(statenames[i], token) != NIP_NO_ERROR){
-        nip_report_error(__FILE__, __LINE__, nip_check_error_type(), 1);
-        free(token);
-        return count;
-      }
-      else{
-        count++;
-      }
-    }
-    else{
-      free(token); /* was seen earlier, skip */
+    if(nip_prepend_string(statenames[i], token) != NIP_NO_ERROR){
+      nip_report_error(__FILE__, __LINE__, nip_check_error_type(), 1);
+      free(token);
+      return -1;
     }
+    count++;
   }
 
   return count;
 }
 
+/* Frees the lists used for collecting state names,
+ * but not the names themselves if they were kept */
+static void nip_free_state_names(nip_string_list* statenames, int n,
+                                 int keep_names){
+  int i;
+  if(!statenames)
+    return;
+  for(i = 0; i < n; i++){
+    if(keep_names){
+      nip_empty_string_list(statenames[i]);
+      free(statenames[i]);
+    }
+    else
+      nip_free_string_list(statenames[i]);
+  }
+  free(statenames);
+}
+
 /*
  * Tells if the given token indicates a missing value, a "null observation".
  * The token must be null terminated.
@@ -436,16 +810,20 @@ static void nip_free_data_file(nip_data_file f){
   }
   free(f->num_of_states);
   free(f->datarows);
+  free(f->series_positions);
+  free(f->row);
+  if(f->mapped)
+    munmap(f->buffer, f->buffer_size);
+  else
+    free(f->buffer);
   free(f);
 }
 
 
 int nip_next_line_tokens(nip_data_file f, char separator, char ***tokens){
 
-  char line[MAX_LINELENGTH];
   char *token;
   int num_of_tokens;
-  int *token_bounds;
   int i, j;
 
   if(!f || !tokens){
@@ -453,194 +831,258 @@ int nip_next_line_tokens(nip_data_file f, char separator, char ***tokens){
     return -1;
   }
 
-  if(!(f->is_open)){
+  if(!(f->is_open) || f->write){
     nip_report_error(__FILE__, __LINE__, EIO, 1);
     return -1;
   }
 
-  /* seek the first line of data (starting from the current line) */
-  num_of_tokens = 0;
-  do{
-    if(fgets(line, MAX_LINELENGTH, f->file) == NULL)
-      break;
-    else
-      f->current_line++;
-    
-    /* observed token count */
-    num_of_tokens = nip_count_tokens(line, NULL, 0, &separator, 1, 0, 1);
-    
-    /* Skip the first line if it contains node labels. */
-    if((f->current_line == f->label_line)  &&  f->first_line_labels)
-      num_of_tokens = 0;
-
-  }while(num_of_tokens < 1);
-
-  if(num_of_tokens == 0)
-    return 0;
-
-  token_bounds = nip_tokenise(line, num_of_tokens, 0, &separator, 1, 0, 1);
-  if(!token_bounds){
-    nip_report_error(__FILE__, __LINE__, nip_check_error_type(), 1);
-    return -1;
+  /* the rows are read from memory: analyse the file first if needed */
+  if(!f->buffer){
+    f->separator = separator;
+    if(nip_analyse_data_file(f) < 0)
+      return -1;
   }
+  if(f->current_line >= f->nrows)
+    return 0;
 
-  /* effective number of tokens from now on: min(f->num_of_nodes, observed) */
-  num_of_tokens = f->num_of_nodes<num_of_tokens ? f->num_of_nodes : num_of_tokens;
-  
-  *tokens = (char **) calloc(num_of_tokens, sizeof(char *)); // TODO: freed where?
-  if(!tokens){
+  /* copy the tokens for the caller */
+  *tokens = (char **) calloc(f->num_of_nodes, sizeof(char *));
+  if(!*tokens){
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-    free(token_bounds);
     return -1;
   }
-
+  num_of_tokens = nip_next_row_tokens(f, *tokens);
   for(i = 0; i < num_of_tokens; i++){
-    token = (char *) calloc(token_bounds[2*i+1] - token_bounds[2*i] + 1,
-                            sizeof(char));
+    token = (char *) calloc(strlen((*tokens)[i]) + 1, sizeof(char));
     if(!token){
       nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-      nip_free_data_file(f);
       for(j = 0; j < i; j++)
-        free(*tokens[j]);
+        free((*tokens)[j]);
       free(*tokens);
-      free(token_bounds);
       return -1;
     }
-
-    strncpy(token, &(line[token_bounds[2*i]]),
-            token_bounds[2*i+1] - token_bounds[2*i]);
-
-    token[token_bounds[2*i+1] - token_bounds[2*i]] = '\0';
+    strcpy(token, (*tokens)[i]);
 
     /* Children, remember what papa said: always use parentheses... */
     (*tokens)[i] = token;
   }
 
-  free(token_bounds);
-
   /* Return the number of acquired tokens. */
   return num_of_tokens;
 }
 
 
-char* nip_next_hugin_token(FILE* f, int* token_length){
-
-  /* The last line read from the file */
-  static char last_line[MAX_LINELENGTH];
+int nip_next_row_tokens(nip_data_file f, char** tokens){
+  int n = 0;
+  int length;
+  size_t pos;
 
-  /* How many tokens left in the current line of input? */
-  static int tokens_left;
+  if(!f || !tokens){
+    nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+    return -1;
+  }
+  if(f->current_line >= f->nrows)
+    return 0;
 
-  /* Pointer to the index array of token boundaries */
-  static int* indexarray = NULL;
+  /* the file stays intact: tokenise a copy of the row */
+  while(n == 0 && f->position < f->buffer_size){
+    length = nip_copy_row(f, &(f->position), f->buffer_size,
+                          &(f->row), &(f->row_size));
+    if(length < 0){
+      nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+      return -1;
+    }
+    pos = 0;
+    n = nip_split_row(f, f->row, &pos, length, tokens, f->num_of_nodes);
+  }
+  f->current_line++;
 
-  /* Pointer to the index array of token boundaries
-   * (not incremented, we need this for free() ) */
-  static int* indexarray_original = NULL;
+  /* effective number of tokens: min(f->num_of_nodes, observed) */
+  return (f->num_of_nodes < n) ? f->num_of_nodes : n;
+}
 
-  /* Should a new line be read in when the next token is requested? */
-  static int nip_read_line = 1; 
-  /* FIXME: this should be a part of the given file struct? */
 
-  /* The token we return */
-  char* token;
+char* nip_copy_data_rows(nip_data_file f, int first, int last, size_t* size){
+  size_t begin, end;
+  char* rows = NULL;
 
-  /* Return if some evil mastermind gives us a NULL pointer */
-  if(!token_length){
-    if(indexarray_original){
-      free(indexarray_original);
-      indexarray = NULL;
-      indexarray_original = NULL;
-    }
+  if(!f || !size){
+    nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+    return NULL;
+  }
+  if(!f->buffer || first < 0 || last > f->ndatarows || last <= first){
+    nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+    return NULL; /* not analysed */
+  }
 
+  begin = f->series_positions[first];
+  end = (last < f->ndatarows) ? f->series_positions[last] : f->buffer_size;
+  rows = (char*) malloc(end - begin + 1);
+  if(!rows){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
     return NULL;
   }
+  memcpy(rows, &(f->buffer[begin]), end - begin);
+  rows[end - begin] = '\0';
+  *size = end - begin;
+  return rows;
+}
 
-  /* Return if input file is not open */
-  if(f == NULL){
-    if(indexarray_original){
-      free(indexarray_original);
-      indexarray = NULL;
-      indexarray_original = NULL;
-    }
 
+int nip_row_tokens_at(nip_data_file f, char* rows, size_t size,
+                      size_t* position, char** tokens){
+  int n = 0;
+
+  if(!f || !rows || !position || !tokens){
+    nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+    return -1;
+  }
+  while(n == 0 && *position < size)
+    n = nip_split_row(f, rows, position, size, tokens, f->num_of_nodes);
+
+  /* effective number of tokens: min(f->num_of_nodes, observed) */
+  return (f->num_of_nodes < n) ? f->num_of_nodes : n;
+}
+
+
+nip_net_file nip_open_net_file(const char* filename){
+  nip_net_file f = (nip_net_file) malloc(sizeof(nip_net_file_struct));
+  if(!f){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+  f->file = fopen(filename, "r");
+  if(!f->file){
+    nip_report_error(__FILE__, __LINE__, EIO, 1);
+    free(f);
     return NULL;
   }
+  f->buffer = NULL;
+  f->buffer_size = 0;
+  f->mapped = 0;
+  f->position = 0;
+  if(nip_load_file(f->file, &(f->buffer), &(f->buffer_size),
+                   &(f->mapped)) != NIP_NO_ERROR){
+    fclose(f->file);
+    free(f);
+    return NULL;
+  }
+  return f;
+}
 
-  /* Read new line if needed and do other magic... */
-  while(nip_read_line){
-    /* Read the line and check for EOF */
-    if(!(fgets(last_line, MAX_LINELENGTH, f))){
 
-      if(indexarray_original){
-        free(indexarray_original);
-        indexarray = NULL;
-        indexarray_original = NULL;
-      }
+void nip_close_net_file(nip_net_file f){
+  if(!f)
+    return;
+  if(f->mapped)
+    munmap(f->buffer, f->buffer_size);
+  else
+    free(f->buffer);
+  fclose(f->file);
+  free(f);
+}
 
-      *token_length = 0;
-      return NULL;
-    }
-    /* how many tokens in the line? */
-    tokens_left = nip_count_tokens(last_line, NULL, 1, "(){}=,;", 7, 1, 1);
-
-    /* Check whether the line has any tokens. If not, read a new line
-     * (go to beginning of loop) */
-    if(tokens_left > 0){
-      /* Adjust pointer to the beginning of token boundary index array */
-      if(indexarray_original){
-        free(indexarray_original);
-        indexarray = NULL;
-        indexarray_original = NULL;
-      }
 
-      indexarray = nip_tokenise(last_line, tokens_left, 1, "(){}=,;", 7, 1, 1);
-      indexarray_original = indexarray;
+/* Tells if the character is a token of its own in a net file */
+static int nip_hugin_separator(char ch){
+  switch(ch){
+  case '(': case ')': case '{': case '}': case '=': case ',': case ';':
+    return 1;
+  default:
+    return 0;
+  }
+}
 
-      /* If tokenise failed, return NULL, *token_length = 0 */
-      if(!indexarray){
-        nip_report_error(__FILE__, __LINE__, nip_check_error_type(), 1);
-        *token_length = 0;
-        return NULL;
-      }
 
-      /* Ignore lines that have COMMENT_CHAR as first non-whitespace char */
-      if(last_line[indexarray[0]] == NIP_COMMENT_CHAR)
-        nip_read_line = 1;
-      else
-        nip_read_line = 0;
+/* Tells if the '"' at position i has a matching one on the same line */
+static int nip_hugin_quote_matched(nip_net_file f, size_t i){
+  const char* s = f->buffer;
+  for(i++; i < f->buffer_size && s[i] != '\n'; i++)
+    if(s[i] == '"')
+      return 1;
+  return 0;
+}
+
+
+int nip_next_hugin_span(nip_net_file f, char** token){
+  char* s;
+  size_t n, i, start;
+
+  if(!f || !token)
+    return 0;
+
+  s = f->buffer;
+  n = f->buffer_size;
+  i = f->position;
+  while(i < n){
+    /* White space between tokens */
+    if(isspace((int)s[i]) || s[i] == '\0'){
+      i++;
+    }
+    /* A comment extends to the end of the line */
+    else if(s[i] == NIP_COMMENT_CHAR){
+      while(i < n && s[i] != '\n')
+	i++;
+    }
+    /* "Quoted string" on a single line, or an ignored stray '"' */
+    else if(s[i] == '"'){
+      start = i;
+      if(nip_hugin_quote_matched(f, i)){
+	for(i++; s[i] != '"'; i++);
+	*token = &(s[start]);
+	f->position = i + 1;
+	return (int)(f->position - start);
+      }
+      i++;
+    }
+    /* Separators are tokens themselves */
+    else if(nip_hugin_separator(s[i])){
+      *token = &(s[i]);
+      f->position = i + 1;
+      return 1;
+    }
+    /* Anything else until white space, separator or quoted string */
+    else{
+      start = i;
+      for(i++; i < n; i++)
+	if(isspace((int)s[i]) || s[i] == '\0' || nip_hugin_separator(s[i]) ||
+	   (s[i] == '"' && nip_hugin_quote_matched(f, i)))
+	  break;
+      *token = &(s[start]);
+      f->position = i;
+      return (int)(i - start);
     }
   }
+  f->position = n;
+  return 0;
+}
+
+
+char* nip_next_hugin_token(nip_net_file f, int* token_length){
+
+  /* The token we return */
+  char* token;
+  char* span = NULL;
+
+  /* Return if some evil mastermind gives us a NULL pointer */
+  if(!token_length)
+    return NULL;
+
+  *token_length = nip_next_hugin_span(f, &span);
+  if(*token_length <= 0)
+    return NULL;
 
-  *token_length = indexarray[1] - indexarray[0];
   token = (char *) calloc(*token_length + 1, sizeof(char));
   if(!token){
-    if(indexarray_original){
-      free(indexarray_original);
-      indexarray = NULL;
-      indexarray_original = NULL;
-    }
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
     *token_length = -1;
     return NULL;
   }
 
-  /* Copy the token */
-  strncpy(token, &(last_line[indexarray[0]]), *token_length);
-
-  /* NULL terminate the token. */
+  /* Copy the token and NULL terminate it. */
+  memcpy(token, span, *token_length);
   token[*token_length] = '\0';
 
-  indexarray += 2;
-  
-  /* If all the tokens have been handled, read a new line next time */
-  if(--tokens_left == 0)
-    nip_read_line = 1;
-
-  /* Still some tokens left. Check for COMMENT_CHAR. */
-  else if(last_line[indexarray[0]] == NIP_COMMENT_CHAR)
-    nip_read_line = 1;
-
 #ifdef PRINT_TOKENS
   printf("%s\n", token);
 #endif
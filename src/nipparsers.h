@@ -25,14 +25,19 @@
 #define __NIPPARSERS_H__
 
 /**
- * Hard length limit (in bytes) when reading lines from files
+ * Comment character in input files. The rest of the line is ignored.
  */
-#define MAX_LINELENGTH 10000
+#define NIP_COMMENT_CHAR '%'
 
 /**
- * Comment character in input files. The rest of the line is ignored.
+ * Maximum number of threads for analysing a data file
  */
-#define NIP_COMMENT_CHAR '%'
+#define NIP_MAX_DATA_THREADS 16
+
+/**
+ * Minimum size (in bytes) of the part of a data file for each thread
+ */
+#define NIP_MIN_DATA_CHUNK 65536
 
 #include <stdio.h> // FILE
 #include <stdlib.h>
@@ -58,6 +63,8 @@ typedef struct {
   int ndatarows; ///< Number of time series (separated by empty lines)
   int* datarows; /**< Number of rows in the file for each time series, 
 		    excluding the line containing node symbols */
+  size_t* series_positions; /**< Position of the first row of each
+			       time series in \p buffer */
 
   int num_of_nodes;    ///< Number of variables present (columns)
   char** node_symbols; ///< Names of the variables (aka attributes or nodes)
@@ -65,10 +72,33 @@ typedef struct {
   int* num_of_states;  ///< Number of states for each variable
   char*** node_states; /**< String array array: Names of the possible values 
 			  of the variables, \p node_states[node][state] */
+
+  char* buffer;       /**< Contents of the whole file after analysis
+			 (read-only), or NULL */
+  size_t buffer_size; ///< Size of the file contents in \p buffer
+  int mapped;         ///< flag if \p buffer is memory-mapped (else allocated)
+  size_t position;    ///< current position in \p buffer
+  int nrows;          ///< Number of rows of data, in all the time series
+  char* row;          ///< Copy of the current row, see nip_next_row_tokens()
+  size_t row_size;    ///< Size of the space allocated for \p row
 } nip_data_file_struct;
 
 typedef nip_data_file_struct* nip_data_file; ///< reference to a data file
 
+/**
+ * Structure for reading tokens from a Hugin Net file. All the state of
+ * the tokeniser is kept here, so that several files can be read at the
+ * same time (e.g. in separate threads). */
+typedef struct {
+  FILE* file; ///< file handle
+  char* buffer;       ///< contents of the whole file (read-only)
+  size_t buffer_size; ///< number of characters in \p buffer
+  int mapped;         ///< non-zero if \p buffer is memory-mapped
+  size_t position;    ///< where the next token is searched from
+} nip_net_file_struct;
+
+typedef nip_net_file_struct* nip_net_file; ///< reference to a net file
+
 /**
  * Opens a file and creates a struct with default values (0). The struct 
  * can be used for reading / parsing or writing the file after opening.
@@ -87,10 +117,17 @@ nip_data_file nip_open_data_file(char* filename, char separator,
 /**
  * Counts and saves statistics about a data file opened for reading:
  * numbers of time series, state names and their counts for each column.
- * The function sets the file position indicator to the beginning of the file.
+ * The file is memory-mapped read-only if possible (or else read into
+ * memory) and analysed in a single pass, without limits on line length.
+ * Only the position of each time series is kept, so the rows can be
+ * read again later: the pages of the file are not copied.
+ * Large files are split at time series boundaries (empty lines) and the
+ * parts are analysed in parallel, see nip_data_threads().
+ * Rows of data can be read after this, starting from the first one.
  * @param file An open file handle
- * @return count of time series successfully read
- * @see nip_open_data_file() */
+ * @return count of time series successfully read, or negative on error
+ * @see nip_open_data_file()
+ * @see nip_next_row_tokens() */
 int nip_analyse_data_file(nip_data_file file);
 
 /**
@@ -104,7 +141,8 @@ void nip_close_data_file(nip_data_file file);
  * Gets the tokens (separated by separator) on the next line of
  * the given file. Allocates memory for an array of strings and its
  * contents. Skips the first line of the file, if it contains node labels 
- * (header row).
+ * (header row), and empty lines. The file is analysed first, if not
+ * done already. See nip_next_row_tokens() for reading without allocations.
  * @param f Reference to an opened data file
  * @param separator The ASCII character to be considered field separator
  * @param tokens Pointer where an array of strings will be written
@@ -113,16 +151,91 @@ void nip_close_data_file(nip_data_file file);
  * in case of error or end of file. */
 int nip_next_line_tokens(nip_data_file f, char separator, char ***tokens);
 
+/**
+ * Gets the tokens on the next row of data in a file analysed by
+ * nip_analyse_data_file(). The row is copied into \p f->row, so the
+ * strings remain valid until the next call. Skips the header row and
+ * empty lines.
+ * @param f Reference to an analysed data file
+ * @param tokens Array of at least \p f->num_of_nodes strings to fill in
+ * @return The number of tokens found (or f->num_of_nodes if smaller),
+ * 0 at the end of data, or a negative number in case of error
+ * @see nip_next_line_tokens() */
+int nip_next_row_tokens(nip_data_file f, char** tokens);
+
+/**
+ * Copies the rows of the time series \p first ... \p last - 1 of an
+ * analysed data file for nip_row_tokens_at(), so that only the rows
+ * being read take memory. Several threads can read separate time series
+ * at the same time this way.
+ * @param f Reference to an analysed data file
+ * @param first Index of the first time series
+ * @param last Index of the time series after the last one
+ * @param size Pointer where the size of the copy is written
+ * @return The rows, terminated by '\0' (free after use), or NULL */
+char* nip_copy_data_rows(nip_data_file f, int first, int last, size_t* size);
+
+/**
+ * Gets the tokens on a row of data copied by nip_copy_data_rows(),
+ * terminating them in place, so the strings remain valid as long as
+ * \p rows. Skips empty lines.
+ * @param f Reference to the analysed data file
+ * @param rows The copied rows
+ * @param size Size of \p rows
+ * @param position Pointer to the position of the row in \p rows
+ * (e.g. \p f->series_positions[n] - \p f->series_positions[first] for
+ * the first row of time series n), updated to the position of the next row
+ * @param tokens Array of at least \p f->num_of_nodes strings to fill in
+ * @return The number of tokens found (or f->num_of_nodes if smaller),
+ * or 0 at the end of \p rows */
+int nip_row_tokens_at(nip_data_file f, char* rows, size_t size,
+                      size_t* position, char** tokens);
+
+/**
+ * Tells how many threads are worth using for reading \p size bytes of
+ * data: the number of online processors, or the value of the NIP_THREADS
+ * environment variable, but at most NIP_MAX_DATA_THREADS and at least
+ * NIP_MIN_DATA_CHUNK bytes for each thread.
+ * @param size Amount of data in bytes
+ * @return number of threads, at least 1 */
+int nip_data_threads(size_t size);
+
+
+/**
+ * Opens a Hugin Net file for reading tokens. The whole file is read
+ * into memory (memory-mapped read-only if possible), so there are no
+ * limits on line length and the tokens can be read without copying them.
+ * @param filename Name of the file to be opened
+ * @return reference to a new net file struct, or NULL if opening failed
+ * @see nip_close_net_file() */
+nip_net_file nip_open_net_file(const char* filename);
+
+/**
+ * Closes the file and frees the struct.
+ * @param f Reference to a net file opened with nip_open_net_file() */
+void nip_close_net_file(nip_net_file f);
+
+/**
+ * Gets the next token from an opened hugin .net file without copying it.
+ * Tokens are separated by white space, "(){}=,;" are tokens themselves,
+ * "quoted strings" (with the quotes) on a single line are one token, and
+ * comments from NIP_COMMENT_CHAR to the end of the line are skipped.
+ * @param f Reference to an opened .net file
+ * @param token Pointer where the beginning of the token is written: the
+ * token is NOT null terminated and remains valid until the file is closed
+ * @return length of the token, or 0 if no more tokens to read
+ * @see nip_next_hugin_token() */
+int nip_next_hugin_span(nip_net_file f, char** token);
 
 /**
- * Gets the next token from an opened hugin .net file.
+ * Gets the next token from an opened hugin .net file as a new string.
  * If token_length == 0, there are no more tokens.
- * @param f File descriptor to a .net file
+ * @param f Reference to an opened .net file
  * @param token_length Pointer where the length of a found token is written, 
  * or 0 if no more tokens to read.
  * NOTE: length does not include the null character
  * @return a null terminated string, free it after use */
-char* nip_next_hugin_token(FILE* f, int* token_length);
+char* nip_next_hugin_token(nip_net_file f, int* token_length);
 
 
 #endif /* __PARSER_H__ */
@@ -25,8 +25,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "niplists.h"
+#include "nipthreads.h"
 #include "niperrorhandler.h"
 
 
@@ -54,6 +56,90 @@ static void nip_choose_potential_indices(int source_indices[],
                                          int dest_indices[],
                                          int mapping[], int size_of_mapping);
 
+/* An operation on a large potential split in parts, 
+ * possibly processed by several threads */
+typedef struct nip_potential_job_struct {
+  int (*kernel)(struct nip_potential_job_struct* job, int part);
+  nip_potential p;  /* the potential traversed */
+  int* strides;     /* step in the other table along each dimension of p */
+  double* first;    /* the sums, or the numerator */
+  double* second;   /* the denominator, or NULL */
+  int length;       /* number of sums */
+  double* partial;  /* sums of each part, or NULL if the parts are disjoint */
+  int unit;         /* the parts begin at multiples of this */
+  int num_of_parts;
+  int next_part;    /* the first part not taken by any thread yet */
+  int error;
+  pthread_mutex_t lock;
+} nip_potential_job;
+
+/* Helper threads currently working on potentials, all jobs together */
+static int nip_potential_helpers = 0;
+static pthread_mutex_t nip_potential_helpers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Computes the step in a table of n dimensions (with cardinality[])
+ * along each dimension of p, according to mapping[] of the n dimensions 
+ * to those of p. The steps are 0 along the dimensions not mapped. */
+static int* nip_mapping_strides(nip_potential p, int cardinality[],
+                                int mapping[], int n);
+
+/* A position in potential p and the offset of the corresponding element 
+ * in another table. Adjacent dimensions are merged where the steps allow,
+ * so that the first one is as long a run as possible: contiguous, 
+ * or a single element of the other table. */
+typedef struct {
+  int dimensionality;  /* after merging */
+  int* cardinality;
+  int* strides;
+  int* index;
+  int offset;
+} nip_potential_cursor;
+
+/* Places a cursor at flat index begin of p, with strides[] for 
+ * the other table. Returns an error code, or 0. */
+static int nip_start_cursor(nip_potential_cursor* cursor, nip_potential p,
+                            int strides[], int begin);
+
+/* Moves a cursor n elements on, at most to the end of the current run */
+static void nip_advance_cursor(nip_potential_cursor* cursor, int n);
+
+/* sums[] += p->data[begin...end-1] mapped by strides[] */
+static int nip_sum_range(nip_potential p, int strides[], double sums[],
+                         int begin, int end);
+
+/* p->data[begin...end-1] *= numerator[] / denominator[] mapped by strides */
+static int nip_update_range(nip_potential p, int strides[],
+                            double numerator[], double denominator[],
+                            int begin, int end);
+
+/* Marginalises p into sums[] of given length, in parts if p is large */
+static int nip_sum_data(nip_potential p, int strides[], double sums[],
+                        int length);
+
+/* The range of elements of p in a part of the job */
+static void nip_part_range(nip_potential_job* job, int part,
+                           int* begin, int* end);
+
+/* Kernels for the parts of nip_sum_data(), nip_update_potential(), 
+ * and nip_normalise_cpd() */
+static int nip_sum_part(nip_potential_job* job, int part);
+static int nip_update_part(nip_potential_job* job, int part);
+static int nip_normalise_part(nip_potential_job* job, int part);
+
+/* Processes the parts of a job in the calling thread and the helpers */
+static int nip_run_potential_job(nip_potential_job* job);
+
+/* The loop of each thread in nip_run_potential_job() */
+static void* nip_potential_worker(void* arg);
+
+/* Number of parts worth splitting a potential of given size into */
+static int nip_potential_parts(int size);
+
+/* Reserves at most wanted helper threads, or returns how many can be used */
+static int nip_reserve_potential_helpers(int wanted);
+
+
 
 static double* nip_get_potential_pointer(nip_potential p, int indices[]){
   int i;
@@ -81,6 +167,315 @@ static void nip_choose_potential_indices(int source_indices[],
 }
 
 
+static int* nip_mapping_strides(nip_potential p, int cardinality[],
+                                int mapping[], int n){
+  int i, step = 1;
+  int* strides = (int*) calloc(p->dimensionality + 1, sizeof(int));
+  if(!strides)
+    return NULL;
+  for(i = 0; i < n; i++){
+    strides[mapping[i]] = step;
+    step *= cardinality[i];
+  }
+  return strides;
+}
+
+
+static int nip_start_cursor(nip_potential_cursor* cursor, nip_potential p,
+                            int strides[], int begin){
+  int j, m = 0;
+  int* space = (int*) calloc(3 * (p->dimensionality + 1), sizeof(int));
+  if(!space)
+    return ENOMEM;
+  cursor->cardinality = space;
+  cursor->strides = space + p->dimensionality + 1;
+  cursor->index = space + 2 * (p->dimensionality + 1);
+
+  /* e.g. steps {1, 3} with cardinality {3, 4} make a run of 12 */
+  for(j = 0; j < p->dimensionality; j++){
+    if(p->cardinality[j] == 1)
+      continue;
+    if(m > 0 && strides[j] == 
+       cursor->strides[m-1] * cursor->cardinality[m-1]){
+      cursor->cardinality[m-1] *= p->cardinality[j];
+    }
+    else{
+      cursor->cardinality[m] = p->cardinality[j];
+      cursor->strides[m] = strides[j];
+      m++;
+    }
+  }
+  if(m == 0){ /* a single element */
+    cursor->cardinality[0] = 1;
+    cursor->strides[0] = 0;
+    m = 1;
+  }
+  cursor->dimensionality = m;
+
+  /* inverse mapping of begin */
+  cursor->offset = 0;
+  for(j = 0; j < m; j++){
+    cursor->index[j] = begin % cursor->cardinality[j];
+    begin /= cursor->cardinality[j];
+    cursor->offset += cursor->index[j] * cursor->strides[j];
+  }
+  return 0;
+}
+
+
+static void nip_advance_cursor(nip_potential_cursor* cursor, int n){
+  int j;
+  cursor->index[0] += n;
+  cursor->offset += n * cursor->strides[0];
+  if(cursor->index[0] < cursor->cardinality[0])
+    return;
+
+  /* the end of a run: the first dimension is the least significant */
+  cursor->offset -= cursor->strides[0] * cursor->cardinality[0];
+  cursor->index[0] = 0;
+  for(j = 1; j < cursor->dimensionality; j++){
+    cursor->offset += cursor->strides[j];
+    if(++(cursor->index[j]) < cursor->cardinality[j])
+      break;
+    cursor->offset -= cursor->strides[j] * cursor->cardinality[j];
+    cursor->index[j] = 0;
+  }
+  return;
+}
+
+
+static int nip_sum_range(nip_potential p, int strides[], double sums[],
+                         int begin, int end){
+  int i, k, n, o, step;
+  double sum;
+  nip_potential_cursor cursor;
+
+  if(nip_start_cursor(&cursor, p, strides, begin) != 0)
+    return ENOMEM;
+
+  for(i = begin; i < end; i += n){
+    n = cursor.cardinality[0] - cursor.index[0];
+    if(n > end - i)
+      n = end - i;
+    step = cursor.strides[0];
+    o = cursor.offset;
+    if(step == 0){ /* a block reduction */
+      sum = sums[o];
+      for(k = 0; k < n; k++)
+        sum += p->data[i + k]; /* THE sum */
+      sums[o] = sum;
+    }
+    else{
+      for(k = 0; k < n; k++, o += step)
+        sums[o] += p->data[i + k];
+    }
+    nip_advance_cursor(&cursor, n);
+  }
+  free(cursor.cardinality);
+  return 0;
+}
+
+
+static int nip_update_range(nip_potential p, int strides[],
+                            double numerator[], double denominator[],
+                            int begin, int end){
+  int i, k, n, o, step;
+  double x;
+  nip_potential_cursor cursor;
+
+  if(nip_start_cursor(&cursor, p, strides, begin) != 0)
+    return ENOMEM;
+
+  /* a run is a broadcast of a single factor, or contiguous factors */
+  for(i = begin; i < end; i += n){
+    n = cursor.cardinality[0] - cursor.index[0];
+    if(n > end - i)
+      n = end - i;
+    step = cursor.strides[0];
+    o = cursor.offset;
+    for(k = 0; k < n; k++, o += step){
+      x = p->data[i + k];
+      if(numerator) /* THE multiplication */
+        x *= numerator[o];
+      if(denominator) /* THE division, see Procedural Guide p. 20 */
+        x = (denominator[o] != 0) ? x / denominator[o] : 0;
+      p->data[i + k] = x;
+    }
+    nip_advance_cursor(&cursor, n);
+  }
+  free(cursor.cardinality);
+  return 0;
+}
+
+
+static int nip_sum_data(nip_potential p, int strides[], double sums[],
+                        int length){
+  int i, j, k, err, parts, outer = 1;
+  nip_potential_job job;
+
+  if(p->size_of_data < NIP_POTENTIAL_PARALLEL_MIN)
+    return nip_sum_range(p, strides, sums, 0, p->size_of_data);
+
+  job.kernel = nip_sum_part;
+  job.p = p;
+  job.strides = strides;
+  job.first = sums;
+  job.second = NULL;
+  job.length = length;
+  job.partial = NULL;
+  parts = nip_potential_parts(p->size_of_data);
+
+  /* If the most significant dimensions are kept, parts along them 
+   * add to different sums and the order of additions stays the same */
+  for(j = p->dimensionality - 1; j >= 0 && outer < parts; j--){
+    if(strides[j] == 0 && p->cardinality[j] > 1)
+      break;
+    outer *= p->cardinality[j];
+  }
+  job.unit = p->size_of_data / outer;
+  job.num_of_parts = (outer < parts) ? outer : parts;
+
+  /* Otherwise each part needs sums of its own, 
+   * if they take only a fraction of the memory p does */
+  k = p->size_of_data / (8 * length);
+  if(k > parts)
+    k = parts;
+  if(k > job.num_of_parts){
+    job.unit = 1;
+    job.num_of_parts = k;
+    job.partial = (double*) calloc((size_t)k * length, sizeof(double));
+    if(!job.partial)
+      return ENOMEM;
+  }
+  if(job.num_of_parts < 2)
+    return nip_sum_range(p, strides, sums, 0, p->size_of_data);
+
+  err = nip_run_potential_job(&job);
+
+  /* the same order of additions regardless of the threads */
+  if(job.partial && !err){
+    for(k = 0; k < job.num_of_parts; k++)
+      for(i = 0; i < length; i++)
+        sums[i] += job.partial[(size_t)k * length + i];
+  }
+  free(job.partial);
+  return err;
+}
+
+
+static void nip_part_range(nip_potential_job* job, int part,
+                           int* begin, int* end){
+  long long units = job->p->size_of_data / job->unit;
+  *begin = (int)((part * units) / job->num_of_parts) * job->unit;
+  *end = (int)(((part + 1) * units) / job->num_of_parts) * job->unit;
+  return;
+}
+
+
+static int nip_sum_part(nip_potential_job* job, int part){
+  int begin, end;
+  double* sums = job->first;
+  if(job->partial)
+    sums = job->partial + (size_t)part * job->length;
+  nip_part_range(job, part, &begin, &end);
+  return nip_sum_range(job->p, job->strides, sums, begin, end);
+}
+
+
+static int nip_update_part(nip_potential_job* job, int part){
+  int begin, end;
+  nip_part_range(job, part, &begin, &end);
+  return nip_update_range(job->p, job->strides, job->first, job->second,
+                          begin, end);
+}
+
+
+static int nip_normalise_part(nip_potential_job* job, int part){
+  int i, begin, end;
+  nip_part_range(job, part, &begin, &end);
+  for(i = begin; i < end; i += job->unit)
+    nip_normalise_array(&(job->p->data[i]), job->unit);
+  return 0;
+}
+
+
+static int nip_run_potential_job(nip_potential_job* job){
+  int k, n, started = 0;
+  pthread_t threads[NIP_MAX_POTENTIAL_THREADS];
+
+  job->next_part = 0;
+  job->error = 0;
+  if(pthread_mutex_init(&(job->lock), NULL) != 0)
+    return NIP_ERROR_GENERAL;
+
+  /* the calling thread works too */
+  n = nip_reserve_potential_helpers(job->num_of_parts - 1);
+  for(k = 0; k < n; k++)
+    if(pthread_create(&(threads[started]), NULL,
+                      nip_potential_worker, job) == 0)
+      started++;
+  nip_potential_worker(job);
+  for(k = 0; k < started; k++)
+    pthread_join(threads[k], NULL);
+
+  pthread_mutex_lock(&nip_potential_helpers_lock);
+  nip_potential_helpers -= n;
+  pthread_mutex_unlock(&nip_potential_helpers_lock);
+  pthread_mutex_destroy(&(job->lock));
+  return job->error;
+}
+
+
+static void* nip_potential_worker(void* arg){
+  int part, err;
+  nip_potential_job* job = (nip_potential_job*) arg;
+
+  pthread_mutex_lock(&(job->lock));
+  while(job->next_part < job->num_of_parts && !job->error){
+    part = job->next_part++;
+    pthread_mutex_unlock(&(job->lock));
+
+    err = job->kernel(job, part);
+
+    pthread_mutex_lock(&(job->lock));
+    if(err != 0)
+      job->error = err;
+  }
+  pthread_mutex_unlock(&(job->lock));
+  return NULL;
+}
+
+
+static int nip_potential_parts(int size){
+  int n = size / NIP_POTENTIAL_BLOCK;
+  if(n > NIP_POTENTIAL_MAX_PARTS)
+    n = NIP_POTENTIAL_MAX_PARTS;
+  return (n < 1) ? 1 : n;
+}
+
+
+static int nip_reserve_potential_helpers(int wanted){
+  long n;
+
+  if(wanted < 1)
+    return 0;
+  n = nip_max_threads();
+  if(n > NIP_MAX_POTENTIAL_THREADS)
+    n = NIP_MAX_POTENTIAL_THREADS;
+
+  /* the threads of concurrent jobs share the same limit */
+  pthread_mutex_lock(&nip_potential_helpers_lock);
+  n -= 1 + nip_potential_helpers;
+  if(n > wanted)
+    n = wanted;
+  if(n < 0)
+    n = 0;
+  nip_potential_helpers += n;
+  pthread_mutex_unlock(&nip_potential_helpers_lock);
+  return (int)n;
+}
+
+
 nip_potential nip_new_potential(int cardinality[], int dimensionality,
                                 double data[]){
 
@@ -266,48 +661,36 @@ void nip_inverse_mapping(nip_potential p, int flat_index, int indices[]){
 
 int nip_general_marginalise(nip_potential source, nip_potential destination,
                             int mapping[]){
-  int i;
-  double *potvalue;
+  int err;
+  int* strides;
 
   if(destination->dimensionality > source->dimensionality)
     return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
 
-  /* index arrays  (eg. [5][4][3] <-> { 5, 4, 3 }) */
-  if(destination->dimensionality == 0){
-    /* the rare event of potential being scalar */
-    destination->data[0] = 0;
-    for(i = 0; i < source->size_of_data; i++)
-      destination->data[0] += source->data[i];
-    return 0;
-  }
+  /* index arrays  (eg. [5][4][3] <-> { 5, 4, 3 }): the step in 
+   * destination along each dimension of source, e.g. if mapping = {0,2}
+   * and destination is [5][7], the steps are {1, 0, 5} */
+  strides = nip_mapping_strides(source, destination->cardinality,
+                                mapping, destination->dimensionality);
+  if(!strides)
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
 
   /* Remove old garbage */
   nip_uniform_potential(destination, 0.0);
 
   /* Linear traverse through array for easy access */
-  for(i = 0; i < source->size_of_data; i++){
-    /* flat index i  ->  index array  */
-    nip_inverse_mapping(source, i, source->temp_index);
-
-    /* remove extra indices, eg. if mapping = { 0, 2, 4 }, then
-       source_indices { 2, 6, 7, 5, 3 } becomes dest_indices { 2, 7, 3 }*/
-    nip_choose_potential_indices(source->temp_index,
-                                 destination->temp_index,
-                                 mapping,
-                                 destination->dimensionality);
-
-    /* get pointer to the destination potential element where the current
-     data should be added */
-    potvalue = nip_get_potential_pointer(destination, destination->temp_index);
-    *potvalue += source->data[i];
-  }
-
+  err = nip_sum_data(source, strides, destination->data,
+                     destination->size_of_data);
+  free(strides);
+  if(err != 0)
+    return nip_report_error(__FILE__, __LINE__, err, 1);
   return 0;
 }
 
 
 int nip_total_marginalise(nip_potential source, double destination[], int variable){
-  int i, j, x, index = 0, flat_index;
+  int i, err;
+  int* strides;
 
   if(variable < 0 || variable >= source->dimensionality)
     return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
@@ -315,27 +698,20 @@ int nip_total_marginalise(nip_potential source, double destination[], int variab
   /* index arrays  (eg. [5][4][3] <-> { 5, 4, 3 })
                          |  |  |
      variable index:     0  1  2... (or 'significance') */
-  if(source->dimensionality == 0){
-    destination[0] = source->data[0];
-    return 0;
-  }
+  strides = nip_mapping_strides(source, &(source->cardinality[variable]),
+                                &variable, 1);
+  if(!strides)
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
 
   /* initialization */
   for(i = 0; i < source->cardinality[variable]; i++)
     destination[i] = 0.0;
 
-  for(i = 0; i < source->size_of_data; i++){
-    /* partial inverse mapping to find out the destination index */
-    flat_index = i;
-    x = source->size_of_data;
-    for(j = source->dimensionality - 1; j >= variable; j--){
-      x /= source->cardinality[j];
-      index = flat_index / x;    /* integer division */
-      flat_index -= index * x;
-    }
-    destination[index] += source->data[i]; /* THE sum */
-  }
-
+  err = nip_sum_data(source, strides, destination,
+                     source->cardinality[variable]);
+  free(strides);
+  if(err != 0)
+    return nip_report_error(__FILE__, __LINE__, err, 1);
   return 0;
 }
 
@@ -365,14 +741,28 @@ int nip_normalise_potential(nip_potential p){
 /* Makes the potential a valid conditional probability distribution
  * assuming that the first variable is the (only) child */
 int nip_normalise_cpd(nip_potential p){
-  int i, n;
+  int i, n, err;
+  nip_potential_job job;
   if(!p)
     return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
 
   n = p->cardinality[0]; /* first dimension */
-  for(i = 0; i < p->size_of_data; i += n)
-    nip_normalise_array(&(p->data[i]), n);
+  if(p->size_of_data < NIP_POTENTIAL_PARALLEL_MIN){
+    for(i = 0; i < p->size_of_data; i += n)
+      nip_normalise_array(&(p->data[i]), n);
+    return 0;
+  }
 
+  /* whole columns in each part */
+  job.kernel = nip_normalise_part;
+  job.p = p;
+  job.unit = n;
+  job.num_of_parts = nip_potential_parts(p->size_of_data);
+  if(job.num_of_parts > p->size_of_data / n)
+    job.num_of_parts = p->size_of_data / n;
+  err = nip_run_potential_job(&job);
+  if(err != 0)
+    return nip_report_error(__FILE__, __LINE__, err, 1);
   return 0;
 }
 
@@ -416,90 +806,98 @@ int nip_sum_potential(nip_potential sum, nip_potential increment){
 }
 
 
-int nip_update_potential(nip_potential numerator, nip_potential denominator,
-                         nip_potential target, int mapping[]){
+int nip_weighted_sum_potential(nip_potential sum, nip_potential increment,
+                               double weight){
   int i;
-  int nvars = 0;
-  double* potvalue;
-  int* source_index;
 
-  if((numerator && denominator &&
-      ((numerator->dimensionality != denominator->dimensionality) ||
-       (numerator->dimensionality > target->dimensionality))) ||
-     (numerator == NULL && denominator == NULL)){
-    return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
-  }
-
-  if(numerator){
-    nvars = numerator->dimensionality;
-    source_index = numerator->temp_index;
+  if(!sum || !increment){
+    return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
   }
-  else{
-    nvars = denominator->dimensionality;
-    source_index = denominator->temp_index;
+  if(sum->size_of_data != increment->size_of_data){
+    return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
   }
 
-  if(nvars == 0){ /* when numerator & denominator are scalar */
-    for(i = 0; i < target->size_of_data; i++){
-      if(numerator)
-        target->data[i] *= numerator->data[0];
+  for(i = 0; i < sum->size_of_data; i++)
+    sum->data[i] += weight * increment->data[i];
 
-      if(denominator){
-        if(denominator->data[0])
-          target->data[i] /= denominator->data[0];
-        else
-          target->data[i] = 0; /* see Procedural Guide p. 20 */
-      }
-    }
-    return 0;
-  }
+  return 0;
+}
 
-  /* The general idea is the same as in marginalise */
-  for(i = 0; i < target->size_of_data; i++){
-    nip_inverse_mapping(target, i, target->temp_index);
-    nip_choose_potential_indices(target->temp_index,
-                                 source_index,
-                                 mapping, nvars);
 
-    if(numerator){ /* THE multiplication */
-      potvalue = nip_get_potential_pointer(numerator, source_index);
-      target->data[i] *= *potvalue;
-    }
+int nip_update_potential(nip_potential numerator, nip_potential denominator,
+                         nip_potential target, int mapping[]){
+  int err;
+  int* strides;
+  nip_potential source;
+  nip_potential_job job;
 
-    if(denominator){ /* THE division */
-      potvalue = nip_get_potential_pointer(denominator, source_index);
-      if(*potvalue != 0)
-        target->data[i] /= *potvalue;
-      else
-        target->data[i] = 0;  /* see Procedural Guide p. 20 */
-    }
+  if((numerator && denominator &&
+      ((numerator->dimensionality != denominator->dimensionality) ||
+       (numerator->dimensionality > target->dimensionality))) ||
+     (numerator == NULL && denominator == NULL)){
+    return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
   }
 
+  /* The general idea is the same as in marginalise, 
+   * and scalar numerator & denominator have all the steps 0 */
+  source = numerator ? numerator : denominator;
+  strides = nip_mapping_strides(target, source->cardinality,
+                                mapping, source->dimensionality);
+  if(!strides)
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+
+  job.kernel = nip_update_part;
+  job.p = target;
+  job.strides = strides;
+  job.first = numerator ? numerator->data : NULL;
+  job.second = denominator ? denominator->data : NULL;
+  job.unit = 1;
+  job.num_of_parts = nip_potential_parts(target->size_of_data);
+  if(target->size_of_data < NIP_POTENTIAL_PARALLEL_MIN)
+    err = nip_update_range(target, strides, job.first, job.second,
+                           0, target->size_of_data);
+  else
+    err = nip_run_potential_job(&job);
+  free(strides);
+  if(err != 0)
+    return nip_report_error(__FILE__, __LINE__, err, 1);
   return 0;
 }
 
 
 int nip_update_evidence(double numerator[], double denominator[],
                         nip_potential target, int var){
-  int i, source_index;
+  int i, k, n, o, step;
+  int* strides;
+  double x;
+  nip_potential_cursor cursor;
 
   /* target->dimensionality > 0  always */
+  strides = nip_mapping_strides(target, &(target->cardinality[var]),
+                                &var, 1);
+  if(!strides || nip_start_cursor(&cursor, target, strides, 0) != 0){
+    free(strides);
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  }
 
   /* The general idea is the same as in marginalise */
-  for(i = 0; i < target->size_of_data; i++){
-    nip_inverse_mapping(target, i, target->temp_index);
-    /* some of the work above is useless (only one index is used) */
-    source_index = target->temp_index[var];
-
-    target->data[i] *= numerator[source_index];  /* THE multiplication */
-
-    if(denominator != NULL && denominator[source_index] != 0)
-      target->data[i] /= denominator[source_index];  /* THE division */
+  for(i = 0; i < target->size_of_data; i += n){
+    n = cursor.cardinality[0] - cursor.index[0];
+    step = cursor.strides[0];
+    o = cursor.offset;
+    for(k = 0; k < n; k++, o += step){
+      x = target->data[i + k] * numerator[o];  /* THE multiplication */
+      if(denominator != NULL && denominator[o] != 0)
+        x /= denominator[o];  /* THE division */
+      target->data[i + k] = x;
+    }
+    nip_advance_cursor(&cursor, n);
     /* ----------------------------------------------------------- */
     /* It is assumed that: denominator[i]==0 => numerator[i]==0 !!!*/
     /* ----------------------------------------------------------- */
   }
-
+  free(cursor.cardinality);
+  free(strides);
   return 0;
 }
 
@@ -507,8 +905,8 @@ int nip_update_evidence(double numerator[], double denominator[],
 int nip_init_potential(nip_potential probs, nip_potential target,
                        int mapping[]){
   /* probs is assumed to be normalised */
-  int i;
-  double *potvalue;
+  int i, err;
+  int* strides;
 
   if(!mapping){
     if(probs->size_of_data != target->size_of_data){
@@ -529,15 +927,42 @@ int nip_init_potential(nip_potential probs, nip_potential target,
    ** number of variables DOES NOT imply that the elements are
    ** in the same order! (Had funny effects with the EM-algorithm :)
    **/
+  strides = nip_mapping_strides(target, probs->cardinality,
+                                mapping, probs->dimensionality);
+  if(!strides)
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  err = nip_update_range(target, strides, probs->data, NULL,
+                         0, target->size_of_data);
+  free(strides);
+  if(err != 0)
+    return nip_report_error(__FILE__, __LINE__, err, 1);
+  return 0;
+}
+
+
+int nip_product_potential(nip_potential target, nip_potential probs[],
+			  int* mappings[], int n){
+  int i, k;
+  double value;
+
+  for(k = 0; k < n; k++)
+    if(!mappings[k])
+      return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+
   for(i = 0; i < target->size_of_data; i++){
+    /* the target index is computed only once for all the factors */
     nip_inverse_mapping(target, i, target->temp_index);
-    nip_choose_potential_indices(target->temp_index,
-                                 probs->temp_index,
-                                 mapping,
-                                 probs->dimensionality);
-
-    potvalue = nip_get_potential_pointer(probs, probs->temp_index);
-    target->data[i] *= *potvalue;  /* THE multiplication */
+    value = 1.0;
+    for(k = 0; k < n; k++){
+      if(probs[k]->dimensionality == 0)
+	continue; /* normalised scalar == 1 */
+      nip_choose_potential_indices(target->temp_index,
+				   probs[k]->temp_index,
+				   mappings[k],
+				   probs[k]->dimensionality);
+      value *= *nip_get_potential_pointer(probs[k], probs[k]->temp_index);
+    }
+    target->data[i] = value;
   }
 
   return 0;
@@ -42,6 +42,21 @@
 
 #define NIP_DIMENSIONALITY(p) ((p)->dimensionality) ///< get number of dims
 
+/**
+ * Minimum number of entries in a potential worth splitting between threads
+ * in nip_general_marginalise(), nip_total_marginalise(),
+ * nip_update_potential() and nip_normalise_cpd(). */
+#define NIP_POTENTIAL_PARALLEL_MIN 262144
+
+/** Number of entries processed at a time by one thread: fits in cache */
+#define NIP_POTENTIAL_BLOCK 32768
+
+/** Upper limit for the number of parts a large operation is split into */
+#define NIP_POTENTIAL_MAX_PARTS 64
+
+/** Upper limit for the number of threads working on a single potential */
+#define NIP_MAX_POTENTIAL_THREADS 16
+
 /**
  * Structure for storing multidimensional tables of probabilities
  */
@@ -157,6 +172,14 @@ void nip_inverse_mapping(nip_potential p, int flat_index, int indices[]);
  * @param mapping Placement of the destination variables in the source 
  * potential in the same order they appear in the destination potential 
  * (0-based indices)
+ *
+ * A source potential of at least NIP_POTENTIAL_PARALLEL_MIN entries is
+ * split into parts of whole blocks processed by several threads: the
+ * number of online processors, or the value of the NIP_THREADS
+ * environment variable. If the parts do not share destination elements,
+ * the sums are the same as serial ones. Otherwise each part has sums
+ * of its own, added together in the order of the parts. Either way,
+ * the result does not depend on the number of threads.
  * @return an error code, or 0 on success
  */
 int nip_general_marginalise(nip_potential source, nip_potential destination, 
@@ -171,6 +194,7 @@ int nip_general_marginalise(nip_potential source, nip_potential destination,
  *   NOTE: Size of the array MUST be correct (check it from the variable)
  * @param variable The 0-based index of the variable of interest 
  * @return an error code, or 0 on success
+ * @see nip_general_marginalise() for the use of threads
  */
 int nip_total_marginalise(nip_potential source, double destination[], 
 			  int variable);
@@ -196,6 +220,8 @@ int nip_normalise_potential(nip_potential p);
  * Normalises a potential so that it is a valid conditional probability 
  * distribution (CPD). This assumes that the first variable (dimension) 
  * is the child. Potentially faster than normalise_dimension(p, 0).
+ * Large potentials are split between threads like in 
+ * nip_general_marginalise(), each one normalising whole columns.
  * @param p The potential to modify
  * @return an error code, or 0 on success
  */
@@ -219,6 +245,18 @@ int nip_normalise_dimension(nip_potential p, int dimension);
 int nip_sum_potential(nip_potential sum, nip_potential increment);
 
 
+/**
+ * Method for accumulating a weighted sum of potentials: 
+ * "sum += weight * increment" for potential tables.
+ * @param sum The potential to add into
+ * @param increment The potential to add
+ * @param weight Multiplier for \p increment
+ * @return an error code, or 0 on success
+ * @see nip_sum_potential() */
+int nip_weighted_sum_potential(nip_potential sum, nip_potential increment,
+			       double weight);
+
+
 /**
  * Method for updating target potential by multiplying with numerator 
  * potential and dividing with denominator potential. Useful in message 
@@ -237,6 +275,10 @@ int nip_sum_potential(nip_potential sum, nip_potential increment);
  *   This MUST have similar dimensions to numerator.
  * @param mapping An index array which holds the placement of the variables 
  *   of \p numerator & \p denominator potential in the \p target potential
+ *
+ * A large \p target is split between threads like in 
+ * nip_general_marginalise(), but each element is updated independently 
+ * and the result is always the same as a serial one.
  * @return an error code, or 0 on success */
 int nip_update_potential(nip_potential numerator, nip_potential denominator, 
 			 nip_potential target, int mapping[]);
@@ -267,6 +309,20 @@ int nip_update_evidence(double numerator[], double denominator[],
 int nip_init_potential(nip_potential probs, nip_potential target, 
 		       int mapping[]);
 
+/**
+ * Sets \p target to the product of \p n probability distributions,
+ * computing each element in a single pass instead of initialising
+ * a uniform potential and multiplying the distributions in one by one.
+ * @param target The potential to overwrite
+ * @param probs Array of \p n probability distributions
+ * @param mappings Indices of each \p probs[k] dimension in \p target
+ * @param n Number of distributions, 0 makes \p target uniform 1.0
+ * @return an error code, or 0 on success
+ * @see nip_init_potential()
+ */
+int nip_product_potential(nip_potential target, nip_potential probs[],
+			  int* mappings[], int n);
+
 /**
  * Prints a textual representation of the potential \p p to stream.
  * Mostly for debugging.
@@ -21,6 +21,8 @@
 #include <ctype.h>  // isspace
 #include <stdlib.h> // calloc, free
 #include <string.h> // strncpy
+#include <stdio.h>  // snprintf
+#include <math.h>   // floor
 #include "niperrorhandler.h"
 
 /*
@@ -247,3 +249,138 @@ char** nip_split(const char s[], int indices[], int n){
 
   return words;
 }
+
+
+unsigned long nip_hash_string(const char* s){
+  unsigned long h = 2166136261UL;
+  while(*s != '\0')
+    h = (h ^ (unsigned char)(*s++)) * 16777619UL;
+  return h;
+}
+
+
+/* Powers of ten that are exactly representable as doubles */
+static const double nip_powers_of_ten[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+#define NIP_MAX_EXACT_POWER 22
+#define NIP_MAX_EXACT_MANTISSA 9007199254740992ULL /* 2^53 */
+
+int nip_parse_number(const char* s, int length, double* value){
+  int i = 0, digits = 0, exponent = 0, e = 0, e_digits = 0;
+  int negative = 0, e_negative = 0, exact = 1;
+  unsigned long long mantissa = 0;
+  char buffer[64];
+  char* copy = buffer;
+  char* endptr;
+
+  if(length <= 0)
+    return 0;
+
+  /* [+-]digits[.digits][(e|E)[+-]digits] */
+  if(s[i] == '+' || s[i] == '-')
+    negative = (s[i++] == '-');
+  for(; i < length && isdigit((int)s[i]); i++, digits++){
+    if(mantissa > NIP_MAX_EXACT_MANTISSA / 10)
+      exact = 0;
+    else
+      mantissa = 10 * mantissa + (s[i] - '0');
+  }
+  if(i < length && s[i] == '.'){
+    for(i++; i < length && isdigit((int)s[i]); i++, digits++, exponent--){
+      if(mantissa > NIP_MAX_EXACT_MANTISSA / 10)
+	exact = 0;
+      else
+	mantissa = 10 * mantissa + (s[i] - '0');
+    }
+  }
+  if(digits > 0 && i < length && (s[i] == 'e' || s[i] == 'E')){
+    i++;
+    if(i < length && (s[i] == '+' || s[i] == '-'))
+      e_negative = (s[i++] == '-');
+    for(; i < length && isdigit((int)s[i]); i++, e_digits++)
+      if(e < 10000)
+	e = 10 * e + (s[i] - '0');
+    if(e_digits == 0)
+      exact = 0; /* e.g. "1e": let strtod() decide where it ends */
+    exponent += e_negative ? -e : e;
+  }
+
+  /* Exact conversion: both the mantissa and the power of ten are
+   * exactly representable, so a single correctly rounded operation
+   * gives the correctly rounded result. */
+  if(exact && digits > 0 && i == length &&
+     mantissa <= NIP_MAX_EXACT_MANTISSA &&
+     exponent >= -NIP_MAX_EXACT_POWER && exponent <= NIP_MAX_EXACT_POWER){
+    if(exponent < 0)
+      *value = (double)mantissa / nip_powers_of_ten[-exponent];
+    else
+      *value = (double)mantissa * nip_powers_of_ten[exponent];
+    if(negative)
+      *value = -(*value);
+    return length;
+  }
+
+  /* Everything else: long mantissas, "inf", "nan", hex etc. */
+  if(length >= (int)sizeof(buffer)){
+    copy = (char*) malloc(length + 1);
+    if(!copy){
+      nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+      return 0;
+    }
+  }
+  memcpy(copy, s, length);
+  copy[length] = '\0';
+  *value = strtod(copy, &endptr);
+  i = (int)(endptr - copy);
+  if(copy != buffer)
+    free(copy);
+  return i;
+}
+
+
+int nip_format_number(double x, int precision, char* s, int size){
+  int i, n, negative;
+  unsigned long long digits, scale;
+  double y, fraction;
+  char buffer[48];
+
+  /* Direct conversion: x * 10^precision is an integer plus a fraction
+   * that is far enough from one half to round the same way as the
+   * exact decimal value would. Ties and large values go to snprintf(). */
+  negative = (x < 0 || (x == 0 && 1 / x < 0));
+  y = negative ? -x : x;
+  if(precision >= 0 && precision <= 17 && size > 0 &&
+     y < 1e15 / nip_powers_of_ten[precision]){
+    y *= nip_powers_of_ten[precision];
+    digits = (unsigned long long)floor(y);
+    fraction = y - (double)digits;
+    if(fabs(fraction - 0.5) > 4 * y * 1.1102230246251565e-16 + 1e-300){
+      if(fraction > 0.5)
+	digits++;
+
+      /* Digits backwards: the decimals, the point, the integer part */
+      n = 0;
+      scale = digits;
+      for(i = 0; i < precision; i++){
+	buffer[n++] = '0' + (char)(scale % 10);
+	scale /= 10;
+      }
+      if(precision > 0)
+	buffer[n++] = '.';
+      do{
+	buffer[n++] = '0' + (char)(scale % 10);
+	scale /= 10;
+      } while(scale > 0);
+      if(negative)
+	buffer[n++] = '-';
+
+      for(i = 0; i < n && i < size - 1; i++)
+	s[i] = buffer[n - 1 - i];
+      s[i] = '\0';
+      return n;
+    }
+  }
+  return snprintf(s, size, "%.*f", precision, x);
+}
@@ -79,4 +79,38 @@ int* nip_tokenise(const char s[], int n, int q_strings,
  * @see nip_tokenise() */
 char** nip_split(const char s[], int indices[], int n);
 
+/**
+ * Computes a hash value of a null terminated string (FNV-1a),
+ * e.g. for lookup tables of symbols with open addressing.
+ * @param s The input string
+ * @return hash value of \p s */
+unsigned long nip_hash_string(const char* s);
+
+/**
+ * Parses a decimal number from the beginning of a string that is not
+ * necessarily null terminated. Plain decimal numbers with at most 15-16
+ * significant digits are converted directly, exactly like strtod() does;
+ * anything else is left to strtod().
+ * @param s The input string
+ * @param length Number of characters available in \p s
+ * @param value Pointer where the parsed number is written
+ * @return number of characters parsed, or 0 if \p s does not start
+ * with a number
+ * @see strtod() in <stdlib.h> */
+int nip_parse_number(const char* s, int length, double* value);
+
+/**
+ * Formats a number with a fixed number of decimals, like
+ * snprintf(s, size, "%.*f", precision, x) but without parsing a format
+ * string. Moderate values are converted directly with the same rounding
+ * as printf(); anything else is left to snprintf().
+ * @param x The number to format
+ * @param precision Number of digits after the decimal point
+ * @param s Where to write the null terminated result
+ * @param size Size of the array \p s
+ * @return number of characters (excluding the null) in the result,
+ * or the number needed if \p size was too small
+ * @see snprintf() in <stdio.h> */
+int nip_format_number(double x, int precision, char* s, int size);
+
 #endif /* __NIPSTRING_H__ */
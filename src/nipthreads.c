@@ -0,0 +1,48 @@
+/**
+ * @file
+ * @brief How many threads the library may use for one job
+ *
+ * @author NIP contributors
+ * @copyright &copy; 2026 NIP contributors <br>
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. <br>
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nipthreads.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* NIP_THREADS or the number of processors, read once per process */
+static long nip_thread_limit = 1;
+static pthread_once_t nip_thread_limit_once = PTHREAD_ONCE_INIT;
+
+/* Sets nip_thread_limit, see pthread_once() */
+static void nip_init_thread_limit(void);
+
+
+static void nip_init_thread_limit(void){
+  char* setting = getenv("NIP_THREADS");
+
+  if(setting && atoi(setting) > 0)
+    nip_thread_limit = atoi(setting);
+  else
+    nip_thread_limit = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nip_thread_limit < 1)
+    nip_thread_limit = 1; /* unknown */
+}
+
+
+long nip_max_threads(){
+  pthread_once(&nip_thread_limit_once, nip_init_thread_limit);
+  return nip_thread_limit;
+}
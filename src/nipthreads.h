@@ -0,0 +1,31 @@
+/**
+ * @file
+ * @brief How many threads the library may use for one job
+ *
+ * @author NIP contributors
+ * @copyright &copy; 2026 NIP contributors <br>
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. <br>
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NIPTHREADS_H__
+#define __NIPTHREADS_H__
+
+/**
+ * Tells the maximum number of threads: the value of the NIP_THREADS
+ * environment variable if positive, or else the number of online
+ * processors. Both are read only once per process, so later calls
+ * are cheap and the answer does not change.
+ * @return the number of threads, at least 1
+ */
+long nip_max_threads();
+
+#endif
@@ -24,8 +24,26 @@
 #include <stdlib.h>
 
 #include "niperrorhandler.h"
+#include "nipstring.h"
+
+/* Larger sets of variables are combined using the dense indices 
+ * instead of comparing every pair of variables */
+#define NIP_LINEAR_SET_LIMIT 64
+
+static nip_variable* nip_variable_bitset_union(nip_variable* a, 
+						nip_variable* b, 
+						int na, int nb, int* nc);
+
+static nip_variable* nip_variable_bitset_isect(nip_variable* a, 
+						nip_variable* b, 
+						int na, int nb, int* nc);
+
+static int* nip_variable_index_mapper(nip_variable* set, 
+				      nip_variable* subset, 
+				      int nset, int nsubset);
 
 static int nip_set_variable_text(char** record, const char *name);
+static int nip_build_state_table(nip_variable v);
 
 /*
  * Gives the variable a verbose name, symbol etc.
@@ -69,7 +87,12 @@ nip_variable nip_new_variable(const char* symbol, const char* name,
   }
 
   v->cardinality = cardinality;
+#ifdef __GNUC__
+  v->id = __sync_fetch_and_add(&id, 1); /* unique even if parsing in threads */
+#else
   v->id = id++;
+#endif
+  v->index = (int)(v->id - NIP_VAR_MIN_ID); /* until numbered by a model */
   v->previous = NULL;
   v->next = NULL;
 
@@ -92,6 +115,9 @@ nip_variable nip_new_variable(const char* symbol, const char* name,
     nip_set_variable_text(&(v->name), name);
   /* DANGER! The name can be omitted and consequently be NULL */
 
+  v->state_names = NULL;
+  v->state_table = NULL;
+  v->state_table_size = 0;
   if(states){
     v->state_names = (char **) calloc(cardinality, sizeof(char *));
     if(!(v->state_names)){
@@ -124,10 +150,42 @@ nip_variable nip_new_variable(const char* symbol, const char* name,
   /* initialise likelihoods to 1 */
   for(dpointer=v->likelihood, i=0; i < cardinality; *dpointer++ = 1, i++);
 
+  /* without the table, state names are searched linearly */
+  if(v->state_names)
+    nip_build_state_table(v);
+
   return v;
 }
 
 
+/* Builds a hash table of state indices, at most half full */
+static int nip_build_state_table(nip_variable v){
+  int i, size;
+  unsigned long h;
+
+  size = 4;
+  while(size < 2 * v->cardinality)
+    size *= 2;
+
+  v->state_table = (int*) malloc(size * sizeof(int));
+  if(!(v->state_table)){
+    v->state_table_size = 0;
+    return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  }
+  v->state_table_size = size;
+  for(i = 0; i < size; i++)
+    v->state_table[i] = -1; /* empty */
+
+  for(i = 0; i < v->cardinality; i++){
+    h = nip_hash_string(v->state_names[i]) & (size - 1);
+    while(v->state_table[h] >= 0)
+      h = (h + 1) & (size - 1); /* linear probing */
+    v->state_table[h] = i;
+  }
+  return 0;
+}
+
+
 /* Useful? Get rid of this function? */
 nip_variable nip_copy_variable(nip_variable v){
   int i;
@@ -144,6 +202,9 @@ nip_variable nip_copy_variable(nip_variable v){
 
   copy->cardinality = v->cardinality;
   copy->id = v->id;
+  copy->index = v->index;
+  copy->state_table = NULL;
+  copy->state_table_size = 0;
 
   nip_set_variable_text(&(copy->name), v->name);
   /* symbol etc? */
@@ -190,6 +251,7 @@ void nip_free_variable(nip_variable v){
     for(i = 0; i < v->cardinality; i++)
       free(v->state_names[i]);
   free(v->state_names);
+  free(v->state_table);
   free(v->parents);
   free(v->family_mapping);
   free(v->likelihood);
@@ -212,6 +274,35 @@ unsigned long nip_variable_id(nip_variable v){
 }
 
 
+int nip_variable_index(nip_variable v){
+  if(v)
+    return v->index;
+  return -1;
+}
+
+
+void nip_set_variable_index(nip_variable v, int i){
+  if(v)
+    v->index = i;
+}
+
+
+nip_bitset nip_variable_bitset(nip_variable* vars, int nvars){
+  int i, n = 0;
+  nip_bitset b;
+
+  for(i = 0; i < nvars; i++)
+    if(vars[i]->index >= n)
+      n = vars[i]->index + 1;
+  b = nip_new_bitset(n);
+  if(!b)
+    return NULL;
+  for(i = 0; i < nvars; i++)
+    nip_bitset_add(b, vars[i]->index);
+  return b;
+}
+
+
 void nip_mark_variable(nip_variable v){
   if(v) 
     v->mark = NIP_MARK_ON;
@@ -238,8 +329,18 @@ char* nip_variable_symbol(nip_variable v){
 
 int nip_variable_state_index(nip_variable v, char *state){
   int i;
+  unsigned long h;
   if(!v->state_names)
     return -1;
+  if(v->state_table){
+    h = nip_hash_string(state) & (v->state_table_size - 1);
+    while((i = v->state_table[h]) >= 0){
+      if(strcmp(state, v->state_names[i]) == 0)
+        return i;
+      h = (h + 1) & (v->state_table_size - 1);
+    }
+    return -1;
+  }
   for(i = 0; i < v->cardinality; i++)
     if(strcmp(state, v->state_names[i]) == 0)
       return i;
@@ -460,6 +561,9 @@ nip_variable* nip_variable_union(nip_variable* a, nip_variable* b,
     *nc = 0;
     return NULL;
   }
+
+  if(na * nb > NIP_LINEAR_SET_LIMIT)
+    return nip_variable_bitset_union(a, b, na, nb, nc);
   
   /* Size of the union */
   n = na + nb;
@@ -520,6 +624,9 @@ nip_variable* nip_variable_isect(nip_variable *a, nip_variable *b,
       *nc = -1;
     return NULL;
   }
+
+  if(na * nb > NIP_LINEAR_SET_LIMIT)
+    return nip_variable_bitset_isect(a, b, na, nb, nc);
   
   /* Size of the intersection */
   n = 0;
@@ -570,6 +677,9 @@ int* nip_mapper(nip_variable *set, nip_variable *subset,
     return NULL;
   }
 
+  if(nset * nsubset > NIP_LINEAR_SET_LIMIT)
+    return nip_variable_index_mapper(set, subset, nset, nsubset);
+
   mapping = (int*) calloc(nsubset, sizeof(int));
   if(!mapping){
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
@@ -589,6 +699,121 @@ int* nip_mapper(nip_variable *set, nip_variable *subset,
 }
 
 
+static nip_variable* nip_variable_bitset_union(nip_variable* a, 
+						nip_variable* b, 
+						int na, int nb, int* nc){
+  int i, n = 0;
+  nip_variable* c = NULL;
+  nip_bitset found = NULL;
+
+  for(i = 0; i < na; i++)
+    if(a[i]->index >= n)
+      n = a[i]->index + 1;
+  for(i = 0; i < nb; i++)
+    if(b[i]->index >= n)
+      n = b[i]->index + 1;
+  found = nip_new_bitset(n);
+  c = (nip_variable*) calloc(na + nb, sizeof(nip_variable));
+  if(!found || !c){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    nip_free_bitset(found);
+    free(c);
+    *nc = -1;
+    return NULL;
+  }
+
+  for(i = 0; i < na; i++){ /* first the set a */
+    c[i] = a[i];
+    nip_bitset_add(found, a[i]->index);
+  }
+  n = na;
+  for(i = 0; i < nb; i++){ /* then the missing ones from b */
+    if(!NIP_BITSET_CONTAINS(found, b[i]->index)){
+      nip_bitset_add(found, b[i]->index);
+      c[n++] = b[i];
+    }
+  }
+  nip_free_bitset(found);
+  *nc = n;
+  return c;
+}
+
+
+static nip_variable* nip_variable_bitset_isect(nip_variable* a, 
+						nip_variable* b, 
+						int na, int nb, int* nc){
+  int i, n;
+  nip_variable* c = NULL;
+  nip_bitset in_b = nip_variable_bitset(b, nb);
+
+  if(!in_b){
+    *nc = -1;
+    return NULL;
+  }
+
+  /* Size of the intersection */
+  n = 0;
+  for(i = 0; i < na; i++)
+    if(NIP_BITSET_CONTAINS(in_b, a[i]->index))
+      n++;
+  *nc = n;
+  if(n == 0){
+    nip_free_bitset(in_b);
+    return NULL; /* empty set */
+  }
+
+  c = (nip_variable*) calloc(n, sizeof(nip_variable));
+  if(!c){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    nip_free_bitset(in_b);
+    *nc = -1;
+    return NULL;
+  }
+  n = 0;
+  for(i = 0; i < na; i++)
+    if(NIP_BITSET_CONTAINS(in_b, a[i]->index))
+      c[n++] = a[i];
+  nip_free_bitset(in_b);
+  return c;
+}
+
+
+static int* nip_variable_index_mapper(nip_variable* set, 
+				      nip_variable* subset, 
+				      int nset, int nsubset){
+  int i, j, low, high;
+  int* mapping = NULL;
+  int* position = NULL;
+
+  /* position[index - low] is the place of each variable in set */
+  low = high = set[0]->index;
+  for(j = 1; j < nset; j++){
+    if(set[j]->index < low)
+      low = set[j]->index;
+    if(set[j]->index > high)
+      high = set[j]->index;
+  }
+  mapping = (int*) calloc(nsubset, sizeof(int));
+  position = (int*) calloc(high - low + 1, sizeof(int));
+  if(!mapping || !position){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    free(mapping);
+    free(position);
+    return NULL;
+  }
+  for(j = nset - 1; j >= 0; j--)
+    position[set[j]->index - low] = j; /* the first one if repeated */
+
+  for(i = 0; i < nsubset; i++){
+    j = subset[i]->index - low;
+    if(j >= 0 && j <= high - low)
+      mapping[i] = position[j];
+  }
+  free(position);
+  return mapping;
+}
+
+
 nip_variable_list nip_new_variable_list(){
   nip_variable_list vl = (nip_variable_list) 
     malloc(sizeof(nip_variable_list_struct));
@@ -21,6 +21,8 @@
 #ifndef __NIPVARIABLE_H__
 #define __NIPVARIABLE_H__
 
+#include "nipbitset.h"
+
 /* The name, symbol, statename etc. can be at most 40 characters long...
  * FIXME: problematic from UTF-8 point of view! */
 #define NIP_VAR_TEXT_LENGTH 40 ///< Limit variable & state names, FIXME
@@ -50,11 +52,15 @@
  * The struct and typedefs for nip_variable */
 typedef struct nip_var {
   unsigned long id; ///< Unique id for every variable
+  int index; ///< Dense index of the variable in its model, for bitsets
   char* symbol; ///< Short symbol for the variable (string)
   char* name; ///< Label in the Net language (string)
 
   int cardinality; ///< Number of possible values
   char** state_names; ///< Name of each value (strings)
+  int* state_table; /**< Hash table (open addressing) of state indices
+                       by name, or NULL */
+  int state_table_size; ///< Size of \p state_table, a power of two
   double* likelihood; ///< Likelihood of each value
   double* prior; ///< Prior prob. of each value for an indep. variable
   int prior_entered; ///< Tells whether the prior is already in use
@@ -167,6 +173,32 @@ int nip_equal_variables(nip_variable v1, nip_variable v2);
  */
 unsigned long nip_variable_id(nip_variable v);
 
+/**
+ * Gives the dense index of a variable: the variables of a model are 
+ * numbered 0...n-1 for representing sets of them as bitsets. 
+ * A new variable gets a unique index (id - NIP_VAR_MIN_ID) until the 
+ * model containing it numbers its variables.
+ * @param v A variable reference
+ * @return the index of the variable \p v, or -1 if NULL
+ * @see nip_set_variable_index() */
+int nip_variable_index(nip_variable v);
+
+/**
+ * Sets the dense index of a variable. Done when creating a model, 
+ * before creating any cliques, so that the variables of the same 
+ * model have different indices.
+ * @param v A variable reference
+ * @param i Index of \p v among the variables of the model */
+void nip_set_variable_index(nip_variable v, int i);
+
+/**
+ * Creates a bitset of the indices of the given variables.
+ * @param vars Array of variables (of the same model)
+ * @param nvars Size of the array
+ * @return a new bitset, remember to free it, or NULL if out of memory
+ * @see nip_variable_index() */
+nip_bitset nip_variable_bitset(nip_variable* vars, int nvars);
+
 /**
  * Method for marking a variable.
  * @param v Reference to the variable */
@@ -192,7 +224,8 @@ char* nip_variable_symbol(nip_variable v);
 
 /**
  * Gives a numerical representation of the variable state. 
- * This function is useful when parsing data. 
+ * This function is useful when parsing data: the state is looked up
+ * from a hash table built when the variable was created.
  * @param v Reference to the variable
  * @param state A value represented as a string
  * @return the index in [0 ... <cardinality-1>] or -1 if the 
@@ -33,12 +33,33 @@
 #define DEBUG_BISONTEST
 */
 
-FILE *open_net_file(const char *filename);
-void close_net_file();
-int yyparse();
-nip_variable_list get_parsed_variables();
-int get_cliques(nip_clique** clique_array_pointer);
-/* Reminder: extern keyword is for declaring external _variables_ */
+/* huginnet.tab.h declares yyparse(), open_net_file(), etc. */
+
+/*
+ * Prints the variables and the potential of a clique in the order of
+ * the variable IDs, whatever the layout of the clique.
+ */
+static void print_clique(nip_clique c){
+  int i, j, n = NIP_DIMENSIONALITY(c->p);
+  nip_variable v;
+  nip_variable* vars = (nip_variable*) calloc(n, sizeof(nip_variable));
+  nip_potential p;
+
+  for(i = 0; i < n; i++){ /* insertion sort */
+    v = c->variables[i];
+    for(j = i; j > 0 && nip_variable_id(vars[j - 1]) > nip_variable_id(v); j--)
+      vars[j] = vars[j - 1];
+    vars[j] = v;
+  }
+  fprintf(stdout, "clique ");
+  for(i = 0; i < n; i++)
+    fprintf(stdout, "%s ", nip_variable_symbol(vars[i]));
+  fprintf(stdout, "\n");
+  p = nip_clique_potential(c, vars);
+  nip_fprintf_potential(stdout, p);
+  nip_free_potential(p);
+  free(vars);
+}
 
 /*
  * Calculate the probability distribution of variable "var".
@@ -93,6 +114,7 @@ int main(int argc, char *argv[]){
   int nvars;
   nip_variable_list var_list;
   nip_variable_iterator it;
+  nip_net_parser parser;
 
 #ifdef DEBUG_BISONTEST
   int temp;
@@ -107,20 +129,21 @@ int main(int argc, char *argv[]){
     fprintf(stderr, "- probability of the state of the variable.\n");
     return 0;
   }
-  else if(open_net_file(argv[1]) == NULL)
+  else if((parser = open_net_file(argv[1])) == NULL)
     return -1;
 
-  retval = yyparse();
+  retval = yyparse(parser);
 
-  close_net_file();
-
-  if(retval != 0)
+  if(retval != 0){
+    close_net_file(parser);
     return retval;
+  }
   /* The input file has been parsed. -- */
 
   // get the results of parsing
-  num_of_cliques = get_cliques(&cliques);
-  var_list = get_parsed_variables();
+  num_of_cliques = get_cliques(parser, &cliques);
+  var_list = get_parsed_variables(parser);
+  close_net_file(parser);
   it = NIP_LIST_ITERATOR(var_list);
   nvars = NIP_LIST_LENGTH(var_list);
   vars = (nip_variable*) calloc(nvars, sizeof(nip_variable));
@@ -137,8 +160,7 @@ int main(int argc, char *argv[]){
   fprintf(stdout, "Before evidence:\n");
   for(i = 0; i < num_of_cliques; i++){
     fprintf(stdout, "Potential of ");
-    nip_fprintf_clique(stdout, cliques[i]);
-    nip_fprintf_potential(stdout, cliques[i]->p);
+    print_clique(cliques[i]);
   }
 
   // generate evidence about the variable
@@ -173,8 +195,7 @@ int main(int argc, char *argv[]){
   fprintf(stdout, "After evidence:\n");
   for(i = 0; i < num_of_cliques; i++){
     fprintf(stdout, "Potential of ");
-    nip_fprintf_clique(stdout, cliques[i]);
-    nip_fprintf_potential(stdout, cliques[i]->p);
+    print_clique(cliques[i]);
   }
 
   printf("Normalised probability of %s:\n", nip_variable_symbol(interesting));
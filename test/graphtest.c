@@ -237,7 +237,9 @@ nip_graph test6() {
 void test7(nip_graph g) {
   nip_clique* cliques;
   nip_clique ci;
-  int i, j, n_cliques, n_vars;
+  nip_variable v;
+  nip_variable vars[8]; /* the variables of a clique in the order of IDs */
+  int i, j, k, n_cliques, n_vars;
 	
   printf("\tTest 7... graph_to_cliques\n");
 
@@ -247,8 +249,14 @@ void test7(nip_graph g) {
     printf("\t\tclique %i: ", i);
     ci = cliques[i];
     n_vars = nip_clique_size(ci);
+    for (j = 0; j < n_vars; j++) { /* insertion sort */
+      v = ci->variables[j];
+      for (k = j; k > 0 && nip_variable_id(vars[k - 1]) > nip_variable_id(v); k--)
+	vars[k] = vars[k - 1];
+      vars[k] = v;
+    }
     for (j = 0; j < n_vars; j++)
-      printf("%s ", ci->variables[j]->symbol);
+      printf("%s ", vars[j]->symbol);
     printf("\n");	
   }
 	
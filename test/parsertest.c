@@ -23,10 +23,6 @@
 #include <stdio.h>
 #include "nipparsers.h"
 
-/* see nip.c */
-FILE *open_net_file(const char *filename);
-void close_net_file();
-
 /* Tries out the Huginnet parser stuff and low level data parsing. */
 int main(int argc, char *argv[]){
 
@@ -34,13 +30,13 @@ int main(int argc, char *argv[]){
   int ok = 1;
   char *token;
   char **tokens = NULL;
-  FILE *nf = NULL;  
+  nip_net_file nf = NULL;
 
   if (argc < 2) {
     fprintf(stderr, "Filename must be given\n");
     return -1;
   }
-  else if ((nf = open_net_file(argv[1])) == NULL) {
+  else if ((nf = nip_open_net_file(argv[1])) == NULL) {
     fprintf(stderr, "Failed to open net file %s", argv[1]);
     return -1;
   }
@@ -59,7 +55,7 @@ int main(int argc, char *argv[]){
       free(token);
     }
   }
-  close_net_file();
+  nip_close_net_file(nf);
 
   return 0;
 }
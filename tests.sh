@@ -163,6 +163,84 @@ assert $of $ef $LINENO
 rm $of
 
 
+echo '' 1>&2
+echo '12. Test distributed EM steps: util/nipcounts' 1>&2
+
+if=test/input12.csv
+of=test/output12.net
+ef=test/expect12.net
+head -n17 test/input8.csv > test/input12a.csv
+head -n1 test/input8.csv > test/input12b.csv
+tail -n16 test/input8.csv >> test/input12b.csv
+cp test/input12a.csv $if
+echo "" >> $if
+tail -n16 test/input8.csv >> $if
+./util/nipcounts estep test/input7.net $if test/counts12.bin
+./util/nipcounts mstep test/input7.net test/counts12.bin $ef > /dev/null
+./util/nipcounts estep test/input7.net test/input12a.csv test/counts12a.bin
+./util/nipcounts estep test/input7.net test/input12b.csv test/counts12b.bin
+./util/nipcounts merge test/input7.net test/counts12.bin \
+    test/counts12a.bin test/counts12b.bin > /dev/null
+./util/nipcounts mstep test/input7.net test/counts12.bin $of > /dev/null
+assert $of $ef $LINENO
+rm $if $of $ef test/input12a.csv test/input12b.csv test/counts12*.bin
+
+
+echo '' 1>&2
+echo '13. Test binary data files: util/nipconvert' 1>&2
+
+if=test/input8.csv
+of=test/output13.csv
+ef=test/expect13.csv
+./util/nipconvert test/input7.net multivariate $if binary test/data13.bin
+./util/nipconvert test/input7.net binary test/data13.bin multivariate $of
+./util/nipconvert test/input7.net multivariate $if multivariate $ef
+assert $of $ef $LINENO
+rm $of $ef test/data13.bin
+
+
+echo '' 1>&2
+echo '14. Test compiled models: util/nipcompile' 1>&2
+
+if=test/input8.csv
+of=test/output14.csv
+ef=test/expect9.csv
+./util/nipcompile test/input7.net test/model14.bin
+./util/nipinference test/model14.bin $if P1 $of # 2> /dev/null
+assert $of $ef $LINENO
+rm $of test/model14.bin
+
+
+echo '' 1>&2
+echo '15. Test parallel reading of large data files: src/nipparsers.c' 1>&2
+
+if=test/input15.csv
+of=test/output15.csv
+ef=test/expect15.csv
+# 1500 copies of the time series in test/input8.csv
+awk 'NR == 1 { print; next } { s = s $0 "\n" } END { for(i = 0; i < 1500; i++) printf "%s\n", s }' test/input8.csv > $if
+NIP_THREADS=1 ./util/nipinference test/input7.net $if P1 $ef > /dev/null 2>&1
+NIP_THREADS=4 ./util/nipinference test/input7.net $if P1 $of > /dev/null 2>&1
+assert $of $ef $LINENO
+rm $if $of $ef
+
+
+echo '' 1>&2
+echo '16. Test pruned models for queries: src/nip.c' 1>&2
+
+if=test/input16.csv
+of=test/output16.txt
+ef=test/expect16.txt
+# the expected values are exact results for the Asia network
+./util/nipjoint test/input16.net $if L B 2> /dev/null > $of
+./util/niplikelihood test/input16.net $if X D 2> /dev/null >> $of
+assert $of $ef $LINENO
+NIP_PRUNING=0 ./util/nipjoint test/input16.net $if L B 2> /dev/null > $of
+NIP_PRUNING=0 ./util/niplikelihood test/input16.net $if X D 2> /dev/null >> $of
+assert $of $ef $LINENO
+rm $of
+
+
 # TODO: some 3 layers or units more...
 
 echo "$(tput setaf 2)OK$(tput sgr0)" 1>&2
@@ -18,7 +18,7 @@
 /* nipbenchmark.c
  *
  * SYNOPSIS:
- * NIPBENCHMARK <MODEL.NET> <INPUT_DATA.TXT> <THRESHOLD> <MINL> <VAR> <OUTPUT_DATA.TXT>
+ * NIPBENCHMARK <MODEL.NET> <INPUT_DATA.TXT> <THRESHOLD> <MINL> <VAR> <OUTPUT_DATA.TXT> [<NPROC>]
  *
  * Executes leave-one-out testing on the prediction accuracy.
  * For each time series, a model is estimated from the rest
@@ -30,33 +30,231 @@
  * for further assessment, at least when the results of this
  * program are used for model selection.
  *
+ * If the number of processes <NPROC> is given, a faster approximation
+ * is used: the model is estimated once from all the data, the expected
+ * counts of each held-out series are subtracted from the total, and
+ * each fold is warm started from the result with a few EM iterations.
+ * The folds are divided between <NPROC> worker processes.
+ * NOTE: this keeps the expected counts of every series in memory.
+ * A series that is impossible for the model estimated from all the data
+ * is left out of the total (with a warning) instead of aborting.
+ *
  * EXAMPLE:
  * ./nipbenchmark model.net data.txt 0.00001 -1.2 A inferred_data.txt
+ * ./nipbenchmark model.net data.txt 0.00001 -1.2 A inferred_data.txt 4
  *
  * Author: Janne Toivola
  * Version: $Id: nipbenchmark.c,v 1.2 2010-12-07 17:23:19 jatoivol Exp $
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>    // fork
+#include <sys/types.h>
+#include <sys/wait.h>  // waitpid
 #include "nip.h"
 
 #define MAX_ITER 1024L
 
+/* Max. number of EM iterations for a warm started fold */
+#define FOLD_ITER 16L
+
 /* a lot of similarities with the inference tool (inftest)... */
 
 /* TODO: a way to evaluate statistical significance... empirical p-value? */
 
+/* Repeats EM until good enough, returns an error code */
+static int train(nip_model model, time_series* set, int n, double threshold,
+                 double min_log_likelihood, nip_double_list learning_curve);
+
+/* Computes fold i from the total expected counts, returns an error code */
+static int warm_fold(nip_model model, time_series* ts_set, int n_max, int i,
+                     time_series* loo_set, nip_potential* total,
+                     nip_potential** stats, double threshold,
+                     double min_log_likelihood,
+                     nip_double_list learning_curve);
+
+/* Serialises the inference result of a fold */
+static int write_fold(FILE* f, int fold, uncertain_series ucs, double ll);
+
+/* Reads what write_fold wrote, returns NULL at the end of file */
+static uncertain_series read_fold(FILE* f, nip_variable v,
+                                  int* fold, double* ll);
+
+
+static int train(nip_model model, time_series* set, int n, double threshold,
+                 double min_log_likelihood, nip_double_list learning_curve){
+  int e, j;
+  double last;
+  nip_convergence stopping_reason;
+
+  /* Use all the data (mark all variables) in EM */
+  for(j = 0; j < model->num_of_vars; j++)
+    nip_mark_variable(model->variables[j]);
+
+  /* repeat EM until good enough */
+  do{
+    last = 0; /* init */
+
+    /* free the list if necessary */
+    if(NIP_LIST_LENGTH(learning_curve) > 0)
+      nip_empty_double_list(learning_curve);
+
+    /* the EM algorithm */
+    e = em_learn(model, set, n, 1, MAX_ITER, threshold, learning_curve,
+                 &stopping_reason, &nip_append_double, NULL);
+    if(!(e == NIP_NO_ERROR || e == NIP_ERROR_BAD_LUCK)){
+      fprintf(stderr, "There were errors during learning:\n");
+      nip_report_error(__FILE__, __LINE__, e, 1);
+      return e;
+    }
+
+    /* find out the last value in learning curve */
+    if(NIP_LIST_LENGTH(learning_curve) > 0){
+      last = learning_curve->last->data;
+    }
+
+  } while(e == NIP_ERROR_BAD_LUCK || last < min_log_likelihood);
+
+  return NIP_NO_ERROR;
+}
+
+
+static int warm_fold(nip_model model, time_series* ts_set, int n_max, int i,
+                     time_series* loo_set, nip_potential* total,
+                     nip_potential** stats, double threshold,
+                     double min_log_likelihood,
+                     nip_double_list learning_curve){
+  int e, j, k;
+  double last = 0;
+  nip_potential* counts = NULL;
+  nip_convergence stopping_reason;
+
+  /* leave-one-out operation */
+  for(j = 0; j < n_max; j++){
+    if(j < i)
+      loo_set[j] = ts_set[j];
+    if(j > i)
+      loo_set[j-1] = ts_set[j];
+  }
+
+  /* the rest of the data: total minus the held-out series */
+  counts = new_expected_counts(model, 0.0);
+  if(!counts)
+    return NIP_ERROR_OUTOFMEMORY;
+  for(j = 0; j < model->num_of_vars; j++){
+    nip_sum_potential(counts[j], total[j]);
+    if(!stats[i])
+      continue; /* the series was not included in the total */
+    nip_weighted_sum_potential(counts[j], stats[i][j], -1.0);
+    for(k = 0; k < counts[j]->size_of_data; k++)
+      if(counts[j]->data[k] < 0)
+        counts[j]->data[k] = 0; /* rounding errors */
+  }
+  e = set_expected_counts(model, counts);
+  free_expected_counts(model, counts);
+  if(e != NIP_NO_ERROR)
+    return e;
+
+  /* a few EM iterations starting from there */
+  for(j = 0; j < model->num_of_vars; j++)
+    nip_mark_variable(model->variables[j]);
+  if(NIP_LIST_LENGTH(learning_curve) > 0)
+    nip_empty_double_list(learning_curve);
+  e = em_learn(model, loo_set, n_max-1, 0, FOLD_ITER, threshold,
+               learning_curve, &stopping_reason, &nip_append_double, NULL);
+  if(!(e == NIP_NO_ERROR || e == NIP_ERROR_BAD_LUCK)){
+    fprintf(stderr, "There were errors during learning:\n");
+    nip_report_error(__FILE__, __LINE__, e, 1);
+    return e;
+  }
+  if(NIP_LIST_LENGTH(learning_curve) > 0)
+    last = learning_curve->last->data;
+
+  /* fall back to the slow way if the warm start was not good enough */
+  if(e == NIP_ERROR_BAD_LUCK || last < min_log_likelihood)
+    return train(model, loo_set, n_max-1, threshold,
+                 min_log_likelihood, learning_curve);
+
+  return NIP_NO_ERROR;
+}
+
+
+static int write_fold(FILE* f, int fold, uncertain_series ucs, double ll){
+  int t, card;
+  card = NIP_CARDINALITY(ucs->variables[0]);
+  if(fwrite(&fold, sizeof(int), 1, f) != 1 ||
+     fwrite(&(ucs->length), sizeof(int), 1, f) != 1 ||
+     fwrite(&ll, sizeof(double), 1, f) != 1)
+    return NIP_ERROR_IO;
+  for(t = 0; t < ucs->length; t++)
+    if(fwrite(ucs->data[t][0], sizeof(double), card, f) != card)
+      return NIP_ERROR_IO;
+  return NIP_NO_ERROR;
+}
+
+
+static uncertain_series read_fold(FILE* f, nip_variable v,
+                                  int* fold, double* ll){
+  int t, length;
+  int card = NIP_CARDINALITY(v);
+  uncertain_series ucs = NULL;
+
+  if(fread(fold, sizeof(int), 1, f) != 1 ||
+     fread(&length, sizeof(int), 1, f) != 1 ||
+     fread(ll, sizeof(double), 1, f) != 1)
+    return NULL;
+
+  ucs = (uncertain_series) malloc(sizeof(uncertain_series_struct));
+  if(!ucs){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NULL;
+  }
+  ucs->num_of_vars = 1;
+  ucs->length = 0; /* grows as the data gets allocated */
+  ucs->variables = (nip_variable*) calloc(1, sizeof(nip_variable));
+  ucs->data = (double***) calloc(length, sizeof(double**));
+  if(!(ucs->variables && ucs->data)){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free_uncertainseries(ucs);
+    return NULL;
+  }
+  ucs->variables[0] = v;
+
+  for(t = 0; t < length; t++){
+    ucs->data[t] = (double**) calloc(1, sizeof(double*));
+    if(!ucs->data[t]){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+      free_uncertainseries(ucs);
+      return NULL;
+    }
+    ucs->length++;
+    ucs->data[t][0] = (double*) calloc(card, sizeof(double));
+    if(!ucs->data[t][0] ||
+       fread(ucs->data[t][0], sizeof(double), card, f) != card){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+      free_uncertainseries(ucs);
+      return NULL;
+    }
+  }
+  return ucs;
+}
+
+
 int main(int argc, char *argv[]){
 
   int e, i, j, n_max;
+  int n_proc = 0;
+  int status;
+  pid_t* workers = NULL;
+  FILE** results = NULL;
 
-  int have_random_init;
   long seed;
 
   double probe, loglikelihood;
-  double threshold, min_log_likelihood, last;
+  double threshold, min_log_likelihood;
 
   char* tailptr = NULL;
 
@@ -66,24 +264,35 @@ int main(int argc, char *argv[]){
   time_series ts = NULL;
   time_series *ts_set = NULL;
   time_series *loo_set = NULL; /* just a bunch of temporary pointers */
+  uncertain_series ucs = NULL;
   uncertain_series *ucs_set = NULL;
+  nip_potential* total = NULL;
+  nip_potential** stats = NULL;
 
   nip_double_list learning_curve = NULL;
-  nip_double_link link = NULL;
-  nip_convergence stopping_reason;
 
   printf("nipbenchmark:\n");
 
   /*****************************************/
   /* Parse the model from a Hugin NET file */
   /*****************************************/
-  if(argc < 6){
+  if(argc < 7){
     printf("Specify:\n - name of the net file,\n - input data file, \n");
     printf(" - EM stopping threshold,\n - minimum average likelihood, \n");
-    printf(" - variable of interest,\n - and output data file.\n");
+    printf(" - variable of interest,\n - output data file,\n");
+    printf(" - and optionally number of processes for fast mode.\n");
     return 0;
   }
 
+  /* the optional fast mode */
+  if(argc > 7){
+    n_proc = (int) strtol(argv[7], &tailptr, 10);
+    if(n_proc < 1 || tailptr == argv[7]){
+      fprintf(stderr, "Specify a valid number of processes: %s?\n", argv[7]);
+      return -1;
+    }
+  }
+
   model = parse_model(argv[1]);
 
   if(model == NULL)
@@ -166,35 +375,21 @@ int main(int argc, char *argv[]){
   printf("  Random seed = %ld\n", seed);
   learning_curve = nip_new_double_list();
 
-  for(i = 0; i < n_max; i++){
-
-    /* leave-one-out operation */
-    for(j = 0; j < n_max; j++){
-      if(j < i)
-        loo_set[j] = ts_set[j];
-      if(j > i)
-        loo_set[j-1] = ts_set[j];
-    }
+  if(n_proc == 0){
+    /* the slow way: a full EM for each fold */
+    for(i = 0; i < n_max; i++){
 
-    /* Use all the data (mark all variables) in EM */
-    for(j = 0; j < model->num_of_vars; j++)
-      nip_mark_variable(model->variables[j]);
-
-    /* repeat EM until good enough */
-    do{
-      last = 0; /* init */
-
-      /* free the list if necessary */
-      if(NIP_LIST_LENGTH(learning_curve) > 0)
-        nip_empty_double_list(learning_curve);
+      /* leave-one-out operation */
+      for(j = 0; j < n_max; j++){
+        if(j < i)
+          loo_set[j] = ts_set[j];
+        if(j > i)
+          loo_set[j-1] = ts_set[j];
+      }
 
-      /* the EM algorithm */
-      have_random_init = 1;
-      e = em_learn(model, loo_set, n_max-1, have_random_init, MAX_ITER,
-                   threshold, learning_curve, &stopping_reason, &nip_append_double, NULL);
-      if(!(e == NIP_NO_ERROR || e == NIP_ERROR_BAD_LUCK)){
-        fprintf(stderr, "There were errors during learning:\n");
-        nip_report_error(__FILE__, __LINE__, e, 1);
+      e = train(model, loo_set, n_max-1, threshold,
+                min_log_likelihood, learning_curve);
+      if(e != NIP_NO_ERROR){
         for(i = 0; i < n_max; i++)
           free_timeseries(ts_set[i]);
         free(ts_set);
@@ -206,27 +401,142 @@ int main(int argc, char *argv[]){
         return -1;
       }
 
-      /* find out the last value in learning curve */
-      if(NIP_LIST_LENGTH(learning_curve) > 0){
-        last = learning_curve->last->data;
-      }
+      /* the computation of posterior probabilities */
+      ts = ts_set[i];
 
-    } while(e == NIP_ERROR_BAD_LUCK || last < min_log_likelihood);
+      /* ignore possible evidence about the variable to be predicted */
+      nip_unmark_variable(v);
 
-    /* the computation of posterior probabilities */
-    ts = ts_set[i];
+      /* Run the inference procedure */
+      ucs_set[i] = forward_backward_inference(ts, &v, 1, &probe);
 
-    /* ignore possible evidence about the variable to be predicted */
-    nip_unmark_variable(v);
+      /* Compute average log likelihood */
+      loglikelihood += probe / TIME_SERIES_LENGTH(ts);
 
-    /* Run the inference procedure */
-    ucs_set[i] = forward_backward_inference(ts, &v, 1, &probe);
+      /* Display progress */
+      printf("  %d / %d\n", i+1, n_max);
+    }
+  }
+  else{
+    /* the fast way: 1. the model from all the data */
+    e = train(model, ts_set, n_max, threshold,
+              min_log_likelihood, learning_curve);
+
+    /* 2. expected counts of each series, and their total */
+    stats = (nip_potential**) calloc(n_max, sizeof(nip_potential*));
+    total = new_expected_counts(model, 1.0); /* same pseudo counts as EM */
+    workers = (pid_t*) calloc(n_proc, sizeof(pid_t));
+    results = (FILE**) calloc(n_proc, sizeof(FILE*));
+    if(e == NIP_NO_ERROR && !(stats && total && workers && results)){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+      e = NIP_ERROR_OUTOFMEMORY;
+    }
+    for(i = 0; e == NIP_NO_ERROR && i < n_max; i++){
+      stats[i] = new_expected_counts(model, 0.0);
+      if(!stats[i]){
+        e = NIP_ERROR_OUTOFMEMORY;
+        break;
+      }
+      e = accumulate_expected_counts(ts_set[i], stats[i], &probe);
+      if(e == NIP_ERROR_BAD_LUCK){
+        /* impossible evidence for the model: already left out */
+        fprintf(stderr, "Warning: series %d is impossible for the model,", i);
+        fprintf(stderr, " not included in the expected counts.\n");
+        free_expected_counts(model, stats[i]);
+        stats[i] = NULL;
+        e = NIP_NO_ERROR;
+        continue;
+      }
+      for(j = 0; e == NIP_NO_ERROR && j < model->num_of_vars; j++)
+        nip_sum_potential(total[j], stats[i][j]);
+    }
 
-    /* Compute average log likelihood */
-    loglikelihood += probe / TIME_SERIES_LENGTH(ts);
+    /* 3. the folds, divided between worker processes */
+    for(j = 0; e == NIP_NO_ERROR && j < n_proc; j++){
+      results[j] = tmpfile();
+      if(!results[j]){
+        nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
+        e = NIP_ERROR_IO;
+        break;
+      }
+      fflush(stdout); /* don't duplicate buffered output */
+      workers[j] = (n_proc > 1) ? fork() : 0;
+      if(workers[j] < 0){
+        nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+        e = NIP_ERROR_GENERAL;
+        break;
+      }
+      if(workers[j] > 0)
+        continue; /* the parent starts the next worker */
+
+      for(i = j; i < n_max; i += n_proc){
+        e = warm_fold(model, ts_set, n_max, i, loo_set, total, stats,
+                      threshold, min_log_likelihood, learning_curve);
+        if(e != NIP_NO_ERROR)
+          break;
+        nip_unmark_variable(v);
+        ucs = forward_backward_inference(ts_set[i], &v, 1, &probe);
+        if(!ucs){
+          e = NIP_ERROR_GENERAL;
+          break;
+        }
+        e = write_fold(results[j], i, ucs, probe / TIME_SERIES_LENGTH(ts_set[i]));
+        free_uncertainseries(ucs);
+        if(e != NIP_NO_ERROR)
+          break;
+        printf("  %d / %d\n", i+1, n_max);
+        fflush(stdout);
+      }
+      if(n_proc > 1){
+        fflush(results[j]);
+        _exit(e == NIP_NO_ERROR ? 0 : 1); /* the worker is done */
+      }
+    }
 
-    /* Display progress */
-    printf("  %d / %d\n", i+1, n_max);
+    /* 4. collect the results in order */
+    for(j = 0; j < n_proc; j++){
+      if(workers[j] > 0){
+        if(waitpid(workers[j], &status, 0) < 0 ||
+           !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+          e = NIP_ERROR_GENERAL;
+      }
+    }
+    for(j = 0; e == NIP_NO_ERROR && j < n_proc; j++){
+      rewind(results[j]);
+      while((ucs = read_fold(results[j], v, &i, &probe)) != NULL){
+        ucs_set[i] = ucs;
+        loglikelihood += probe;
+      }
+    }
+    for(i = 0; e == NIP_NO_ERROR && i < n_max; i++)
+      if(!ucs_set[i])
+        e = NIP_ERROR_GENERAL; /* a fold is missing */
+
+    for(j = 0; results && j < n_proc; j++)
+      if(results[j])
+        fclose(results[j]);
+    free(results);
+    free(workers);
+    for(i = 0; stats && i < n_max; i++)
+      free_expected_counts(model, stats[i]);
+    free(stats);
+    free_expected_counts(model, total);
+
+    if(e != NIP_NO_ERROR){
+      fprintf(stderr, "There were errors during leave-one-out:\n");
+      nip_report_error(__FILE__, __LINE__, e, 1);
+      for(i = 0; i < n_max; i++){
+        free_timeseries(ts_set[i]);
+        free_uncertainseries(ucs_set[i]);
+      }
+      free(ts_set);
+      free(ucs_set);
+      free(loo_set);
+      free_model(model);
+      nip_empty_double_list(learning_curve);
+      free(learning_curve);
+      return -1;
+    }
   }
   loglikelihood /= n_max;
 
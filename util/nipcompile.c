@@ -0,0 +1,62 @@
+/*  NIP - Dynamic Bayesian Network library
+    Copyright (C) 2026  NIP contributors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* nipcompile.c
+ *
+ * Compiles a NET file into a binary model file, which the other
+ * programs can load without parsing and triangulating the model again.
+ *
+ * SYNOPSIS:
+ * NIPCOMPILE <MODEL.NET> <MODEL.BIN>
+ *
+ * EXAMPLE:
+ * ./nipcompile model.net model.bin
+ * ./nipinference model.bin data.txt B result.txt
+ *
+ * Author: NIP contributors
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "nip.h"
+
+
+int main(int argc, char *argv[]) {
+  int e;
+  nip_model model = NULL;
+
+  if(argc < 3){
+    printf("You must specify: \n");
+    printf(" - the NET file for the model, \n");
+    printf(" - the name of the compiled model file to write.\n");
+    return 0;
+  }
+
+  model = parse_model(argv[1]);
+  if(!model){
+    fprintf(stderr, "Unable to parse the NET file: %s?\n", argv[1]);
+    return -1;
+  }
+
+  e = write_compiled_model(model, argv[2]);
+  free_model(model);
+  if(e != NIP_NO_ERROR){
+    fprintf(stderr, "Unable to write the model file: %s\n", argv[2]);
+    return -1;
+  }
+  return 0;
+}
@@ -21,9 +21,14 @@
  * CONVERT <MODEL.NET> <IN FORMAT> <IN.TXT> <OUT FORMAT> <OUT.TXT>
  *
  * Converts data between various formats: 
- * currently only univariate data into unary format!
+ * - univariate or multivariate CSV into unary format
+ *   (currently only univariate data!)
+ * - CSV into binary format, for fast loading of the same data
+ * - binary format back into CSV ('multivariate')
  *
  * EXAMPLE: ./nipconvert m.net univariate data.txt unary udata.txt
+ * EXAMPLE: ./nipconvert m.net multivariate data.txt binary data.bin
+ *          ./nipconvert m.net binary data.bin multivariate data2.txt
  *
  * Author: Janne Toivola
  * Version: $Id: nipconvert.c,v 1.2 2010-12-07 17:23:19 jatoivol Exp $
@@ -49,11 +54,13 @@
 #define UNIVARIATE   1
 #define MULTIVARIATE 2
 #define UNARY        3
+#define BINARY       4
 #define INVALID     99
 
 #define S_UNIVARIATE "univariate"
 #define S_MULTIVARIATE "multivariate"
 #define S_UNARY "unary"
+#define S_BINARY "binary"
 /* BTW: use only ASCII in these strings! */
 
 
@@ -187,9 +194,9 @@ int main(int argc, char *argv[]) {
   if(argc < 6){
     printf("You must specify: \n"); 
     printf(" - the NET file for the model, \n");
-    printf(" - input format ('univariate'), \n");
+    printf(" - input format ('univariate', 'multivariate' or 'binary'), \n");
     printf(" - input file name, \n");
-    printf(" - output format ('unary'), \n");
+    printf(" - output format ('unary', 'multivariate' or 'binary'), \n");
     printf(" - output file name, please!\n");
     return 0;
   }
@@ -205,6 +212,10 @@ int main(int argc, char *argv[]) {
   /* Reminder: strcasecmp() is NOT ANSI C. */
   if(strcasecmp(argv[2], S_UNIVARIATE) == 0)
     iformat = UNIVARIATE;
+  else if(strcasecmp(argv[2], S_MULTIVARIATE) == 0)
+    iformat = MULTIVARIATE;
+  else if(strcasecmp(argv[2], S_BINARY) == 0)
+    iformat = BINARY;
   /* additional formats here */
   else{
     printf("Invalid input file format: %s?\n", argv[2]);
@@ -214,6 +225,10 @@ int main(int argc, char *argv[]) {
 
   if(strcasecmp(argv[4], S_UNARY) == 0)
     oformat = UNARY;
+  else if(strcasecmp(argv[4], S_MULTIVARIATE) == 0)
+    oformat = MULTIVARIATE;
+  else if(strcasecmp(argv[4], S_BINARY) == 0)
+    oformat = BINARY;
   /* additional formats here */
   else{
     printf("Invalid output file format: %s?\n", argv[4]);
@@ -227,6 +242,9 @@ int main(int argc, char *argv[]) {
   case MULTIVARIATE:
     n = read_timeseries(model, argv[3], &ts_set, NULL);
     break;
+  case BINARY:
+    n = read_timeseries_binary(model, argv[3], &ts_set, NULL);
+    break;
   default:
     n = 0; /* should be impossible */
   }
@@ -243,6 +261,12 @@ int main(int argc, char *argv[]) {
   case UNARY:
     k = write_unary_timeseries(ts_set, n, argv[5]);
     break;
+  case MULTIVARIATE:
+    k = write_timeseries(ts_set, n, argv[5]);
+    break;
+  case BINARY:
+    k = write_timeseries_binary(ts_set, n, argv[5]);
+    break;
   default:
     ; /* shouldn't happen */
   }
@@ -0,0 +1,224 @@
+/*  NIP - Dynamic Bayesian Network library
+    Copyright (C) 2026  NIP contributors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* nipcounts.c
+ *
+ * Runs the steps of the EM algorithm separately, so that the E-step
+ * can be divided between processes or machines working on separate
+ * parts (shards) of the data.
+ *
+ * SYNOPSIS:
+ * NIPCOUNTS estep <MODEL.NET> <DATA.TXT> <COUNTS.BIN>
+ * NIPCOUNTS merge <MODEL.NET> <COUNTS.BIN> <SHARD1.BIN> <SHARD2.BIN> ...
+ * NIPCOUNTS mstep <MODEL.NET> <COUNTS.BIN> <RESULT.NET>
+ *
+ * - estep computes the expected counts of the parameters of <MODEL.NET>
+ *   given the data in <DATA.TXT>, and writes them into <COUNTS.BIN>
+ * - merge sums the counts of the shards into <COUNTS.BIN>
+ * - mstep estimates new parameters for the structure in <MODEL.NET>
+ *   from <COUNTS.BIN> and writes the result into <RESULT.NET>
+ * The average log. likelihood of the data (given the model of the
+ * E-step) is printed to stdout by merge and mstep.
+ *
+ * EXAMPLE: one EM iteration over two shards
+ * ./nipcounts estep model1.net data1.txt c1.bin
+ * ./nipcounts estep model1.net data2.txt c2.bin
+ * ./nipcounts merge model1.net c.bin c1.bin c2.bin
+ * ./nipcounts mstep model1.net c.bin model2.net
+ *
+ * Author: NIP contributors
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "nip.h"
+#include "niplists.h"
+#include "nipvariable.h"
+
+static int estep(char* model_file, char* data_file, char* counts_file);
+static int merge(char* model_file, char* counts_file,
+                 char** shard_files, int n_shards);
+static int mstep(char* model_file, char* counts_file, char* result_file);
+
+
+static int estep(char* model_file, char* data_file, char* counts_file){
+  int i, n_ts, e;
+  long ts_steps = 0;
+  double probe, loglikelihood = 0;
+  nip_model model = NULL;
+  time_series *ts_set = NULL;
+  nip_potential* counts = NULL;
+
+  model = parse_model(model_file);
+  if(!model){
+    fprintf(stderr, "Unable to parse the NET file: %s?\n", model_file);
+    return -1;
+  }
+
+  n_ts = read_timeseries(model, data_file, &ts_set, NULL);
+  if(n_ts == 0){
+    fprintf(stderr, "Unable to parse the data file: %s?\n", data_file);
+    free_model(model);
+    return -1;
+  }
+  i = collapse_timeseries(ts_set, n_ts);
+  if(i > 0)
+    n_ts = i;
+
+  counts = new_expected_counts(model, 0.0);
+  if(!counts){
+    for(i = 0; i < n_ts; i++)
+      free_timeseries(ts_set[i]);
+    free(ts_set);
+    free_model(model);
+    return -1;
+  }
+
+  /* Use all the data */
+  for(i = 0; i < model->num_of_vars; i++)
+    nip_mark_variable(model->variables[i]);
+
+  e = NIP_NO_ERROR;
+  for(i = 0; i < n_ts && e == NIP_NO_ERROR; i++){
+    e = accumulate_expected_counts(ts_set[i], counts, &probe);
+    loglikelihood += probe;
+    ts_steps += TIME_SERIES_WEIGHT(ts_set[i]) * TIME_SERIES_LENGTH(ts_set[i]);
+  }
+  if(e == NIP_ERROR_BAD_LUCK)
+    fprintf(stderr, "The data is impossible given the model.\n");
+  if(e == NIP_NO_ERROR)
+    e = write_expected_counts(model, counts, loglikelihood, ts_steps,
+                              counts_file);
+
+  free_expected_counts(model, counts);
+  for(i = 0; i < n_ts; i++)
+    free_timeseries(ts_set[i]);
+  free(ts_set);
+  free_model(model);
+  return (e == NIP_NO_ERROR) ? 0 : -1;
+}
+
+
+static int merge(char* model_file, char* counts_file,
+                 char** shard_files, int n_shards){
+  int i, v, e;
+  long steps, ts_steps = 0;
+  double probe, loglikelihood = 0;
+  nip_model model = NULL;
+  nip_potential* counts = NULL;
+  nip_potential* shard = NULL;
+
+  /* the model is needed only for the structure */
+  model = parse_model(model_file);
+  if(!model){
+    fprintf(stderr, "Unable to parse the NET file: %s?\n", model_file);
+    return -1;
+  }
+
+  counts = new_expected_counts(model, 0.0);
+  if(!counts){
+    free_model(model);
+    return -1;
+  }
+
+  for(i = 0; i < n_shards; i++){
+    shard = read_expected_counts(model, shard_files[i], &probe, &steps);
+    if(!shard){
+      free_expected_counts(model, counts);
+      free_model(model);
+      return -1;
+    }
+    for(v = 0; v < model->num_of_vars; v++)
+      nip_sum_potential(counts[v], shard[v]);
+    loglikelihood += probe;
+    ts_steps += steps;
+    free_expected_counts(model, shard);
+  }
+
+  e = write_expected_counts(model, counts, loglikelihood, ts_steps,
+                            counts_file);
+  if(e == NIP_NO_ERROR && ts_steps > 0)
+    printf("%g\n", loglikelihood / ts_steps);
+
+  free_expected_counts(model, counts);
+  free_model(model);
+  return (e == NIP_NO_ERROR) ? 0 : -1;
+}
+
+
+static int mstep(char* model_file, char* counts_file, char* result_file){
+  int v, e;
+  long ts_steps;
+  double loglikelihood;
+  nip_model model = NULL;
+  nip_potential* counts = NULL;
+  nip_potential* pseudo = NULL;
+
+  model = parse_model(model_file);
+  if(!model){
+    fprintf(stderr, "Unable to parse the NET file: %s?\n", model_file);
+    return -1;
+  }
+
+  counts = read_expected_counts(model, counts_file, &loglikelihood, &ts_steps);
+  if(!counts){
+    free_model(model);
+    return -1;
+  }
+
+  /* the same pseudo counts as in em_learn(), added only once */
+  pseudo = new_expected_counts(model, 1.0);
+  if(!pseudo){
+    free_expected_counts(model, counts);
+    free_model(model);
+    return -1;
+  }
+  for(v = 0; v < model->num_of_vars; v++)
+    nip_sum_potential(counts[v], pseudo[v]);
+  free_expected_counts(model, pseudo);
+
+  e = set_expected_counts(model, counts);
+  if(e == NIP_NO_ERROR)
+    e = write_model(model, result_file);
+  if(e == NIP_NO_ERROR && ts_steps > 0)
+    printf("%g\n", loglikelihood / ts_steps);
+
+  free_expected_counts(model, counts);
+  free_model(model);
+  return (e == NIP_NO_ERROR) ? 0 : -1;
+}
+
+
+int main(int argc, char *argv[]) {
+
+  if(argc > 4 && strcmp(argv[1], "estep") == 0)
+    return estep(argv[2], argv[3], argv[4]);
+
+  if(argc > 4 && strcmp(argv[1], "merge") == 0)
+    return merge(argv[2], argv[3], &(argv[4]), argc - 4);
+
+  if(argc > 4 && strcmp(argv[1], "mstep") == 0)
+    return mstep(argv[2], argv[3], argv[4]);
+
+  fprintf(stderr, "nipcounts:\n");
+  fprintf(stderr, "Specify one of the following: \n");
+  fprintf(stderr, " - estep <model.net> <data.txt> <counts.bin>\n");
+  fprintf(stderr, " - merge <model.net> <counts.bin> <shard1.bin> <shard2.bin> ...\n");
+  fprintf(stderr, " - mstep <model.net> <counts.bin> <result.net>\n");
+  return 0;
+}
@@ -48,7 +48,7 @@ static int ts_progress(int sequence, int length){
 
 int main(int argc, char *argv[]){
 
-  int i, n_max;
+  int i, n, n_max, n_batch, e;
 
   double probe, loglikelihood;
 
@@ -58,6 +58,7 @@ int main(int argc, char *argv[]){
   time_series ts = NULL;
   time_series *ts_set = NULL;
   uncertain_series *ucs_set = NULL;
+  timeseries_reader data = NULL;
 
   fprintf(stderr, "nipinference:\n");
 
@@ -80,25 +81,25 @@ int main(int argc, char *argv[]){
   print_cliques(model);
 #endif
 
-  /*****************************/
-  /* read the data from a file */
-  /*****************************/
+  /*************************************************/
+  /* open the data file, read a batch at a time... */
+  /*************************************************/
   fprintf(stderr, "  Reading input data from %s... \n", argv[2]);
-  n_max = read_timeseries(model, argv[2], &ts_set, &ts_progress);
-  if(n_max < 1){
+  data = open_timeseries(model, argv[2], TIMESERIES_BATCH, 0);
+  if(!data){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
     fprintf(stderr, "%s\n", argv[2]);
     free_model(model);
     return -1;
   }
+  n_max = data->num_of_series;
   fprintf(stderr, "  ...%d sequences found.\n", n_max);
 
-  ucs_set = (uncertain_series*) calloc(n_max, sizeof(uncertain_series));
+  ucs_set = (uncertain_series*) calloc(data->batch_size,
+                                       sizeof(uncertain_series));
   if(!ucs_set){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-    for(i = 0; i < n_max; i++)
-      free_timeseries(ts_set[i]);
-    free(ts_set);
+    close_timeseries(data);
     free_model(model);
     return -1;
   }
@@ -110,9 +111,7 @@ int main(int argc, char *argv[]){
   if(!v){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
     fprintf(stderr, "No such variable (%s) in the model.\n", argv[3]);
-    for(i = 0; i < n_max; i++)
-      free_timeseries(ts_set[i]);
-    free(ts_set);
+    close_timeseries(data);
     free(ucs_set);
     free_model(model);
     return -1;
@@ -127,32 +126,43 @@ int main(int argc, char *argv[]){
   /*****************/
   fprintf(stderr, "  Computing...\n");
   loglikelihood = 0; /* init */
-
-  for(i = 0; i < n_max; i++){
-    /* the computation of posterior probabilities */
-    ts = ts_set[i];
-    ucs_set[i] = forward_backward_inference(ts, &v, 1, &probe);
-
-    /* Compute average log likelihood */
-    loglikelihood += probe / TIME_SERIES_LENGTH(ts);
-    ts_progress(i, ts->length);
+  e = NIP_NO_ERROR;
+
+  /* ...and write the results of each batch before reading the next */
+  n = 0;
+  while(e == NIP_NO_ERROR && (n_batch = next_timeseries(data, &ts_set)) > 0){
+    for(i = 0; i < n_batch; i++){
+      /* the computation of posterior probabilities */
+      ts = ts_set[i];
+      ucs_set[i] = forward_backward_inference(ts, &v, 1, &probe);
+
+      /* Compute average log likelihood */
+      loglikelihood += probe / TIME_SERIES_LENGTH(ts);
+      ts_progress(n + i, ts->length);
+    }
+
+    /* write the output */
+    if(n == 0)
+      e = write_uncertainseries(ucs_set, n_batch, v, argv[4]);
+    else
+      e = append_uncertainseries(ucs_set, n_batch, v, argv[4]);
+
+    for(i = 0; i < n_batch; i++)
+      free_uncertainseries(ucs_set[i]);
+    n += n_batch;
   }
-  loglikelihood /= n_max;
-
-  /* write the output */
-  write_uncertainseries(ucs_set, n_max, v, argv[4]);
+  if(n < n_max)
+    fprintf(stderr, "  Stopped after %d sequences.\n", n);
+  if(n > 0)
+    loglikelihood /= n;
 
   fprintf(stderr, "  Average log. likelihood = %g\n", loglikelihood);
   fprintf(stderr, "  ...computing done.\n"); /* new line for the prompt */
 
   /* free some memory */
-  for(i = 0; i < n_max; i++){
-    free_timeseries(ts_set[i]);
-    free_uncertainseries(ucs_set[i]);
-  }
-  free(ts_set);
+  close_timeseries(data);
   free(ucs_set);
   free_model(model);
 
-  return 0;
+  return (n < n_max) ? -1 : 0;
 }
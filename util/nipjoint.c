@@ -26,6 +26,7 @@
  * - one time step worth of data will be read from <DATA.TXT>,
  * - optional parameters <VAR1...> are the symbols of the variables 
  *   whose probability distribution (given the data) will be computed
+ * - inference runs on a model pruned for the variables and the data
  *
  * EXAMPLE: ./nipjoint model.net data.txt height weight
  *
@@ -48,13 +49,16 @@ int main(int argc, char *argv[]){
 
   int i, n;
   int num_of_vars = 0;
+  int num_of_evidence = 0;
   nip_potential result = NULL;
 
   nip_model model = NULL;
+  nip_model pruned = NULL;
   time_series ts = NULL;
   time_series *ts_set = NULL;
   nip_variable v = NULL;
   nip_variable *vars = NULL;
+  nip_variable *evidence = NULL;
 
   double m1, m2;
 
@@ -82,19 +86,6 @@ int main(int argc, char *argv[]){
     return -1;
   ts = ts_set[0];
 
-  make_consistent(model); /* no side effects ? */
-
-  /* compute probability mass before entering evidence */
-  m1 = nip_probability_mass(model->cliques, model->num_of_cliques);
-
-  /* enter the evidence... */
-  i = insert_ts_step(ts, 0, model, NIP_MARK_BOTH);
-  /* ...and distribute it */
-  make_consistent(model);
-
-  /* compute probability mass after making the model consistent */
-  m2 = nip_probability_mass(model->cliques, model->num_of_cliques);
-  
   /* It's possible to select the variables as
    * the third...N'th command line parameters.
    */
@@ -124,11 +115,49 @@ int main(int argc, char *argv[]){
     }
   }
   /* The inputs have been parsed. -- */
+
+  /* A smaller model for the query given the observed variables,
+   * leaving the probability mass intact */
+  evidence = (nip_variable *) calloc(ts->num_of_observed + 1,
+                                     sizeof(nip_variable));
+  if(evidence){
+    for(i = 0; i < ts->num_of_observed; i++)
+      if(ts->data[0][i] >= 0)
+        evidence[num_of_evidence++] = ts->observed[i];
+    pruned = prune_model(model, vars, num_of_vars,
+                         evidence, num_of_evidence, 1);
+    free(evidence);
+  }
+  else
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+  if(!pruned){
+    if(argc > 3)
+      free(vars);
+    for(i = 0; i < n; i++)
+      free_timeseries(ts_set[i]);
+    free(ts_set);
+    free_model(model);
+    return -1;
+  }
+  reset_model(pruned);
+  use_priors(pruned, !NIP_HAD_A_PREVIOUS_TIMESLICE);
+  make_consistent(pruned);
+
+  /* compute probability mass before entering evidence */
+  m1 = nip_probability_mass(pruned->cliques, pruned->num_of_cliques);
+
+  /* enter the evidence... */
+  i = insert_ts_step(ts, 0, pruned, NIP_MARK_BOTH);
+  /* ...and distribute it */
+  make_consistent(pruned);
+
+  /* compute probability mass after making the model consistent */
+  m2 = nip_probability_mass(pruned->cliques, pruned->num_of_cliques);
   
   /****************************************************/
   /* The joint probability computation not tested yet */
   /****************************************************/
-  result = get_joint_probability(model, vars, num_of_vars);
+  result = get_joint_probability(pruned, vars, num_of_vars);
 
   /* Print stuff */
   printf("P(");
@@ -142,7 +171,8 @@ int main(int argc, char *argv[]){
   printf("Marginal probability after evidence : m2 = %g\n", m2);
   printf("Log. likelihood: ln(m2/m1) = %g\n", log(m2/m1));
   
-  free(vars);
+  if(argc > 3)
+    free(vars); /* else they belong to ts */
   nip_free_potential(result);
   for(i = 0; i < n; i++)
     free_timeseries(ts_set[i]);
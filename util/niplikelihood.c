@@ -52,13 +52,19 @@
 
 int main(int argc, char *argv[]) {
 
-  int i, n, t;
+  int i, j, n, t;
+  int nq = 0;
+  int ne;
   nip_model model = NULL;
+  nip_model pruned = NULL;
+  timeseries_reader data = NULL;
   time_series *ts_set = NULL;
   time_series ts = NULL;
   double m1, m2;
   double log_likelihood = 0;
   nip_variable v = NULL;
+  nip_variable* query = NULL;
+  nip_variable* evidence = NULL;
 
   printf("niplikelihood:\n");
 
@@ -77,14 +83,23 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
-  /* read the data */
-  n = read_timeseries(model, argv[2], &ts_set, NULL);
-  if(n == 0){
+  /* open the data, read a batch at a time */
+  data = open_timeseries(model, argv[2], TIMESERIES_BATCH, 0);
+  if(!data){
     fprintf(stderr, "Unable to parse the data file: %s?\n", argv[2]);
     free_model(model);
     return -1;
   }
 
+  query = (nip_variable*) calloc(argc + model->num_of_vars,
+                                 sizeof(nip_variable));
+  if(!query){
+    close_timeseries(data);
+    free_model(model);
+    return -1;
+  }
+  evidence = query + argc;
+
   /* Read the variable labels */
   for(i = 0; i < model->num_of_vars; i++)
     nip_unmark_variable(model->variables[i]); /* Unmark all to be sure */
@@ -104,41 +119,57 @@ int main(int argc, char *argv[]) {
     }
     else{
       nip_mark_variable(v); /* Mark the variables of interest */
+      query[nq++] = v;
     }
   }
 
   /* THE work */
-  for(i = 0; i < n; i++){ /* For each time series */
-    ts = ts_set[i];
-    reset_model(model); /* Reset the clique tree */
-    use_priors(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
-    
-    for(t = 0; t < TIME_SERIES_LENGTH(ts); t++){ /* For each time step */      
-
-      insert_ts_step(ts, t, model, NIP_MARK_OFF); /* Only unmarked variables */
-      make_consistent(model);      
-      m1 = model_prob_mass(model); /* the reference mass */
-
-      insert_ts_step(ts, t, model, NIP_MARK_ON); /* Only marked variables */
-      make_consistent(model);
-      m2 = model_prob_mass(model); /* the final mass */
-
-      /* log_likelihood == ln p( marked | unmarked ) */
-      log_likelihood = log(m2) - log(m1);
-
-      printf("%g %g %g\n", m1, m2, log_likelihood); /* One of the results */
-
-      reset_model(model); /* Reset the clique tree */
-      use_priors(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
+  while((n = next_timeseries(data, &ts_set)) > 0){
+    for(i = 0; i < n; i++){ /* For each time series */
+      ts = ts_set[i];
+
+      for(t = 0; t < TIME_SERIES_LENGTH(ts); t++){ /* For each time step */
+
+        /* A smaller model for the marked variables and the rest,
+         * without the barren ones: the masses stay the same */
+        ne = 0;
+        for(j = 0; j < ts->num_of_observed; j++)
+          if(!nip_variable_marked(ts->observed[j]) && ts->data[t][j] >= 0)
+            evidence[ne++] = ts->observed[j];
+        pruned = prune_model(model, query, nq, evidence, ne, 1);
+        if(!pruned){
+          n = -1;
+          break;
+        }
+        reset_model(pruned); /* Reset the clique tree */
+        use_priors(pruned, (t == 0) ? !NIP_HAD_A_PREVIOUS_TIMESLICE :
+                   NIP_HAD_A_PREVIOUS_TIMESLICE);
+
+        insert_ts_step(ts, t, pruned, NIP_MARK_OFF); /* Only unmarked variables */
+        make_consistent(pruned);
+        m1 = model_prob_mass(pruned); /* the reference mass */
+
+        insert_ts_step(ts, t, pruned, NIP_MARK_ON); /* Only marked variables */
+        make_consistent(pruned);
+        m2 = model_prob_mass(pruned); /* the final mass */
+
+        /* log_likelihood == ln p( marked | unmarked ) */
+        log_likelihood = log(m2) - log(m1);
+
+        printf("%g %g %g\n", m1, m2, log_likelihood); /* One of the results */
+      }
+      if(n < 0)
+        break;
+      printf("\n"); /* time series separator */
     }
-    printf("\n"); /* time series separator */
+    if(n < 0)
+      break; /* pruning failed */
   }
 
   /* Free stuff */
-  for(i = 0; i < n; i++)
-    free_timeseries(ts_set[i]);
-  free(ts_set);
+  free(query);
+  close_timeseries(data);
   free_model(model);
 
-  return 0;
+  return (n < 0) ? -1 : 0;
 }
@@ -49,7 +49,7 @@ static int ts_progress(int sequence, int length){
 
 int main(int argc, char *argv[]){
 
-  int i, j, k, n, n_max, t = 0;
+  int i, j, k, n, n_max, n_batch, t = 0;
   double m, m_max;
   FILE *f = NULL;
 
@@ -59,6 +59,7 @@ int main(int argc, char *argv[]){
   time_series ts = NULL;
   time_series *ts_set = NULL;
   uncertain_series ucs = NULL;
+  timeseries_reader data = NULL;
 
   fprintf(stderr, "nipmap:\n");
 
@@ -76,17 +77,22 @@ int main(int argc, char *argv[]){
   if(model == NULL)
     return -1;
 
-  /*****************************/
-  /* read the data from a file */
-  /*****************************/
+  /*************************************************/
+  /* open the data file, read a batch at a time... */
+  /*************************************************/
   fprintf(stderr, "  Reading input data from %s... \n", argv[2]);
-  n_max = read_timeseries(model, argv[2], &ts_set, &ts_progress);
-  if(n_max < 1){
+  data = open_timeseries(model, argv[2], TIMESERIES_BATCH, 0);
+  n_batch = 0;
+  if(data)
+    n_batch = next_timeseries(data, &ts_set);
+  if(n_batch < 1){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
     fprintf(stderr, "%s\n", argv[2]);
+    close_timeseries(data);
     free_model(model);
     return -1;
   }
+  n_max = data->num_of_series;
   fprintf(stderr, "  ...%d sequences found.\n", n_max);
 
   ts = ts_set[0];
@@ -97,9 +103,7 @@ int main(int argc, char *argv[]){
   f = fopen(argv[3], "w");
   if(!f){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
-    for(i = 0; i < n_max; i++)
-      free_timeseries(ts_set[i]);
-    free(ts_set);
+    close_timeseries(data);
     free_model(model);
     return -1;
   }
@@ -107,9 +111,8 @@ int main(int argc, char *argv[]){
   if(ts->num_of_hidden == 0){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
     fprintf(stderr, "No hidden variables to estimate.\n");
-    for(i = 0; i < n_max; i++)
-      free_timeseries(ts_set[i]);
-    free(ts_set);
+    fclose(f);
+    close_timeseries(data);
     free_model(model);
     return -1;
   }
@@ -153,8 +156,17 @@ int main(int argc, char *argv[]){
 
     /*fprintf(stderr, "Time series %d of %d\r               ", n+1, n_max);*/
 
+    /* the next batch of time series after the current one */
+    if(n_batch == 0){
+      n_batch = next_timeseries(data, &ts_set);
+      if(n_batch < 1)
+        break;
+    }
+
     /* select time series */
-    ts = ts_set[n];
+    ts = ts_set[0];
+    ts_set++;
+    n_batch--;
 
     /* the computation of posterior probabilities */
     ucs = forward_backward_inference(ts, ts->hidden, ts->num_of_hidden, NULL);
@@ -198,17 +210,15 @@ int main(int argc, char *argv[]){
 
   fprintf(stderr, "  ...computing done\n"); /* new line for the prompt */
 
+  /* free some memory */
+  close_timeseries(data);
+  free_model(model);
+
   /* close the file */
   if(fclose(f)){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_IO, 1);
     return -1;
   }
 
-  /* free some memory */
-  for(i = 0; i < n_max; i++)
-    free_timeseries(ts_set[i]);
-  free(ts_set);
-  free_model(model);
-
-  return 0;
+  return (n < n_max) ? -1 : 0;
 }
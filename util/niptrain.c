@@ -23,7 +23,7 @@
  * to the specified output file.
  *
  * SYNOPSIS:
- * NIPTRAIN <ORIGINAL.NET> <DATA.TXT> <SEED> <THRESHOLD> <MINL> <MAXI> <RESULT.NET>
+ * NIPTRAIN <ORIGINAL.NET> <DATA.TXT> <SEED> <THRESHOLD> <MINL> <MAXI> <RESULT.NET> [<SECONDS> [<INTERVAL>]]
  *
  * - Structure of the model will be read from the file <ORIGINAL.NET>
  * - data for learning will be read from <DATA.TXT>
@@ -32,9 +32,20 @@
  * - <MINL> sets the minimum average log. likelihood
  *   (be careful not to demand too much)
  * - <MAXI> sets the maximum number of iterations, non-number for unlimited
- * - resulting model will be written to the file <RESULT.NET>
+ * - resulting model will be written to the file <RESULT.NET>:
+ *   the best one of the successful runs, if restarted because of <MINL>
+ * - optional <SECONDS> limits the (wall-clock) running time,
+ *   non-number for unlimited
+ * - optional <INTERVAL> is the number of seconds between intermediate
+ *   models (checkpoints) written into <RESULT.NET>, in addition to one
+ *   after every BATCH_ITERATIONS iterations
+ *
+ * Training can be resumed from a checkpoint by giving it as the
+ * <ORIGINAL.NET> with a non-number <SEED> (no random initialisation).
  *
  * EXAMPLE: ./niptrain model1.net data.txt 73 0.00001 -1.2 128 model2.net
+ * EXAMPLE: ./niptrain model1.net data.txt 73 0.00001 -1.2 - model2.net 86400 600
+ *          ./niptrain model2.net data.txt - 0.00001 -1.2 - model3.net 86400 600
  *
  * Author: Janne Toivola
  * Version: $Id: niptrain.c,v 1.1 2010-12-03 17:21:29 jatoivol Exp $
@@ -47,6 +58,7 @@
 #include <limits.h>
 #include <float.h>
 #include <math.h>
+#include <time.h>
 #include "nip.h"
 #include "niplists.h"
 #include "nipvariable.h"
@@ -62,18 +74,65 @@ static int ts_progress(int sequence, int length){
   return 0;
 }
 
+/* State of the time budget and checkpoints, for the EM callback */
+static nip_model checkpoint_model = NULL;
+static char* checkpoint_file = NULL;
+static time_t deadline = 0; // 0 if unlimited
+static time_t next_checkpoint = 0; // 0 if only after each batch
+static long checkpoint_interval = 0;
+static double best_log_likelihood = -HUGE_VAL; // of the model in the file
+
+// Writes the model via a temporary file, so that a crash (or preemption)
+// while writing never destroys the previous checkpoint
+static int checkpoint(nip_model model, char* filename);
+static int checkpoint(nip_model model, char* filename){
+  int e;
+  char* temp = (char*) calloc(strlen(filename) + 5, sizeof(char));
+  if(!temp)
+    return NIP_ERROR_OUTOFMEMORY;
+  sprintf(temp, "%s.tmp", filename);
+  e = write_model(model, temp);
+  if(e == NIP_NO_ERROR && rename(temp, filename) != 0)
+    e = NIP_ERROR_IO;
+  if(e != NIP_NO_ERROR)
+    remove(temp);
+  free(temp);
+  return e;
+}
+
 // Callback for witnessing EM progress
 static int em_progress(nip_double_list learning_curve, double mean_log_likelihood);
 static int em_progress(nip_double_list learning_curve, double mean_log_likelihood){
+  int e;
+  time_t now;
   fprintf(stderr, "                            iteration %4d: %16g\r",
           learning_curve->length+1, mean_log_likelihood);
-  return nip_append_double(learning_curve, mean_log_likelihood);
+  e = nip_append_double(learning_curve, mean_log_likelihood);
+  if(e != NIP_NO_ERROR)
+    return e;
+
+  now = time(NULL);
+  if(next_checkpoint > 0 && now >= next_checkpoint){
+    /* never replace a better model of an earlier run */
+    if(mean_log_likelihood > best_log_likelihood &&
+       mean_log_likelihood <= 0 &&
+       checkpoint(checkpoint_model, checkpoint_file) == NIP_NO_ERROR){
+      best_log_likelihood = mean_log_likelihood;
+      fprintf(stderr, "\n  Wrote intermediate model into %s\n",
+              checkpoint_file);
+    }
+    next_checkpoint = now + checkpoint_interval;
+  }
+  if(deadline > 0 && now >= deadline)
+    return EM_INTERRUPT; // out of time
+  return NIP_NO_ERROR;
 }
 
 int main(int argc, char *argv[]) {
 
   int i, n, k, e;
   nip_model model = NULL;
+  timeseries_reader data = NULL;
   time_series *ts_set = NULL;
   int n_ts;
   time_series ts;
@@ -81,12 +140,16 @@ int main(int argc, char *argv[]) {
   double min_log_likelihood = 0;
   double last = 0;
   nip_double_list learning_curve = NULL;
+  nip_double_list best_curve = NULL;
+  nip_double_list swap = NULL;
   nip_double_link link = NULL;
   nip_convergence stopping_criterion = LIKELIHOOD;
   char* tailptr = NULL;
   long seed;
   long max_iterations, current_iterations, left_iterations;
+  long time_budget;
   int have_random_init;
+  int out_of_time = 0;
 
   // TODO: version numbering scheme for checking compatibility
   fprintf(stderr, "niptrain:\n");
@@ -101,6 +164,9 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, " - minimum required log. likelihood/time step (<<0.0), \n");
     fprintf(stderr, " - maximum number of iterations (int>3 if limited), and \n");
     fprintf(stderr, " - file name for the resulting model, please!\n");
+    fprintf(stderr, "Optionally also: \n");
+    fprintf(stderr, " - maximum running time in seconds, and \n");
+    fprintf(stderr, " - seconds between intermediate models.\n");
     return 0;
   }
 
@@ -115,13 +181,22 @@ int main(int argc, char *argv[]) {
 
   /* read the data */
   fprintf(stderr, "  Reading input data from %s... \n", argv[2]);
-  n_ts = read_timeseries(model, argv[2], &ts_set, &ts_progress);
-  if(n_ts == 0){
+  /* identical sequences are processed only once, but weighted
+   * (within each batch, if there is too much data to keep in memory) */
+  data = open_timeseries(model, argv[2], TIMESERIES_BATCH, 1);
+  n = 0;
+  if(data)
+    n = next_timeseries(data, &ts_set);
+  if(n < 1){
     fprintf(stderr, "Unable to parse the data file: %s?\n", argv[2]);
+    close_timeseries(data);
     free_model(model);
     return -1;
   }
+  n_ts = data->num_of_series;
   fprintf(stderr, "  ...%8d sequences found.\n", n_ts);
+  if(data->cached && n < n_ts)
+    fprintf(stderr, "  ...%8d of them distinct.\n", n);
 
   /* print a summary about the variables */
   ts = ts_set[0];
@@ -134,9 +209,7 @@ int main(int argc, char *argv[]) {
   fprintf(stderr, "\n");
   if(model->num_of_vars == ts->num_of_hidden){
     fprintf(stderr, "No relevant data columns: check the header row.\n");
-    for(i = 0; i < n_ts; i++)
-      free_timeseries(ts_set[i]);
-    free(ts_set);
+    close_timeseries(data);
     free_model(model);
     return -1;
   }
@@ -158,9 +231,7 @@ int main(int argc, char *argv[]) {
   threshold = strtod(argv[4], &tailptr);
   if(threshold <= 0.0 || threshold > 1  || tailptr == argv[4]){
     fprintf(stderr, "Specify a valid threshold value: %s?\n", argv[4]);
-    for(i = 0; i < n_ts; i++)
-      free_timeseries(ts_set[i]);
-    free(ts_set);
+    close_timeseries(data);
     free_model(model);
     return -1;
   }
@@ -171,9 +242,7 @@ int main(int argc, char *argv[]) {
   if(min_log_likelihood >= 0.0 || tailptr == argv[5]){
     fprintf(stderr, "Specify a valid value for minimum log. likelihood");
     fprintf(stderr, " / time step: %s?\n", argv[5]);
-    for(i = 0; i < n_ts; i++)
-      free_timeseries(ts_set[i]);
-    free(ts_set);
+    close_timeseries(data);
     free_model(model);
     return -1;
   }
@@ -186,11 +255,38 @@ int main(int argc, char *argv[]) {
   }
   fprintf(stderr, "  Max. number of iterations = %ld\n", max_iterations);
 
+  /* read the optional time budget and checkpoint interval */
+  checkpoint_model = model;
+  checkpoint_file = argv[7];
+  if(argc > 8){
+    time_budget = strtol(argv[8], &tailptr, 10);
+    if(tailptr != argv[8] && time_budget > 0){
+      deadline = time(NULL) + time_budget;
+      fprintf(stderr, "  Max. running time = %ld s\n", time_budget);
+    }
+  }
+  if(argc > 9){
+    checkpoint_interval = strtol(argv[9], &tailptr, 10);
+    if(tailptr != argv[9] && checkpoint_interval > 0){
+      next_checkpoint = time(NULL) + checkpoint_interval;
+      fprintf(stderr, "  Checkpoint interval = %ld s\n", checkpoint_interval);
+    }
+  }
+
   /* THE algorithm (may take a while) */
   fprintf(stderr, "  Computing... \n");
   for(i = 0; i < model->num_of_vars; i++)
     nip_mark_variable(model->variables[i]); /* Make sure all the data is used */
   learning_curve = nip_new_double_list();
+  best_curve = nip_new_double_list();
+  if(!learning_curve || !best_curve){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    close_timeseries(data);
+    free_model(model);
+    free(learning_curve);
+    free(best_curve);
+    return -1;
+  }
   n = 0;
   do{
     n++;
@@ -208,26 +304,31 @@ int main(int argc, char *argv[]) {
       k++;
       current_iterations = (left_iterations > BATCH_ITERATIONS) ? BATCH_ITERATIONS : left_iterations;
 
-      e = em_learn(model, ts_set, n_ts, have_random_init, current_iterations,
-                   threshold, learning_curve, &stopping_criterion,
-                   &em_progress, &ts_progress);
+      e = em_learn_stream(model, data, have_random_init, current_iterations,
+                          threshold, learning_curve, &stopping_criterion,
+                          &em_progress, &ts_progress);
       if(!(e == NIP_NO_ERROR || e == NIP_ERROR_BAD_LUCK)){
         fprintf(stderr, "There were errors during learning:\n");
         nip_report_error(__FILE__, __LINE__, e, 1);
-        for(i = 0; i < n_ts; i++)
-          free_timeseries(ts_set[i]);
-        free(ts_set);
+        close_timeseries(data);
         free_model(model);
         nip_empty_double_list(learning_curve);
         free(learning_curve);
+        nip_empty_double_list(best_curve);
+        free(best_curve);
         return -1;
       }
       left_iterations -= current_iterations; // maintain max cumulative count
 
-      /* Write the results to a NET file */
-      i =  write_model(model, argv[7]);
-      if(i == NIP_NO_ERROR){
-        fprintf(stderr, "\n  Wrote intermediate model into %s\n", argv[7]);
+      /* Write the results to a NET file, unless the parameters are
+       * invalid or worse than those of an earlier run */
+      if(e == NIP_NO_ERROR && NIP_LIST_LENGTH(learning_curve) > 0 &&
+         learning_curve->last->data > best_log_likelihood){
+        i =  checkpoint(model, argv[7]);
+        if(i == NIP_NO_ERROR){
+          best_log_likelihood = learning_curve->last->data;
+          fprintf(stderr, "\n  Wrote intermediate model into %s\n", argv[7]);
+        }
       }
 
       /* See if em_learn quit early due to threshold */
@@ -237,6 +338,9 @@ int main(int argc, char *argv[]) {
         // TODO: minor drop in learning curve, but recovered during the 3 minimum iterations ?
       case DELTA : // true convergence
         left_iterations = 0; break; // drop remaining iterations
+      case INTERRUPTED : // time budget exhausted
+        out_of_time = 1;
+        left_iterations = 0; break;
       // default : continue with the next batch
       }
     } while (left_iterations > 0);
@@ -256,38 +360,64 @@ int main(int argc, char *argv[]) {
                 n, last, i);
     }
 
-    /* Try again, if not satisfied with the result */
+    /* Keep the best successful run in the file */
+    if(e == NIP_NO_ERROR && i > 0 &&
+       (NIP_LIST_LENGTH(best_curve) == 0 || last > best_curve->last->data)){
+      if(last >= best_log_likelihood){
+        k = checkpoint(model, argv[7]);
+        if(k != NIP_NO_ERROR){
+          fprintf(stderr, "  Failed to write the model into %s\n", argv[7]);
+          nip_report_error(__FILE__, __LINE__, k, 1);
+          close_timeseries(data);
+          free_model(model);
+          nip_empty_double_list(learning_curve);
+          free(learning_curve);
+          nip_empty_double_list(best_curve);
+          free(best_curve);
+          return -1;
+        }
+        best_log_likelihood = last;
+      }
+      swap = best_curve;
+      best_curve = learning_curve;
+      learning_curve = swap;
+    }
+
+    /* Try again, if not satisfied with the result (and there is time) */
     have_random_init = 1; // cannot continue from the same model
-  } while(e == NIP_ERROR_BAD_LUCK ||
-          last < min_log_likelihood); // stopping_criterion == LIKELIHOOD
+    if(deadline > 0 && time(NULL) >= deadline)
+      out_of_time = 1;
+  } while(!out_of_time &&
+          (e == NIP_ERROR_BAD_LUCK ||
+           last < min_log_likelihood)); // stopping_criterion == LIKELIHOOD
+
+  if(out_of_time)
+    fprintf(stderr, "  Time budget exhausted.\n");
 
   fprintf(stderr, "  ...computing done.\n");
-  for(i = 0; i < n_ts; i++)
-    free_timeseries(ts_set[i]);
-  free(ts_set);
+  close_timeseries(data);
+  free_model(model);
+  nip_empty_double_list(learning_curve);
+  free(learning_curve);
+
+  if(NIP_LIST_LENGTH(best_curve) == 0){
+    fprintf(stderr, "  No successful runs: did not write %s\n", argv[7]);
+    free(best_curve);
+    return -1;
+  }
 
-  /* Print the learning curve: iteration number, average log. likelihood */
-  link = learning_curve->first; n = 1;
+  /* Print the learning curve of the best run:
+   * iteration number, average log. likelihood */
+  link = best_curve->first; n = 1;
   while(link != NULL){
     /* Reminder: rint() is NOT ANSI C. */
     printf("%d,%g\n", n++, rint(link->data / threshold) * threshold);
     link = link->fwd;
   }
-  nip_empty_double_list(learning_curve);
-  free(learning_curve);
-
-  /* Write the results to a NET file */
-  i =  write_model(model, argv[7]);
-  if(i == NIP_NO_ERROR){
-    fprintf(stderr, "  Wrote the final model into %s\n", argv[7]);
-  }
-  else {
-    fprintf(stderr, "  Failed to write the model into %s\n", argv[7]);
-    nip_report_error(__FILE__, __LINE__, i, 1);
-    free_model(model);
-    return -1;
-  }
-  free_model(model);
+  fprintf(stderr, "  Wrote the final model (%g) into %s\n",
+          best_curve->last->data, argv[7]);
+  nip_empty_double_list(best_curve);
+  free(best_curve);
 
   return 0;
 }